@@ -0,0 +1,99 @@
+#include "batchinference.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+std::vector<cv::Mat> runOnce(cv::dnn::Net &net, const cv::Mat &blob, const std::vector<cv::String> &outputNames)
+{
+    net.setInput(blob);
+    std::vector<cv::Mat> outputs;
+    if (outputNames.empty())
+        outputs.push_back(net.forward());
+    else
+        net.forward(outputs, outputNames);
+    return outputs;
+}
+
+// Part n of an output computed for `inputs` inputs: the leading axis when it
+// is the batch, otherwise an equal share of the rows (Darknet region layers
+// stack the detections of all inputs).
+cv::Mat splitOutput(const cv::Mat &output, int inputs, int n)
+{
+    if (inputs == 1)
+        return output.clone();
+    if (output.dims >= 3 && output.size[0] == inputs) {
+        std::vector<int> sizes(output.size.p, output.size.p + output.dims);
+        sizes[0] = 1;
+        return cv::Mat(output.dims, sizes.data(), output.type(), const_cast<uchar *>(output.ptr(n))).clone();
+    }
+    const int rows = output.size[0] / inputs;
+    return output.rowRange(n * rows, (n + 1) * rows).clone();
+}
+
+} // namespace
+
+
+BatchInference::BatchInference(int batchSize)
+    : current(batchSize > 0 ? std::min(batchSize, int(MaxBatch)) : 1), tuning(batchSize <= 0)
+{
+}
+
+cv::Mat BatchInference::input(const cv::Mat &batch, int n)
+{
+    std::vector<int> sizes(batch.size.p, batch.size.p + batch.dims);
+    sizes[0] = 1;
+    return cv::Mat(batch.dims, sizes.data(), batch.type(), const_cast<uchar *>(batch.ptr(n)));
+}
+
+std::vector<std::vector<cv::Mat>> BatchInference::forward(cv::dnn::Net &net, const cv::Mat &batch,
+                                                          const std::vector<cv::String> &outputNames)
+{
+    const int inputs = batch.size[0];
+    std::vector<std::vector<cv::Mat>> perInput(inputs);
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<cv::Mat> outputs;
+    try {
+        outputs = runOnce(net, batch, outputNames);
+    } catch (const cv::Exception &) {
+        if (inputs == 1)
+            throw;
+        // Fixed batch of one: this batch goes through singly, later ones too.
+        current = 1;
+        tuning = false;
+        for (int n = 0; n < inputs; ++n)
+            perInput[n] = runOnce(net, input(batch, n), outputNames);
+        return perInput;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (int n = 0; n < inputs; ++n) {
+        perInput[n].reserve(outputs.size());
+        for (const cv::Mat &output : outputs)
+            perInput[n].push_back(splitOutput(output, inputs, n));
+    }
+    if (tuning && inputs == current)
+        tune(inputs, seconds);
+    return perInput;
+}
+
+void BatchInference::tune(int inputs, double seconds)
+{
+    if (!warmedUp) {
+        warmedUp = true;
+        return;
+    }
+    const double perInput = seconds / inputs;
+    if (bestSeconds == 0.0 || perInput < bestSeconds * (1.0 - TuneGain)) {
+        best = inputs;
+        bestSeconds = perInput;
+        if (current < MaxBatch) {
+            current = std::min(current * 2, int(MaxBatch));
+            return;
+        }
+    }
+    current = best;
+    tuning = false;
+}
@@ -0,0 +1,52 @@
+#ifndef BATCHINFERENCE_H
+#define BATCHINFERENCE_H
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/dnn.hpp>
+
+// Runs a network over many inputs, several per forward pass.
+//
+// The caller packs the next nextBatch() inputs into one N x C x H x W blob
+// and calls forward(), which splits every output back per input. Batch
+// size 0 tunes itself while running: it starts at one input and doubles
+// while the time per input keeps dropping by at least TuneGain, then stays
+// at the best size seen. Networks exported with a fixed batch of one reject
+// larger blobs; their batch is then run one input at a time and the size
+// stays at one. One per run; forward() is called from one thread at a
+// time, nextBatch() from any.
+class BatchInference {
+public:
+    static const int MaxBatch = 32;
+    static constexpr double TuneGain = 0.05;
+
+    explicit BatchInference(int batchSize = 0);
+
+    bool isTuning() const { return tuning; }
+    int batchSize() const { return current; }
+    // Inputs the next forward() should get.
+    int nextBatch(int remaining) const { return std::max(1, std::min(current.load(), remaining)); }
+
+    // outputs[n][k] is output k (in outputNames order, or the default
+    // output if none are named) for input n of the batch. The outputs are
+    // copies, so they stay valid across later passes.
+    std::vector<std::vector<cv::Mat>> forward(cv::dnn::Net &net, const cv::Mat &batch,
+                                              const std::vector<cv::String> &outputNames = {});
+
+    // Input n of a batch blob as a 1 x C x H x W header into it.
+    static cv::Mat input(const cv::Mat &batch, int n);
+
+private:
+    std::atomic<int> current;
+    std::atomic<bool> tuning;
+    int best = 1;
+    double bestSeconds = 0.0;    // per input at the best size
+    bool warmedUp = false;       // the first pass pays for allocations
+
+    void tune(int inputs, double seconds);
+};
+
+#endif // BATCHINFERENCE_H
@@ -1,12 +1,27 @@
 #include "customobjectdetectionwindow.h"
 #include <QMessageBox>
+#include <QPainter>
 #include <QPixmap>
 #include <QDebug>
-#include <QApplication>
 
+#include <map>
 
-CustomObjectDetectionWindow::CustomObjectDetectionWindow(const QList<cv::Mat> &images, QWidget *parent)
-    : QDialog(parent), originalImages(images)
+#include "batchinference.h"
+#include "detectiondecoder.h"
+#include "detectionpipeline.h"
+#include "sliceplan.h"
+#include "modelregistry.h"
+#include "taskscheduler.h"
+#include "tileplan.h"
+#include "volumepyramid.h"
+#include "volumestatistics.h"
+#include "windowlevel.h"
+
+#include <opencv2/core/hal/intrin.hpp>
+
+
+CustomObjectDetectionWindow::CustomObjectDetectionWindow(const Volume &volume, QWidget *parent)
+    : QDialog(parent), originalVolume(volume)
 {
     setWindowTitle("Custom Object Detection - YOLOv11 ONNX");
 
@@ -15,9 +30,57 @@ CustomObjectDetectionWindow::CustomObjectDetectionWindow(const QList<cv::Mat> &i
     statusLabel = new QLabel("Ready to run detection.", this);
     mainLayout->addWidget(statusLabel);
 
+    // Network runs on keyframes only, the other slices are filled in.
+    QHBoxLayout *skipLayout = new QHBoxLayout;
+    skipCombo = new QComboBox(this);
+    skipCombo->addItem("Every slice", 1.0);
+    skipCombo->addItem("Skip similar slices (about 2x faster)", 2.0);
+    skipCombo->addItem("Skip similar slices (about 4x faster)", 4.0);
+    skipCombo->addItem("Skip similar slices (about 8x faster)", 8.0);
+    skipLayout->addWidget(new QLabel("Slices:", this));
+    skipLayout->addWidget(skipCombo, 1);
+    mainLayout->addLayout(skipLayout);
+
+    // Large slices lose small objects when squashed to the network input.
+    tileCheck = new QCheckBox("Tile high-resolution slices", this);
+    mainLayout->addWidget(tileCheck);
+
+    // Slices per forward pass; Auto tunes it while running.
+    QHBoxLayout *batchLayout = new QHBoxLayout;
+    batchSpin = new QSpinBox(this);
+    batchSpin->setRange(0, BatchInference::MaxBatch);
+    batchSpin->setSpecialValueText("Auto");
+    batchSpin->setValue(0);
+    batchLayout->addWidget(new QLabel("Batch size:", this));
+    batchLayout->addWidget(batchSpin, 1);
+    mainLayout->addLayout(batchLayout);
+
+    // Threads preparing and drawing slices around the network.
+    QHBoxLayout *threadLayout = new QHBoxLayout;
+    preprocessSpin = new QSpinBox(this);
+    preprocessSpin->setRange(1, DetectionPipeline::MaxThreads);
+    preprocessSpin->setValue(DetectionPipeline::preprocessThreadsSetting());
+    postprocessSpin = new QSpinBox(this);
+    postprocessSpin->setRange(1, DetectionPipeline::MaxThreads);
+    postprocessSpin->setValue(DetectionPipeline::postprocessThreadsSetting());
+    threadLayout->addWidget(new QLabel("Preprocess threads:", this));
+    threadLayout->addWidget(preprocessSpin, 1);
+    threadLayout->addWidget(new QLabel("Postprocess threads:", this));
+    threadLayout->addWidget(postprocessSpin, 1);
+    mainLayout->addLayout(threadLayout);
+
     runButton = new QPushButton("Run Detection", this);
     mainLayout->addWidget(runButton);
 
+    progressBar = new QProgressBar(this);
+    progressBar->setRange(0, 1000);
+    progressBar->setVisible(false);
+    mainLayout->addWidget(progressBar);
+
+    cancelButton = new QPushButton("Cancel", this);
+    cancelButton->setVisible(false);
+    mainLayout->addWidget(cancelButton);
+
     closeButton = new QPushButton("Close", this);
     mainLayout->addWidget(closeButton);
 
@@ -32,181 +95,311 @@ CustomObjectDetectionWindow::CustomObjectDetectionWindow(const QList<cv::Mat> &i
 
     connect(runButton, &QPushButton::clicked, this, &CustomObjectDetectionWindow::runDetection);
     connect(closeButton, &QPushButton::clicked, this, &CustomObjectDetectionWindow::closeWindow);
-
-    // Load your ONNX model - adjust path as needed
-    QString modelPath = "C:/Users/Me/Documents/xip_app/model.onnx"; // <-- Change this path to your model location
-    loadModel(modelPath);
+    connect(cancelButton, &QPushButton::clicked, this, [this]() {
+        if (task)
+            task->cancel();
+    });
+
+    // The network is shared and loaded once per session; model() starts
+    // loading it if startup did not.
+    connect(&ModelRegistry::instance(), &ModelRegistry::stateChanged, this, [this](int id) {
+        if (id == ModelRegistry::Custom)
+            updateModelState();
+    });
+    ModelRegistry::instance().model(ModelRegistry::Custom);
+    updateModelState();
 }
 
 CustomObjectDetectionWindow::~CustomObjectDetectionWindow()
 {
-}
-
-void CustomObjectDetectionWindow::loadModel(const QString &modelPath)
-{
-    try {
-        net = cv::dnn::readNetFromONNX(modelPath.toStdString());
-        if (net.empty()) {
-            QMessageBox::critical(this, "Error", "Failed to load ONNX model.");
-        } else {
-            statusLabel->setText("Model loaded successfully.");
-        }
-    } catch (const cv::Exception &ex) {
-        QMessageBox::critical(this, "Error", QString("Exception loading model: %1").arg(ex.what()));
+    // The job writes into this dialog's volumes, so it has to be gone first.
+    if (task) {
+        task->cancel();
+        task->wait();
     }
 }
 
-cv::Mat CustomObjectDetectionWindow::preprocess(const cv::Mat &image)
+void CustomObjectDetectionWindow::updateModelState()
 {
-    // Normalize slice (like Python's 2nd and 98th percentile clip and scale)
-    cv::Mat imgFloat;
-    image.convertTo(imgFloat, CV_32F);
-
-    double p2, p98;
-    cv::Mat sorted;
-    cv::sort(imgFloat.reshape(1,1), sorted, cv::SORT_ASCENDING);
-    int len = sorted.cols;
-    p2 = sorted.at<float>(0, std::max(0, int(0.02 * len)));
-    p98 = sorted.at<float>(0, std::min(len - 1, int(0.98 * len)));
-
-    cv::Mat clipped;
-    cv::threshold(imgFloat, clipped, p2, 255, cv::THRESH_TOZERO);
-    cv::threshold(clipped, clipped, p98, p98, cv::THRESH_TRUNC);
-
-    clipped = (clipped - p2) * (255.0 / (p98 - p2));
-    clipped.convertTo(clipped, CV_8U);
-
-    // Convert grayscale to BGR
-    cv::Mat imgBGR;
-    cv::cvtColor(clipped, imgBGR, cv::COLOR_GRAY2BGR);
-
-    // Resize to model input size (assuming 640x640, change if needed)
-    cv::Mat blob;
-    cv::resize(imgBGR, blob, cv::Size(640, 640));
-
-    // Convert to float and normalize [0,1]
-    blob.convertTo(blob, CV_32F, 1.0 / 255);
-
-    return blob;
+    const ModelRegistry &registry = ModelRegistry::instance();
+    const ModelRegistry::State state = registry.state(ModelRegistry::Custom);
+    if (state == ModelRegistry::Ready)
+        statusLabel->setText("Model loaded successfully.");
+    else if (state == ModelRegistry::Failed)
+        statusLabel->setText(QString("Could not load the ONNX model from %1: %2")
+                                 .arg(registry.modelPath(ModelRegistry::Custom), registry.errorString(ModelRegistry::Custom)));
+    else
+        statusLabel->setText("Loading the ONNX model...");
+    runButton->setEnabled(!task && state == ModelRegistry::Ready);
 }
 
-QList<cv::Rect> CustomObjectDetectionWindow::postprocess(const cv::Mat &image, const cv::Mat &outputs, float confThreshold)
+// Percentile clip, normalisation, resize and NCHW packing in two passes
+// over the input-sized image. The slice is resized once in its native type;
+// the 2nd and 98th percentiles come from a histogram of the resized image
+// unless given, and one vectorised convertTo scales it into the first
+// channel plane. A second pass clips that plane to [0, 1] and copies it
+// into the other two (gray to BGR). Resizing before clipping only differs
+// where neighbouring pixels straddle a percentile.
+void CustomObjectDetectionWindow::preprocess(const cv::Mat &image, int inputSize, cv::Mat &blob, cv::Mat &resized,
+                                             const cv::Vec2d &clip)
 {
-    QList<cv::Rect> boxes;
-    std::vector<float> confidences;
-
-    // Assuming output shape: Nx85 (x, y, w, h, conf, 80 class scores)
-    // You may need to adjust this depending on your model output format
-
-    const int dimensions = outputs.cols;  // 85 for COCO; adjust for your model
-    const int rows = outputs.rows;
-
-    for (int i = 0; i < rows; ++i) {
-        const float *data = outputs.ptr<float>(i);
-        float confidence = data[4];
-        if (confidence >= confThreshold) {
-            // Find class with max score
-            float maxClassScore = 0;
-            int classId = -1;
-            for (int c = 5; c < dimensions; ++c) {
-                if (data[c] > maxClassScore) {
-                    maxClassScore = data[c];
-                    classId = c - 5;
-                }
-            }
-            float finalScore = confidence * maxClassScore;
-            if (finalScore >= confThreshold) {
-                // Convert from center x,y,w,h to rect
-                int cx = int(data[0] * image.cols);
-                int cy = int(data[1] * image.rows);
-                int w = int(data[2] * image.cols);
-                int h = int(data[3] * image.rows);
-                int left = cx - w / 2;
-                int top = cy - h / 2;
-
-                boxes.append(cv::Rect(left, top, w, h));
-                confidences.push_back(finalScore);
-            }
-        }
+    const int sizes[4] = { 1, 3, inputSize, inputSize };
+    blob.create(4, sizes, CV_32F);
+    cv::resize(image, resized, cv::Size(inputSize, inputSize), 0, 0, cv::INTER_LINEAR);
+
+    const cv::Vec2d range = clip[1] > clip[0] ? clip : clipRange(resized);
+    const double p2 = range[0];
+    const double scale = 1.0 / (range[1] - range[0]);
+
+    const int n = inputSize * inputSize;
+    float *data = blob.ptr<float>();
+    cv::Mat planes[3];
+    for (int c = 0; c < 3; ++c)
+        planes[c] = cv::Mat(inputSize, inputSize, CV_32F, data + c * n);
+
+    if (resized.channels() != 1) {
+        cv::Mat scaled;
+        resized.convertTo(scaled, CV_32F, scale, -p2 * scale);
+        cv::min(scaled, 1.0, scaled);
+        cv::max(scaled, 0.0, scaled);
+        cv::split(scaled, planes);   // writes into the blob's planes
+        return;
     }
 
-    // Non-max suppression to remove overlapping boxes
-    std::vector<int> indices;
-    std::vector<cv::Rect> rects(boxes.begin(), boxes.end());
-    cv::dnn::NMSBoxes(rects, confidences, confThreshold, 0.4f, indices);
-
-    QList<cv::Rect> filteredBoxes;
-    for (int idx : indices) {
-        filteredBoxes.append(rects[idx]);
+    resized.convertTo(planes[0], CV_32F, scale, -p2 * scale);
+    float *b = data;
+    float *g = data + n;
+    float *r = data + 2 * n;
+    int i = 0;
+#if CV_SIMD
+    const cv::v_float32 zero = cv::vx_setzero_f32();
+    const cv::v_float32 one = cv::vx_setall_f32(1.0f);
+    for (; i + cv::v_float32::nlanes <= n; i += cv::v_float32::nlanes) {
+        const cv::v_float32 v = cv::v_min(cv::v_max(cv::vx_load(b + i), zero), one);
+        cv::v_store(b + i, v);
+        cv::v_store(g + i, v);
+        cv::v_store(r + i, v);
     }
-    return filteredBoxes;
+#endif
+    for (; i < n; ++i)
+        b[i] = g[i] = r[i] = std::min(std::max(b[i], 0.0f), 1.0f);
 }
 
-void CustomObjectDetectionWindow::drawBoxes(cv::Mat &image, const QList<cv::Rect> &boxes, const std::vector<float> &confidences)
+cv::Vec2d CustomObjectDetectionWindow::clipRange(const cv::Mat &resized)
 {
-    for (int i = 0; i < boxes.size(); ++i) {
-        cv::rectangle(image, boxes[i], cv::Scalar(0, 255, 0), 2);
-        if (i < confidences.size()) {
-            std::string label = cv::format("%.2f", confidences[i]);
-            int baseLine = 0;
-            cv::Size labelSize = cv::getTextSize(label, cv::FONT_HERSHEY_SIMPLEX, 0.5, 1, &baseLine);
-            int top = std::max(boxes[i].y, labelSize.height);
-            cv::putText(image, label, cv::Point(boxes[i].x, top - 4),
-                        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 255, 0), 1);
-        }
-    }
+    const Histogram histogram = VolumeStatistics::histogram(resized);
+    const double p2 = histogram.percentile(2.0);
+    return cv::Vec2d(p2, std::max(histogram.percentile(98.0), p2 + 1e-6));
 }
 
 void CustomObjectDetectionWindow::runDetection()
 {
-    if (net.empty()) {
+    const std::shared_ptr<DetectionModel> model = ModelRegistry::instance().model(ModelRegistry::Custom);
+    if (!model) {
         QMessageBox::warning(this, "Warning", "Model is not loaded.");
         return;
     }
 
-    statusLabel->setText("Running detection... Please wait.");
-    QApplication::processEvents();
-
-    detectedImages.clear();
-
-    float confThreshold = 0.6f;
-
-    for (int i = 0; i < originalImages.size(); ++i) {
-        cv::Mat preprocessed = preprocess(originalImages[i]);
-
-        // Create blob from preprocessed image (already normalized and resized)
-        cv::Mat blob = cv::dnn::blobFromImage(preprocessed);
-
-        net.setInput(blob);
-
-        cv::Mat outputs = net.forward();
-
-        // outputs shape depends on your model, may need reshaping
-        // for YOLOv5/YOLOv7-like, outputs shape is usually Nx85
-        cv::Mat reshapedOutputs = outputs.reshape(1, outputs.total() / 85);
-
-        QList<cv::Rect> boxes = postprocess(originalImages[i], reshapedOutputs, confThreshold);
+    if (task)
+        return;
 
-        // Draw boxes on a copy of original image (convert grayscale to BGR for drawing)
-        cv::Mat imgColor;
-        cv::cvtColor(originalImages[i], imgColor, cv::COLOR_GRAY2BGR);
+    statusLabel->setText("Running detection...");
+
+    // Boxes are kept per slice and shown over the views; the volume stays as it is.
+    found.assign(originalVolume.depth(), std::vector<Detection>());
+    results = DetectionResults();
+    thumbnails.clear();
+
+    const float confThreshold = 0.6f;
+
+    const double speedup = skipCombo->currentData().toDouble();
+    const bool tiled = tileCheck->isChecked();
+    const int batchSize = batchSpin->value();
+    const int preprocessThreads = preprocessSpin->value();
+    const int postprocessThreads = postprocessSpin->value();
+    DetectionPipeline::saveThreadSettings(preprocessThreads, postprocessThreads);
+    task = TaskScheduler::instance().run(Task::Compute, [this, model, confThreshold, speedup, tiled, batchSize,
+                                                         preprocessThreads, postprocessThreads](Task &job) {
+        // Slices (or tiles) go through the network in batches, each
+        // preprocessed straight into its slot of an N x 3 x S x S tensor, S
+        // the model's input size, that one forward pass then takes. Preparing the next batches and
+        // decoding the previous ones overlap with each pass. A batch keeps
+        // its tensor, grown to the batch size, and resize buffers for the
+        // next batch.
+        BatchInference batches(batchSize);
+        DetectionPipeline pipeline(preprocessThreads, postprocessThreads);
+        const int inputSize = model->inputSize;
+
+        // Slices to run are planned first: every slice, or keyframes with
+        // empty slices left out and the rest filled in afterwards. Each one
+        // then goes in whole, squashed to the network input, or as
+        // overlapping input-sized tiles at native resolution.
+        const SlicePlan plan = SlicePlan::adaptive(originalVolume, speedup, job.priority(), job.cancelFlag());
+        const TilePlan tiles = tiled ? TilePlan::tiled(originalVolume, plan.keyframes(), inputSize, job.priority(),
+                                                       job.cancelFlag())
+                                     : TilePlan::wholeSlices(originalVolume, plan.keyframes());
+        std::vector<int> pending = tiles.tilesPerSlice(originalVolume.depth());
+        std::mutex foundMutex;   // tiles of one slice are decoded on any thread
+
+        // Tiles are clipped to the percentiles of their whole slice, so
+        // background tiles are not stretched; the first tile of a slice to
+        // be prepared takes them.
+        std::map<int, cv::Vec2d> clips;
+        std::mutex clipMutex;
+        auto clipOf = [&](int z, const cv::Mat &slice) {
+            std::lock_guard<std::mutex> lock(clipMutex);
+            auto it = clips.find(z);
+            if (it == clips.end()) {
+                cv::Mat resized;
+                cv::resize(slice, resized, cv::Size(inputSize, inputSize), 0, 0, cv::INTER_LINEAR);
+                it = clips.emplace(z, clipRange(resized)).first;
+            }
+            return it->second;
+        };
 
-        // NOTE: We don't have confidences vector separately here — you'd need to modify postprocess to output confidences if you want to draw labels
+        auto prepare = [&](DetectionPipeline::Batch &batch) {
+            if (batch.input.empty() || batch.input.size[0] < batch.count) {
+                const int sizes[4] = { batch.count, 3, inputSize, inputSize };
+                batch.input.create(4, sizes, CV_32F);
+            }
+            batch.images.resize(batch.count);
+            for (int k = 0; k < batch.count; ++k) {
+                const TilePlan::Tile &tile = tiles.tile(batch.items[k]);
+                originalVolume.prefetch(tile.slice, tile.slice + 1);
+                const cv::Mat slice = originalVolume.axial(tile.slice);
+                cv::Mat slot = BatchInference::input(batch.input, k);
+                if (tiles.isTiled())
+                    preprocess(slice(tile.rect), inputSize, slot, batch.images[k], clipOf(tile.slice, slice));
+                else
+                    preprocess(slice, inputSize, slot, batch.images[k]);
+            }
+        };
+        auto infer = [&](DetectionPipeline::Batch &batch) {
+            const int sizes[4] = { batch.count, 3, inputSize, inputSize };
+            const cv::Mat input(4, sizes, CV_32F, batch.input.data);
+            // Other dialogs may be running the same network.
+            std::lock_guard<std::mutex> lock(model->mutex);
+            batch.outputs = batches.forward(model->net, input);
+        };
+        auto decode = [&](DetectionPipeline::Batch &batch) {
+            for (int k = 0; k < batch.count; ++k) {
+                const TilePlan::Tile &tile = tiles.tile(batch.items[k]);
+                const cv::Mat &output = batch.outputs[k].front();
+
+                // Exported models give boxes in input pixels; the layout
+                // (YOLOv5 rows, YOLOv8/v11 channels) is read off the output.
+                const DetectionDecoder::Layout layout = DetectionDecoder::layoutOf(output, int(model->classNames.size()));
+                const cv::Size2f scale(float(tile.rect.width) / inputSize, float(tile.rect.height) / inputSize);
+                std::vector<Detection> detections;
+                DetectionDecoder::decode(output, layout, confThreshold, scale, detections);
+                DetectionDecoder::suppress(detections, 0.4f);
+                for (Detection &detection : detections) {
+                    detection.box += tile.rect.tl();
+                    detection.tile = batch.items[k];
+                }
 
-        for (const auto &box : boxes) {
-            cv::rectangle(imgColor, box, cv::Scalar(0, 255, 0), 2);
+                std::lock_guard<std::mutex> lock(foundMutex);
+                std::vector<Detection> &slice = found[tile.slice];
+                slice.insert(slice.end(), detections.begin(), detections.end());
+                if (--pending[tile.slice] == 0) {
+                    originalVolume.release(tile.slice, tile.slice + 1);
+                    if (tiles.isTiled()) {
+                        std::lock_guard<std::mutex> clipLock(clipMutex);
+                        clips.erase(tile.slice);
+                    }
+                }
+            }
+        };
+        if (pipeline.run(tiles.items(), batches, prepare, infer, decode, job.cancelFlag(),
+                         [&job](int done, int total) { job.setProgress(done, total); })) {
+            // Objects on tile borders were found by several tiles.
+            if (tiles.isTiled()) {
+                for (int z : plan.keyframes())
+                    tiles.merge(found[z]);
+            }
+            plan.propagate(found);
+            results = DetectionResults(originalVolume.width(), originalVolume.height(), found, model->classNames, plan.sources());
+
+            // Thumbnails are made here rather than on the GUI thread, and
+            // only for slices with something to show.
+            const WindowLevel display = WindowLevel::fullRange(originalVolume);
+            for (int z = 0; z < originalVolume.depth() && int(thumbnails.size()) < MaxThumbnails; ++z) {
+                if (!found[z].empty())
+                    thumbnails.emplace_back(z, thumbnail(originalVolume, z, display));
+            }
         }
+        found.clear();
+    });
+
+    runButton->setEnabled(false);
+    skipCombo->setEnabled(false);
+    tileCheck->setEnabled(false);
+    batchSpin->setEnabled(false);
+    preprocessSpin->setEnabled(false);
+    postprocessSpin->setEnabled(false);
+    progressBar->setValue(0);
+    progressBar->setVisible(true);
+    cancelButton->setVisible(true);
+    connect(task, &Task::progressChanged, progressBar, &QProgressBar::setValue);
+    connect(task, &Task::finished, this, [this](bool cancelled) {
+        finishDetection(cancelled, task ? task->errorString() : QString());
+    });
+}
 
-        detectedImages.append(imgColor);
+void CustomObjectDetectionWindow::finishDetection(bool cancelled, const QString &error)
+{
+    task = nullptr;
+    runButton->setEnabled(true);
+    skipCombo->setEnabled(true);
+    tileCheck->setEnabled(true);
+    batchSpin->setEnabled(true);
+    preprocessSpin->setEnabled(true);
+    postprocessSpin->setEnabled(true);
+    progressBar->setVisible(false);
+    cancelButton->setVisible(false);
+
+    if (!error.isEmpty()) {
+        statusLabel->setText("Detection failed.");
+        QMessageBox::warning(this, "Error", QString("Detection failed: %1").arg(error));
+        return;
     }
+    if (cancelled) {
+        statusLabel->setText("Detection cancelled.");
+        return;
+    }
+
+    displayImages();
 
-    displayImages(detectedImages);
+    statusLabel->setText(QString("Found %1 objects in %2 images.").arg(results.count()).arg(results.depth()));
+    emit detectionCompleted(results);
+}
 
-    statusLabel->setText(QString("Detection completed on %1 images.").arg(detectedImages.size()));
-    emit detectionCompleted(detectedImages);
+QImage CustomObjectDetectionWindow::thumbnail(const Volume &volume, int z, const WindowLevel &display)
+{
+    // Reduced by the largest power of two that keeps it at least
+    // ThumbnailSize, instead of scaling the full-resolution slice.
+    int level = 0;
+    while (level < VolumePyramid::MaxLevel
+           && (std::max(volume.width(), volume.height()) >> (level + 1)) >= ThumbnailSize)
+        ++level;
+
+    volume.prefetch(z, z + 1);
+    const cv::Mat img = VolumePyramid::reduce(volume.axial(z), level);
+    QImage qimg;
+    if (img.channels() == 1) {
+        const cv::Mat gray = display.apply(img);
+        qimg = QImage(gray.data, gray.cols, gray.rows, gray.step, QImage::Format_Grayscale8).copy();
+    } else {
+        qimg = QImage(img.data, img.cols, img.rows, img.step, QImage::Format_RGB888).rgbSwapped();
+    }
+    volume.release(z, z + 1);
+    return qimg.scaled(ThumbnailSize, ThumbnailSize, Qt::KeepAspectRatio, Qt::SmoothTransformation)
+        .convertToFormat(QImage::Format_RGB32);
 }
 
-void CustomObjectDetectionWindow::displayImages(const QList<cv::Mat> &images)
+// Boxes are painted over each thumbnail at its own size; the main window
+// shows them over every slice.
+void CustomObjectDetectionWindow::displayImages()
 {
     // Clear previous
     QLayoutItem *child;
@@ -215,12 +408,14 @@ void CustomObjectDetectionWindow::displayImages(const QList<cv::Mat> &images)
         delete child;
     }
 
-    for (const auto &img : images) {
-        cv::Mat rgb;
-        cv::cvtColor(img, rgb, cv::COLOR_BGR2RGB);
-        QImage qimg(rgb.data, rgb.cols, rgb.rows, rgb.step, QImage::Format_RGB888);
+    for (const std::pair<int, QImage> &shown : thumbnails) {
+        QImage image = shown.second;
+        QPainter painter(&image);
+        results.paint(painter, shown.first, double(image.width()) / originalVolume.width(), image.rect());
+        painter.end();
+
         QLabel *label = new QLabel;
-        label->setPixmap(QPixmap::fromImage(qimg).scaled(320, 320, Qt::KeepAspectRatio));
+        label->setPixmap(QPixmap::fromImage(image));
         imageLayout->addWidget(label);
     }
     imageContainer->setLayout(imageLayout);
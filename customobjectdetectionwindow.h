@@ -1,50 +1,82 @@
 #ifndef CUSTOMOBJECTDETECTIONWINDOW_H
 #define CUSTOMOBJECTDETECTIONWINDOW_H
 
+#include <QCheckBox>
+#include <QComboBox>
 #include <QDialog>
 #include <QList>
 #include <QImage>
 #include <QLabel>
+#include <QPointer>
+#include <QProgressBar>
 #include <QVBoxLayout>
 #include <QPushButton>
 #include <QScrollArea>
+#include <QSpinBox>
+#include <utility>
+
 #include <opencv2/opencv.hpp>
 
+#include "detectionresults.h"
+#include "volume.h"
+
+class Task;
+class WindowLevel;
+
 class CustomObjectDetectionWindow : public QDialog
 {
     Q_OBJECT
 public:
-    explicit CustomObjectDetectionWindow(const QList<cv::Mat> &images, QWidget *parent = nullptr);
+    explicit CustomObjectDetectionWindow(const Volume &volume, QWidget *parent = nullptr);
     ~CustomObjectDetectionWindow();
 
 signals:
-    void detectionCompleted(const QList<cv::Mat> &detectedImages);
+    void detectionCompleted(const DetectionResults &results);
 
 private slots:
     void runDetection();
     void closeWindow();
+    void updateModelState();
 
 private:
-    QList<cv::Mat> originalImages;
-    QList<cv::Mat> detectedImages;
+    Volume originalVolume;
+    std::vector<std::vector<Detection>> found;   // per slice, filled by the job
+    DetectionResults results;
+    std::vector<std::pair<int, QImage>> thumbnails;   // slices with detections, made by the job
 
     QLabel *statusLabel;
     QPushButton *runButton;
+    QPushButton *cancelButton;
     QPushButton *closeButton;
+    QComboBox *skipCombo;      // speedup target of slice skipping
+    QCheckBox *tileCheck;      // run large slices as tiles at native resolution
+    QSpinBox *batchSpin;       // inputs per forward pass, 0 tunes it
+    QSpinBox *preprocessSpin;  // pipeline threads per stage
+    QSpinBox *postprocessSpin;
+    QProgressBar *progressBar;
+    QPointer<Task> task;   // detection running on the scheduler
 
     QVBoxLayout *mainLayout;
     QScrollArea *scrollArea;
     QWidget *imageContainer;
     QVBoxLayout *imageLayout;
 
-    cv::dnn::Net net;
-
-    void loadModel(const QString &modelPath);
-    cv::Mat preprocess(const cv::Mat &image);
-    QList<cv::Rect> postprocess(const cv::Mat &image, const cv::Mat &outputs, float confThreshold);
+    void finishDetection(bool cancelled, const QString &error);
+    // Writes the network input for one slice or tile into blob
+    // (1x3xinputSize^2, float, NCHW), reusing blob and the resize buffer
+    // across calls. Intensities are clipped to clip (low, high) if given,
+    // otherwise to the image's own percentiles.
+    static void preprocess(const cv::Mat &image, int inputSize, cv::Mat &blob, cv::Mat &resized,
+                           const cv::Vec2d &clip = cv::Vec2d());
+    // 2nd and 98th percentiles of an image resized to the network input.
+    static cv::Vec2d clipRange(const cv::Mat &resized);
 
-    void displayImages(const QList<cv::Mat> &images);
-    void drawBoxes(cv::Mat &image, const QList<cv::Rect> &boxes, const std::vector<float> &confidences);
+    // Only slices with detections get a thumbnail, at most MaxThumbnails.
+    static const int ThumbnailSize = 320;
+    static const int MaxThumbnails = 64;
+    // Slice reduced through the pyramid levels and window-mapped, without boxes.
+    static QImage thumbnail(const Volume &volume, int z, const WindowLevel &display);
+    void displayImages();
 };
 
 #endif // CUSTOMOBJECTDETECTIONWINDOW_H
@@ -0,0 +1,383 @@
+#include "datastream.h"
+
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <type_traits>
+#include <vector>
+
+#include <zlib.h>
+
+namespace {
+
+const qint64 BufferBytes = 256 * 1024;          // compressed I/O block
+const size_t ChunkBytes = 16 * 1024 * 1024;     // samples staged per conversion chunk
+
+template <typename Fn>
+void dispatchSampleType(SampleType type, Fn &&fn)
+{
+    switch (type) {
+    case SampleType::UInt8: fn(static_cast<quint8 *>(nullptr)); break;
+    case SampleType::Int8: fn(static_cast<qint8 *>(nullptr)); break;
+    case SampleType::UInt16: fn(static_cast<quint16 *>(nullptr)); break;
+    case SampleType::Int16: fn(static_cast<qint16 *>(nullptr)); break;
+    case SampleType::UInt32: fn(static_cast<quint32 *>(nullptr)); break;
+    case SampleType::Int32: fn(static_cast<qint32 *>(nullptr)); break;
+    // std:: 64-bit types match cv::saturate_cast's overloads on every platform.
+    case SampleType::UInt64: fn(static_cast<std::uint64_t *>(nullptr)); break;
+    case SampleType::Int64: fn(static_cast<std::int64_t *>(nullptr)); break;
+    case SampleType::Float32: fn(static_cast<float *>(nullptr)); break;
+    case SampleType::Float64: fn(static_cast<double *>(nullptr)); break;
+    }
+}
+
+template <typename S, typename D>
+void convertSamples(const char *src, D *dst, size_t count, const SampleFormat &format)
+{
+    const bool scaled = format.isScaled();
+    for (size_t i = 0; i < count; ++i) {
+        S value;
+        std::memcpy(&value, src + i * sizeof(S), sizeof(S));
+        if (format.swapBytes)
+            value = byteSwapped(value);
+        dst[i] = scaled ? cv::saturate_cast<D>(double(value) * format.slope + format.intercept)
+                        : cv::saturate_cast<D>(value);
+    }
+}
+
+// Converts whole slices of staged samples into the volume, slices in parallel.
+void convertChunk(const char *src, const SampleFormat &format, Volume &volume, int z0, int slices)
+{
+    const size_t sliceSamples = size_t(volume.width()) * volume.height();
+    const size_t srcSliceBytes = sliceSamples * sampleSize(format.type);
+
+    dispatchSampleType(format.type, [&](auto *sourceTag) {
+        using S = std::remove_pointer_t<decltype(sourceTag)>;
+        dispatchVoxelType(volume.type(), [&](auto *targetTag) {
+            using D = std::remove_pointer_t<decltype(targetTag)>;
+            if constexpr (std::is_arithmetic<D>::value) {
+                cv::parallel_for_(cv::Range(0, slices), [&](const cv::Range &r) {
+                    for (int i = r.start; i < r.end; ++i)
+                        convertSamples<S>(src + i * srcSliceBytes,
+                                          reinterpret_cast<D *>(volume.slicePtr(z0 + i)), sliceSamples, format);
+                });
+            }
+        });
+    });
+}
+
+} // namespace
+
+
+struct InputStream::Inflater {
+    z_stream stream;
+    std::vector<char> buffer;
+    bool finished = false;
+};
+
+InputStream::InputStream() = default;
+
+InputStream::~InputStream()
+{
+    if (inflater)
+        inflateEnd(&inflater->stream);
+}
+
+bool InputStream::open(const QString &path, qint64 offset, bool compressed)
+{
+    file.setFileName(path);
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(offset)) {
+        error = file.errorString();
+        return false;
+    }
+    if (!compressed)
+        return true;
+
+    inflater.reset(new Inflater);
+    std::memset(&inflater->stream, 0, sizeof(z_stream));
+    // 15 + 32: maximum window, accept both gzip and zlib headers.
+    if (inflateInit2(&inflater->stream, 15 + 32) != Z_OK) {
+        inflater.reset();
+        error = "Could not initialise decompression.";
+        return false;
+    }
+    inflater->buffer.resize(BufferBytes);
+    return true;
+}
+
+qint64 InputStream::read(char *data, qint64 bytes)
+{
+    if (!inflater) {
+        qint64 total = 0;
+        while (total < bytes) {
+            const qint64 n = file.read(data + total, bytes - total);
+            if (n <= 0) {
+                if (n < 0)
+                    error = file.errorString();
+                break;
+            }
+            total += n;
+        }
+        return total;
+    }
+
+    z_stream &zs = inflater->stream;
+    qint64 total = 0;
+    while (total < bytes && !inflater->finished) {
+        if (zs.avail_in == 0) {
+            const qint64 n = file.read(inflater->buffer.data(), BufferBytes);
+            if (n <= 0) {
+                error = n < 0 ? file.errorString() : QString("Unexpected end of compressed data.");
+                break;
+            }
+            zs.next_in = reinterpret_cast<Bytef *>(inflater->buffer.data());
+            zs.avail_in = uInt(n);
+        }
+
+        // avail_out is 32-bit, so very large reads go in pieces.
+        const qint64 want = std::min<qint64>(bytes - total, 1 << 30);
+        zs.next_out = reinterpret_cast<Bytef *>(data + total);
+        zs.avail_out = uInt(want);
+        const int status = inflate(&zs, Z_NO_FLUSH);
+        total += want - zs.avail_out;
+
+        if (status == Z_STREAM_END) {
+            // Another gzip member may follow (pigz, concatenated files).
+            if (zs.avail_in == 0 && file.atEnd())
+                inflater->finished = true;
+            else
+                inflateReset(&zs);
+        } else if (status != Z_OK && status != Z_BUF_ERROR) {
+            error = QString("Corrupt compressed data (%1).").arg(zs.msg ? zs.msg : "zlib error");
+            break;
+        }
+    }
+    return total;
+}
+
+bool InputStream::skip(qint64 bytes)
+{
+    if (!inflater)
+        return file.seek(file.pos() + bytes);
+
+    std::vector<char> scratch(std::min(bytes, BufferBytes));
+    while (bytes > 0) {
+        const qint64 n = read(scratch.data(), std::min<qint64>(bytes, qint64(scratch.size())));
+        if (n <= 0)
+            return false;
+        bytes -= n;
+    }
+    return true;
+}
+
+
+struct OutputStream::Deflater {
+    z_stream stream;
+    std::vector<char> buffer;
+};
+
+OutputStream::OutputStream() = default;
+
+OutputStream::~OutputStream()
+{
+    if (deflater)
+        deflateEnd(&deflater->stream);
+}
+
+bool OutputStream::open(const QString &path)
+{
+    file.setFileName(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool OutputStream::startCompression()
+{
+    deflater.reset(new Deflater);
+    std::memset(&deflater->stream, 0, sizeof(z_stream));
+    // Level 1 favours speed; volumes are large and mostly smooth. 15 + 16 writes a gzip header.
+    if (deflateInit2(&deflater->stream, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        deflater.reset();
+        error = "Could not initialise compression.";
+        return false;
+    }
+    deflater->buffer.resize(BufferBytes);
+    return true;
+}
+
+bool OutputStream::write(const char *data, qint64 bytes)
+{
+    if (!deflater) {
+        if (file.write(data, bytes) != bytes) {
+            error = file.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    z_stream &zs = deflater->stream;
+    while (bytes > 0) {
+        const qint64 piece = std::min<qint64>(bytes, 1 << 30);
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        zs.avail_in = uInt(piece);
+        do {
+            zs.next_out = reinterpret_cast<Bytef *>(deflater->buffer.data());
+            zs.avail_out = uInt(BufferBytes);
+            deflate(&zs, Z_NO_FLUSH);
+            const qint64 produced = BufferBytes - zs.avail_out;
+            if (produced > 0 && file.write(deflater->buffer.data(), produced) != produced) {
+                error = file.errorString();
+                return false;
+            }
+        } while (zs.avail_in > 0);
+        data += piece;
+        bytes -= piece;
+    }
+    return true;
+}
+
+bool OutputStream::commit()
+{
+    if (deflater) {
+        z_stream &zs = deflater->stream;
+        zs.next_in = nullptr;
+        zs.avail_in = 0;
+        int status = Z_OK;
+        while (status == Z_OK) {
+            zs.next_out = reinterpret_cast<Bytef *>(deflater->buffer.data());
+            zs.avail_out = uInt(BufferBytes);
+            status = deflate(&zs, Z_FINISH);
+            const qint64 produced = BufferBytes - zs.avail_out;
+            if (produced > 0 && file.write(deflater->buffer.data(), produced) != produced) {
+                error = file.errorString();
+                return false;
+            }
+        }
+        if (status != Z_STREAM_END) {
+            error = "Compression failed.";
+            return false;
+        }
+    }
+    if (!file.commit()) {
+        error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+
+int sampleSize(SampleType type)
+{
+    int size = 0;
+    dispatchSampleType(type, [&](auto *tag) { size = int(sizeof(*tag)); });
+    return size;
+}
+
+int volumeTypeFor(const SampleFormat &format)
+{
+    if (format.isScaled())
+        return CV_32FC1;
+    switch (format.type) {
+    case SampleType::UInt8: return CV_8UC1;
+    case SampleType::Int8:
+    case SampleType::Int16: return CV_16SC1;
+    case SampleType::UInt16: return CV_16UC1;
+    default: return CV_32FC1;
+    }
+}
+
+bool sampleTypeFor(int volumeType, SampleType &type)
+{
+    switch (volumeType) {
+    case CV_8UC1: type = SampleType::UInt8; return true;
+    case CV_16UC1: type = SampleType::UInt16; return true;
+    case CV_16SC1: type = SampleType::Int16; return true;
+    case CV_32FC1: type = SampleType::Float32; return true;
+    default: return false;
+    }
+}
+
+bool readSamples(InputStream &in, const SampleFormat &format, Volume &volume,
+                 const ReadProgress &progress, QString *error)
+{
+    const int depth = volume.depth();
+    const size_t sliceBytes = size_t(volume.width()) * volume.height() * sampleSize(format.type);
+    const int chunkSlices = int(std::max<size_t>(1, ChunkBytes / std::max<size_t>(1, sliceBytes)));
+    const qint64 totalBytes = qint64(sliceBytes) * depth;
+
+    SampleType native;
+    const bool direct = !format.swapBytes && !format.isScaled()
+        && sampleTypeFor(volume.type(), native) && native == format.type;
+
+    auto fail = [&](const QString &message) {
+        if (error)
+            *error = message;
+        return false;
+    };
+
+    if (direct) {
+        // Slices of a fresh volume are contiguous, so a chunk is one read.
+        for (int z0 = 0; z0 < depth; z0 += chunkSlices) {
+            const int n = std::min(chunkSlices, depth - z0);
+            const qint64 bytes = qint64(sliceBytes) * n;
+            if (in.read(reinterpret_cast<char *>(volume.slicePtr(z0)), bytes) != bytes)
+                return fail(in.errorString().isEmpty() ? QString("File is truncated.") : in.errorString());
+            volume.release(z0, z0 + n);
+            if (progress && !progress(qint64(sliceBytes) * (z0 + n), totalBytes))
+                return fail(QString());
+        }
+        return true;
+    }
+
+    // Double buffered: chunk i is converted on a worker while chunk i + 1 is read.
+    std::vector<char> staging[2];
+    std::future<void> pending;
+    int current = 0;
+    for (int z0 = 0; z0 < depth; z0 += chunkSlices) {
+        const int n = std::min(chunkSlices, depth - z0);
+        const qint64 bytes = qint64(sliceBytes) * n;
+        std::vector<char> &buffer = staging[current];
+        buffer.resize(size_t(bytes));
+        if (in.read(buffer.data(), bytes) != bytes)
+            return fail(in.errorString().isEmpty() ? QString("File is truncated.") : in.errorString());
+
+        if (pending.valid())
+            pending.get();
+        pending = std::async(std::launch::async, [&volume, &buffer, format, z0, n]() {
+            convertChunk(buffer.data(), format, volume, z0, n);
+            volume.release(z0, z0 + n);
+        });
+        current ^= 1;
+
+        if (progress && !progress(qint64(sliceBytes) * (z0 + n), totalBytes))
+            return fail(QString());
+    }
+    if (pending.valid())
+        pending.get();
+    return true;
+}
+
+bool writeSamples(OutputStream &out, const Volume &volume, QString *error)
+{
+    const qint64 rowBytes = qint64(volume.width()) * qint64(volume.elemSize());
+    const bool packed = volume.rowStride() == size_t(rowBytes);
+    for (int z = 0; z < volume.depth(); ++z) {
+        const char *slice = reinterpret_cast<const char *>(volume.slicePtr(z));
+        bool ok = true;
+        if (packed) {
+            ok = out.write(slice, rowBytes * volume.height());
+        } else {
+            for (int y = 0; y < volume.height() && ok; ++y)
+                ok = out.write(slice + y * volume.rowStride(), rowBytes);
+        }
+        if (!ok) {
+            if (error)
+                *error = out.errorString();
+            return false;
+        }
+    }
+    return true;
+}
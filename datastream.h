@@ -0,0 +1,103 @@
+#ifndef DATASTREAM_H
+#define DATASTREAM_H
+
+#include <QFile>
+#include <QSaveFile>
+#include <QString>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+#include "volume.h"
+
+// Sequential reader over a file region. Compressed regions (gzip or zlib,
+// including concatenated gzip members) are inflated on the fly, so callers
+// can read straight into their destination buffers.
+class InputStream {
+public:
+    InputStream();
+    ~InputStream();
+
+    bool open(const QString &path, qint64 offset, bool compressed);
+    // Reads up to bytes; fewer are returned only at the end of the data or on error.
+    qint64 read(char *data, qint64 bytes);
+    bool skip(qint64 bytes);
+    QString errorString() const { return error; }
+
+private:
+    struct Inflater;
+    QFile file;
+    std::unique_ptr<Inflater> inflater;
+    QString error;
+};
+
+// Sequential writer that can switch to gzip compression part-way, e.g. after
+// a plain-text header. The file only replaces its target on commit().
+class OutputStream {
+public:
+    OutputStream();
+    ~OutputStream();
+
+    bool open(const QString &path);
+    bool startCompression();
+    bool write(const char *data, qint64 bytes);
+    bool commit();
+    QString errorString() const { return error; }
+
+private:
+    struct Deflater;
+    QSaveFile file;
+    std::unique_ptr<Deflater> deflater;
+    QString error;
+};
+
+// Sample types found in NRRD and NIfTI files.
+enum class SampleType { UInt8, Int8, UInt16, Int16, UInt32, Int32, UInt64, Int64, Float32, Float64 };
+
+struct SampleFormat {
+    SampleType type = SampleType::UInt8;
+    bool swapBytes = false;      // stored in the other byte order
+    double slope = 1.0;          // value = stored * slope + intercept
+    double intercept = 0.0;
+
+    bool isScaled() const { return slope != 1.0 || intercept != 0.0; }
+};
+
+int sampleSize(SampleType type);
+// Volume type for the samples: 8 and 16-bit data is kept as is (signed
+// bytes widen to 16 bit), everything else and scaled data becomes float.
+int volumeTypeFor(const SampleFormat &format);
+// Sample type a volume is written as; false for types files cannot hold.
+bool sampleTypeFor(int volumeType, SampleType &type);
+
+// Called after each chunk; returning false cancels the read.
+typedef std::function<bool(qint64 done, qint64 total)> ReadProgress;
+
+// Streams depth x height x width samples into a preallocated volume of
+// volumeTypeFor(format). Native data is read straight into the volume buffer;
+// data that needs swapping, scaling or widening is read into one of two
+// staging chunks and converted on a worker while the next chunk is read.
+// Finished chunks of paged volumes are released, so files larger than the
+// memory budget stream through.
+bool readSamples(InputStream &in, const SampleFormat &format, Volume &volume,
+                 const ReadProgress &progress, QString *error);
+// Writes the voxels in native byte order, slice by slice.
+bool writeSamples(OutputStream &out, const Volume &volume, QString *error);
+
+inline bool isLittleEndianHost()
+{
+    const quint16 probe = 1;
+    return *reinterpret_cast<const uchar *>(&probe) == 1;
+}
+
+template <typename T>
+T byteSwapped(T value)
+{
+    uchar *bytes = reinterpret_cast<uchar *>(&value);
+    for (size_t i = 0; i < sizeof(T) / 2; ++i)
+        std::swap(bytes[i], bytes[sizeof(T) - 1 - i]);
+    return value;
+}
+
+#endif // DATASTREAM_H
@@ -0,0 +1,175 @@
+#include "detectiondecoder.h"
+
+#include <algorithm>
+#include <cfloat>
+
+#include <opencv2/core/hal/intrin.hpp>
+
+namespace {
+
+// The last two axes of an output as a rows x cols float matrix.
+cv::Mat matrixOf(const cv::Mat &output)
+{
+    CV_Assert(output.depth() == CV_32F && output.dims >= 2);
+    const int rows = output.size[output.dims - 2];
+    const int cols = output.size[output.dims - 1];
+    CV_Assert(output.total() == size_t(rows) * size_t(cols));
+    const cv::Mat continuous = output.isContinuous() ? output : output.clone();
+    return continuous.reshape(1, rows);
+}
+
+float maxOf(const float *values, int n)
+{
+    float best = -FLT_MAX;
+    int i = 0;
+#if CV_SIMD
+    const int lanes = cv::v_float32::nlanes;
+    if (n >= lanes) {
+        cv::v_float32 m = cv::vx_load(values);
+        for (i = lanes; i + lanes <= n; i += lanes)
+            m = cv::v_max(m, cv::vx_load(values + i));
+        best = cv::v_reduce_max(m);
+    }
+#endif
+    for (; i < n; ++i)
+        best = std::max(best, values[i]);
+    return best;
+}
+
+cv::Rect boxOf(float cx, float cy, float w, float h, const cv::Size2f &scale)
+{
+    return cv::Rect(cvRound((cx - 0.5f * w) * scale.width), cvRound((cy - 0.5f * h) * scale.height),
+                    cvRound(w * scale.width), cvRound(h * scale.height));
+}
+
+void decodeRows(const cv::Mat &m, DetectionDecoder::Layout layout, float threshold, const cv::Size2f &scale,
+                std::vector<Detection> &detections)
+{
+    const bool objectness = layout != DetectionDecoder::Yolov8Rows;
+    const int first = objectness ? 5 : 4;
+    const int classes = m.cols - first;
+    if (classes <= 0)
+        return;
+
+    for (int r = 0; r < m.rows; ++r) {
+        const float *row = m.ptr<float>(r);
+        // Class scores are at most one, so low objectness rules a row out.
+        const float gate = objectness ? row[4] : 1.0f;
+        if (gate < threshold)
+            continue;
+        const float best = maxOf(row + first, classes);
+        const float score = layout == DetectionDecoder::Yolov5 ? best * gate : best;
+        if (score < threshold)
+            continue;
+        const int classId = int(std::find(row + first, row + first + classes, best) - (row + first));
+        detections.push_back({ boxOf(row[0], row[1], row[2], row[3], scale), score, classId });
+    }
+}
+
+void decodeColumns(const cv::Mat &m, float threshold, const cv::Size2f &scale, std::vector<Detection> &detections)
+{
+    const int classes = m.rows - 4;
+    const int anchors = m.cols;
+    if (classes <= 0)
+        return;
+
+    // Running best score and class per candidate, one class row at a time.
+    const float *scores = m.ptr<float>(4);
+    std::vector<float> best(scores, scores + anchors);
+    std::vector<int> bestClass(anchors, 0);
+    for (int c = 1; c < classes; ++c) {
+        const float *row = m.ptr<float>(4 + c);
+        int a = 0;
+#if CV_SIMD
+        const int lanes = cv::v_float32::nlanes;
+        const cv::v_int32 id = cv::vx_setall_s32(c);
+        for (; a + lanes <= anchors; a += lanes) {
+            const cv::v_float32 v = cv::vx_load(row + a);
+            const cv::v_float32 b = cv::vx_load(best.data() + a);
+            const cv::v_float32 greater = v > b;
+            cv::v_store(best.data() + a, cv::v_select(greater, v, b));
+            cv::v_store(bestClass.data() + a,
+                        cv::v_select(cv::v_reinterpret_as_s32(greater), id, cv::vx_load(bestClass.data() + a)));
+        }
+#endif
+        for (; a < anchors; ++a) {
+            if (row[a] > best[a]) {
+                best[a] = row[a];
+                bestClass[a] = c;
+            }
+        }
+    }
+
+    const float *x = m.ptr<float>(0);
+    const float *y = m.ptr<float>(1);
+    const float *w = m.ptr<float>(2);
+    const float *h = m.ptr<float>(3);
+    for (int a = 0; a < anchors; ++a) {
+        if (best[a] >= threshold)
+            detections.push_back({ boxOf(x[a], y[a], w[a], h[a], scale), best[a], bestClass[a] });
+    }
+}
+
+} // namespace
+
+
+DetectionDecoder::Layout DetectionDecoder::layoutOf(const cv::Mat &output, int classes)
+{
+    const int rows = output.size[output.dims - 2];
+    const int cols = output.size[output.dims - 1];
+    if (cols > rows)
+        return Yolov8;
+    if (classes > 0 && cols == 4 + classes)
+        return Yolov8Rows;
+    return Yolov5;
+}
+
+void DetectionDecoder::decode(const cv::Mat &output, Layout layout, float threshold, const cv::Size2f &scale,
+                              std::vector<Detection> &detections)
+{
+    const cv::Mat m = matrixOf(output);
+    if (layout == Yolov8)
+        decodeColumns(m, threshold, scale, detections);
+    else
+        decodeRows(m, layout, threshold, scale, detections);
+}
+
+void DetectionDecoder::suppress(std::vector<Detection> &detections, float iouThreshold, bool classAware)
+{
+    // Sorted by class, then score, so each class is one run and boxes are
+    // only compared with the kept boxes of their own run.
+    std::sort(detections.begin(), detections.end(), [classAware](const Detection &a, const Detection &b) {
+        if (classAware && a.classId != b.classId)
+            return a.classId < b.classId;
+        return a.score > b.score;
+    });
+
+    std::vector<Detection> kept;
+    for (size_t begin = 0; begin < detections.size();) {
+        size_t end = begin + 1;
+        while (end < detections.size() && (!classAware || detections[end].classId == detections[begin].classId))
+            ++end;
+
+        const size_t firstKept = kept.size();
+        for (size_t i = begin; i < end; ++i) {
+            const cv::Rect &box = detections[i].box;
+            bool keep = true;
+            for (size_t j = firstKept; j < kept.size() && keep; ++j) {
+                // IoU above the threshold, without the division.
+                const float shared = float((box & kept[j].box).area());
+                keep = shared <= iouThreshold * float(box.area() + kept[j].box.area() - shared);
+            }
+            if (keep)
+                kept.push_back(detections[i]);
+        }
+        begin = end;
+    }
+    detections.swap(kept);
+}
+
+float DetectionDecoder::overlap(const cv::Rect &a, const cv::Rect &b)
+{
+    const float intersection = float((a & b).area());
+    const float united = float(a.area() + b.area()) - intersection;
+    return united > 0.0f ? intersection / united : 0.0f;
+}
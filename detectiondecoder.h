@@ -0,0 +1,55 @@
+#ifndef DETECTIONDECODER_H
+#define DETECTIONDECODER_H
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+struct Detection {
+    cv::Rect box;
+    float score = 0.0f;
+    int classId = 0;
+    int tile = -1;   // TilePlan tile it was found on, when tiled
+};
+
+// Turns raw YOLO outputs into scored boxes.
+//
+// Every layout is read in its own memory order. Row layouts (one candidate
+// per row) are gated on objectness where they have it, then reduce the
+// contiguous class scores with a vectorised max; only survivors look up
+// their class. The channel-first YOLOv8/v11 layout keeps a running maximum
+// and class per candidate while streaming each class row once, vectorised
+// across candidates, so nothing is transposed. Leading axes of size one
+// (the batch) are ignored.
+class DetectionDecoder {
+public:
+    enum Layout {
+        Darknet,        // rows of x, y, w, h, objectness, class scores already
+                        // multiplied by objectness (OpenCV region layers)
+        Yolov5,         // rows of x, y, w, h, objectness, class scores
+        Yolov8,         // (4 + classes) x candidates: coordinates, class scores
+        Yolov8Rows      // the same transposed, one candidate per row
+    };
+
+    // Layout of an ONNX output: wider than tall is channel-first YOLOv8/v11;
+    // rows are YOLOv8 when they hold 4 + classes values and YOLOv5 otherwise.
+    // classes is 0 when unknown.
+    static Layout layoutOf(const cv::Mat &output, int classes = 0);
+
+    // Appends the candidates of output scoring at least threshold. Box
+    // coordinates are multiplied by scale, e.g. by the image size for
+    // normalised coordinates.
+    static void decode(const cv::Mat &output, Layout layout, float threshold, const cv::Size2f &scale,
+                       std::vector<Detection> &detections);
+
+    // Greedy non-maximum suppression over all classes in one call: a box is
+    // dropped if it overlaps a kept, higher-scoring box of its class (of any
+    // class unless classAware) by more than iouThreshold. The survivors are
+    // grouped by class, highest score first.
+    static void suppress(std::vector<Detection> &detections, float iouThreshold, bool classAware = true);
+
+    // Intersection over union of two boxes, 0 for empty ones.
+    static float overlap(const cv::Rect &a, const cv::Rect &b);
+};
+
+#endif // DETECTIONDECODER_H
@@ -0,0 +1,145 @@
+#include "detectionpipeline.h"
+
+#include <QSettings>
+
+#include <exception>
+#include <future>
+#include <memory>
+
+#include "batchinference.h"
+
+DetectionPipeline::DetectionPipeline(int preprocessThreads, int postprocessThreads)
+    : preprocessThreads(std::clamp(preprocessThreads, 1, int(MaxThreads))),
+      postprocessThreads(std::clamp(postprocessThreads, 1, int(MaxThreads)))
+{
+}
+
+bool DetectionPipeline::run(const std::vector<int> &items, BatchInference &batches, const Stage &preprocess, const Stage &infer,
+                            const Stage &postprocess, const std::atomic<bool> *cancel,
+                            const std::function<void(int, int)> &progress)
+{
+    typedef std::unique_ptr<Batch> Slot;
+
+    // Enough slots for every thread to hold one while both queues are full.
+    const int slots = preprocessThreads + postprocessThreads + 2 * QueueDepth + 1;
+    BoundedQueue<Slot> idle(slots, cancel);
+    BoundedQueue<Slot> prepared(QueueDepth, cancel);
+    BoundedQueue<Slot> inferred(QueueDepth, cancel);
+    for (int i = 0; i < slots; ++i)
+        idle.push(std::make_unique<Batch>());
+
+    std::atomic<bool> stopped(false);
+    auto stopping = [&]() { return stopped || (cancel && *cancel); };
+    auto stop = [&]() {
+        stopped = true;
+        idle.close();
+        prepared.close();
+        inferred.close();
+    };
+    // A stage that quits because the run was cut short wakes all the others,
+    // which may be blocked on a queue it would have emptied or filled.
+    auto stopIfStopping = [&]() {
+        if (stopping())
+            stop();
+    };
+
+    // The first exception of any stage stops all of them.
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    auto guarded = [&](const Stage &stage, Batch &batch) {
+        try {
+            stage(batch);
+            return true;
+        } catch (...) {
+            {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+            stop();
+            return false;
+        }
+    };
+
+    // Preprocess threads cut the next batch off the remaining items, so
+    // batches may enter the queue out of order.
+    std::mutex cutMutex;
+    const int total = int(items.size());
+    int next = 0;
+    std::atomic<int> preprocessing(preprocessThreads);
+    auto preprocessLoop = [&]() {
+        Slot batch;
+        while (!stopping() && idle.pop(batch)) {
+            {
+                std::lock_guard<std::mutex> lock(cutMutex);
+                if (next >= total)
+                    break;
+                batch->count = batches.nextBatch(total - next);
+                batch->items.assign(items.begin() + next, items.begin() + next + batch->count);
+                next += batch->count;
+            }
+            if (!guarded(preprocess, *batch) || !prepared.push(std::move(batch)))
+                break;
+        }
+        stopIfStopping();
+        if (--preprocessing == 0)
+            prepared.close();
+    };
+
+    std::atomic<int> done(0);
+    auto postprocessLoop = [&]() {
+        Slot batch;
+        while (!stopping() && inferred.pop(batch)) {
+            if (!guarded(postprocess, *batch))
+                break;
+            const int finished = done += batch->count;
+            if (progress)
+                progress(finished, total);
+            batch->outputs.clear();
+            if (!idle.push(std::move(batch)))
+                break;
+        }
+        stopIfStopping();
+    };
+
+    std::vector<std::future<void>> workers;
+    for (int i = 0; i < preprocessThreads; ++i)
+        workers.push_back(std::async(std::launch::async, preprocessLoop));
+    for (int i = 0; i < postprocessThreads; ++i)
+        workers.push_back(std::async(std::launch::async, postprocessLoop));
+
+    Slot batch;
+    while (!stopping() && prepared.pop(batch)) {
+        if (!guarded(infer, *batch) || !inferred.push(std::move(batch)))
+            break;
+    }
+    // Postprocessing drains what is left, unless the run was cut short;
+    // then every stage is woken and quits.
+    if (stopping())
+        stop();
+    else
+        inferred.close();
+
+    for (std::future<void> &worker : workers)
+        worker.get();
+    if (error)
+        std::rethrow_exception(error);
+    return !stopping();
+}
+
+int DetectionPipeline::preprocessThreadsSetting()
+{
+    return std::clamp(QSettings().value("detection/preprocessThreads", 2).toInt(), 1, int(MaxThreads));
+}
+
+int DetectionPipeline::postprocessThreadsSetting()
+{
+    return std::clamp(QSettings().value("detection/postprocessThreads", 2).toInt(), 1, int(MaxThreads));
+}
+
+void DetectionPipeline::saveThreadSettings(int preprocessThreads, int postprocessThreads)
+{
+    QSettings settings;
+    settings.setValue("detection/preprocessThreads", preprocessThreads);
+    settings.setValue("detection/postprocessThreads", postprocessThreads);
+}
@@ -0,0 +1,132 @@
+#ifndef DETECTIONPIPELINE_H
+#define DETECTIONPIPELINE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+class BatchInference;
+
+// FIFO of at most `capacity` items between two pipeline stages. push()
+// blocks while it is full and pop() while it is empty. After close(),
+// push() fails and pop() hands out what is left, then fails. Once *cancel
+// is set, both fail at once, also when already waiting: a flag cannot
+// notify, so waits poll it every PollInterval.
+template <typename T>
+class BoundedQueue {
+public:
+    static constexpr std::chrono::milliseconds PollInterval{ 20 };
+
+    explicit BoundedQueue(size_t capacity, const std::atomic<bool> *cancel = nullptr)
+        : capacity(std::max<size_t>(capacity, 1)), cancel(cancel) {}
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!wait(notFull, lock, [this]() { return closed || items.size() < capacity; }) || closed)
+            return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!wait(notEmpty, lock, [this]() { return closed || !items.empty(); }) || items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    const std::atomic<bool> *cancel;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<T> items;
+    bool closed = false;
+
+    // False if cancelled before ready() held.
+    template <typename Ready>
+    bool wait(std::condition_variable &condition, std::unique_lock<std::mutex> &lock, Ready ready)
+    {
+        if (!cancel) {
+            condition.wait(lock, ready);
+            return true;
+        }
+        while (!*cancel) {
+            if (condition.wait_for(lock, PollInterval, ready))
+                return !*cancel;
+        }
+        return false;
+    }
+};
+
+// Runs the work items of a volume (slices, or tiles of them) through
+// preprocess, inference and postprocess stages that overlap: while the
+// network works on one batch, the preprocess threads prepare the next ones
+// and the postprocess threads decode and draw the previous ones.
+//
+// Inference runs on the calling thread, as a network takes one forward
+// pass at a time; the other two stages get their own threads. Batches are
+// handed on through bounded queues of QueueDepth, so no stage runs far
+// ahead of the network. Batch slots are recycled once postprocessed, so
+// buffers a stage keeps in them (input tensors, resized images) are reused
+// and memory stays bounded. Batches reach postprocessing in any order.
+class DetectionPipeline {
+public:
+    static const int QueueDepth = 2;
+    static const int MaxThreads = 16;
+
+    // One batch of items and what the stages make of it; the stages
+    // decide what goes into images and input.
+    struct Batch {
+        std::vector<int> items;
+        int count = 0;   // items.size()
+        std::vector<cv::Mat> images;
+        cv::Mat input;
+        std::vector<std::vector<cv::Mat>> outputs;   // per item
+    };
+    typedef std::function<void(Batch &)> Stage;
+
+    DetectionPipeline(int preprocessThreads, int postprocessThreads);
+
+    // Runs the given items, in batches cut in order with
+    // batches.nextBatch(). progress(done, total) is called with the items
+    // postprocessed so far, from postprocess threads. Stops early when
+    // *cancel becomes true and returns false. The first exception thrown by
+    // a stage stops the pipeline and is rethrown here.
+    bool run(const std::vector<int> &items, BatchInference &batches, const Stage &preprocess, const Stage &infer,
+             const Stage &postprocess, const std::atomic<bool> *cancel = nullptr,
+             const std::function<void(int, int)> &progress = nullptr);
+
+    // Thread counts from the settings, clamped to [1, MaxThreads].
+    static int preprocessThreadsSetting();
+    static int postprocessThreadsSetting();
+    static void saveThreadSettings(int preprocessThreads, int postprocessThreads);
+
+private:
+    int preprocessThreads;
+    int postprocessThreads;
+};
+
+#endif // DETECTIONPIPELINE_H
@@ -0,0 +1,115 @@
+#include "detectionresults.h"
+
+#include <QPainter>
+
+#include <algorithm>
+
+#include "volume.h"
+
+DetectionResults::DetectionResults(int width, int height, const std::vector<std::vector<Detection>> &slices,
+                                   const std::vector<std::string> &classNames, const std::vector<SliceSource> &sources)
+{
+    auto data = std::make_shared<Data>();
+    data->width = width;
+    data->height = height;
+    data->classNames = classNames;
+
+    size_t total = 0;
+    for (const std::vector<Detection> &slice : slices)
+        total += slice.size();
+    data->offsets.reserve(slices.size() + 1);
+    data->boxes.reserve(total);
+    data->scores.reserve(total);
+    data->classIds.reserve(total);
+
+    data->offsets.push_back(0);
+    for (const std::vector<Detection> &slice : slices) {
+        for (const Detection &detection : slice) {
+            data->boxes.push_back(detection.box);
+            data->scores.push_back(detection.score);
+            data->classIds.push_back(detection.classId);
+        }
+        data->offsets.push_back(int(data->scores.size()));
+    }
+    if (sources.size() == slices.size())
+        data->sources.assign(sources.begin(), sources.end());
+    else
+        data->sources.assign(slices.size(), Inferred);
+    linkTracks(*data);
+    d = data;
+}
+
+void DetectionResults::linkTracks(Data &data)
+{
+    data.tracks.assign(data.scores.size(), -1);
+    std::vector<std::pair<float, std::pair<int, int>>> pairs;
+    for (size_t z = 0; z + 1 < data.offsets.size(); ++z) {
+        const int begin = data.offsets[z];
+        const int end = data.offsets[z + 1];
+        if (z > 0) {
+            // Candidate links from the previous slice, most overlapping first.
+            const int previous = data.offsets[z - 1];
+            pairs.clear();
+            for (int i = previous; i < begin; ++i) {
+                for (int j = begin; j < end; ++j) {
+                    if (data.classIds[i] != data.classIds[j])
+                        continue;
+                    const float overlap = DetectionDecoder::overlap(data.boxes[i], data.boxes[j]);
+                    if (overlap >= LinkOverlap)
+                        pairs.push_back({ overlap, { i, j } });
+                }
+            }
+            std::sort(pairs.begin(), pairs.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+
+            std::vector<bool> continued(begin - previous, false);
+            for (const auto &pair : pairs) {
+                const int i = pair.second.first;
+                const int j = pair.second.second;
+                if (continued[i - previous] || data.tracks[j] >= 0)
+                    continue;
+                continued[i - previous] = true;
+                data.tracks[j] = data.tracks[i];
+            }
+        }
+        // Boxes that continue nothing start a tubelet.
+        for (int j = begin; j < end; ++j) {
+            if (data.tracks[j] < 0)
+                data.tracks[j] = data.trackCount++;
+        }
+    }
+}
+
+bool DetectionResults::covers(const Volume &volume) const
+{
+    return d && volume.width() == d->width && volume.height() == d->height && volume.depth() == depth();
+}
+
+std::string DetectionResults::className(int i) const
+{
+    const int id = d->classIds[i];
+    if (id >= 0 && id < int(d->classNames.size()))
+        return d->classNames[id];
+    return std::to_string(id);
+}
+
+void DetectionResults::paint(QPainter &painter, int z, double scale, const QRectF &visible) const
+{
+    if (!d || z < 0 || z >= depth())
+        return;
+
+    painter.save();
+    painter.setPen(QPen(Qt::green, 2, source(z) == Propagated ? Qt::DashLine : Qt::SolidLine));
+    painter.setBrush(Qt::NoBrush);
+    const int textHeight = painter.fontMetrics().ascent();
+    for (int i = begin(z); i < end(z); ++i) {
+        const cv::Rect &b = d->boxes[i];
+        const QRectF rect(b.x * scale, b.y * scale, b.width * scale, b.height * scale);
+        if (!rect.intersects(visible))
+            continue;
+        painter.drawRect(rect);
+        const QString label = QString("%1 %2 #%3").arg(QString::fromStdString(className(i)))
+                                  .arg(d->scores[i], 0, 'f', 2).arg(d->tracks[i]);
+        painter.drawText(QPointF(rect.left(), std::max(rect.top() - 4, visible.top() + textHeight)), label);
+    }
+    painter.restore();
+}
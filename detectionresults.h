@@ -0,0 +1,78 @@
+#ifndef DETECTIONRESULTS_H
+#define DETECTIONRESULTS_H
+
+#include <QRectF>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "detectiondecoder.h"
+
+class QPainter;
+class Volume;
+
+// Detections of a whole volume, kept apart from its voxels.
+//
+// Boxes, scores, class ids and tubelet ids are packed slice after slice
+// into parallel arrays (struct of arrays); the entries of slice z are
+// [begin(z), end(z)). Boxes are linked across Z into tubelets when packed:
+// each box continues the box of its class on the previous slice that
+// overlaps it most (by at least LinkOverlap), best pairs first, and starts
+// a new tubelet otherwise. Immutable once built and implicitly shared, so
+// copies are cheap and can be handed between threads.
+class DetectionResults {
+public:
+    // How the detections of a slice were obtained.
+    enum SliceSource { Inferred, Propagated, Skipped };
+
+    static constexpr float LinkOverlap = 0.3f;
+
+    DetectionResults() = default;
+    // Packs the detections found on each slice of a width x height x
+    // slices.size() volume. Without sources every slice counts as inferred.
+    DetectionResults(int width, int height, const std::vector<std::vector<Detection>> &slices,
+                     const std::vector<std::string> &classNames, const std::vector<SliceSource> &sources = {});
+
+    bool isEmpty() const { return !d; }
+    int depth() const { return d ? int(d->offsets.size()) - 1 : 0; }
+    int count() const { return d ? int(d->scores.size()) : 0; }
+    // Whether the results were found on a volume of this size.
+    bool covers(const Volume &volume) const;
+
+    int begin(int z) const { return d->offsets[z]; }
+    int end(int z) const { return d->offsets[z + 1]; }
+    const cv::Rect &box(int i) const { return d->boxes[i]; }
+    float score(int i) const { return d->scores[i]; }
+    int classId(int i) const { return d->classIds[i]; }
+    std::string className(int i) const;
+    int track(int i) const { return d->tracks[i]; }
+    int trackCount() const { return d ? d->trackCount : 0; }
+    SliceSource source(int z) const { return SliceSource(d->sources[z]); }
+
+    // Boxes and labels of slice z at scale display pixels per voxel, dashed
+    // on propagated slices. Boxes outside visible (display coordinates)
+    // are skipped.
+    void paint(QPainter &painter, int z, double scale, const QRectF &visible) const;
+
+private:
+    struct Data {
+        int width = 0;
+        int height = 0;
+        std::vector<int> offsets;   // depth + 1 entries
+        std::vector<cv::Rect> boxes;
+        std::vector<float> scores;
+        std::vector<int> classIds;
+        std::vector<int> tracks;
+        std::vector<uchar> sources;   // SliceSource per slice
+        int trackCount = 0;
+        std::vector<std::string> classNames;
+    };
+
+    static void linkTracks(Data &data);
+    std::shared_ptr<const Data> d;
+};
+
+#endif // DETECTIONRESULTS_H
@@ -1,27 +1,110 @@
 #include "editwindow.h"
+#include "taskscheduler.h"
+#include "volumehistory.h"
 #include <QDesktopWidget>  // Optional for screen geometry if needed
+#include <QMessageBox>
+#include <QPixmap>
 
+namespace {
 
-EditWindow::EditWindow(const QList<cv::Mat> &images, QWidget *parent)
-    : QDialog(parent), imageSlices(images)
+// Range and step of the value control for each kind of step.
+void setupValueSpin(QDoubleSpinBox *spin, const FilterOp &op)
+{
+    const QSignalBlocker blocker(spin);
+    switch (op.kind) {
+    case FilterOp::GaussianBlur:
+        spin->setRange(0.3, 20.0);
+        spin->setSingleStep(0.1);
+        spin->setDecimals(1);
+        break;
+    case FilterOp::Sharpen:
+        spin->setRange(0.0, 5.0);
+        spin->setSingleStep(0.1);
+        spin->setDecimals(1);
+        break;
+    case FilterOp::EdgeDetection:
+        spin->setRange(1.0, 255.0);
+        spin->setSingleStep(5.0);
+        spin->setDecimals(0);
+        break;
+    case FilterOp::Brightness:
+        spin->setRange(-255.0, 255.0);
+        spin->setSingleStep(5.0);
+        spin->setDecimals(0);
+        break;
+    case FilterOp::Contrast:
+        spin->setRange(0.1, 5.0);
+        spin->setSingleStep(0.05);
+        spin->setDecimals(2);
+        break;
+    case FilterOp::Gaussian3D:
+        spin->setRange(0.3, 10.0);
+        spin->setSingleStep(0.1);
+        spin->setDecimals(1);
+        break;
+    case FilterOp::Mean3D:
+    case FilterOp::Median3D:
+        spin->setRange(1.0, VolumeFilter::MaxMedianRadius);
+        spin->setSingleStep(1.0);
+        spin->setDecimals(0);
+        break;
+    case FilterOp::Invert:
+    case FilterOp::Gradient3D:
+        break;
+    }
+    spin->setEnabled(op.hasValue());
+    spin->setValue(op.value);
+}
+
+// The slider spans the spin box range linearly.
+int sliderPosition(const QDoubleSpinBox *spin, int steps)
+{
+    const double span = spin->maximum() - spin->minimum();
+    return span > 0.0 ? qRound((spin->value() - spin->minimum()) / span * steps) : 0;
+}
+
+double sliderValue(const QDoubleSpinBox *spin, int position, int steps)
+{
+    return spin->minimum() + (spin->maximum() - spin->minimum()) * position / steps;
+}
+
+} // namespace
+
+
+EditWindow::EditWindow(const Volume &volume, VolumeHistory *history, QWidget *parent)
+    : QDialog(parent), volume(volume), history(history)
 {
     setWindowTitle("Edit Images");
 
     QVBoxLayout *layout = new QVBoxLayout(this);
 
+    // Filters are queued as a chain and applied together in one pass.
+    QHBoxLayout *addLayout = new QHBoxLayout();
     filterCombo = new QComboBox(this);
-    filterCombo->addItems({
-        "None",
-        "Gaussian Blur",
-        "Sharpen",
-        "Edge Detection",
-        "Invert",
-        "Brightness +",
-        "Brightness -",
-        "Contrast +",
-        "Contrast -"
-    });
-    layout->addWidget(filterCombo);
+    filterCombo->addItems(FilterOp::names());
+    addButton = new QPushButton("Add", this);
+    addLayout->addWidget(filterCombo, 1);
+    addLayout->addWidget(addButton);
+    layout->addLayout(addLayout);
+
+    chainList = new QListWidget(this);
+    layout->addWidget(chainList);
+
+    QHBoxLayout *stepLayout = new QHBoxLayout();
+    valueSpin = new QDoubleSpinBox(this);
+    valueSpin->setEnabled(false);
+    removeButton = new QPushButton("Remove", this);
+    removeButton->setEnabled(false);
+    stepLayout->addWidget(new QLabel("Value:", this));
+    stepLayout->addWidget(valueSpin, 1);
+    stepLayout->addWidget(removeButton);
+    layout->addLayout(stepLayout);
+
+    // Dragging previews a reduced slice; the full one follows on release.
+    valueSlider = new QSlider(Qt::Horizontal, this);
+    valueSlider->setRange(0, SliderSteps);
+    valueSlider->setEnabled(false);
+    layout->addWidget(valueSlider);
 
     QHBoxLayout *btnLayout = new QHBoxLayout();
     applyButton = new QPushButton("Apply", this);
@@ -30,19 +113,59 @@ EditWindow::EditWindow(const QList<cv::Mat> &images, QWidget *parent)
     btnLayout->addWidget(undoButton);
     layout->addLayout(btnLayout);
 
-//    preview = new QLabel(this);
-//    preview->setFixedSize(256, 256);
-//    preview->setStyleSheet("border: 1px solid gray;");
-//    layout->addWidget(preview, 0, Qt::AlignHCenter);
+    QHBoxLayout *progressLayout = new QHBoxLayout();
+    progressBar = new QProgressBar(this);
+    progressBar->setRange(0, 1000);
+    progressBar->setTextVisible(false);
+    cancelButton = new QPushButton("Cancel", this);
+    progressLayout->addWidget(progressBar);
+    progressLayout->addWidget(cancelButton);
+    layout->addLayout(progressLayout);
+    setRunning(false);
+
+    preview = new QLabel(this);
+    preview->setFixedSize(256, 256);
+    preview->setAlignment(Qt::AlignCenter);
+    preview->setStyleSheet("border: 1px solid gray;");
+    layout->addWidget(preview, 0, Qt::AlignHCenter);
 
+    connect(addButton, &QPushButton::clicked, this, &EditWindow::addStep);
+    connect(removeButton, &QPushButton::clicked, this, &EditWindow::removeStep);
+    connect(chainList, &QListWidget::currentRowChanged, this, &EditWindow::selectStep);
+    connect(valueSpin, QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, &EditWindow::setStepValue);
+    connect(valueSlider, &QSlider::valueChanged, this, [this](int position) {
+        valueSpin->setValue(sliderValue(valueSpin, position, SliderSteps));
+    });
+    connect(valueSlider, &QSlider::sliderReleased, this, &EditWindow::schedulePreview);
+
+    previewTimer = new QTimer(this);
+    previewTimer->setSingleShot(true);
+    previewTimer->setInterval(0);
+    connect(previewTimer, &QTimer::timeout, this, &EditWindow::updatePreview);
     connect(applyButton, &QPushButton::clicked, this, &EditWindow::applyFilter);
     connect(undoButton, &QPushButton::clicked, this, &EditWindow::undoLast);
+    connect(cancelButton, &QPushButton::clicked, this, [this]() {
+        if (task)
+            task->cancel();
+    });
 
-    // Show preview of first image
-    //if (!imageSlices.isEmpty())
-     //   preview->setPixmap(QPixmap::fromImage(matToQImage(imageSlices.first())));
+    // Undo, redo, rotation or another open volume may replace the volume
+    // this dialog edits.
+    connect(history, &VolumeHistory::currentChanged, this, [this](const Volume &current) {
+        this->volume = current;
+        setGraphSource(current);
+        schedulePreview();
+    });
+    undoButton->setEnabled(history->canUndo());
+    connect(history, &VolumeHistory::changed, this, [this]() {
+        undoButton->setEnabled(!task && this->history->canUndo());
+    });
 
-    resize(400, 300);  // Ensures the window is a usable size
+    previewSlice = volume.depth() / 2;
+    setGraphSource(volume);
+    schedulePreview();
+
+    resize(400, 560);  // Ensures the window is a usable size
     move(100, 100);    // Optional: place it somewhere visible on screen
     show();            // Ensure it becomes visible when instantiated
 
@@ -51,56 +174,184 @@ EditWindow::EditWindow(const QList<cv::Mat> &images, QWidget *parent)
 
 QImage EditWindow::matToQImage(const cv::Mat &mat)
 {
-    return QImage(mat.data, mat.cols, mat.rows, mat.step, QImage::Format_Grayscale8).copy();
+    const cv::Mat display = WindowLevel::fullRange(mat).apply(mat);
+    if (display.type() == CV_8UC3)
+        return QImage(display.data, display.cols, display.rows, display.step, QImage::Format_RGB888).rgbSwapped();
+    return QImage(display.data, display.cols, display.rows, display.step, QImage::Format_Grayscale8).copy();
 }
 
-void EditWindow::applyFilter()
+EditWindow::~EditWindow()
 {
-    // Deep copy for undo
-    QList<cv::Mat> copiedSlices;
-    for (const cv::Mat &img : imageSlices) {
-        copiedSlices.append(img.clone());
+    // A filter still running is stopped and its slices are put back.
+    if (task) {
+        task->cancel();
+        task->wait();
+        finishFilter(true, QString());
     }
-    undoStack.push(copiedSlices);  // Push deep copy
-
-    QString filter = filterCombo->currentText();
-
-    for (cv::Mat &img : imageSlices) {
-        if (filter == "Gaussian Blur") {
-            cv::GaussianBlur(img, img, cv::Size(5, 5), 1.5);
-        } else if (filter == "Sharpen") {
-            cv::Mat kernel = (cv::Mat_<float>(3,3) <<
-                               0, -1,  0,
-                              -1,  5, -1,
-                               0, -1,  0);
-            cv::filter2D(img, img, img.depth(), kernel);
-        } else if (filter == "Edge Detection") {
-            cv::Mat edges;
-            cv::Canny(img, edges, 50, 150);
-            img = edges;
-        } else if (filter == "Invert") {
-            img = 255 - img;
-        } else if (filter == "Brightness +") {
-            img += cv::Scalar(30);
-        } else if (filter == "Brightness -") {
-            img -= cv::Scalar(30);
-        } else if (filter == "Contrast +") {
-            img.convertTo(img, -1, 1.2, 0);  // alpha > 1
-        } else if (filter == "Contrast -") {
-            img.convertTo(img, -1, 0.8, 0);  // alpha < 1
-        }
+}
+
+void EditWindow::setRunning(bool running)
+{
+    applyButton->setEnabled(!running);
+    undoButton->setEnabled(!running && history->canUndo());
+    filterCombo->setEnabled(!running);
+    addButton->setEnabled(!running);
+    chainList->setEnabled(!running);
+    valueSpin->setEnabled(!running && chainList->currentRow() >= 0
+                          && graph.op(chainList->currentRow()).hasValue());
+    valueSlider->setEnabled(valueSpin->isEnabled());
+    removeButton->setEnabled(!running && chainList->currentRow() >= 0);
+    progressBar->setVisible(running);
+    progressBar->setValue(0);
+    cancelButton->setVisible(running);
+}
+
+void EditWindow::addStep()
+{
+    FilterOp op;
+    if (!FilterOp::fromName(filterCombo->currentText(), &op))
+        return;
+    graph.append(op);
+    chainList->addItem(op.label());
+    chainList->setCurrentRow(graph.size() - 1);
+    schedulePreview();
+}
+
+void EditWindow::removeStep()
+{
+    const int row = chainList->currentRow();
+    if (row < 0)
+        return;
+    graph.remove(row);
+    delete chainList->takeItem(row);
+    schedulePreview();
+}
+
+void EditWindow::selectStep(int row)
+{
+    removeButton->setEnabled(row >= 0);
+    if (row < 0) {
+        valueSpin->setEnabled(false);
+        valueSlider->setEnabled(false);
+        return;
     }
+    setupValueSpin(valueSpin, graph.op(row));
+    const QSignalBlocker blocker(valueSlider);
+    valueSlider->setValue(sliderPosition(valueSpin, SliderSteps));
+    valueSlider->setEnabled(valueSpin->isEnabled());
+}
 
-    //preview->setPixmap(QPixmap::fromImage(matToQImage(imageSlices.first())));
-    emit imagesEdited(imageSlices);
+void EditWindow::setStepValue(double value)
+{
+    const int row = chainList->currentRow();
+    if (row < 0)
+        return;
+    // Only this step and the ones after it are recomputed for the preview.
+    graph.setValue(row, value);
+    chainList->item(row)->setText(graph.op(row).label());
+    if (!valueSlider->isSliderDown()) {
+        const QSignalBlocker blocker(valueSlider);
+        valueSlider->setValue(sliderPosition(valueSpin, SliderSteps));
+    }
+    schedulePreview();
 }
 
+void EditWindow::setPreviewSlice(int z)
+{
+    previewSlice = z;
+    schedulePreview();
+}
 
-void EditWindow::undoLast()
+void EditWindow::schedulePreview()
 {
-    if (!undoStack.isEmpty()) {
-        imageSlices = undoStack.pop();
-        //preview->setPixmap(QPixmap::fromImage(matToQImage(imageSlices.first())));
-        emit imagesEdited(imageSlices);
+    previewTimer->start();
+}
+
+// Only the shown slice is computed, and while the value is being dragged
+// only a reduced copy of it, so the preview keeps up with the slider.
+void EditWindow::updatePreview()
+{
+    if (volume.isEmpty()) {
+        preview->clear();
+        return;
     }
+    const int z = qBound(0, previewSlice, volume.depth() - 1);
+    const cv::Mat result = valueSlider->isSliderDown() ? graph.draft(z, DraftSize) : graph.slice(z);
+    preview->setPixmap(QPixmap::fromImage(matToQImage(result))
+                           .scaled(preview->size(), Qt::KeepAspectRatio, Qt::SmoothTransformation));
+}
+
+void EditWindow::applyFilter()
+{
+    if (task || history->isEditing() || volume.isEmpty())
+        return;
+    // With nothing queued, Apply runs the selected filter on its own.
+    if (graph.isEmpty())
+        addStep();
+    if (graph.isEmpty())
+        return;
+
+    // The chain runs on the scheduler and writes back in place, once per 3D
+    // step and once for the 2D steps between them. Slices are recorded around
+    // every write, so the chain is a single history step that only keeps
+    // the changed tiles.
+    history->beginEdit(graph.name(), volume);
+    setRunning(true);
+
+    const Volume target = volume;
+    VolumeHistory *edits = history;
+    task = TaskScheduler::instance().run(Task::Compute, [target, chain = graph, edits](Task &job) mutable {
+        // The preview may still be on the provisional range.
+        chain.setRange(WindowLevel::fullRange(target));
+        chain.run(target, job, [edits](int z) { edits->saveSlice(z); },
+                  [edits](int z) { edits->commitSlice(z); });
+    });
+    connect(task, &Task::progressChanged, progressBar, &QProgressBar::setValue);
+    connect(task, &Task::finished, this, [this](bool cancelled) {
+        finishFilter(cancelled, task ? task->errorString() : QString());
+    });
+}
+
+void EditWindow::setGraphSource(const Volume &source)
+{
+    graph.setSource(source);
+    const int serial = ++sourceSerial;
+    WindowLevel::fullRangeLater(source, this, [this, serial](const WindowLevel &range) {
+        if (serial != sourceSerial)
+            return;
+        graph.setRange(range);
+        schedulePreview();
+    });
+}
+
+void EditWindow::finishFilter(bool cancelled, const QString &error)
+{
+    task = nullptr;
+    // The history marked the slices the chain wrote, and abortEdit() marks
+    // those it puts back.
+    if (cancelled) {
+        history->abortEdit();
+    } else {
+        history->endEdit();
+        // The chain is in the volume now; the next one starts from it.
+        graph.clear();
+        chainList->clear();
+    }
+    setGraphSource(volume);
+    setRunning(false);
+
+    schedulePreview();
+    emit volumeEdited(volume);
+    if (!error.isEmpty())
+        QMessageBox::warning(this, "Error", QString("Filter failed: %1").arg(error));
+}
+
+
+void EditWindow::undoLast()
+{
+    if (task)
+        return;
+    // Applied to the history's current volume; this dialog and the main
+    // window follow through VolumeHistory::currentChanged and restored.
+    history->undo();
 }
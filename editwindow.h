@@ -3,15 +3,26 @@
 
 #include <QWidget>
 #include <QComboBox>
+#include <QDoubleSpinBox>
+#include <QListWidget>
 #include <QPushButton>
 #include <QLabel>
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QImage>
-#include <QStack>
+#include <QPointer>
+#include <QProgressBar>
+#include <QSlider>
+#include <QTimer>
 #include <opencv2/opencv.hpp>
 
+#include "filtergraph.h"
 #include "segmentationwindow.h"
+#include "volume.h"
+#include "windowlevel.h"
+
+class Task;
+class VolumeHistory;
 
 #include <QDialog>
 
@@ -20,25 +31,59 @@ class EditWindow : public QDialog  // Not QWidget
     Q_OBJECT
 
 public:
-    explicit EditWindow(const QList<cv::Mat> &images, QWidget *parent = nullptr);
+    // Edits are recorded in the shared history, which also serves Undo.
+    EditWindow(const Volume &volume, VolumeHistory *history, QWidget *parent = nullptr);
+    ~EditWindow();
+
+    // Width and height the preview is reduced to while a value is dragged.
+    static const int DraftSize = 384;
 
+public slots:
+    // Slice shown in the preview, normally the main window's Z cursor.
+    void setPreviewSlice(int z);
 
 signals:
-    void imagesEdited(QList<cv::Mat> newImages);
+    void volumeEdited(const Volume &volume);
 
 private slots:
+    void addStep();
+    void removeStep();
+    void selectStep(int row);
+    void setStepValue(double value);
     void applyFilter();
     void undoLast();
 
 private:
     QLabel *preview;
     QComboBox *filterCombo;
+    QPushButton *addButton;
+    QPushButton *removeButton;
+    QListWidget *chainList;
+    QDoubleSpinBox *valueSpin;
+    QSlider *valueSlider;        // drag control for valueSpin, 0..SliderSteps
     QPushButton *applyButton;
     QPushButton *undoButton;
     QPushButton *segmentationButton;
+    QPushButton *cancelButton;
+    QProgressBar *progressBar;
+
+    Volume volume;
+    VolumeHistory *history;
+    QPointer<Task> task;   // filter running on the scheduler
+
+    // Steps queued for Apply; the preview evaluates them lazily.
+    FilterGraph graph;
+    // Sets the graph's source and hands it the full range once counted.
+    void setGraphSource(const Volume &source);
+    int sourceSerial = 0;        // tells range results for earlier sources apart
+    int previewSlice = 0;
+    QTimer *previewTimer;        // coalesces changes into one preview per event loop pass
+    void schedulePreview();
+    void updatePreview();
+    static const int SliderSteps = 1000;
 
-    QList<cv::Mat> imageSlices;
-    QStack<QList<cv::Mat>> undoStack;
+    void setRunning(bool running);
+    void finishFilter(bool cancelled, const QString &error);
 
     QImage matToQImage(const cv::Mat &mat);
 
@@ -0,0 +1,561 @@
+#include "filtergraph.h"
+#include "taskscheduler.h"
+#include "volumepyramid.h"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+// Every point operation is x -> a * x + b.
+void pointAffine(const FilterOp &op, const WindowLevel &range, double *a, double *b)
+{
+    switch (op.kind) {
+    case FilterOp::Invert:
+        *a = -1.0;
+        *b = range.low() + range.high();
+        break;
+    case FilterOp::Brightness:
+        *a = 1.0;
+        *b = op.value * range.width() / 255.0;
+        break;
+    case FilterOp::Contrast:
+        *a = op.value;
+        *b = 0.0;
+        break;
+    default:
+        *a = 1.0;
+        *b = 0.0;
+        break;
+    }
+}
+
+// Table over every value of T. Each operation saturates, as it would when
+// run on its own, so the folded pass gives the same result as the chain.
+template <typename T>
+cv::Mat pointTable(const FilterOp *ops, int count, const WindowLevel &range)
+{
+    const int first = std::numeric_limits<T>::min();
+    const int size = int(std::numeric_limits<T>::max()) - first + 1;
+    cv::Mat table(1, size, cv::DataType<T>::type);
+    T *out = table.ptr<T>();
+    for (int i = 0; i < size; ++i) {
+        T value = T(first + i);
+        for (int k = 0; k < count; ++k) {
+            double a, b;
+            pointAffine(ops[k], range, &a, &b);
+            value = cv::saturate_cast<T>(a * value + b);
+        }
+        out[i] = value;
+    }
+    return table;
+}
+
+template <typename T>
+void lookup(cv::Mat &image, const cv::Mat &table)
+{
+    const T *t = table.ptr<T>() - int(std::numeric_limits<T>::min());
+    const int count = image.cols * image.channels();
+    for (int y = 0; y < image.rows; ++y) {
+        T *p = image.ptr<T>(y);
+        for (int x = 0; x < count; ++x)
+            p[x] = t[p[x]];
+    }
+}
+
+int gaussianSize(double sigma)
+{
+    return std::max(3, 2 * cvRound(1.5 * sigma) + 1);
+}
+
+cv::Mat kernelFor(const FilterOp &op)
+{
+    if (op.kind == FilterOp::GaussianBlur) {
+        const cv::Mat g = cv::getGaussianKernel(gaussianSize(op.value), op.value, CV_32F);
+        return g * g.t();
+    }
+    const float a = float(op.value);
+    return (cv::Mat_<float>(3, 3) <<
+             0, -a,         0,
+            -a,  1 + 4 * a, -a,
+             0, -a,         0);
+}
+
+// Full convolution of two kernels. Both are symmetric, so the correlation
+// filter2D computes is the convolution.
+cv::Mat compose(const cv::Mat &a, const cv::Mat &b)
+{
+    cv::Mat padded, out;
+    cv::copyMakeBorder(a, padded, b.rows / 2, b.rows / 2, b.cols / 2, b.cols / 2, cv::BORDER_CONSTANT, 0);
+    cv::filter2D(padded, out, CV_32F, b, cv::Point(-1, -1), 0, cv::BORDER_CONSTANT);
+    return out;
+}
+
+} // namespace
+
+
+QStringList FilterOp::names()
+{
+    return { "Gaussian Blur", "Sharpen", "Edge Detection", "Invert",
+             "Brightness +", "Brightness -", "Contrast +", "Contrast -",
+             "3D Gaussian", "3D Mean", "3D Median", "3D Gradient Magnitude" };
+}
+
+bool FilterOp::fromName(const QString &name, FilterOp *op)
+{
+    if (name == "Gaussian Blur")
+        *op = FilterOp(GaussianBlur, 1.5);
+    else if (name == "Sharpen")
+        *op = FilterOp(Sharpen, 1.0);
+    else if (name == "Edge Detection")
+        *op = FilterOp(EdgeDetection, 50.0);
+    else if (name == "Invert")
+        *op = FilterOp(Invert, 0.0);
+    else if (name == "Brightness +")
+        *op = FilterOp(Brightness, 30.0);
+    else if (name == "Brightness -")
+        *op = FilterOp(Brightness, -30.0);
+    else if (name == "Contrast +")
+        *op = FilterOp(Contrast, 1.2);
+    else if (name == "Contrast -")
+        *op = FilterOp(Contrast, 0.8);
+    else if (name == "3D Gaussian")
+        *op = FilterOp(Gaussian3D, 1.0);
+    else if (name == "3D Mean")
+        *op = FilterOp(Mean3D, 1.0);
+    else if (name == "3D Median")
+        *op = FilterOp(Median3D, 1.0);
+    else if (name == "3D Gradient Magnitude")
+        *op = FilterOp(Gradient3D, 0.0);
+    else
+        return false;
+    return true;
+}
+
+QString FilterOp::name() const
+{
+    switch (kind) {
+    case GaussianBlur: return "Gaussian Blur";
+    case Sharpen: return "Sharpen";
+    case EdgeDetection: return "Edge Detection";
+    case Invert: return "Invert";
+    case Brightness: return "Brightness";
+    case Contrast: return "Contrast";
+    case Gaussian3D: return "3D Gaussian";
+    case Mean3D: return "3D Mean";
+    case Median3D: return "3D Median";
+    case Gradient3D: return "3D Gradient Magnitude";
+    }
+    return QString();
+}
+
+VolumeFilter::Kind FilterOp::volumeKind() const
+{
+    switch (kind) {
+    case Mean3D: return VolumeFilter::Mean;
+    case Median3D: return VolumeFilter::Median;
+    case Gradient3D: return VolumeFilter::GradientMagnitude;
+    default: return VolumeFilter::Gaussian;
+    }
+}
+
+QString FilterOp::label() const
+{
+    return hasValue() ? QString("%1 (%2)").arg(name()).arg(value) : name();
+}
+
+
+FilterGraph::FilterGraph(const Volume &source)
+{
+    setSource(source);
+}
+
+void FilterGraph::setSource(const Volume &source)
+{
+    input = source;
+    range = WindowLevel::provisionalRange(source);
+    cache.clear();
+    recent.clear();
+    compile();
+}
+
+void FilterGraph::setRange(const WindowLevel &fullRange)
+{
+    if (fullRange == range)
+        return;
+    range = fullRange;
+    cache.clear();
+    recent.clear();
+    compile();
+}
+
+void FilterGraph::append(const FilterOp &op)
+{
+    ops.push_back(op);
+    compile();
+}
+
+void FilterGraph::remove(int i)
+{
+    if (i < 0 || i >= size())
+        return;
+    ops.erase(ops.begin() + i);
+    compile();
+}
+
+void FilterGraph::setValue(int i, double value)
+{
+    if (i < 0 || i >= size() || ops[i].value == value)
+        return;
+    ops[i].value = value;
+    compile();
+}
+
+void FilterGraph::clear()
+{
+    ops.clear();
+    compile();
+}
+
+QString FilterGraph::name() const
+{
+    QStringList names;
+    for (const FilterOp &op : ops)
+        names << op.name();
+    return names.join(", ");
+}
+
+void FilterGraph::compile()
+{
+    stages.clear();
+    for (int i = 0; i < size(); ++i) {
+        const FilterOp &op = ops[i];
+        const Stage::Kind kind = op.isPoint() ? Stage::Point
+                               : op.isVolume() ? Stage::Volumetric
+                               : op.kind == FilterOp::EdgeDetection ? Stage::Edges : Stage::Kernel;
+
+        // Kernels are only combined where the intermediate result could not
+        // have been clipped: on float data or after a non-negative kernel.
+        bool merge = !stages.empty() && stages.back().kind == kind
+                     && (kind == Stage::Point || kind == Stage::Kernel);
+        if (merge && kind == Stage::Kernel) {
+            double minWeight = 0.0;
+            cv::minMaxLoc(stages.back().kernel, &minWeight);
+            merge = CV_MAT_DEPTH(input.type()) == CV_32F || minWeight >= 0.0;
+        }
+
+        if (merge) {
+            Stage &stage = stages.back();
+            ++stage.opCount;
+            if (kind == Stage::Kernel) {
+                stage.kernel = compose(stage.kernel, kernelFor(op));
+                stage.sigma = 0.0;
+            }
+        } else {
+            Stage stage;
+            stage.kind = kind;
+            stage.firstOp = i;
+            stage.opCount = 1;
+            if (kind == Stage::Kernel) {
+                stage.kernel = kernelFor(op);
+                stage.sigma = op.kind == FilterOp::GaussianBlur ? op.value : 0.0;
+            } else if (kind == Stage::Edges) {
+                stage.lowThreshold = op.value;
+            } else if (kind == Stage::Volumetric) {
+                stage.filter = op.volumeKind();
+                stage.size = op.value;
+            }
+            stages.push_back(stage);
+        }
+        stages.back().key += QString("%1:%2;").arg(int(op.kind)).arg(op.value, 0, 'g', 17).toLatin1();
+    }
+
+    for (Stage &stage : stages) {
+        if (stage.kind == Stage::Point)
+            compilePoint(stage);
+    }
+}
+
+void FilterGraph::compilePoint(Stage &stage) const
+{
+    const FilterOp *first = ops.data() + stage.firstOp;
+    switch (CV_MAT_DEPTH(input.type())) {
+    case CV_8U:
+        stage.table = pointTable<uchar>(first, stage.opCount, range);
+        break;
+    case CV_16U:
+        stage.table = pointTable<ushort>(first, stage.opCount, range);
+        break;
+    case CV_16S:
+        stage.table = pointTable<short>(first, stage.opCount, range);
+        break;
+    default:
+        // Float data does not clip, so the operations compose exactly.
+        stage.scale = 1.0;
+        stage.offset = 0.0;
+        for (int k = 0; k < stage.opCount; ++k) {
+            double a, b;
+            pointAffine(first[k], range, &a, &b);
+            stage.scale *= a;
+            stage.offset = a * stage.offset + b;
+        }
+        break;
+    }
+}
+
+FilterGraph::CachedSlice &FilterGraph::cachedSlice(int z)
+{
+    CachedSlice &entry = cache[z];
+    const quint64 version = input.sliceVersion(z);
+    if (entry.version != version) {
+        entry.version = version;
+        entry.keys.clear();
+        entry.outputs.clear();
+    }
+
+    // Stages up to the first one that changed are kept.
+    size_t reuse = 0;
+    while (reuse < entry.keys.size() && reuse < stages.size() && entry.keys[reuse] == stages[reuse].key)
+        ++reuse;
+    entry.keys.resize(reuse);
+    entry.outputs.resize(reuse);
+
+    recent.remove(z);
+    recent.push_front(z);
+    return entry;
+}
+
+// Output of stages 0..stage for slice z; stage -1 is the source.
+cv::Mat FilterGraph::stageOutput(int z, int stage)
+{
+    if (stage < 0)
+        return input.axial(z);
+
+    CachedSlice &entry = cachedSlice(z);
+    while (int(entry.outputs.size()) <= stage) {
+        const int s = int(entry.outputs.size());
+        const cv::Mat previous = s > 0 ? entry.outputs.back() : input.axial(z);
+        cv::Mat out;
+        if (stages[s].kind == Stage::Volumetric) {
+            const int r = VolumeFilter::radius(stages[s].filter, stages[s].size, input.spacing(), input.depth());
+            std::vector<cv::Mat> window;
+            for (int k = -r; k <= r; ++k) {
+                const int zz = cv::borderInterpolate(z + k, input.depth(), cv::BORDER_REFLECT_101);
+                window.push_back(zz == z ? previous : stageOutput(zz, s - 1));
+            }
+            out = VolumeFilter::filterSlice(stages[s].filter, stages[s].size, input.spacing(), range, window);
+        } else if (stages[s].kind == Stage::Edges) {
+            out = runEdges(stages[s], previous);
+        } else {
+            out = runStages(s, s + 1, previous, true);
+        }
+        entry.keys.push_back(stages[s].key);
+        entry.outputs.push_back(out);
+    }
+    return entry.outputs[stage];
+}
+
+cv::Mat FilterGraph::slice(int z)
+{
+    if (input.isEmpty() || z < 0 || z >= input.depth())
+        return cv::Mat();
+
+    const cv::Mat result = stageOutput(z, int(stages.size()) - 1);
+
+    // A 3D stage needs its whole window cached, or every preview would
+    // recompute it.
+    int keep = CacheSlices;
+    for (const Stage &stage : stages) {
+        if (stage.kind == Stage::Volumetric)
+            keep += 2 * VolumeFilter::radius(stage.filter, stage.size, input.spacing(), input.depth());
+    }
+    while (int(recent.size()) > keep) {
+        cache.erase(recent.back());
+        recent.pop_back();
+    }
+    return result;
+}
+
+cv::Mat FilterGraph::draft(int z, int maxSize) const
+{
+    if (input.isEmpty() || z < 0 || z >= input.depth())
+        return cv::Mat();
+
+    int level = 0;
+    while (level < VolumePyramid::MaxLevel && (std::max(input.width(), input.height()) >> level) > maxSize)
+        ++level;
+    const double factor = double(1 << level);
+
+    // Kernels shrink with the image; 3D Gaussians get the reduced spacing
+    // instead, which keeps their reach along Z.
+    FilterGraph reduced;
+    const QVector3D spacing = input.spacing();
+    const QVector3D reducedSpacing(spacing.x() * float(factor), spacing.y() * float(factor), spacing.z());
+    for (FilterOp op : ops) {
+        if (op.kind == FilterOp::GaussianBlur || op.kind == FilterOp::Gaussian3D)
+            op.value = std::max(op.value / factor, 0.3);
+        else if (op.kind == FilterOp::Mean3D || op.kind == FilterOp::Median3D)
+            op.value = std::max(std::round(op.value / factor), 1.0);
+        reduced.ops.push_back(op);
+    }
+
+    // Only the slices the 3D stages reach are reduced, reflected at the ends
+    // of the volume as the full evaluation would.
+    int reach = 0;
+    for (const FilterOp &op : reduced.ops) {
+        if (op.isVolume())
+            reach += VolumeFilter::radius(op.volumeKind(), op.value, reducedSpacing, input.depth());
+    }
+    const cv::Mat centre = VolumePyramid::reduce(input.axial(z), level);
+    Volume window(centre.cols, centre.rows, 2 * reach + 1, input.type());
+    window.setSpacing(reducedSpacing);
+    for (int k = -reach; k <= reach; ++k) {
+        const int zz = cv::borderInterpolate(z + k, input.depth(), cv::BORDER_REFLECT_101);
+        cv::Mat dst = window.axial(k + reach);
+        if (zz == z)
+            centre.copyTo(dst);
+        else
+            VolumePyramid::reduce(input.axial(zz), level).copyTo(dst);
+    }
+
+    reduced.input = window;
+    reduced.range = range;
+    reduced.compile();
+    return reduced.stageOutput(reach, int(reduced.stages.size()) - 1).clone();
+}
+
+bool FilterGraph::run(const Volume &target, Task &job, const std::function<void(int)> &beforeWrite,
+                      const std::function<void(int)> &afterWrite) const
+{
+    for (int first = 0; first < int(stages.size());) {
+        if (stages[first].kind == Stage::Volumetric) {
+            if (!VolumeFilter::apply(stages[first].filter, stages[first].size, range, target, target, job,
+                                     beforeWrite, afterWrite))
+                return false;
+            ++first;
+            continue;
+        }
+        int last = first + 1;
+        while (last < int(stages.size()) && stages[last].kind != Stage::Volumetric)
+            ++last;
+        const bool done = job.parallelFor(target.depth(), [&](int z) {
+            target.prefetch(z + 1, z + 2);
+            if (beforeWrite)
+                beforeWrite(z);
+            cv::Mat img = target.axial(z);
+            applySlice(first, last, img, img);
+            if (afterWrite)
+                afterWrite(z);
+            target.release(z, z + 1);   // paged volumes stream through the budget
+        });
+        if (!done)
+            return false;
+        first = last;
+    }
+    return true;
+}
+
+// Stages [first, last) without 3D ones, on one image.
+void FilterGraph::applySlice(int first, int last, const cv::Mat &src, cv::Mat &dst) const
+{
+    cv::Mat current = src;
+    while (first < last) {
+        if (stages[first].kind == Stage::Edges) {
+            current = runEdges(stages[first], current);
+            ++first;
+            continue;
+        }
+        int end = first + 1;
+        while (end < last && stages[end].kind != Stage::Edges)
+            ++end;
+        current = runStages(first, end, current);
+        first = end;
+    }
+    if (current.data != dst.data)
+        current.copyTo(dst);
+}
+
+// Runs point and kernel stages band by band. Each band is taken with a halo
+// as wide as all kernels together, reflected at the slice edges; since the
+// kernels are symmetric, the halo stays a mirror image of the band through
+// every stage, so the result matches running the stages one by one over the
+// whole slice.
+cv::Mat FilterGraph::runStages(int first, int last, const cv::Mat &src, bool parallel) const
+{
+    cv::Mat out = src.clone();
+    int halo = 0;
+    for (int s = first; s < last; ++s)
+        halo += stages[s].halo();
+
+    if (halo == 0) {
+        for (int s = first; s < last; ++s)
+            runPoint(stages[s], out);
+        return out;
+    }
+
+    auto runBand = [&](int band) {
+        const int y0 = band * BandRows;
+        const int y1 = std::min(y0 + BandRows, src.rows);
+        // Rows outside the band come from the slice where it has them.
+        cv::Mat buffer;
+        cv::copyMakeBorder(src.rowRange(y0, y1), buffer, halo, halo, halo, halo, cv::BORDER_REFLECT_101);
+        for (int s = first; s < last; ++s) {
+            const Stage &stage = stages[s];
+            if (stage.kind == Stage::Point)
+                runPoint(stage, buffer);
+            else if (stage.sigma > 0.0)
+                cv::GaussianBlur(buffer, buffer, stage.kernel.size(), stage.sigma);
+            else
+                cv::filter2D(buffer, buffer, buffer.depth(), stage.kernel);
+        }
+        cv::Mat dst = out.rowRange(y0, y1);
+        buffer(cv::Rect(halo, halo, src.cols, y1 - y0)).copyTo(dst);
+    };
+
+    // The bulk path is already parallel across slices; a preview spreads
+    // the bands of its one slice instead.
+    const int bands = (src.rows + BandRows - 1) / BandRows;
+    if (parallel) {
+        TaskScheduler::parallelFor(cv::Range(0, bands), Task::Interactive, [&](const cv::Range &range) {
+            for (int band = range.start; band < range.end; ++band)
+                runBand(band);
+        });
+    } else {
+        for (int band = 0; band < bands; ++band)
+            runBand(band);
+    }
+    return out;
+}
+
+void FilterGraph::runPoint(const Stage &stage, cv::Mat &image) const
+{
+    switch (image.depth()) {
+    case CV_8U:
+        cv::LUT(image, stage.table, image);
+        break;
+    case CV_16U:
+        lookup<ushort>(image, stage.table);
+        break;
+    case CV_16S:
+        lookup<short>(image, stage.table);
+        break;
+    default:
+        image.convertTo(image, -1, stage.scale, stage.offset);
+        break;
+    }
+}
+
+cv::Mat FilterGraph::runEdges(const Stage &stage, const cv::Mat &src) const
+{
+    // Canny only takes 8-bit input; edges are stored at the top of the range.
+    cv::Mat edges, out;
+    cv::Canny(src.depth() == CV_8U ? src : range.apply(src), edges, stage.lowThreshold, 3 * stage.lowThreshold);
+    if (src.channels() != 1)
+        cv::cvtColor(edges, out, cv::COLOR_GRAY2BGR);
+    else
+        edges.convertTo(out, src.type(), src.depth() == CV_8U ? 1.0 : range.high() / 255.0);
+    return out;
+}
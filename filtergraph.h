@@ -0,0 +1,147 @@
+#ifndef FILTERGRAPH_H
+#define FILTERGRAPH_H
+
+#include <QByteArray>
+#include <QStringList>
+
+#include <functional>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "volume.h"
+#include "volumefilter.h"
+#include "windowlevel.h"
+
+class Task;
+
+// One step of an Edit chain. The value is the step's single parameter:
+// sigma for the blurs, strength for sharpening, the lower Canny threshold,
+// the brightness offset in 1/255 of the data range, the contrast gain and
+// the radius of the 3D mean and median.
+struct FilterOp {
+    enum Kind { GaussianBlur, Sharpen, EdgeDetection, Invert, Brightness, Contrast,
+                Gaussian3D, Mean3D, Median3D, Gradient3D };
+
+    Kind kind = Invert;
+    double value = 0.0;
+
+    FilterOp() = default;
+    FilterOp(Kind kind, double value) : kind(kind), value(value) {}
+
+    // The Edit dialog entries ("Gaussian Blur", "Brightness +", ...).
+    static QStringList names();
+    static bool fromName(const QString &name, FilterOp *op);
+
+    QString name() const;
+    QString label() const;          // name with its value
+    bool hasValue() const { return kind != Invert && kind != Gradient3D; }
+    bool isPoint() const { return kind == Invert || kind == Brightness || kind == Contrast; }
+    // Reads neighbouring slices (VolumeFilter).
+    bool isVolume() const { return kind >= Gaussian3D; }
+    VolumeFilter::Kind volumeKind() const;
+};
+
+// Lazily evaluated chain of Edit operations over a volume.
+//
+// The chain is compiled into stages: consecutive point operations fold into
+// a single lookup table (or one scale and offset for float data), and
+// consecutive blur/sharpen kernels into one kernel while no intermediate
+// could clip. Edge detection needs the whole slice and 3D filters need
+// neighbouring slices, so both stand alone.
+//
+// slice() computes one slice on demand and keeps every stage output of the
+// most recent slices, so changing a value only recomputes from the stage
+// it belongs to; a 3D stage pulls the slices around it from the stage
+// before. run() is the bulk path used for Apply: runs of 2D stages between
+// edge detections go through each slice in bands of BandRows rows plus the
+// halo of their kernels, keeping the intermediates in cache, and 3D stages
+// stream through the volume (VolumeFilter::apply).
+class FilterGraph {
+public:
+    static const int BandRows = 64;
+    static const int CacheSlices = 4;
+
+    FilterGraph() = default;
+    explicit FilterGraph(const Volume &source);
+
+    // Cached slices are dropped. The data range that brightness, contrast
+    // and invert work on starts as the middle slice's; setRange() gives
+    // the full one, which run() should always get.
+    void setSource(const Volume &source);
+    const Volume &source() const { return input; }
+    void setRange(const WindowLevel &range);
+
+    bool isEmpty() const { return ops.empty(); }
+    int size() const { return int(ops.size()); }
+    const FilterOp &op(int i) const { return ops[i]; }
+    void append(const FilterOp &op);
+    void remove(int i);
+    void setValue(int i, double value);
+    void clear();
+    // History entry for the whole chain.
+    QString name() const;
+
+    // Result for slice z of the source, computed now if not cached. The
+    // image is shared with the cache (or the source) and must not be
+    // written to. GUI-only.
+    cv::Mat slice(int z);
+    // Quick approximation of slice(z) for interactive use: the chain runs on
+    // the slice (and the slices 3D steps read) reduced by powers of two
+    // until it is at most maxSize wide and high, with kernel sizes scaled to
+    // match. Nothing is cached.
+    cv::Mat draft(int z, int maxSize) const;
+
+    // Runs the chain over the whole target in place, one pass per 3D stage
+    // and one for the 2D stages between them. beforeWrite and afterWrite run
+    // around every slice write. Returns false if cancelled.
+    bool run(const Volume &target, Task &job, const std::function<void(int)> &beforeWrite = nullptr,
+             const std::function<void(int)> &afterWrite = nullptr) const;
+
+private:
+    struct Stage {
+        enum Kind { Point, Kernel, Edges, Volumetric };
+        Kind kind = Point;
+        int firstOp = 0, opCount = 0;
+        QByteArray key;             // ops and values, to match cached outputs
+        // Point
+        cv::Mat table;              // integer types: value -> value
+        double scale = 1.0, offset = 0.0;
+        // Kernel
+        cv::Mat kernel;             // CV_32F, odd size
+        double sigma = 0.0;         // > 0 for a single Gaussian
+        // Edges
+        double lowThreshold = 0.0;
+        // Volumetric
+        VolumeFilter::Kind filter = VolumeFilter::Gaussian;
+        double size = 0.0;
+
+        int halo() const { return kind == Kernel ? kernel.rows / 2 : 0; }
+    };
+
+    struct CachedSlice {
+        quint64 version = 0;
+        std::vector<QByteArray> keys;
+        std::vector<cv::Mat> outputs;
+    };
+
+    Volume input;
+    WindowLevel range;
+    std::vector<FilterOp> ops;
+    std::vector<Stage> stages;
+    std::map<int, CachedSlice> cache;
+    std::list<int> recent;          // cached slices, most recent first
+
+    void compile();
+    void compilePoint(Stage &stage) const;
+    CachedSlice &cachedSlice(int z);
+    cv::Mat stageOutput(int z, int stage);
+    void applySlice(int first, int last, const cv::Mat &src, cv::Mat &dst) const;
+    cv::Mat runStages(int first, int last, const cv::Mat &src, bool parallel = false) const;
+    void runPoint(const Stage &stage, cv::Mat &image) const;
+    cv::Mat runEdges(const Stage &stage, const cv::Mat &src) const;
+};
+
+#endif // FILTERGRAPH_H
@@ -1,11 +1,21 @@
 #include "mainwindow.h"
+#include "modelregistry.h"
 
 #include <QApplication>
+#include <QCommandLineParser>
 
 #include <QPalette>
 
 int main(int argc, char *argv[]) {
     QApplication app(argc, argv);
+    app.setOrganizationName("xip_app");
+    app.setApplicationName("xip_app");
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    ModelRegistry::addOptions(parser);
+    parser.process(app);
+    ModelRegistry::instance().configure(parser);
 
     QPalette darkPalette;
     darkPalette.setColor(QPalette::Window, QColor(100, 100, 100));
@@ -27,5 +37,8 @@ int main(int argc, char *argv[]) {
     MainWindow window;
     window.show();
 
+    // Detection networks load in the background while the window comes up.
+    ModelRegistry::instance().preload();
+
     return app.exec();
 }
@@ -3,6 +3,15 @@
 #include "segmentationwindow.h"
 #include "objectdetectionwindow.h"
 #include "customobjectdetectionwindow.h"
+#include "reslice.h"
+#include "volumerenderview.h"
+#include "sliceloader.h"
+#include "volumefile.h"
+#include "nrrdfile.h"
+#include "niftifile.h"
+#include "pagedstorage.h"
+#include "volumehistory.h"
+#include "taskscheduler.h"
 
 #include <QMenuBar>
 #include <QFileDialog>
@@ -14,6 +23,13 @@
 #include <QPainter>
 #include <QPen>
 #include <QToolBar>
+#include <QActionGroup>
+#include <QProgressDialog>
+#include <QTimer>
+#include <QMouseEvent>
+#include <QApplication>
+#include <QInputDialog>
+#include <QSettings>
 
 #include <Qt3DRender/QCamera>
 #include <Qt3DExtras/QOrbitCameraController>
@@ -38,6 +54,10 @@ MainWindow::MainWindow(QWidget *parent)
 {
     ui->setupUi(this);
 
+    // Volumes above the budget are paged from scratch files instead of the heap.
+    PagedStorage::setBudget(QSettings().value("memoryBudgetMB", 2048).toLongLong() * 1024 * 1024);
+    VolumeFile::setCacheLimit(QSettings().value("volumeCacheMB", 4096).toLongLong() * 1024 * 1024);
+
     // Central widget with grid layout for 2D and 3D views.
     QGridLayout *grid = new QGridLayout;
     QWidget *central = new QWidget(this);
@@ -50,6 +70,7 @@ MainWindow::MainWindow(QWidget *parent)
         views[i]->setMinimumSize(200, 200);
         views[i]->setStyleSheet("background-color: black;");
         views[i]->setAlignment(Qt::AlignCenter);
+        views[i]->installEventFilter(this);
         grid->addWidget(views[i], i / 2, i % 2);
     }
 
@@ -61,7 +82,50 @@ MainWindow::MainWindow(QWidget *parent)
     // Make sure the container accepts mouse events.
     container3D->setFocusPolicy(Qt::StrongFocus);
     container3D->setMouseTracking(true);
-    grid->addWidget(container3D, 1, 1); // last cell in grid
+
+    // The last grid cell switches between the Qt3D slice stack and the
+    // CPU ray-cast renderer (View menu).
+    volumeRenderView = new VolumeRenderView(this);
+    view3DStack = new QStackedWidget(this);
+    view3DStack->addWidget(container3D);
+    view3DStack->addWidget(volumeRenderView);
+    grid->addWidget(view3DStack, 1, 1); // last cell in grid
+
+    loader = new SliceLoader(this);
+    connect(loader, &SliceLoader::sliceLoaded, this, &MainWindow::onSliceLoaded);
+    connect(loader, &SliceLoader::finished, this, &MainWindow::onLoadFinished);
+
+    streamRefreshTimer = new QTimer(this);
+    streamRefreshTimer->setSingleShot(true);
+    streamRefreshTimer->setInterval(100);
+    connect(streamRefreshTimer, &QTimer::timeout, this, [this]() {
+        updatePlanes(CoronalPlane | SagittalPlane);
+    });
+
+    windowTextureTimer = new QTimer(this);
+    windowTextureTimer->setSingleShot(true);
+    windowTextureTimer->setInterval(150);
+    connect(windowTextureTimer, &QTimer::timeout, this, [this]() {
+        for (SliceTextureImage *textureImage : sliceTextures)
+            textureImage->setWindow(windowLevel);
+    });
+
+    history = new VolumeHistory(this);
+    history->setMemoryCap(QSettings().value("undoMemoryMB", 1024).toLongLong() * 1024 * 1024);
+    connect(history, &VolumeHistory::restored, this, [this](const Volume &restored) {
+        volume = restored;
+        loadAndDisplayImages();
+    });
+
+    refineTimer = new QTimer(this);
+    refineTimer->setSingleShot(true);
+    refineTimer->setInterval(150);
+    connect(refineTimer, &QTimer::timeout, this, [this]() {
+        const int planes = refinePlanes;
+        refinePlanes = 0;
+        reslicePlanes(planes, displayLevel());
+        displayPlanes(planes);
+    });
 
     setupSlider();
     setupMenus();
@@ -72,6 +136,10 @@ MainWindow::MainWindow(QWidget *parent)
 }
 
 MainWindow::~MainWindow() {
+    if (pyramidTask) {
+        pyramidTask->cancel();
+        pyramidTask->wait();
+    }
     delete ui;
 }
 
@@ -82,11 +150,118 @@ void MainWindow::setupMenus() {
     connect(openSetAct, &QAction::triggered, this, &MainWindow::openImageSet);
     fileMenu->addAction(openSetAct);
 
+    QAction *openVolumeAct = new QAction("Open &Volume...", this);
+    connect(openVolumeAct, &QAction::triggered, this, &MainWindow::openVolumeFile);
+    fileMenu->addAction(openVolumeAct);
+
+    QAction *saveVolumeAct = new QAction("&Save Volume As...", this);
+    connect(saveVolumeAct, &QAction::triggered, this, &MainWindow::saveVolumeFile);
+    fileMenu->addAction(saveVolumeAct);
+    fileMenu->addSeparator();
+
+    QAction *budgetAct = new QAction("Memory &Budget...", this);
+    connect(budgetAct, &QAction::triggered, this, [this]() {
+        bool ok = false;
+        const int megabytes = QInputDialog::getInt(this, "Memory Budget",
+            "Resident voxel data of all volumes (MB).\nLarger volumes are paged from disk.",
+            int(PagedStorage::budget() / (1024 * 1024)), 64, 1024 * 1024, 256, &ok);
+        if (!ok)
+            return;
+        PagedStorage::setBudget(qint64(megabytes) * 1024 * 1024);
+        QSettings().setValue("memoryBudgetMB", megabytes);
+    });
+    fileMenu->addAction(budgetAct);
+
+    QAction *cacheAct = new QAction("Volume &Cache Limit...", this);
+    connect(cacheAct, &QAction::triggered, this, [this]() {
+        bool ok = false;
+        const int megabytes = QInputDialog::getInt(this, "Volume Cache Limit",
+            "Disk space for decoded image stacks (MB).\nLeast recently opened stacks are removed first, 0 turns the cache off.",
+            int(VolumeFile::cacheLimit() / (1024 * 1024)), 0, 1024 * 1024, 1024, &ok);
+        if (!ok)
+            return;
+        VolumeFile::setCacheLimit(qint64(megabytes) * 1024 * 1024);
+        QSettings().setValue("volumeCacheMB", megabytes);
+    });
+    fileMenu->addAction(cacheAct);
+    fileMenu->addSeparator();
+
     QAction *exitAct = new QAction(QIcon(":/icons/exit.png"), "E&xit", this);
     connect(exitAct, &QAction::triggered, this, &MainWindow::close);
     fileMenu->addAction(exitAct);
 
+    QMenu *viewMenu = menuBar()->addMenu("&View");
+    QActionGroup *renderGroup = new QActionGroup(this);
+    auto addRenderMode = [=](const QString &name, int mode) {
+        QAction *act = viewMenu->addAction(name);
+        act->setCheckable(true);
+        act->setChecked(mode < 0);
+        renderGroup->addAction(act);
+        connect(act, &QAction::triggered, this, [=]() {
+            if (mode < 0) {
+                view3DStack->setCurrentWidget(container3D);
+            } else {
+                volumeRenderView->setMode(static_cast<RayCaster::Mode>(mode));
+                view3DStack->setCurrentWidget(volumeRenderView);
+            }
+        });
+    };
+    addRenderMode("3D &Slice Stack", -1);
+    viewMenu->addSeparator();
+    addRenderMode("Ray Cast: &Maximum Intensity", RayCaster::MaximumIntensity);
+    addRenderMode("Ray Cast: M&inimum Intensity", RayCaster::MinimumIntensity);
+    addRenderMode("Ray Cast: &Composite", RayCaster::Composite);
+    addRenderMode("Ray Cast: Iso&surface", RayCaster::Isosurface);
+    viewMenu->addSeparator();
+    // Detection boxes are drawn over the axial view, never into the volume.
+    showDetectionsAct = viewMenu->addAction("Show &Detections");
+    showDetectionsAct->setCheckable(true);
+    showDetectionsAct->setChecked(true);
+    showDetectionsAct->setEnabled(false);
+    connect(showDetectionsAct, &QAction::toggled, this, [this]() { refreshViews(); });
+    QAction *resetWindowAct = viewMenu->addAction("&Reset Window/Level");
+    connect(resetWindowAct, &QAction::triggered, this, [this]() {
+        if (volume.isEmpty())
+            return;
+        resetWindowLevel();
+        setWindowLevel(windowLevel);
+    });
+
     QMenu *editMenu = menuBar()->addMenu("&Edit");
+    QAction *undoAct = editMenu->addAction("&Undo");
+    undoAct->setShortcut(QKeySequence::Undo);
+    // Nothing is undone under a filter that is still writing the volume.
+    connect(undoAct, &QAction::triggered, this, [this]() {
+        if (!history->isEditing())
+            history->undo();
+    });
+    QAction *redoAct = editMenu->addAction("&Redo");
+    redoAct->setShortcut(QKeySequence::Redo);
+    connect(redoAct, &QAction::triggered, this, [this]() {
+        if (!history->isEditing())
+            history->redo();
+    });
+    auto updateUndoActions = [=]() {
+        undoAct->setEnabled(history->canUndo());
+        undoAct->setText(history->canUndo() ? QString("&Undo %1").arg(history->undoName()) : QString("&Undo"));
+        redoAct->setEnabled(history->canRedo());
+        redoAct->setText(history->canRedo() ? QString("&Redo %1").arg(history->redoName()) : QString("&Redo"));
+    };
+    connect(history, &VolumeHistory::changed, this, updateUndoActions);
+    updateUndoActions();
+
+    QAction *undoMemoryAct = editMenu->addAction("Undo &Memory Limit...");
+    connect(undoMemoryAct, &QAction::triggered, this, [this]() {
+        bool ok = false;
+        const int megabytes = QInputDialog::getInt(this, "Undo Memory Limit",
+            "Memory kept for undo steps (MB).\nOlder steps are moved to disk.",
+            int(history->memoryCap() / (1024 * 1024)), 0, 1024 * 1024, 128, &ok);
+        if (!ok)
+            return;
+        history->setMemoryCap(qint64(megabytes) * 1024 * 1024);
+        QSettings().setValue("undoMemoryMB", megabytes);
+    });
+    editMenu->addSeparator();
     QAction *editImageAct = new QAction(QIcon(":/icons/edit.png"), "Edit &Image...", this);
     connect(editImageAct, &QAction::triggered, this, &MainWindow::openEditWindow);
     editMenu->addAction(editImageAct);
@@ -147,13 +322,42 @@ void MainWindow::setupMenus() {
 
 
 void MainWindow::setupSlider() {
-    slider = new QSlider(Qt::Horizontal, this);
-    slider->setMinimum(0);
-    slider->setMaximum(0);
-    slider->setValue(0);
-    slider->setEnabled(false);
+    auto makeSlider = [this](const QString &name, int stretch) {
+        QSlider *s = new QSlider(Qt::Horizontal, this);
+        s->setMinimum(0);
+        s->setMaximum(0);
+        s->setValue(0);
+        s->setEnabled(false);
+        statusBar()->addPermanentWidget(new QLabel(name, this));
+        statusBar()->addPermanentWidget(s, stretch);
+        return s;
+    };
+
+    sliderX = makeSlider("X", 0);
+    sliderY = makeSlider("Y", 0);
+    slider = makeSlider("Z", 1);
+    connect(sliderX, &QSlider::valueChanged, this, &MainWindow::onSliderXChanged);
+    connect(sliderY, &QSlider::valueChanged, this, &MainWindow::onSliderYChanged);
     connect(slider, &QSlider::valueChanged, this, &MainWindow::onSliderChanged);
-    statusBar()->addPermanentWidget(slider, 1);
+}
+
+// Clamps the cursors to the current volume and mirrors them on the sliders
+// without triggering another update.
+void MainWindow::syncCursorSliders() {
+    const bool hasVolume = !volume.isEmpty();
+    cursorX = hasVolume ? qBound(0, cursorX, volume.width() - 1) : 0;
+    cursorY = hasVolume ? qBound(0, cursorY, volume.height() - 1) : 0;
+    cursorZ = hasVolume ? qBound(0, cursorZ, volume.depth() - 1) : 0;
+
+    QSlider *sliders[3] = { sliderX, sliderY, slider };
+    const int maxima[3] = { volume.width() - 1, volume.height() - 1, volume.depth() - 1 };
+    const int values[3] = { cursorX, cursorY, cursorZ };
+    for (int i = 0; i < 3; ++i) {
+        QSignalBlocker blocker(sliders[i]);
+        sliders[i]->setMaximum(hasVolume ? maxima[i] : 0);
+        sliders[i]->setValue(values[i]);
+        sliders[i]->setEnabled(hasVolume);
+    }
 }
 
 void MainWindow::setup3DView() {
@@ -196,141 +400,601 @@ void MainWindow::setup3DView() {
 
 
 void MainWindow::openImageSet() {
+    if (!canReplaceVolume())
+        return;
+
     QStringList fileNames = QFileDialog::getOpenFileNames(this,
         "Select Image Slices",
         "",
-        "Images (*.png *.jpg *.jpeg *.bmp)");
+        "Images (*.png *.jpg *.jpeg *.bmp *.tif *.tiff)");
 
     if (fileNames.isEmpty())
         return;
 
-    imageSlices.clear();
-    const int targetWidth = 256;
-    const int targetHeight = 256;
-    for (const QString &filePath : fileNames) {
-        cv::Mat img = cv::imread(filePath.toStdString(), cv::IMREAD_GRAYSCALE);
-        if (!img.empty()) {
-            if (img.cols != targetWidth || img.rows != targetHeight) {
-                cv::resize(img, img, cv::Size(targetWidth, targetHeight));
-            }
-            imageSlices.append(img);
+    // A stack that was decoded before is mapped from the cache instead.
+    pendingCachePath = VolumeFile::cachePath(fileNames);
+    if (!pendingCachePath.isEmpty() && QFileInfo::exists(pendingCachePath)) {
+        const Volume cached = VolumeFile::mapCached(pendingCachePath);
+        if (!cached.isEmpty()) {
+            stopLoading();
+            pendingCachePath.clear();
+            history->clear();
+            detections = DetectionResults();
+            volume = cached;
+            resetWindowLevel();
+            loadAndDisplayImages();
+            statusBar()->showMessage("Opened cached volume", 5000);
+            return;
         }
     }
-    if (imageSlices.isEmpty()) {
+
+    // Files are decoded on a thread pool at their native size and bit depth;
+    // slices show up as they arrive.
+    if (!loader->start(fileNames)) {
         QMessageBox::warning(this, "Error", "No valid images loaded.");
-        slider->setEnabled(false);
         return;
     }
-    slider->setMaximum(imageSlices.size() - 1);
-    slider->setValue(0);
-    slider->setEnabled(true);
-    currentIndex = 0;
+
+    history->clear();
+    detections = DetectionResults();
+    volume = Volume();
+    syncCursorSliders();
+
+    if (!loadProgress) {
+        loadProgress = new QProgressDialog("Loading image slices...", "Cancel", 0, 0, this);
+        loadProgress->setWindowModality(Qt::NonModal);
+        loadProgress->setMinimumDuration(300);
+        connect(loadProgress, &QProgressDialog::canceled, loader, &SliceLoader::cancel);
+        connect(loader, &SliceLoader::progress, loadProgress, [this](int done, int total) {
+            loadProgress->setMaximum(total);
+            loadProgress->setValue(done);
+        });
+    }
+    loadProgress->reset();
+    loadProgress->setMaximum(fileNames.size());
+    loadProgress->setValue(0);
+}
+
+
+// The running edit would go on writing into the old volume and hand it
+// back when done, replacing the one just opened.
+bool MainWindow::canReplaceVolume() {
+    if (!history->isEditing())
+        return true;
+    QMessageBox::information(this, "Edit Running", "Wait for the running edit to finish, or cancel it, "
+                                                   "before opening another volume.");
+    return false;
+}
+
+
+// Drops a stack load in progress, e.g. when another volume replaces it.
+void MainWindow::stopLoading() {
+    loader->stop();
+    streamRefreshTimer->stop();
+    if (loadProgress)
+        loadProgress->reset();
+}
+
+
+void MainWindow::openVolumeFile() {
+    if (!canReplaceVolume())
+        return;
+
+    const QString fileName = QFileDialog::getOpenFileName(this, "Open Volume", "",
+        QString("Volumes (*.%1 *.nrrd *.nhdr *.nii *.nii.gz *.hdr *.hdr.gz)").arg(VolumeFile::Extension));
+    if (fileName.isEmpty())
+        return;
+
+    // NRRD and NIfTI files are streamed in; native files are only mapped.
+    QProgressDialog progress("Reading volume...", "Cancel", 0, 1000, this);
+    progress.setWindowModality(Qt::WindowModal);
+    progress.setMinimumDuration(300);
+    const ReadProgress onProgress = [&progress](qint64 done, qint64 total) {
+        progress.setValue(int(done * 1000 / std::max<qint64>(total, 1)));
+        QApplication::processEvents();
+        return !progress.wasCanceled();
+    };
+
+    const QString lower = fileName.toLower();
+    QString error;
+    Volume opened;
+    if (lower.endsWith(".nrrd") || lower.endsWith(".nhdr"))
+        opened = NrrdFile::read(fileName, &error, onProgress);
+    else if (lower.endsWith(".nii") || lower.endsWith(".nii.gz") || lower.endsWith(".hdr") || lower.endsWith(".hdr.gz"))
+        opened = NiftiFile::read(fileName, &error, onProgress);
+    else
+        opened = VolumeFile::map(fileName, &error);
+    progress.reset();
+
+    if (opened.isEmpty()) {
+        if (!progress.wasCanceled())
+            QMessageBox::warning(this, "Error", QString("Could not open volume: %1").arg(error));
+        return;
+    }
+    // Reading processes events, so an edit may have started meanwhile.
+    if (!canReplaceVolume())
+        return;
+
+    stopLoading();
+    history->clear();
+    detections = DetectionResults();
+    volume = opened;
+    resetWindowLevel();
+    loadAndDisplayImages();
+}
+
+
+void MainWindow::saveVolumeFile() {
+    if (volume.isEmpty()) {
+        QMessageBox::warning(this, "Warning", "No volume to save.");
+        return;
+    }
+
+    const QString nativeFilter = QString("Native volume (*.%1)").arg(VolumeFile::Extension);
+    QString filter = nativeFilter;
+    QString fileName = QFileDialog::getSaveFileName(this, "Save Volume", "",
+        nativeFilter + ";;NRRD (*.nrrd);;NRRD, gzip (*.nrrd);;NIfTI (*.nii);;NIfTI, gzip (*.nii.gz)", &filter);
+    if (fileName.isEmpty())
+        return;
+    if (QFileInfo(fileName).suffix().isEmpty()) {
+        if (filter.startsWith("NRRD"))
+            fileName += ".nrrd";
+        else if (filter.startsWith("NIfTI"))
+            fileName += filter.contains("gzip") ? ".nii.gz" : ".nii";
+        else
+            fileName += QString(".") + VolumeFile::Extension;
+    }
+
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    const QString lower = fileName.toLower();
+    QString error;
+    bool saved;
+    if (lower.endsWith(".nrrd"))
+        saved = NrrdFile::write(volume, fileName, filter.contains("gzip"), &error);
+    else if (lower.endsWith(".nii") || lower.endsWith(".nii.gz"))
+        saved = NiftiFile::write(volume, fileName, &error);
+    else
+        saved = VolumeFile::write(volume, fileName, &error);
+    QApplication::restoreOverrideCursor();
+
+    if (!saved)
+        QMessageBox::warning(this, "Error", QString("Could not save volume: %1").arg(error));
+}
+
+
+void MainWindow::onSliceLoaded(int index) {
+    // First slice decoded: start showing the volume that is being filled.
+    if (volume.isEmpty() && loader->isRunning()) {
+        volume = loader->volume();
+        history->setCurrentVolume(volume);
+        // Provisional window from the first slice, replaced once all are in.
+        windowLevel = WindowLevel::fullRange(volume.axial(index));
+        windowLevelType = volume.type();
+        cursorX = volume.width() / 2;
+        cursorY = volume.height() / 2;
+        cursorZ = index;
+        syncCursorSliders();
+        updatePlanes(AllPlanes);
+        return;
+    }
+
+    if (index == cursorZ)
+        updatePlanes(AxialPlane);
+    if (!streamRefreshTimer->isActive())
+        streamRefreshTimer->start();
+}
+
+
+void MainWindow::onLoadFinished(const Volume &loaded, bool cancelled) {
+    streamRefreshTimer->stop();
+    if (loadProgress)
+        loadProgress->reset();
+
+    volume = loaded;
+    if (volume.isEmpty()) {
+        syncCursorSliders();
+        if (!cancelled)
+            QMessageBox::warning(this, "Error", "No valid images loaded.");
+        return;
+    }
+
+    // Complete stacks are cached so the next open only maps the file.
+    if (!cancelled)
+        VolumeFile::writeInBackground(volume, pendingCachePath);
+    pendingCachePath.clear();
+
+    resetWindowLevel();
     loadAndDisplayImages();
+    if (cancelled)
+        statusBar()->showMessage(QString("Loading cancelled, %1 slices loaded").arg(volume.depth()), 5000);
 }
 
 
+// Full refresh after the volume itself changed.
 void MainWindow::loadAndDisplayImages() {
-    if (imageSlices.isEmpty() || currentIndex < 0 || currentIndex >= imageSlices.size())
+    // Undo, redo and the open dialogs work on whatever is shown.
+    history->setCurrentVolume(volume);
+    syncCursorSliders();
+    if (volume.isEmpty())
+        return;
+
+    // Edits and segmentation may change the voxel type (e.g. to an 8-bit mask).
+    if (volume.type() != windowLevelType)
+        resetWindowLevel();
+
+    updatePyramid();
+    updatePlanes(AllPlanes);
+    update3DViews(false);
+}
+
+
+// Starts bringing the pyramid up to date with the volume. A build of a
+// replaced volume is cancelled; either way the pending change is picked up
+// when the running build reports back.
+void MainWindow::updatePyramid() {
+    if (volume.isEmpty())
+        return;
+    // One build at a time; a newer volume waits for the cancelled one.
+    if (pyramidTask) {
+        if (!pyramid.covers(volume))
+            pyramidTask->cancel();
+        pyramidPending = true;
+        return;
+    }
+
+    if (!pyramid.covers(volume))
+        pyramid = VolumePyramid(volume);
+    pyramidReady = false;
+    pyramidPending = false;
+
+    // The worker gets a shallow copy; levels and build state are shared.
+    VolumePyramid target = pyramid;
+    pyramidTask = TaskScheduler::instance().run(Task::Background, [target](Task &job) mutable {
+        target.update(job.cancelFlag());
+    });
+    connect(pyramidTask, &Task::finished, this, &MainWindow::onPyramidUpdated);
+}
+
+
+void MainWindow::onPyramidUpdated() {
+    pyramidTask = nullptr;
+    if (pyramidPending) {
+        updatePyramid();
+        return;
+    }
+    pyramidReady = true;
+    if (!pyramidUsable())
+        return;
+
+    // Zoomed-out planes switch to their level. Large volumes get a coarse 3D
+    // preview now and the level matching the panes once that is on screen.
+    updatePlanes(AllPlanes);
+    if (qint64(volume.totalBytes()) > ProgressiveBytes) {
+        update3DViews(true);
+        QTimer::singleShot(0, this, [this]() {
+            if (pyramidUsable())
+                update3DViews(false);
+        });
+    } else {
+        update3DViews(false);
+    }
+}
+
+
+bool MainWindow::pyramidUsable() const {
+    return pyramidReady && pyramid.covers(volume);
+}
+
+
+// Coarsest pyramid level that still has a pixel per screen pixel at the zoom.
+int MainWindow::displayLevel() const {
+    return pyramidUsable() ? pyramid.levelForScale(zoomFactor) : 0;
+}
+
+
+// The middle slice's range stands in until the full range is counted off the
+// GUI thread; a window set in the meantime is kept.
+void MainWindow::resetWindowLevel() {
+    const WindowLevel provisional = WindowLevel::provisionalRange(volume);
+    windowLevel = provisional;
+    windowLevelType = volume.type();
+    const uchar *data = volume.data();
+    WindowLevel::fullRangeLater(volume, this, [this, data, provisional](const WindowLevel &range) {
+        if (volume.data() == data && windowLevel == provisional && range != provisional)
+            setWindowLevel(range);
+    });
+}
+
+
+// Only remaps the cached planes; voxel data and reslicing are untouched.
+void MainWindow::setWindowLevel(const WindowLevel &level) {
+    windowLevel = level;
+    if (volume.isEmpty())
+        return;
+
+    displayPlanes(AllPlanes);
+    volumeRenderView->setWindow(windowLevel);
+    windowTextureTimer->start();
+}
+
+
+bool MainWindow::eventFilter(QObject *watched, QEvent *event) {
+    const bool isView = watched == views[0] || watched == views[1] || watched == views[2];
+    if (!isView || volume.isEmpty())
+        return QMainWindow::eventFilter(watched, event);
+
+    if (event->type() == QEvent::MouseButtonPress) {
+        QMouseEvent *mouse = static_cast<QMouseEvent *>(event);
+        if (mouse->button() == Qt::RightButton) {
+            windowDragStart = mouse->pos();
+            windowDragLevel = windowLevel;
+            return true;
+        }
+        if (mouse->button() == Qt::LeftButton) {
+            const int view = watched == views[0] ? 0 : watched == views[1] ? 1 : 2;
+            if (pickVoxel(view, mouse->pos()))
+                return true;
+        }
+    } else if (event->type() == QEvent::MouseMove) {
+        QMouseEvent *mouse = static_cast<QMouseEvent *>(event);
+        if (mouse->buttons() & Qt::RightButton) {
+            // One pixel of motion moves by 1/256 of the window the drag started from.
+            const QPoint delta = mouse->pos() - windowDragStart;
+            const double step = windowDragLevel.width() / 256.0;
+            WindowLevel level = windowDragLevel;
+            level.setWidth(windowDragLevel.width() + delta.x() * step);
+            level.setCenter(windowDragLevel.center() + delta.y() * step);
+            setWindowLevel(level);
+            return true;
+        }
+    }
+    return QMainWindow::eventFilter(watched, event);
+}
+
+
+// Maps a position on a view to the voxel under it, moves the cursor there
+// and emits voxelPicked(). The views show their plane centred at
+// zoomFactor times its full-resolution size.
+bool MainWindow::pickVoxel(int view, const QPoint &pos) {
+    const QSize planeSizes[3] = {
+        QSize(volume.width(), volume.height()),
+        QSize(volume.depth(), volume.height()),
+        QSize(volume.width(), volume.depth())
+    };
+    const QSize shown = planeSizes[view] * zoomFactor;
+    const QPoint origin((views[view]->width() - shown.width()) / 2, (views[view]->height() - shown.height()) / 2);
+    const int col = int((pos.x() - origin.x()) / zoomFactor);
+    const int row = int((pos.y() - origin.y()) / zoomFactor);
+    if (pos.x() < origin.x() || pos.y() < origin.y() || col >= planeSizes[view].width()
+            || row >= planeSizes[view].height())
+        return false;
+
+    int x = cursorX, y = cursorY, z = cursorZ;
+    if (view == 0) {
+        x = col;
+        y = row;
+    } else if (view == 1) {
+        z = col;
+        y = row;
+    } else {
+        x = col;
+        z = row;
+    }
+    sliderX->setValue(x);
+    sliderY->setValue(y);
+    slider->setValue(z);
+    emit voxelPicked(x, y, z);
+    return true;
+}
+
+
+// Reslices only the requested planes, then redraws all views (axis lines
+// depend on the other cursors, so they are cheap overlays on the cached planes).
+void MainWindow::updatePlanes(int planes) {
+    if (volume.isEmpty())
         return;
 
-    const int depth = imageSlices.size();
-    const int height = imageSlices[0].rows;
-    const int width = imageSlices[0].cols;
+    // Reslicing walks through every slice, so large volumes are resliced
+    // from the coarsest level first and at full detail once the cursor rests.
+    const int level = displayLevel();
+    const int reslice = planes & (CoronalPlane | SagittalPlane);
+    if (reslice && pyramidUsable() && qint64(volume.totalBytes()) > ProgressiveBytes
+            && level < pyramid.levelCount() - 1) {
+        reslicePlanes(reslice, pyramid.levelCount() - 1);
+        refinePlanes |= reslice;
+        refineTimer->start();
+    } else {
+        reslicePlanes(reslice, level);
+        refinePlanes &= ~reslice;
+    }
 
-    // Axial view (already loaded)
-    const cv::Mat &axial = imageSlices[currentIndex];
-    // Axial view: XY plane
-    QImage axialImage = drawAxisLines(matToQImage(axial), currentIndex, currentIndex, Qt::red, Qt::green);
-    views[0]->setPixmap(QPixmap::fromImage(axialImage.scaled(axialImage.size() * zoomFactor, Qt::KeepAspectRatio, Qt::SmoothTransformation)));
+    displayPlanes(planes);
+}
 
-    // Coronal view: YZ slice (height vs depth)
-    cv::Mat coronal(height, depth, CV_8UC1);
-    for (int z = 0; z < depth; ++z)
-        for (int y = 0; y < height; ++y)
-            coronal.at<uchar>(y, z) = imageSlices[z].at<uchar>(y, currentIndex);  // X = currentIndex
 
-    // Coronal view: YZ plane    
-    QImage coronalImage = drawAxisLines(matToQImage(coronal), currentIndex, currentIndex, Qt::blue, Qt::green);
-    views[1]->setPixmap(QPixmap::fromImage(coronalImage.scaled(coronalImage.size() * zoomFactor, Qt::KeepAspectRatio, Qt::SmoothTransformation)));
+void MainWindow::reslicePlanes(int planes, int level) {
+    const Volume &source = level > 0 ? pyramid.level(level) : volume;
+
+    if (planes & CoronalPlane) {
+        // Coronal view: YZ plane at X (height vs depth)
+        Reslicer::coronal(source, VolumePyramid::toLevel(cursorX, level, source.width()), coronalData);
+        planeLevels[1] = level;
+    }
+    if (planes & SagittalPlane) {
+        // Sagittal view: XZ plane at Y (depth vs width)
+        Reslicer::sagittal(source, VolumePyramid::toLevel(cursorY, level, source.height()), sagittalData);
+        planeLevels[2] = level;
+    }
+}
 
 
-    // Sagittal view: XZ slice (width vs depth)
-    cv::Mat sagittal(depth, width, CV_8UC1);
-    for (int z = 0; z < depth; ++z)
-        for (int x = 0; x < width; ++x)
-            sagittal.at<uchar>(z, x) = imageSlices[z].at<uchar>(currentIndex, x);  // Y = currentIndex
+// Maps the native planes through the current window and redraws.
+void MainWindow::displayPlanes(int planes) {
+    if (volume.isEmpty())
+        return;
 
-    // Sagittal view: XZ plane
-    QImage sagittalImage = drawAxisLines(matToQImage(sagittal), currentIndex, currentIndex, Qt::blue, Qt::red);
-    views[2]->setPixmap(QPixmap::fromImage(sagittalImage.scaled(sagittalImage.size() * zoomFactor, Qt::KeepAspectRatio, Qt::SmoothTransformation)));
+    if (planes & AxialPlane) {
+        // Axial view: XY plane at Z, a header into the volume or its level.
+        // Neighbouring slices of paged volumes are read ahead for scrolling.
+        const int level = displayLevel();
+        if (level == 0) {
+            volume.touch(cursorZ, cursorZ + 1);
+            volume.prefetch(cursorZ - PrefetchSlices, cursorZ + PrefetchSlices + 1);
+        }
+        const Volume &source = level > 0 ? pyramid.level(level) : volume;
+        planeImages[0] = matToQImage(source.axial(cursorZ));
+        planeLevels[0] = level;
+    }
+    if (planes & CoronalPlane)
+        planeImages[1] = matToQImage(coronalData);
+    if (planes & SagittalPlane)
+        planeImages[2] = matToQImage(sagittalData);
 
+    refreshViews();
+}
 
 
-    // Update 3D view
-    update3DView();
+void MainWindow::refreshViews() {
+    if (volume.isEmpty())
+        return;
+
+    // Axis line colours: X cursor red, Y cursor green, Z cursor blue. Planes
+    // from a pyramid level have reduced X and Y, so the cursors are mapped
+    // into the level and the images scaled to the full-resolution size.
+    const int *lv = planeLevels;
+    const QImage annotated[3] = {
+        drawAxisLines(planeImages[0], cursorX >> lv[0], cursorY >> lv[0], Qt::red, Qt::green),
+        drawAxisLines(planeImages[1], cursorZ, cursorY >> lv[1], Qt::blue, Qt::green),
+        drawAxisLines(planeImages[2], cursorX >> lv[2], cursorZ, Qt::red, Qt::blue)
+    };
+    const QSize planeSizes[3] = {
+        QSize(volume.width(), volume.height()),
+        QSize(volume.depth(), volume.height()),
+        QSize(volume.width(), volume.depth())
+    };
+    for (int i = 0; i < 3; ++i) {
+        QImage shown = annotated[i].scaled(planeSizes[i] * zoomFactor, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        if (i == 0)
+            paintDetections(shown);
+        views[i]->setPixmap(QPixmap::fromImage(shown));
+    }
+
+    statusBar()->showMessage(QString("Showing slice %1 / %2  (x %3, y %4)  W %5  L %6")
+        .arg(cursorZ + 1).arg(volume.depth()).arg(cursorX).arg(cursorY)
+        .arg(windowLevel.width(), 0, 'g', 5).arg(windowLevel.center(), 0, 'g', 5));
+}
+
+
+// Boxes of the current slice, drawn at screen resolution onto the scaled
+// axial image and only where the view shows it: the plane is centred in the
+// view, and zoomed in it is cropped to the view.
+void MainWindow::paintDetections(QImage &shown) {
+    if (!showDetectionsAct->isChecked() || !detections.covers(volume))
+        return;
+    const QPoint origin((views[0]->width() - shown.width()) / 2, (views[0]->height() - shown.height()) / 2);
+    const QRect visible = QRect(-origin, views[0]->size()) & shown.rect();
+    if (visible.isEmpty() || detections.begin(cursorZ) == detections.end(cursorZ))
+        return;
 
-    statusBar()->showMessage(QString("Showing slice %1 / %2")
-        .arg(currentIndex + 1).arg(imageSlices.size()));
+    QPainter painter(&shown);
+    painter.setClipRect(visible);
+    detections.paint(painter, cursorZ, zoomFactor, visible);
 }
 
 
+// Grayscale planes of any depth go through the display window.
 QImage MainWindow::matToQImage(const cv::Mat &mat) {
-    if (mat.type() == CV_8UC1)
-        return QImage(mat.data, mat.cols, mat.rows, mat.step, QImage::Format_Grayscale8).copy();
-    else if (mat.type() == CV_8UC3)
+    if (mat.type() == CV_8UC3)
         return QImage(mat.data, mat.cols, mat.rows, mat.step, QImage::Format_RGB888).rgbSwapped();
-    return QImage();
+    if (mat.channels() != 1)
+        return QImage();
+    const cv::Mat display = windowLevel.apply(mat);
+    return QImage(display.data, display.cols, display.rows, display.step, QImage::Format_Grayscale8).copy();
 }
 
 
-#include <QTemporaryFile>
-#include <QStandardPaths>
 #include <Qt3DExtras/QCuboidMesh>
+#include "slicetexture.h"
 
 
-void MainWindow::update3DView() {
+// Volume level shown by the 3D views: the coarsest one that still has a
+// voxel per pixel of the pane, or the coarsest of all for a preview, and in
+// either case within the memory budget. Empty when nothing fits.
+Volume MainWindow::volumeFor3D(const QSize &viewSize, bool preview) const {
+    if (!pyramidUsable())
+        return qint64(volume.totalBytes()) <= PagedStorage::budget() ? volume : Volume();
+
+    const int finest = preview ? pyramid.levelCount() - 1
+                               : pyramid.levelFor(QSize(volume.width(), volume.height()), viewSize);
+    const int level = pyramid.levelWithin(PagedStorage::budget(), finest);
+    return level < 0 ? Volume() : pyramid.level(level);
+}
+
+
+// Both 3D views read every voxel of what they show. Large volumes wait for
+// the pyramid instead of going through the full resolution first.
+void MainWindow::update3DViews(bool preview) {
+    if (!pyramidUsable() && qint64(volume.totalBytes()) > ProgressiveBytes) {
+        // Keep showing the previous content of an edited volume meanwhile.
+        if (!pyramid.covers(volume)) {
+            update3DView(Volume());
+            volumeRenderView->setVolume(Volume());
+        }
+        return;
+    }
+
+    const Volume sceneSource = volumeFor3D(container3D->size(), preview);
+    update3DView(sceneSource);
+    volumeRenderView->setWindow(windowLevel);
+    volumeRenderView->setVolume(volumeFor3D(volumeRenderView->size(), preview));
+    if (sceneSource.isEmpty() && !volume.isEmpty())
+        statusBar()->showMessage("Volume exceeds the memory budget; 3D views are disabled", 5000);
+}
+
+
+// Creates one textured box per slice. Only needed when the volume geometry
+// or spacing changes; content updates go through update3DView().
+void MainWindow::build3DScene(const Volume &source) {
     if (sliceContainerEntity) {
         delete sliceContainerEntity;
         sliceContainerEntity = nullptr;
     }
+    sliceTextures.clear();
+    sceneVolume = source;
 
-    if (imageSlices.isEmpty())
+    if (source.isEmpty())
         return;
 
     sliceContainerEntity = new Qt3DCore::QEntity(rootEntity);
 
-    const int numSlices = imageSlices.size();
+    const QVector3D voxelSize = source.spacing();
+    const int numSlices = source.depth();
     const float sliceSpacing = voxelSize.z(); // Z voxel spacing
     const int half = numSlices / 2;
 
-    for (int i = 0; i < numSlices; ++i) {
-        const cv::Mat &slice = imageSlices[i];
-        QImage qimg = matToQImage(slice).convertToFormat(QImage::Format_RGBA8888);
-
-        // Save to temp file
-        QString tmpDir = QStandardPaths::writableLocation(QStandardPaths::TempLocation);
-        QString filename = tmpDir + QString("/slice_%1.png").arg(i);
-        qimg.save(filename);
+    // All slices share one mesh; only the texture and position differ.
+    auto *boxMesh = new Qt3DExtras::QCuboidMesh(sliceContainerEntity);
+    boxMesh->setXExtent(source.width() * voxelSize.x());
+    boxMesh->setYExtent(source.height() * voxelSize.y());
+    boxMesh->setZExtent(1.0f);  // 1 cm thickness
 
-        // Texture
+    sliceTextures.reserve(numSlices);
+    for (int i = 0; i < numSlices; ++i) {
+        // Texture data is generated in memory from the volume buffer
         auto *texture = new Qt3DRender::QTexture2D();
-        auto *textureImage = new Qt3DRender::QTextureImage();
-        textureImage->setSource(QUrl::fromLocalFile(filename));
+        auto *textureImage = new SliceTextureImage(i);
+        textureImage->setVolume(source);
+        textureImage->setWindow(windowLevel);
         texture->addTextureImage(textureImage);
         texture->setFormat(Qt3DRender::QAbstractTexture::RGBA8_UNorm);
         texture->setMinificationFilter(Qt3DRender::QAbstractTexture::Linear);
         texture->setMagnificationFilter(Qt3DRender::QAbstractTexture::Linear);
         texture->setGenerateMipMaps(true);
+        sliceTextures.append(textureImage);
 
         auto *material = new Qt3DExtras::QTextureMaterial();
         material->setTexture(texture);
 
-        auto *boxMesh = new Qt3DExtras::QCuboidMesh();
-        boxMesh->setXExtent(qimg.width() * voxelSize.x());
-        boxMesh->setYExtent(qimg.height() * voxelSize.y());
-        boxMesh->setZExtent(1.0f);  // 1 cm thickness
-
-
         // Position
         auto *transform = new Qt3DCore::QTransform();
         float yPos = (i - half) * sliceSpacing;
@@ -345,32 +1009,43 @@ void MainWindow::update3DView() {
 }
 
 
-void MainWindow::onSliderChanged(int value) {
-    if (value >= 0 && value < imageSlices.size()) {
-        currentIndex = value;
-        loadAndDisplayImages();
+// Called when the volume content changed. Rebuilds the scene only for a new
+// geometry; otherwise re-uploads just the slices whose version changed.
+void MainWindow::update3DView(const Volume &source) {
+    if (source.isEmpty() || !source.sameGeometry(sceneVolume)
+            || source.spacing() != sceneVolume.spacing()) {
+        build3DScene(source);
+        return;
     }
-}
-
 
-cv::Mat3b MainWindow::volumeAsMat3b() {
-    int depth = imageSlices.size();
-    int height = imageSlices[0].rows;
-    int width = imageSlices[0].cols;
+    sceneVolume = source;
+    for (SliceTextureImage *textureImage : sliceTextures) {
+        textureImage->setVolume(source);
+        textureImage->setWindow(windowLevel);
+    }
+}
 
-    cv::Mat3b volume(depth, height, width);  // 3D matrix
 
-    for (int z = 0; z < depth; ++z) {
-        for (int y = 0; y < height; ++y) {
-            for (int x = 0; x < width; ++x) {
-                volume(z, y, x) = imageSlices[z].at<uchar>(y, x);
-            }
-        }
+void MainWindow::onSliderChanged(int value) {
+    if (value >= 0 && value < volume.depth()) {
+        cursorZ = value;
+        updatePlanes(AxialPlane);
     }
+}
 
-    return volume;
+void MainWindow::onSliderXChanged(int value) {
+    if (value >= 0 && value < volume.width()) {
+        cursorX = value;
+        updatePlanes(CoronalPlane);
+    }
 }
 
+void MainWindow::onSliderYChanged(int value) {
+    if (value >= 0 && value < volume.height()) {
+        cursorY = value;
+        updatePlanes(SagittalPlane);
+    }
+}
 
 
 #include <Qt3DExtras/QCylinderMesh>
@@ -439,16 +1114,19 @@ QImage MainWindow::drawAxisLines(const QImage &image, int vertical, int horizont
 #include "editwindow.h"  // You'll create this class
 
 void MainWindow::openEditWindow() {
-    if (imageSlices.isEmpty()) {
+    if (volume.isEmpty()) {
         QMessageBox::warning(this, "Warning", "No images to edit.");
         return;
     }
 
-    EditWindow *editor = new EditWindow(QList<cv::Mat>::fromVector(imageSlices), nullptr);
-    connect(editor, &EditWindow::imagesEdited, this, [=](QList<cv::Mat> newImages) {
-        imageSlices = QVector<cv::Mat>(newImages.begin(), newImages.end());
+    EditWindow *editor = new EditWindow(volume, history, nullptr);
+    connect(editor, &EditWindow::volumeEdited, this, [=](const Volume &edited) {
+        volume = edited;
         loadAndDisplayImages();
     });
+    // The preview follows the Z cursor.
+    editor->setPreviewSlice(cursorZ);
+    connect(slider, &QSlider::valueChanged, editor, &EditWindow::setPreviewSlice);
 
     editor->setAttribute(Qt::WA_DeleteOnClose);
     editor->show();
@@ -456,17 +1134,20 @@ void MainWindow::openEditWindow() {
 
 
 void MainWindow::openSegmentationWindow() {
-    if (imageSlices.isEmpty()) {
+    if (volume.isEmpty()) {
         QMessageBox::warning(this, "No Images", "Please load an image first.");
         return;
     }
 
-    SegmentationWindow *segWindow = new SegmentationWindow(imageSlices.toList(), this);
+    SegmentationWindow *segWindow = new SegmentationWindow(volume, history, this);
 
-    connect(segWindow, &SegmentationWindow::imagesSegmented, this, [=](QList<cv::Mat> segmentedImages) {
-        imageSlices = QVector<cv::Mat>(segmentedImages.begin(), segmentedImages.end());
+    connect(segWindow, &SegmentationWindow::volumeSegmented, this, [=](const Volume &segmented) {
+        volume = segmented;
         loadAndDisplayImages();
     });
+    segWindow->setPreviewSlice(cursorZ);
+    connect(slider, &QSlider::valueChanged, segWindow, &SegmentationWindow::setPreviewSlice);
+    connect(this, &MainWindow::voxelPicked, segWindow, &SegmentationWindow::setSeed);
 
     segWindow->setAttribute(Qt::WA_DeleteOnClose);
     segWindow->show();
@@ -477,17 +1158,14 @@ void MainWindow::openSegmentationWindow() {
 
 
 void MainWindow::openObjectDetectionWindow() {
-    if (imageSlices.isEmpty()) {
+    if (volume.isEmpty()) {
         QMessageBox::warning(this, "No Images", "Please load an image first.");
         return;
     }
 
-    ObjectDetectionWindow *detWindow = new ObjectDetectionWindow(imageSlices.toList(), this);
+    ObjectDetectionWindow *detWindow = new ObjectDetectionWindow(volume, this);
 
-    connect(detWindow, &ObjectDetectionWindow::detectionCompleted, this, [=](QList<cv::Mat> detectedImages) {
-        imageSlices = QVector<cv::Mat>(detectedImages.begin(), detectedImages.end());
-        loadAndDisplayImages();
-    });
+    connect(detWindow, &ObjectDetectionWindow::detectionCompleted, this, &MainWindow::showDetections);
 
     detWindow->setAttribute(Qt::WA_DeleteOnClose);
     detWindow->show();
@@ -497,58 +1175,103 @@ void MainWindow::openObjectDetectionWindow() {
 // ///////////////////////////////////////////////////////////////
 
 void MainWindow::openCustomObjectDetectionWindow() {
-    if (imageSlices.isEmpty()) {
+    if (volume.isEmpty()) {
         QMessageBox::warning(this, "No Images", "Please load images first.");
         return;
     }
 
-    CustomObjectDetectionWindow *customDetWin = new CustomObjectDetectionWindow(imageSlices.toList(), this);
+    CustomObjectDetectionWindow *customDetWin = new CustomObjectDetectionWindow(volume, this);
 
-    connect(customDetWin, &CustomObjectDetectionWindow::detectionCompleted, this, [=](QList<cv::Mat> detectedImages) {
-        imageSlices = QVector<cv::Mat>(detectedImages.begin(), detectedImages.end());
-        loadAndDisplayImages();
-    });
+    connect(customDetWin, &CustomObjectDetectionWindow::detectionCompleted, this, &MainWindow::showDetections);
 
     customDetWin->setAttribute(Qt::WA_DeleteOnClose);
     customDetWin->show();
 }
 
 
+// Replaces the shown detections; the volume and its undo history are untouched.
+void MainWindow::showDetections(const DetectionResults &results) {
+    detections = results;
+    showDetectionsAct->setEnabled(!detections.isEmpty());
+    showDetectionsAct->setChecked(true);
+    refreshViews();
+}
+
+
 // ///////////////////////// zooming and .....
 
 void MainWindow::zoomIn() {
     zoomFactor *= 1.25f;  // Increase zoom by 25%
-    loadAndDisplayImages();
+    if (displayLevel() != planeLevels[0])
+        updatePlanes(AllPlanes);
+    else
+        refreshViews();
 }
 
 void MainWindow::zoomOut() {
     zoomFactor /= 1.25f;  // Decrease zoom by 20%
-    loadAndDisplayImages();
+    if (displayLevel() != planeLevels[0])
+        updatePlanes(AllPlanes);
+    else
+        refreshViews();
 }
 
 
+// Rotation swaps width and height, so it goes through a freshly allocated volume.
+static Volume rotateVolume(const Volume &src, int rotateCode) {
+    Volume dst = Volume::allocate(src.height(), src.width(), src.depth(), src.type());
+    dst.setSpacing(QVector3D(src.spacing().y(), src.spacing().x(), src.spacing().z()));
+    for (int z = 0; z < src.depth(); ++z) {
+        cv::Mat out = dst.axial(z);
+        cv::rotate(src.axial(z), out, rotateCode);
+        src.release(z, z + 1);
+        dst.release(z, z + 1);
+    }
+    return dst;
+}
+
 void MainWindow::rotateLeft() {
-    for (cv::Mat &img : imageSlices)
-        cv::rotate(img, img, cv::ROTATE_90_COUNTERCLOCKWISE);
+    if (volume.isEmpty() || history->isEditing())
+        return;
+    history->recordReplace("Rotate Left", volume);
+    volume = rotateVolume(volume, cv::ROTATE_90_COUNTERCLOCKWISE);
     loadAndDisplayImages();
 }
 
 void MainWindow::rotateRight() {
-    for (cv::Mat &img : imageSlices)
-        cv::rotate(img, img, cv::ROTATE_90_CLOCKWISE);
+    if (volume.isEmpty() || history->isEditing())
+        return;
+    history->recordReplace("Rotate Right", volume);
+    volume = rotateVolume(volume, cv::ROTATE_90_CLOCKWISE);
     loadAndDisplayImages();
 }
 
 void MainWindow::mirrorHorizontal() {
-    for (cv::Mat &img : imageSlices)
+    if (volume.isEmpty() || history->isEditing())
+        return;
+    history->beginEdit("Mirror Horizontally", volume);
+    for (int z = 0; z < volume.depth(); ++z) {
+        history->saveSlice(z);
+        cv::Mat img = volume.axial(z);
         cv::flip(img, img, 1);  // horizontal flip
+        history->commitSlice(z);
+        volume.release(z, z + 1);
+    }
+    history->endEdit();
     loadAndDisplayImages();
 }
 
 void MainWindow::mirrorVertical() {
-    for (cv::Mat &img : imageSlices)
+    if (volume.isEmpty() || history->isEditing())
+        return;
+    history->beginEdit("Mirror Vertically", volume);
+    for (int z = 0; z < volume.depth(); ++z) {
+        history->saveSlice(z);
+        cv::Mat img = volume.axial(z);
         cv::flip(img, img, 0);  // vertical flip
+        history->commitSlice(z);
+        volume.release(z, z + 1);
+    }
+    history->endEdit();
     loadAndDisplayImages();
 }
-
-
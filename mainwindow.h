@@ -5,12 +5,26 @@
 #include <QSlider>
 #include <QLabel>
 #include <QVector>
-#include <QStack>
+#include <QStackedWidget>
+#include <QPointer>
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 
+#include "detectionresults.h"
+#include "volume.h"
+#include "volumepyramid.h"
+#include "windowlevel.h"
+
+class SliceTextureImage;
+class VolumeRenderView;
+class SliceLoader;
+class QProgressDialog;
+class QTimer;
+class Task;
+class VolumeHistory;
+
 // Include required Qt3D headers:
 #include <Qt3DExtras/Qt3DWindow>
 #include <Qt3DCore/QEntity>
@@ -28,22 +42,89 @@ public:
     explicit MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
+signals:
+    // Voxel left-clicked in one of the 2D views; the cursor moves there too.
+    void voxelPicked(int x, int y, int z);
+
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
+
 private:
     Ui::MainWindow *ui;
 
     // 2D display views (you already had 3 QLabel views for 2D)
     QLabel *views[3];
 
-    // Slider and image slices (using OpenCV cv::Mat)
+    // Slice slider (Z) plus X/Y cursor sliders, and the image volume
+    // (one contiguous buffer, see volume.h)
     QSlider *slider;
-    QVector<cv::Mat> imageSlices;
-    int currentIndex = 0;
-
-    cv::Mat3b volumeAsMat3b();
+    QSlider *sliderX;
+    QSlider *sliderY;
+    Volume volume;
+
+    // Independent cursor position; each one selects one of the three planes.
+    int cursorX = 0;
+    int cursorY = 0;
+    int cursorZ = 0;
+
+    // Resliced planes for views[0..2], kept so that moving one cursor only
+    // recomputes its own plane and the others just get new axis lines.
+    // coronalData/sagittalData hold native voxel values, planeImages the
+    // windowed 8-bit images, so a window/level change never reslices.
+    enum Plane { AxialPlane = 1, CoronalPlane = 2, SagittalPlane = 4, AllPlanes = 7 };
+    static const int PrefetchSlices = 4;   // read-ahead around the Z cursor
+    cv::Mat coronalData;
+    cv::Mat sagittalData;
+    QImage planeImages[3];
+    int planeLevels[3] = { 0, 0, 0 };   // pyramid level each plane image came from
+    void updatePlanes(int planes);
+    void reslicePlanes(int planes, int level);
+    void displayPlanes(int planes);
+    void refreshViews();
+    void paintDetections(QImage &shown);
+    void syncCursorSliders();
+    bool pickVoxel(int view, const QPoint &pos);
+
+    // Display window for all views. Right-dragging on a 2D view changes it:
+    // horizontal motion sets the width, vertical motion the centre.
+    WindowLevel windowLevel;
+    int windowLevelType = -1;       // volume type the window was chosen for
+    QPoint windowDragStart;
+    WindowLevel windowDragLevel;
+    QTimer *windowTextureTimer;     // throttles 3D texture re-uploads while dragging
+    void setWindowLevel(const WindowLevel &level);
+    void resetWindowLevel();
+
+    // Reduced copies of the volume for zoomed-out planes and the 3D views,
+    // brought up to date in the background after every change. Volumes
+    // above ProgressiveBytes show coarse planes while the cursor moves and a
+    // coarse 3D preview first; the finer results replace them afterwards.
+    VolumePyramid pyramid;
+    QPointer<Task> pyramidTask;     // build running on the background lane
+    bool pyramidPending = false;    // volume changed while a build was running
+    bool pyramidReady = false;
+    QTimer *refineTimer;            // full-resolution reslice once the cursor rests
+    int refinePlanes = 0;
+    static const qint64 ProgressiveBytes = qint64(256) * 1024 * 1024;
+    void updatePyramid();
+    void onPyramidUpdated();
+    bool pyramidUsable() const;
+    int displayLevel() const;
+
+    // Background image-stack loading
+    SliceLoader *loader;
+    QProgressDialog *loadProgress = nullptr;
+    QTimer *streamRefreshTimer;   // throttles reslicing while slices stream in
+    QString pendingCachePath;     // where the stack being loaded gets cached
+    void stopLoading();
+    // False, with a message, while an edit is still writing the volume.
+    bool canReplaceVolume();
 
     // Qt3D members:
     Qt3DExtras::Qt3DWindow *view3D;
     QWidget *container3D;
+    QStackedWidget *view3DStack;            // slice stack (Qt3D) or ray-cast view
+    VolumeRenderView *volumeRenderView;
     Qt3DCore::QEntity *rootEntity;
     Qt3DExtras::QOrbitCameraController *camController; // now a member variable!
 
@@ -51,7 +132,10 @@ private:
     void setupMenus();
     void setupSlider();
     void setup3DView();
-    void update3DView();
+    void update3DViews(bool preview);
+    Volume volumeFor3D(const QSize &viewSize, bool preview) const;
+    void update3DView(const Volume &source);
+    void build3DScene(const Volume &source);
 
     // Your helper:
     QImage matToQImage(const cv::Mat &mat);
@@ -60,11 +144,12 @@ private:
 
 
     Qt3DCore::QEntity* sliceContainerEntity = nullptr;
+    QVector<SliceTextureImage *> sliceTextures;   // one per slice, owned by the scene
+    Volume sceneVolume;                           // geometry the scene was built for
 
-    QVector3D voxelSize = QVector3D(1.0f, 1.0f, 1.0f); // x: width, y: height, z: slice spacing
-
-    QList<cv::Mat> currentImages;           // Holds the current images
-    QStack<QList<cv::Mat>> imageHistory;    // Optional: for undo functionality
+    VolumeHistory *history;                 // undo/redo shared with the edit windows
+    DetectionResults detections;            // last detection run, shown over the axial view
+    QAction *showDetectionsAct;
     QLabel *imageLabel;                     // Assuming you're showing the image here
     double scaleFactor = 1.0;
 
@@ -73,14 +158,21 @@ private:
 
 private slots:
     void openImageSet();
+    void openVolumeFile();
+    void saveVolumeFile();
+    void onSliceLoaded(int index);
+    void onLoadFinished(const Volume &loaded, bool cancelled);
     void loadAndDisplayImages();
     void onSliderChanged(int value);
+    void onSliderXChanged(int value);
+    void onSliderYChanged(int value);
     void openEditWindow();
 
     void openSegmentationWindow();
 
     void openObjectDetectionWindow();
     void openCustomObjectDetectionWindow();
+    void showDetections(const DetectionResults &results);
 
     void zoomIn();
     void zoomOut();
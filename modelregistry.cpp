@@ -0,0 +1,155 @@
+#include "modelregistry.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSettings>
+
+#include <fstream>
+#include <stdexcept>
+
+#include "taskscheduler.h"
+
+namespace {
+
+// Network input width and height per model.
+const int InputSizes[ModelRegistry::ModelCount] = { 416, 640 };
+
+} // namespace
+
+
+std::string DetectionModel::className(int id) const
+{
+    if (id >= 0 && id < int(classNames.size()))
+        return classNames[id];
+    return std::to_string(id);
+}
+
+
+ModelRegistry &ModelRegistry::instance()
+{
+    static ModelRegistry registry;
+    return registry;
+}
+
+void ModelRegistry::addOptions(QCommandLineParser &parser)
+{
+    parser.addOptions({
+        { "model-dir", "Directory holding the detection models.", "dir" },
+        { "yolo-weights", "Darknet weights of the YOLO detector.", "file" },
+        { "yolo-config", "Darknet configuration of the YOLO detector.", "file" },
+        { "yolo-classes", "Class names of the YOLO detector, one per line.", "file" },
+        { "custom-model", "ONNX model of the custom detector.", "file" },
+        { "custom-classes", "Class names of the custom detector, one per line.", "file" },
+        { "no-preload", "Load detection models on first use instead of at startup." },
+    });
+}
+
+void ModelRegistry::configure(const QCommandLineParser &parser)
+{
+    QSettings settings;
+    auto value = [&](const QString &option, const QString &key, const QString &fallback) {
+        return parser.isSet(option) ? parser.value(option) : settings.value(key, fallback).toString();
+    };
+
+    directory = value("model-dir", "models/directory", QCoreApplication::applicationDirPath());
+    preloading = !parser.isSet("no-preload") && settings.value("models/preload", true).toBool();
+
+    entries[Yolo].paths = { value("yolo-weights", "models/yolo/weights", "yolov3.weights"),
+                            value("yolo-config", "models/yolo/config", "yolov3.cfg"),
+                            value("yolo-classes", "models/yolo/classes", "coco.names") };
+    entries[Custom].paths = { value("custom-model", "models/custom/model", "model.onnx"),
+                              QString(),
+                              value("custom-classes", "models/custom/classes", QString()) };
+}
+
+void ModelRegistry::preload()
+{
+    if (!preloading)
+        return;
+    for (int id = 0; id < ModelCount; ++id)
+        load(Model(id));
+}
+
+std::shared_ptr<DetectionModel> ModelRegistry::model(Model id)
+{
+    load(id);
+    return entries[id].model;
+}
+
+QString ModelRegistry::modelPath(Model id) const
+{
+    return resolve(entries[id].paths.model);
+}
+
+QString ModelRegistry::resolve(const QString &path) const
+{
+    if (path.isEmpty() || QFileInfo(path).isAbsolute())
+        return path;
+    return QDir(directory).filePath(path);
+}
+
+void ModelRegistry::load(Model id)
+{
+    Entry &entry = entries[id];
+    if (entry.state == Loading || entry.state == Ready)
+        return;
+
+    const Paths paths = { resolve(entry.paths.model), resolve(entry.paths.config), resolve(entry.paths.classes) };
+    auto loaded = std::make_shared<std::shared_ptr<DetectionModel>>();
+    Task *task = TaskScheduler::instance().run(Task::Background, [paths, id, loaded](Task &) {
+        *loaded = read(paths, InputSizes[id]);
+    });
+
+    entry.state = Loading;
+    entry.error.clear();
+    connect(task, &Task::finished, this, [this, id, task, loaded]() {
+        Entry &entry = entries[id];
+        entry.error = task->errorString();
+        entry.model = *loaded;
+        entry.state = entry.model ? Ready : Failed;
+        if (entry.state == Failed)
+            qWarning() << "Could not load" << modelPath(id) << ":" << entry.error;
+        emit stateChanged(id);
+    });
+    emit stateChanged(id);
+}
+
+std::shared_ptr<DetectionModel> ModelRegistry::read(const Paths &paths, int inputSize)
+{
+    auto model = std::make_shared<DetectionModel>();
+    if (paths.config.isEmpty())
+        model->net = cv::dnn::readNetFromONNX(paths.model.toStdString());
+    else
+        model->net = cv::dnn::readNetFromDarknet(paths.config.toStdString(), paths.model.toStdString());
+    if (model->net.empty())
+        throw std::runtime_error("the network is empty");
+    model->net.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+    model->net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+    model->outputNames = model->net.getUnconnectedOutLayersNames();
+    model->inputSize = inputSize;
+
+    // Without a class list detections are labelled by id.
+    if (!paths.classes.isEmpty()) {
+        std::ifstream names(paths.classes.toStdString());
+        if (!names)
+            qWarning() << "Could not read class names from" << paths.classes;
+        for (std::string line; std::getline(names, line);)
+            model->classNames.push_back(line);
+    }
+
+    // Warm-up: the first pass allocates every layer's buffers. A network
+    // with a fixed input of another size rejects it; the buffers are then
+    // allocated by the first real pass instead, so the model is still used.
+    const int sizes[4] = { 1, 3, inputSize, inputSize };
+    try {
+        model->net.setInput(cv::Mat(4, sizes, CV_32F, cv::Scalar(0)));
+        std::vector<cv::Mat> outputs;
+        model->net.forward(outputs, model->outputNames);
+    } catch (const std::exception &error) {
+        qWarning() << "Warm-up of" << paths.model << "failed:" << error.what();
+    }
+    return model;
+}
@@ -0,0 +1,88 @@
+#ifndef MODELREGISTRY_H
+#define MODELREGISTRY_H
+
+#include <QObject>
+#include <QString>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/dnn.hpp>
+
+class QCommandLineParser;
+
+// A loaded detection network with everything read alongside it. Shared by
+// every dialog that runs it; cv::dnn::Net is not thread-safe, so forward
+// passes hold mutex.
+struct DetectionModel {
+    cv::dnn::Net net;
+    std::vector<cv::String> outputNames;
+    std::vector<std::string> classNames;   // empty when no class list is set
+    int inputSize = 0;                     // width and height of the input
+    std::mutex mutex;
+
+    // Name of class id, or the id itself if the list does not cover it.
+    std::string className(int id) const;
+};
+
+// App-wide detection networks, each loaded once and kept for the session.
+//
+// Paths come from the command line, then QSettings (models/...), then the
+// defaults in the model directory, which is the executable's directory
+// unless configured. Relative paths are taken against the model directory.
+// Loading runs in the background lane, at startup when preloading is on
+// (the default) or on the first model() call, and ends with one warm-up
+// forward pass on a blank input so the first real pass does not pay for
+// allocations and backend setup. All calls are made from the GUI thread.
+class ModelRegistry : public QObject {
+    Q_OBJECT
+public:
+    enum Model { Yolo = 0, Custom = 1, ModelCount };
+    enum State { Unloaded, Loading, Ready, Failed };
+
+    static ModelRegistry &instance();
+
+    // Command-line options overriding the settings; configure() is called
+    // once at startup, before anything is loaded.
+    static void addOptions(QCommandLineParser &parser);
+    void configure(const QCommandLineParser &parser);
+    // Starts loading every model, if preloading is on.
+    void preload();
+
+    // The loaded model, or null while it loads or if it failed. Starts
+    // loading it unless it is loaded or loading; a failed load is retried.
+    std::shared_ptr<DetectionModel> model(Model id);
+    State state(Model id) const { return entries[id].state; }
+    QString errorString(Model id) const { return entries[id].error; }
+    QString modelPath(Model id) const;
+
+signals:
+    void stateChanged(int id);
+
+private:
+    ModelRegistry() = default;
+
+    struct Paths {
+        QString model;     // Darknet weights or ONNX file
+        QString config;    // Darknet cfg, empty for ONNX
+        QString classes;
+    };
+    struct Entry {
+        Paths paths;
+        State state = Unloaded;
+        QString error;
+        std::shared_ptr<DetectionModel> model;
+    };
+
+    QString directory;
+    bool preloading = true;
+    Entry entries[ModelCount];
+
+    QString resolve(const QString &path) const;
+    void load(Model id);
+    static std::shared_ptr<DetectionModel> read(const Paths &paths, int inputSize);
+};
+
+#endif // MODELREGISTRY_H
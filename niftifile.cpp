@@ -0,0 +1,263 @@
+#include "niftifile.h"
+
+#include <QFileInfo>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+// On-disk layout of the NIfTI-1 header; every field is naturally aligned.
+struct Nifti1Header {
+    qint32 sizeof_hdr;
+    char data_type[10];
+    char db_name[18];
+    qint32 extents;
+    qint16 session_error;
+    char regular;
+    char dim_info;
+    qint16 dim[8];
+    float intent_p1;
+    float intent_p2;
+    float intent_p3;
+    qint16 intent_code;
+    qint16 datatype;
+    qint16 bitpix;
+    qint16 slice_start;
+    float pixdim[8];
+    float vox_offset;
+    float scl_slope;
+    float scl_inter;
+    qint16 slice_end;
+    char slice_code;
+    char xyzt_units;
+    float cal_max;
+    float cal_min;
+    float slice_duration;
+    float toffset;
+    qint32 glmax;
+    qint32 glmin;
+    char descrip[80];
+    char aux_file[24];
+    qint16 qform_code;
+    qint16 sform_code;
+    float quatern_b;
+    float quatern_c;
+    float quatern_d;
+    float qoffset_x;
+    float qoffset_y;
+    float qoffset_z;
+    float srow_x[4];
+    float srow_y[4];
+    float srow_z[4];
+    char intent_name[16];
+    char magic[4];
+};
+
+static_assert(sizeof(Nifti1Header) == 348, "NIfTI-1 header must be 348 bytes");
+
+const qint32 HeaderSize = 348;
+const qint32 SingleFileOffset = 352;   // header plus the 4-byte extension flag
+
+enum DataType {
+    DtUInt8 = 2, DtInt16 = 4, DtInt32 = 8, DtFloat32 = 16, DtFloat64 = 64,
+    DtInt8 = 256, DtUInt16 = 512, DtUInt32 = 768, DtInt64 = 1024, DtUInt64 = 1280
+};
+
+bool sampleTypeFromCode(int code, SampleType &type)
+{
+    switch (code) {
+    case DtUInt8: type = SampleType::UInt8; return true;
+    case DtInt8: type = SampleType::Int8; return true;
+    case DtUInt16: type = SampleType::UInt16; return true;
+    case DtInt16: type = SampleType::Int16; return true;
+    case DtUInt32: type = SampleType::UInt32; return true;
+    case DtInt32: type = SampleType::Int32; return true;
+    case DtUInt64: type = SampleType::UInt64; return true;
+    case DtInt64: type = SampleType::Int64; return true;
+    case DtFloat32: type = SampleType::Float32; return true;
+    case DtFloat64: type = SampleType::Float64; return true;
+    default: return false;
+    }
+}
+
+int codeFromSampleType(SampleType type)
+{
+    switch (type) {
+    case SampleType::UInt8: return DtUInt8;
+    case SampleType::UInt16: return DtUInt16;
+    case SampleType::Int16: return DtInt16;
+    default: return DtFloat32;
+    }
+}
+
+void swapHeader(Nifti1Header &h)
+{
+    h.sizeof_hdr = byteSwapped(h.sizeof_hdr);
+    for (qint16 &d : h.dim)
+        d = byteSwapped(d);
+    h.datatype = byteSwapped(h.datatype);
+    h.bitpix = byteSwapped(h.bitpix);
+    for (float &p : h.pixdim)
+        p = byteSwapped(p);
+    h.vox_offset = byteSwapped(h.vox_offset);
+    h.scl_slope = byteSwapped(h.scl_slope);
+    h.scl_inter = byteSwapped(h.scl_inter);
+}
+
+bool isCompressedName(const QString &path)
+{
+    return path.endsWith(".gz", Qt::CaseInsensitive);
+}
+
+// foo.hdr[.gz] -> foo.img[.gz], preferring whichever exists.
+QString imagePathFor(const QString &headerPath)
+{
+    QString base = headerPath;
+    if (isCompressedName(base))
+        base.chop(3);
+    base.chop(4);
+    for (const QString &candidate : { base + ".img", base + ".img.gz", base + ".IMG" }) {
+        if (QFileInfo::exists(candidate))
+            return candidate;
+    }
+    return base + ".img";
+}
+
+void setError(QString *error, const QString &message)
+{
+    if (error)
+        *error = message;
+}
+
+} // namespace
+
+
+Volume NiftiFile::read(const QString &path, QString *error, const ReadProgress &progress)
+{
+    InputStream headerStream;
+    if (!headerStream.open(path, 0, isCompressedName(path))) {
+        setError(error, headerStream.errorString());
+        return Volume();
+    }
+
+    Nifti1Header header;
+    if (headerStream.read(reinterpret_cast<char *>(&header), HeaderSize) != HeaderSize) {
+        setError(error, "Not a NIfTI file.");
+        return Volume();
+    }
+
+    // sizeof_hdr doubles as the byte-order mark.
+    const bool swap = header.sizeof_hdr != HeaderSize;
+    if (swap)
+        swapHeader(header);
+    const bool singleFile = std::memcmp(header.magic, "n+1", 4) == 0;
+    if (header.sizeof_hdr != HeaderSize || (!singleFile && std::memcmp(header.magic, "ni1", 4) != 0)) {
+        setError(error, "Not a NIfTI-1 file.");
+        return Volume();
+    }
+
+    SampleFormat format;
+    if (!sampleTypeFromCode(header.datatype, format.type)) {
+        setError(error, QString("Unsupported NIfTI datatype %1.").arg(header.datatype));
+        return Volume();
+    }
+    format.swapBytes = swap && sampleSize(format.type) > 1;
+    if (header.scl_slope != 0.0f && std::isfinite(header.scl_slope)) {
+        format.slope = header.scl_slope;
+        format.intercept = std::isfinite(header.scl_inter) ? header.scl_inter : 0.0;
+    }
+
+    const int dims = header.dim[0];
+    if (dims < 2 || dims > 7) {
+        setError(error, "Invalid NIfTI dimensions.");
+        return Volume();
+    }
+    const int width = header.dim[1];
+    const int height = header.dim[2];
+    const int depth = dims >= 3 ? header.dim[3] : 1;
+    const qint64 offset = qint64(header.vox_offset);
+    if (width <= 0 || height <= 0 || depth <= 0 || (singleFile && offset < HeaderSize)) {
+        setError(error, "Invalid NIfTI header.");
+        return Volume();
+    }
+
+    Volume volume = Volume::allocate(width, height, depth, volumeTypeFor(format));
+    auto spacing = [&](int axis) {
+        const float p = std::fabs(header.pixdim[axis]);
+        return std::isfinite(p) && p > 0.0f ? p : 1.0f;
+    };
+    volume.setSpacing(QVector3D(spacing(1), spacing(2), dims >= 3 ? spacing(3) : 1.0f));
+
+    if (singleFile) {
+        // Data follows the header and any extensions in the same stream.
+        if (!headerStream.skip(offset - HeaderSize)) {
+            setError(error, "NIfTI file is truncated.");
+            return Volume();
+        }
+        if (!readSamples(headerStream, format, volume, progress, error))
+            return Volume();
+        return volume;
+    }
+
+    const QString imagePath = imagePathFor(path);
+    InputStream imageStream;
+    if (!imageStream.open(imagePath, 0, isCompressedName(imagePath)) || !imageStream.skip(offset)) {
+        setError(error, imageStream.errorString());
+        return Volume();
+    }
+    if (!readSamples(imageStream, format, volume, progress, error))
+        return Volume();
+    return volume;
+}
+
+bool NiftiFile::write(const Volume &volume, const QString &path, QString *error)
+{
+    SampleType type;
+    if (volume.isEmpty() || !sampleTypeFor(volume.type(), type)) {
+        setError(error, "Only grayscale volumes can be written as NIfTI.");
+        return false;
+    }
+    if (std::max({ volume.width(), volume.height(), volume.depth() }) > 32767) {
+        setError(error, "NIfTI-1 dimensions are limited to 32767 voxels.");
+        return false;
+    }
+
+    Nifti1Header header;
+    std::memset(&header, 0, sizeof(header));
+    header.sizeof_hdr = HeaderSize;
+    header.regular = 'r';
+    header.dim[0] = 3;
+    header.dim[1] = qint16(volume.width());
+    header.dim[2] = qint16(volume.height());
+    header.dim[3] = qint16(volume.depth());
+    for (int i = 4; i < 8; ++i)
+        header.dim[i] = 1;
+    header.datatype = qint16(codeFromSampleType(type));
+    header.bitpix = qint16(sampleSize(type) * 8);
+    header.pixdim[0] = 1.0f;
+    header.pixdim[1] = volume.spacing().x();
+    header.pixdim[2] = volume.spacing().y();
+    header.pixdim[3] = volume.spacing().z();
+    header.vox_offset = float(SingleFileOffset);
+    header.xyzt_units = 2;   // millimetres
+    std::memcpy(header.magic, "n+1", 4);
+
+    char block[SingleFileOffset] = {};
+    std::memcpy(block, &header, sizeof(header));
+
+    OutputStream out;
+    if (!out.open(path) || (isCompressedName(path) && !out.startCompression())
+            || !out.write(block, SingleFileOffset)) {
+        setError(error, out.errorString());
+        return false;
+    }
+    if (!writeSamples(out, volume, error))
+        return false;
+    if (!out.commit()) {
+        setError(error, out.errorString());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef NIFTIFILE_H
+#define NIFTIFILE_H
+
+#include <QString>
+
+#include "datastream.h"
+#include "volume.h"
+
+// NIfTI-1 volumes: single files (.nii, .nii.gz) and header/image pairs
+// (.hdr/.img, optionally gzipped). Only the first 3D volume of a series is
+// read; scl_slope/scl_inter scaling produces a float volume. Spacing comes
+// from pixdim, orientation (qform/sform) is not applied.
+class NiftiFile {
+public:
+    static Volume read(const QString &path, QString *error = nullptr, const ReadProgress &progress = ReadProgress());
+    // Single-file output, gzip-compressed when the name ends in .gz.
+    static bool write(const Volume &volume, const QString &path, QString *error = nullptr);
+};
+
+#endif // NIFTIFILE_H
@@ -0,0 +1,234 @@
+#include "nrrdfile.h"
+
+#include <QFileInfo>
+#include <QDir>
+#include <QMap>
+#include <QRegularExpression>
+#include <QStringList>
+
+#include <cmath>
+
+namespace {
+
+bool parseSampleType(const QString &name, SampleType &type)
+{
+    static const QMap<QString, SampleType> types = {
+        { "uchar", SampleType::UInt8 }, { "unsigned char", SampleType::UInt8 },
+        { "uint8", SampleType::UInt8 }, { "uint8_t", SampleType::UInt8 },
+        { "signed char", SampleType::Int8 }, { "int8", SampleType::Int8 }, { "int8_t", SampleType::Int8 },
+        { "short", SampleType::Int16 }, { "short int", SampleType::Int16 }, { "signed short", SampleType::Int16 },
+        { "signed short int", SampleType::Int16 }, { "int16", SampleType::Int16 }, { "int16_t", SampleType::Int16 },
+        { "ushort", SampleType::UInt16 }, { "unsigned short", SampleType::UInt16 },
+        { "unsigned short int", SampleType::UInt16 }, { "uint16", SampleType::UInt16 }, { "uint16_t", SampleType::UInt16 },
+        { "int", SampleType::Int32 }, { "signed int", SampleType::Int32 }, { "int32", SampleType::Int32 },
+        { "int32_t", SampleType::Int32 },
+        { "uint", SampleType::UInt32 }, { "unsigned int", SampleType::UInt32 }, { "uint32", SampleType::UInt32 },
+        { "uint32_t", SampleType::UInt32 },
+        { "longlong", SampleType::Int64 }, { "long long", SampleType::Int64 }, { "long long int", SampleType::Int64 },
+        { "signed long long", SampleType::Int64 }, { "signed long long int", SampleType::Int64 },
+        { "int64", SampleType::Int64 }, { "int64_t", SampleType::Int64 },
+        { "ulonglong", SampleType::UInt64 }, { "unsigned long long", SampleType::UInt64 },
+        { "unsigned long long int", SampleType::UInt64 }, { "uint64", SampleType::UInt64 },
+        { "uint64_t", SampleType::UInt64 },
+        { "float", SampleType::Float32 }, { "double", SampleType::Float64 }
+    };
+    const auto it = types.find(name.toLower());
+    if (it == types.end())
+        return false;
+    type = it.value();
+    return true;
+}
+
+const char *sampleTypeName(SampleType type)
+{
+    switch (type) {
+    case SampleType::UInt8: return "uint8";
+    case SampleType::UInt16: return "uint16";
+    case SampleType::Int16: return "int16";
+    case SampleType::Float32: return "float";
+    default: return nullptr;
+    }
+}
+
+// "spacings: 1 1 2.5", or the vector lengths of "space directions: (1,0,0) (0,1,0) (0,0,2.5)".
+QVector3D parseSpacing(const QMap<QString, QString> &fields, int dimension)
+{
+    float spacing[3] = { 1.0f, 1.0f, 1.0f };
+
+    if (fields.contains("spacings")) {
+        const QStringList values = fields["spacings"].split(' ', Qt::SkipEmptyParts);
+        for (int a = 0; a < std::min(dimension, int(values.size())); ++a) {
+            bool ok = false;
+            const double v = values[a].toDouble(&ok);
+            if (ok && std::isfinite(v) && v != 0.0)
+                spacing[a] = float(std::fabs(v));
+        }
+    } else if (fields.contains("space directions")) {
+        const QRegularExpression vector("\\(([^)]*)\\)|none");
+        auto match = vector.globalMatch(fields["space directions"]);
+        for (int a = 0; a < dimension && match.hasNext(); ++a) {
+            const QRegularExpressionMatch m = match.next();
+            if (m.captured(0) == "none")
+                continue;
+            double length = 0.0;
+            for (const QString &component : m.captured(1).split(',', Qt::SkipEmptyParts))
+                length += std::pow(component.trimmed().toDouble(), 2.0);
+            if (length > 0.0)
+                spacing[a] = float(std::sqrt(length));
+        }
+    }
+    return QVector3D(spacing[0], spacing[1], spacing[2]);
+}
+
+void setError(QString *error, const QString &message)
+{
+    if (error)
+        *error = message;
+}
+
+} // namespace
+
+
+Volume NrrdFile::read(const QString &path, QString *error, const ReadProgress &progress)
+{
+    QFile header(path);
+    if (!header.open(QIODevice::ReadOnly)) {
+        setError(error, header.errorString());
+        return Volume();
+    }
+    if (!header.readLine().startsWith("NRRD000")) {
+        setError(error, "Not a NRRD file.");
+        return Volume();
+    }
+
+    // Field lines up to the first empty line; comments and key/value pairs are skipped.
+    QMap<QString, QString> fields;
+    while (!header.atEnd()) {
+        const QString line = QString::fromLatin1(header.readLine()).trimmed();
+        if (line.isEmpty())
+            break;
+        if (line.startsWith('#') || line.contains(":="))
+            continue;
+        const int colon = line.indexOf(": ");
+        if (colon > 0)
+            fields.insert(line.left(colon).toLower(), line.mid(colon + 2).trimmed());
+    }
+    const qint64 headerEnd = header.pos();
+    header.close();
+
+    SampleFormat format;
+    if (!parseSampleType(fields.value("type"), format.type)) {
+        setError(error, QString("Unsupported NRRD type \"%1\".").arg(fields.value("type")));
+        return Volume();
+    }
+
+    const int dimension = fields.value("dimension").toInt();
+    const QStringList sizeList = fields.value("sizes").split(' ', Qt::SkipEmptyParts);
+    if ((dimension != 2 && dimension != 3) || sizeList.size() != dimension) {
+        setError(error, "Only 2D and 3D scalar NRRD files are supported.");
+        return Volume();
+    }
+    const int width = sizeList[0].toInt();
+    const int height = sizeList[1].toInt();
+    const int depth = dimension == 3 ? sizeList[2].toInt() : 1;
+    if (width <= 0 || height <= 0 || depth <= 0) {
+        setError(error, "Invalid NRRD sizes.");
+        return Volume();
+    }
+
+    const QString encoding = fields.value("encoding").toLower();
+    const bool compressed = encoding == "gzip" || encoding == "gz";
+    if (!compressed && encoding != "raw") {
+        setError(error, QString("Unsupported NRRD encoding \"%1\".").arg(encoding));
+        return Volume();
+    }
+
+    const QString endian = fields.value("endian", isLittleEndianHost() ? "little" : "big").toLower();
+    format.swapBytes = sampleSize(format.type) > 1 && (endian == "little") != isLittleEndianHost();
+
+    // Attached data follows the header; detached data is relative to the header's directory.
+    QString dataPath = path;
+    qint64 offset = headerEnd;
+    QString dataFile = fields.value("data file", fields.value("datafile"));
+    if (!dataFile.isEmpty()) {
+        if (dataFile.startsWith("LIST") || dataFile.contains('%')) {
+            setError(error, "Multi-file NRRD data is not supported.");
+            return Volume();
+        }
+        dataPath = QFileInfo(dataFile).isAbsolute() ? dataFile : QFileInfo(path).dir().filePath(dataFile);
+        offset = 0;
+    }
+
+    const int lineSkip = fields.value("line skip", fields.value("lineskip", "0")).toInt();
+    const qint64 byteSkip = fields.value("byte skip", fields.value("byteskip", "0")).toLongLong();
+    const qint64 dataBytes = qint64(width) * height * depth * sampleSize(format.type);
+
+    if (lineSkip > 0) {
+        QFile data(dataPath);
+        if (!data.open(QIODevice::ReadOnly) || !data.seek(offset)) {
+            setError(error, data.errorString());
+            return Volume();
+        }
+        for (int i = 0; i < lineSkip; ++i)
+            data.readLine();
+        offset = data.pos();
+    }
+    if (!compressed) {
+        // "byte skip: -1" means the data ends the file.
+        offset = byteSkip < 0 ? QFileInfo(dataPath).size() - dataBytes : offset + byteSkip;
+    }
+
+    InputStream in;
+    if (!in.open(dataPath, offset, compressed) || (compressed && byteSkip > 0 && !in.skip(byteSkip))) {
+        setError(error, in.errorString());
+        return Volume();
+    }
+
+    Volume volume = Volume::allocate(width, height, depth, volumeTypeFor(format));
+    volume.setSpacing(parseSpacing(fields, dimension));
+    if (!readSamples(in, format, volume, progress, error))
+        return Volume();
+    return volume;
+}
+
+bool NrrdFile::write(const Volume &volume, const QString &path, bool compress, QString *error)
+{
+    SampleType type;
+    if (volume.isEmpty() || !sampleTypeFor(volume.type(), type)) {
+        setError(error, "Only grayscale volumes can be written as NRRD.");
+        return false;
+    }
+
+    const QVector3D spacing = volume.spacing();
+    const QString header = QString(
+        "NRRD0004\n"
+        "# Complete NRRD file format specification at:\n"
+        "# http://teem.sourceforge.net/nrrd/format.html\n"
+        "type: %1\n"
+        "dimension: 3\n"
+        "sizes: %2 %3 %4\n"
+        "spacings: %5 %6 %7\n"
+        "endian: %8\n"
+        "encoding: %9\n"
+        "\n")
+        .arg(sampleTypeName(type))
+        .arg(volume.width()).arg(volume.height()).arg(volume.depth())
+        .arg(spacing.x()).arg(spacing.y()).arg(spacing.z())
+        .arg(isLittleEndianHost() ? "little" : "big")
+        .arg(compress ? "gzip" : "raw");
+
+    OutputStream out;
+    const QByteArray headerBytes = header.toLatin1();
+    if (!out.open(path) || !out.write(headerBytes.constData(), headerBytes.size())
+            || (compress && !out.startCompression())) {
+        setError(error, out.errorString());
+        return false;
+    }
+    if (!writeSamples(out, volume, error))
+        return false;
+    if (!out.commit()) {
+        setError(error, out.errorString());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,19 @@
+#ifndef NRRDFILE_H
+#define NRRDFILE_H
+
+#include <QString>
+
+#include "datastream.h"
+#include "volume.h"
+
+// NRRD volumes (.nrrd with attached data, .nhdr with a detached data file).
+// Reads 2D and 3D scalar data in raw or gzip encoding and either byte order;
+// spacing comes from "spacings" or the lengths of "space directions".
+// Writes attached .nrrd files, gzip-encoded when compress is set.
+class NrrdFile {
+public:
+    static Volume read(const QString &path, QString *error = nullptr, const ReadProgress &progress = ReadProgress());
+    static bool write(const Volume &volume, const QString &path, bool compress, QString *error = nullptr);
+};
+
+#endif // NRRDFILE_H
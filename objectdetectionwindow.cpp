@@ -4,13 +4,25 @@
 #include <QLabel>
 #include <QDebug>
 #include <QMessageBox>
-
-#include <fstream>
+#include <QProgressBar>
+#include <QSpinBox>
+#include <QComboBox>
+#include <QCheckBox>
+#include <QHBoxLayout>
 
 #include <opencv2/dnn.hpp>
 
-ObjectDetectionWindow::ObjectDetectionWindow(const QList<cv::Mat> &images, QWidget *parent)
-    : QDialog(parent), inputImages(images) {
+#include "batchinference.h"
+#include "detectiondecoder.h"
+#include "detectionpipeline.h"
+#include "sliceplan.h"
+#include "modelregistry.h"
+#include "taskscheduler.h"
+#include "tileplan.h"
+#include "windowlevel.h"
+
+ObjectDetectionWindow::ObjectDetectionWindow(const Volume &volume, QWidget *parent)
+    : QDialog(parent), inputVolume(volume) {
     QVBoxLayout *layout = new QVBoxLayout(this);
 
     setWindowTitle("Object Detection");
@@ -18,106 +30,219 @@ ObjectDetectionWindow::ObjectDetectionWindow(const QList<cv::Mat> &images, QWidg
 
     imageLabel = new QLabel("Click Detect to run YOLO object detection.");
     detectButton = new QPushButton("Run Detection");
+    progressBar = new QProgressBar;
+    progressBar->setRange(0, 1000);
+    progressBar->setVisible(false);
+    cancelButton = new QPushButton("Cancel");
+    cancelButton->setVisible(false);
+    batchSpin = new QSpinBox;
+    batchSpin->setRange(0, BatchInference::MaxBatch);
+    batchSpin->setSpecialValueText("Auto");
+    batchSpin->setValue(0);
+
+    preprocessSpin = new QSpinBox;
+    preprocessSpin->setRange(1, DetectionPipeline::MaxThreads);
+    preprocessSpin->setValue(DetectionPipeline::preprocessThreadsSetting());
+    postprocessSpin = new QSpinBox;
+    postprocessSpin->setRange(1, DetectionPipeline::MaxThreads);
+    postprocessSpin->setValue(DetectionPipeline::postprocessThreadsSetting());
+
+    // Network runs on keyframes only, the other slices are filled in.
+    skipCombo = new QComboBox;
+    skipCombo->addItem("Every slice", 1.0);
+    skipCombo->addItem("Skip similar slices (about 2x faster)", 2.0);
+    skipCombo->addItem("Skip similar slices (about 4x faster)", 4.0);
+    skipCombo->addItem("Skip similar slices (about 8x faster)", 8.0);
+    // Large slices lose small objects when squashed to the network input.
+    tileCheck = new QCheckBox("Tile high-resolution slices");
+
+    QHBoxLayout *batchLayout = new QHBoxLayout;
+    batchLayout->addWidget(new QLabel("Batch size:"));
+    batchLayout->addWidget(batchSpin, 1);
+    QHBoxLayout *skipLayout = new QHBoxLayout;
+    skipLayout->addWidget(new QLabel("Slices:"));
+    skipLayout->addWidget(skipCombo, 1);
+    QHBoxLayout *threadLayout = new QHBoxLayout;
+    threadLayout->addWidget(new QLabel("Preprocess threads:"));
+    threadLayout->addWidget(preprocessSpin, 1);
+    threadLayout->addWidget(new QLabel("Postprocess threads:"));
+    threadLayout->addWidget(postprocessSpin, 1);
 
     layout->addWidget(imageLabel);
+    layout->addLayout(skipLayout);
+    layout->addWidget(tileCheck);
+    layout->addLayout(batchLayout);
+    layout->addLayout(threadLayout);
     layout->addWidget(detectButton);
+    layout->addWidget(progressBar);
+    layout->addWidget(cancelButton);
 
     connect(detectButton, &QPushButton::clicked, this, &ObjectDetectionWindow::runDetection);
-    loadYoloModel();
-}
-
-void ObjectDetectionWindow::loadYoloModel() {
-    // Replace with your YOLO paths
-    std::string modelPath = "C:/Users/Me/Documents/xip_app/yolov3.weights";
-    std::string configPath = "C:/Users/Me/Documents/xip_app/yolov3.cfg";
-    yoloNet = cv::dnn::readNetFromDarknet(configPath, modelPath);
-    yoloNet.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
-    yoloNet.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+    connect(cancelButton, &QPushButton::clicked, this, [this]() {
+        if (task)
+            task->cancel();
+    });
+
+    // The network is shared and loaded once per session; model() starts
+    // loading it if startup did not.
+    connect(&ModelRegistry::instance(), &ModelRegistry::stateChanged, this, [this](int id) {
+        if (id == ModelRegistry::Yolo)
+            updateModelState();
+    });
+    ModelRegistry::instance().model(ModelRegistry::Yolo);
+    updateModelState();
 }
 
-cv::Mat ObjectDetectionWindow::detectObjects(const cv::Mat &image) {
-
-    cv::Mat colorImage;
-    if (image.channels() == 1) {
-        cv::cvtColor(image, colorImage, cv::COLOR_GRAY2BGR);
-    } else {
-        colorImage = image;
-    }
-
-    cv::Mat blob;
-    cv::dnn::blobFromImage(colorImage, blob,  1.0 / 255.0, cv::Size(416, 416), cv::Scalar(), true, false);
-    yoloNet.setInput(blob);
-
-    std::vector<cv::Mat> outputs;
-    yoloNet.forward(outputs, yoloNet.getUnconnectedOutLayersNames());
-
-    // Load class names (optional)
-    std::vector<std::string> classNames;
-    std::ifstream ifs("C:/Users/Me/Documents/xip_app/coco.names");  // Place coco.names in working dir
-    std::string line;
-    while (std::getline(ifs, line)) classNames.push_back(line);
-
-    std::vector<int> classIds;
-    std::vector<float> confidences;
-    std::vector<cv::Rect> boxes;
-
-    float confThreshold = 0.5;
-    float nmsThreshold = 0.4;
-
-    for (auto &output : outputs) {
-        for (int i = 0; i < output.rows; ++i) {
-            float *data = output.ptr<float>(i);
-            float confidence = data[4];
-
-            if (confidence > confThreshold) {
-                cv::Mat scores = output.row(i).colRange(5, output.cols);
-                cv::Point classIdPoint;
-                double maxClassScore;
-                minMaxLoc(scores, nullptr, &maxClassScore, nullptr, &classIdPoint);
-
-                if (maxClassScore > confThreshold) {
-                    int centerX = static_cast<int>(data[0] * image.cols);
-                    int centerY = static_cast<int>(data[1] * image.rows);
-                    int width = static_cast<int>(data[2] * image.cols);
-                    int height = static_cast<int>(data[3] * image.rows);
-                    int left = centerX - width / 2;
-                    int top = centerY - height / 2;
-
-                    boxes.emplace_back(left, top, width, height);
-                    classIds.push_back(classIdPoint.x);
-                    confidences.push_back(static_cast<float>(maxClassScore));
-                }
-            }
-        }
+ObjectDetectionWindow::~ObjectDetectionWindow() {
+    // The job writes into this dialog's volumes, so it has to be gone first.
+    if (task) {
+        task->cancel();
+        task->wait();
     }
+}
 
-    std::vector<int> indices;
-    cv::dnn::NMSBoxes(boxes, confidences, confThreshold, nmsThreshold, indices);
-
-    cv::Mat result = image.clone();
-    for (int idx : indices) {
-        cv::Rect box = boxes[idx];
-        int classId = classIds[idx];
-        std::string label = classNames.empty() ? std::to_string(classId) : classNames[classId];
-        cv::rectangle(result, box, cv::Scalar(0, 255, 0), 2);
-        cv::putText(result, label, cv::Point(box.x, box.y - 5),
-                    cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 255, 0), 1);
-    }
+void ObjectDetectionWindow::updateModelState() {
+    const ModelRegistry &registry = ModelRegistry::instance();
+    const ModelRegistry::State state = registry.state(ModelRegistry::Yolo);
+    if (state == ModelRegistry::Ready)
+        imageLabel->setText("Click Detect to run YOLO object detection.");
+    else if (state == ModelRegistry::Failed)
+        imageLabel->setText(QString("Could not load the YOLO model from %1: %2")
+                                .arg(registry.modelPath(ModelRegistry::Yolo), registry.errorString(ModelRegistry::Yolo)));
+    else
+        imageLabel->setText("Loading the YOLO model...");
+    detectButton->setEnabled(!task && state == ModelRegistry::Ready);
+}
 
-    return result;
+std::vector<Detection> ObjectDetectionWindow::decodeDetections(const cv::Size &imageSize,
+                                                               const std::vector<cv::Mat> &outputs) {
+    const float confThreshold = 0.5f;
+    const float nmsThreshold = 0.4f;
+
+    // Region outputs hold boxes normalised to the image.
+    std::vector<Detection> detections;
+    for (const cv::Mat &output : outputs)
+        DetectionDecoder::decode(output, DetectionDecoder::Darknet, confThreshold,
+                                 cv::Size2f(float(imageSize.width), float(imageSize.height)), detections);
+    DetectionDecoder::suppress(detections, nmsThreshold);
+    return detections;
 }
 
 
 void ObjectDetectionWindow::runDetection() {
-    outputImages.clear();
+    const std::shared_ptr<DetectionModel> model = ModelRegistry::instance().model(ModelRegistry::Yolo);
+    if (task || !model)
+        return;
+
+    // Boxes are kept per slice and shown over the views; the volume stays as it is.
+    found.assign(inputVolume.depth(), std::vector<Detection>());
+    results = DetectionResults();
+
+    // One network can only run one forward pass at a time, so slices go
+    // through it in batches, packed into one blob per pass; the DNN module
+    // spreads each pass over the cores itself. Converting the next batches
+    // and decoding the previous ones overlap with each pass.
+    const double speedup = skipCombo->currentData().toDouble();
+    const bool tiled = tileCheck->isChecked();
+    const int batchSize = batchSpin->value();
+    const int preprocessThreads = preprocessSpin->value();
+    const int postprocessThreads = postprocessSpin->value();
+    DetectionPipeline::saveThreadSettings(preprocessThreads, postprocessThreads);
+    task = TaskScheduler::instance().run(Task::Compute, [this, model, speedup, tiled, batchSize,
+                                                         preprocessThreads, postprocessThreads](Task &job) {
+        // The network expects 8-bit input; deeper volumes are mapped over their full range.
+        const WindowLevel display = WindowLevel::fullRange(inputVolume);
+        BatchInference batches(batchSize);
+        DetectionPipeline pipeline(preprocessThreads, postprocessThreads);
+        const cv::Size inputSize(model->inputSize, model->inputSize);
+
+        // Slices to run are planned first: every slice, or keyframes with
+        // empty slices left out and the rest filled in afterwards. Each one
+        // then goes in whole, squashed to the network input, or as
+        // overlapping input-sized tiles at native resolution.
+        const SlicePlan plan = SlicePlan::adaptive(inputVolume, speedup, job.priority(), job.cancelFlag());
+        const TilePlan tiles = tiled ? TilePlan::tiled(inputVolume, plan.keyframes(), model->inputSize, job.priority(),
+                                                       job.cancelFlag())
+                                     : TilePlan::wholeSlices(inputVolume, plan.keyframes());
+        std::vector<int> pending = tiles.tilesPerSlice(inputVolume.depth());
+        std::mutex foundMutex;   // tiles of one slice are decoded on any thread
+
+        auto preprocess = [&](DetectionPipeline::Batch &batch) {
+            batch.images.resize(batch.count);
+            for (int k = 0; k < batch.count; ++k) {
+                const TilePlan::Tile &tile = tiles.tile(batch.items[k]);
+                const cv::Mat slice = display.apply(inputVolume.axial(tile.slice)(tile.rect));
+                if (slice.channels() == 1)
+                    cv::cvtColor(slice, batch.images[k], cv::COLOR_GRAY2BGR);
+                else
+                    slice.copyTo(batch.images[k]);
+            }
+            cv::dnn::blobFromImages(batch.images, batch.input, 1.0 / 255.0, inputSize, cv::Scalar(), true, false);
+        };
+        auto infer = [&](DetectionPipeline::Batch &batch) {
+            // Other dialogs may be running the same network.
+            std::lock_guard<std::mutex> lock(model->mutex);
+            batch.outputs = batches.forward(model->net, batch.input, model->outputNames);
+        };
+        auto postprocess = [&](DetectionPipeline::Batch &batch) {
+            for (int k = 0; k < batch.count; ++k) {
+                const TilePlan::Tile &tile = tiles.tile(batch.items[k]);
+                std::vector<Detection> detections = decodeDetections(batch.images[k].size(), batch.outputs[k]);
+                for (Detection &detection : detections) {
+                    detection.box += tile.rect.tl();
+                    detection.tile = batch.items[k];
+                }
 
-    for (const auto &img : inputImages) {
-        if (img.empty())
-            continue;
-        outputImages.append(detectObjects(img));
-    }
+                std::lock_guard<std::mutex> lock(foundMutex);
+                std::vector<Detection> &slice = found[tile.slice];
+                slice.insert(slice.end(), detections.begin(), detections.end());
+                if (--pending[tile.slice] == 0)
+                    inputVolume.release(tile.slice, tile.slice + 1);
+            }
+        };
+        if (pipeline.run(tiles.items(), batches, preprocess, infer, postprocess, job.cancelFlag(),
+                         [&job](int done, int total) { job.setProgress(done, total); })) {
+            // Objects on tile borders were found by several tiles.
+            if (tiles.isTiled()) {
+                for (int z : plan.keyframes())
+                    tiles.merge(found[z]);
+            }
+            plan.propagate(found);
+            results = DetectionResults(inputVolume.width(), inputVolume.height(), found, model->classNames, plan.sources());
+        }
+        found.clear();
+    });
+
+    detectButton->setEnabled(false);
+    skipCombo->setEnabled(false);
+    tileCheck->setEnabled(false);
+    batchSpin->setEnabled(false);
+    preprocessSpin->setEnabled(false);
+    postprocessSpin->setEnabled(false);
+    progressBar->setValue(0);
+    progressBar->setVisible(true);
+    cancelButton->setVisible(true);
+    connect(task, &Task::progressChanged, progressBar, &QProgressBar::setValue);
+    connect(task, &Task::finished, this, [this](bool cancelled) {
+        const QString error = task->errorString();
+        task = nullptr;
+        detectButton->setEnabled(true);
+        skipCombo->setEnabled(true);
+        tileCheck->setEnabled(true);
+        batchSpin->setEnabled(true);
+        preprocessSpin->setEnabled(true);
+        postprocessSpin->setEnabled(true);
+        progressBar->setVisible(false);
+        cancelButton->setVisible(false);
+        if (!error.isEmpty()) {
+            QMessageBox::warning(this, "Error", QString("Object detection failed: %1").arg(error));
+            return;
+        }
+        if (cancelled)
+            return;
 
-    emit detectionCompleted(outputImages);
-    QMessageBox::information(this, "Done", "Object detection completed.");
-    close();
+        emit detectionCompleted(results);
+        QMessageBox::information(this, "Done", QString("Found %1 objects in %2 slices.").arg(results.count()).arg(results.depth()));
+        close();
+    });
 }
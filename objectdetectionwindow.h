@@ -3,32 +3,51 @@
 
 #include <QDialog>
 #include <QList>
+#include <QPointer>
 #include <opencv2/opencv.hpp>
 
+#include "detectionresults.h"
+#include "volume.h"
+
+class QCheckBox;
+class QComboBox;
 class QLabel;
+class QProgressBar;
 class QPushButton;
+class QSpinBox;
+class Task;
 
 class ObjectDetectionWindow : public QDialog {
     Q_OBJECT
 public:
-    explicit ObjectDetectionWindow(const QList<cv::Mat> &images, QWidget *parent = nullptr);
+    explicit ObjectDetectionWindow(const Volume &volume, QWidget *parent = nullptr);
+    ~ObjectDetectionWindow();
 
 signals:
-    void detectionCompleted(QList<cv::Mat> detectedImages);
+    void detectionCompleted(const DetectionResults &results);
 
 private slots:
     void runDetection();
+    void updateModelState();
 
 private:
-    QList<cv::Mat> inputImages;
-    QList<cv::Mat> outputImages;
+    Volume inputVolume;
+    std::vector<std::vector<Detection>> found;   // per slice, filled by the job
+    DetectionResults results;
 
     QLabel *imageLabel;
     QPushButton *detectButton;
-
-    cv::dnn::Net yoloNet;
-    void loadYoloModel();
-    cv::Mat detectObjects(const cv::Mat &image);
+    QPushButton *cancelButton;
+    QComboBox *skipCombo;      // speedup target of slice skipping
+    QCheckBox *tileCheck;      // run large slices as tiles at native resolution
+    QSpinBox *batchSpin;       // inputs per forward pass, 0 tunes it
+    QSpinBox *preprocessSpin;  // pipeline threads per stage
+    QSpinBox *postprocessSpin;
+    QProgressBar *progressBar;
+    QPointer<Task> task;   // detection running on the scheduler
+
+    // Detections decoded from one slice's (or tile's) outputs, in its pixels.
+    static std::vector<Detection> decodeDetections(const cv::Size &imageSize, const std::vector<cv::Mat> &outputs);
 };
 
 #endif // OBJECTDETECTIONWINDOW_H
@@ -0,0 +1,260 @@
+#include "pagedstorage.h"
+
+#include <QDir>
+#include <QStandardPaths>
+#include <QTemporaryFile>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(Q_OS_LINUX) && !defined(MADV_PAGEOUT)
+#define MADV_PAGEOUT 21   // Linux 5.4; older headers lack it, the running kernel may not
+#endif
+
+namespace {
+
+enum Advice { WillNeed, Evict };
+
+void setError(QString *error, const QString &message)
+{
+    if (error)
+        *error = message;
+}
+
+#ifdef Q_OS_UNIX
+// Writes dirty pages back (or to swap for private copies) before dropping
+// them. False if the kernel cannot, after which it is not asked again.
+bool pageOut(void *address, size_t length)
+{
+#ifdef MADV_PAGEOUT
+    static std::atomic<bool> supported(true);
+    if (supported.load()) {
+        if (madvise(address, length, MADV_PAGEOUT) == 0)
+            return true;
+        if (errno == EINVAL)
+            supported.store(false);
+    }
+#else
+    Q_UNUSED(address);
+    Q_UNUSED(length);
+#endif
+    return false;
+}
+#endif
+
+} // namespace
+
+
+std::mutex PagedStorage::mutex;
+std::list<PagedStorage::Slot> PagedStorage::lru;
+qint64 PagedStorage::totalResident = 0;
+std::atomic<qint64> PagedStorage::budgetBytes(qint64(2048) * 1024 * 1024);
+
+qint64 PagedStorage::budget()
+{
+    return budgetBytes.load();
+}
+
+void PagedStorage::setBudget(qint64 bytes)
+{
+    budgetBytes.store(std::max<qint64>(bytes, 64 * 1024 * 1024));
+}
+
+PagedStorage::~PagedStorage()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::list<Slot>::iterator &slot : position) {
+            if (slot != lru.end())
+                lru.erase(slot);
+        }
+        totalResident -= resident;
+    }
+    // Closing a QFile leaves its mappings in place until the QFile itself is
+    // destroyed, so unmap explicitly; a scratch file is removed when the
+    // QTemporaryFile goes with the members.
+    if (file && mapping)
+        file->unmap(mapping);
+}
+
+std::shared_ptr<PagedStorage> PagedStorage::createScratch(qint64 bytes, size_t sliceBytes, int depth,
+                                                          QString *error)
+{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (dir.isEmpty() || !QDir().mkpath(dir))
+        dir = QDir::tempPath();
+
+    std::unique_ptr<QTemporaryFile> scratch(new QTemporaryFile(dir + "/scratch-XXXXXX.raw"));
+    // The file is sparse until written, so this does not touch the disk.
+    if (!scratch->open() || !scratch->resize(bytes)) {
+        setError(error, scratch->errorString());
+        return nullptr;
+    }
+    uchar *base = scratch->map(0, bytes);
+    if (!base) {
+        setError(error, scratch->errorString());
+        return nullptr;
+    }
+
+    std::shared_ptr<PagedStorage> storage(new PagedStorage);
+    storage->file = std::move(scratch);
+    storage->mapping = base;
+    storage->voxels = base;
+    storage->bytesPerSlice = sliceBytes;
+    storage->depth = depth;
+    storage->shared = true;
+    storage->position.assign(depth, lru.end());
+    return storage;
+}
+
+std::shared_ptr<PagedStorage> PagedStorage::mapFile(std::unique_ptr<QFile> file, qint64 offset,
+                                                    size_t sliceBytes, int depth, QString *error)
+{
+    const qint64 bytes = offset + qint64(sliceBytes) * depth;
+    uchar *base = file->map(0, bytes, QFileDevice::MapPrivateOption);
+    if (!base) {
+        setError(error, file->errorString());
+        return nullptr;
+    }
+
+    std::shared_ptr<PagedStorage> storage(new PagedStorage);
+    storage->file = std::move(file);
+    storage->mapping = base;
+    storage->voxels = base + offset;
+    storage->bytesPerSlice = sliceBytes;
+    storage->depth = depth;
+    storage->shared = false;
+    storage->position.assign(depth, lru.end());
+    storage->written.assign(depth, 0);
+    return storage;
+}
+
+void PagedStorage::touch(int begin, int end)
+{
+    begin = std::max(begin, 0);
+    end = std::min(end, depth);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int z = begin; z < end; ++z) {
+        if (position[z] != lru.end()) {
+            lru.splice(lru.begin(), lru, position[z]);
+        } else {
+            lru.push_front({ this, z });
+            position[z] = lru.begin();
+            resident += qint64(bytesPerSlice);
+            totalResident += qint64(bytesPerSlice);
+        }
+    }
+
+    // The slices just touched are at the front and are never evicted here;
+    // the others may belong to any paged volume.
+    const qint64 limit = budget();
+    while (totalResident > limit && qint64(lru.size()) > end - begin) {
+        const Slot victim = lru.back();
+        victim.storage->evict(victim.z);
+    }
+}
+
+void PagedStorage::prefetch(int begin, int end)
+{
+    begin = std::max(begin, 0);
+    end = std::min(end, depth);
+    if (begin >= end)
+        return;
+    advise(begin, end, WillNeed);
+    touch(begin, end);
+}
+
+void PagedStorage::release(int begin, int end)
+{
+    begin = std::max(begin, 0);
+    end = std::min(end, depth);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int z = begin; z < end; ++z) {
+        if (position[z] != lru.end())
+            evict(z);
+        else
+            advise(z, z + 1, Evict);   // may have been paged in without touch()
+    }
+}
+
+void PagedStorage::markWritten(int begin, int end)
+{
+    if (shared)
+        return;
+    begin = std::max(begin, 0);
+    end = std::min(end, depth);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::fill(written.begin() + std::min(begin, end), written.begin() + end, 1);
+}
+
+qint64 PagedStorage::residentBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return resident;
+}
+
+qint64 PagedStorage::totalResidentBytes()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return totalResident;
+}
+
+// Called with the mutex held.
+void PagedStorage::evict(int z)
+{
+    lru.erase(position[z]);
+    position[z] = lru.end();
+    resident -= qint64(bytesPerSlice);
+    totalResident -= qint64(bytesPerSlice);
+    advise(z, z + 1, Evict);
+}
+
+// Evictions read written, so they are advised with the mutex held.
+void PagedStorage::advise(int begin, int end, int advice) const
+{
+#ifdef Q_OS_UNIX
+    // madvise() wants page-aligned ranges; only whole pages inside the
+    // slices are evicted, while read-ahead may round outwards.
+    static const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    const uintptr_t first = uintptr_t(voxels + size_t(begin) * bytesPerSlice);
+    const uintptr_t last = uintptr_t(voxels + size_t(end) * bytesPerSlice);
+    uintptr_t from, to;
+    if (advice == WillNeed) {
+        from = first / page * page;
+        to = (last + page - 1) / page * page;
+    } else {
+        from = (first + page - 1) / page * page;
+        to = last / page * page;
+    }
+    if (from >= to)
+        return;
+
+    void *address = reinterpret_cast<void *>(from);
+    const size_t length = to - from;
+    if (advice == WillNeed) {
+        madvise(address, length, MADV_WILLNEED);
+        return;
+    }
+    if (pageOut(address, length))
+        return;
+    // Dropping a shared mapping leaves dirty pages in the page cache for
+    // write-back. Private copies would be lost, so only slices that were
+    // never written are dropped, to be read from the file again.
+    if (shared || std::none_of(written.begin() + begin, written.begin() + end, [](char w) { return w != 0; }))
+        madvise(address, length, MADV_DONTNEED);
+#else
+    // Elsewhere the OS pager alone decides what stays resident.
+    Q_UNUSED(begin);
+    Q_UNUSED(end);
+    Q_UNUSED(advice);
+#endif
+}
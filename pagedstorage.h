@@ -0,0 +1,83 @@
+#ifndef PAGEDSTORAGE_H
+#define PAGEDSTORAGE_H
+
+#include <QFile>
+#include <QString>
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// File-backed voxel storage with a bounded resident set.
+//
+// The voxels live in a memory mapping, so the OS pages them in on first
+// access. On top of that, the slices of all paged storage are tracked in one
+// LRU order: touching a slice may evict the least recently used ones, of any
+// volume, until the resident size of all of them fits the memory budget, and
+// slices can be prefetched (read-ahead) or released once a slice-streamed
+// operation is done with them.
+//
+// Scratch storage is a shared mapping of a temporary file, so evicted slices
+// are written back and nothing is lost. Opened files are mapped privately;
+// their modified pages are paged out rather than dropped. Kernels without
+// MADV_PAGEOUT only get the unwritten slices of a private mapping dropped,
+// which fault back in from the file; written ones are left to swap.
+class PagedStorage {
+public:
+    ~PagedStorage();
+
+    // Temporary file of the given size, removed when the storage goes away.
+    static std::shared_ptr<PagedStorage> createScratch(qint64 bytes, size_t sliceBytes, int depth,
+                                                       QString *error = nullptr);
+    // Copy-on-write mapping of an open file; voxels start at offset.
+    static std::shared_ptr<PagedStorage> mapFile(std::unique_ptr<QFile> file, qint64 offset,
+                                                 size_t sliceBytes, int depth, QString *error = nullptr);
+
+    uchar *data() const { return voxels; }
+    size_t sliceBytes() const { return bytesPerSlice; }
+
+    // Slice ranges are [begin, end) and are clamped to the storage.
+    void touch(int begin, int end);
+    void prefetch(int begin, int end);
+    void release(int begin, int end);
+    // Slices written in place, see Volume::beginModify().
+    void markWritten(int begin, int end);
+    qint64 residentBytes() const;          // of this storage
+    static qint64 totalResidentBytes();    // of all paged storage
+
+    // Resident-set limit of all paged volumes together, and the size above
+    // which new volumes are allocated as scratch storage instead of on the heap.
+    static qint64 budget();
+    static void setBudget(qint64 bytes);
+
+private:
+    PagedStorage() = default;
+
+    std::unique_ptr<QFile> file;   // owns the mapping
+    uchar *mapping = nullptr;      // start of the mapping, file header included
+    uchar *voxels = nullptr;
+    size_t bytesPerSlice = 0;
+    int depth = 0;
+    bool shared = false;
+
+    struct Slot {
+        PagedStorage *storage;
+        int z;
+    };
+    std::vector<std::list<Slot>::iterator> position;  // lru.end() when not resident
+    std::vector<char> written;                        // slices of a private mapping written to
+    qint64 resident = 0;
+
+    // Shared by all paged storage; the mutex guards them and the three above.
+    static std::mutex mutex;
+    static std::list<Slot> lru;                       // most recently used first
+    static qint64 totalResident;
+    static std::atomic<qint64> budgetBytes;
+
+    void evict(int z);
+    void advise(int begin, int end, int advice) const;
+};
+
+#endif // PAGEDSTORAGE_H
@@ -0,0 +1,408 @@
+#include "raycaster.h"
+#include "taskscheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+namespace {
+
+const QRgb Background = qRgb(128, 128, 128);   // matches the Qt3D clear colour
+const int TileSize = 16;
+const float OpaqueAlpha = 0.99f;
+const float Pi = 3.14159265f;
+
+struct Vec3 {
+    float x, y, z;
+};
+
+inline Vec3 operator+(const Vec3 &a, const Vec3 &b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+inline Vec3 operator*(const Vec3 &a, float s) { return { a.x * s, a.y * s, a.z * s }; }
+inline float dot(const Vec3 &a, const Vec3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+// Trilinear sampling at a voxel-space position, one instance per voxel type.
+template <typename T>
+struct Sampler {
+    const uchar *data;
+    size_t sliceStride;
+    size_t rowStride;
+    int dims[3];
+
+    float operator()(const Vec3 &p) const
+    {
+        const float x = std::min(std::max(p.x, 0.0f), float(dims[0] - 1));
+        const float y = std::min(std::max(p.y, 0.0f), float(dims[1] - 1));
+        const float z = std::min(std::max(p.z, 0.0f), float(dims[2] - 1));
+        const int x0 = int(x), y0 = int(y), z0 = int(z);
+        const int x1 = std::min(x0 + 1, dims[0] - 1);
+        const int y1 = std::min(y0 + 1, dims[1] - 1);
+        const int z1 = std::min(z0 + 1, dims[2] - 1);
+        const float fx = x - x0, fy = y - y0, fz = z - z0;
+
+        const T *r00 = reinterpret_cast<const T *>(data + z0 * sliceStride + y0 * rowStride);
+        const T *r01 = reinterpret_cast<const T *>(data + z0 * sliceStride + y1 * rowStride);
+        const T *r10 = reinterpret_cast<const T *>(data + z1 * sliceStride + y0 * rowStride);
+        const T *r11 = reinterpret_cast<const T *>(data + z1 * sliceStride + y1 * rowStride);
+
+        const float c00 = float(r00[x0]) + fx * (float(r00[x1]) - float(r00[x0]));
+        const float c01 = float(r01[x0]) + fx * (float(r01[x1]) - float(r01[x0]));
+        const float c10 = float(r10[x0]) + fx * (float(r10[x1]) - float(r10[x0]));
+        const float c11 = float(r11[x0]) + fx * (float(r11[x1]) - float(r11[x0]));
+        const float c0 = c00 + fy * (c01 - c00);
+        const float c1 = c10 + fy * (c11 - c10);
+        return c0 + fz * (c1 - c0);
+    }
+};
+
+// Intersects the ray with the box [0, dims - 1]. Returns false on a miss.
+bool intersectBox(const Vec3 &o, const Vec3 &d, const int dims[3], float &tNear, float &tFar)
+{
+    const float origin[3] = { o.x, o.y, o.z };
+    const float dir[3] = { d.x, d.y, d.z };
+    tNear = 0.0f;
+    tFar = std::numeric_limits<float>::max();
+    for (int a = 0; a < 3; ++a) {
+        const float hi = float(dims[a] - 1);
+        if (std::fabs(dir[a]) < 1e-8f) {
+            if (origin[a] < 0.0f || origin[a] > hi)
+                return false;
+            continue;
+        }
+        float t0 = (0.0f - origin[a]) / dir[a];
+        float t1 = (hi - origin[a]) / dir[a];
+        if (t0 > t1)
+            std::swap(t0, t1);
+        tNear = std::max(tNear, t0);
+        tFar = std::min(tFar, t1);
+    }
+    return tNear <= tFar;
+}
+
+} // namespace
+
+
+RayCaster::RayCaster()
+{
+    setTransferFunction(defaultTransferFunction());
+}
+
+QVector<QRgb> RayCaster::defaultTransferFunction()
+{
+    // Grey ramp, fully transparent below 20 so background air is skipped.
+    QVector<QRgb> table(256);
+    for (int v = 0; v < 256; ++v) {
+        const int alpha = v < 20 ? 0 : (v - 20) * 40 / 235;
+        table[v] = qRgba(v, v, v, alpha);
+    }
+    return table;
+}
+
+void RayCaster::setTransferFunction(const QVector<QRgb> &table)
+{
+    transferFunction = table;
+    transferFunction.resize(256);
+    alphaPrefix[0] = 0;
+    for (int v = 0; v < 256; ++v)
+        alphaPrefix[v + 1] = alphaPrefix[v] + (qAlpha(transferFunction[v]) > 0 ? 1 : 0);
+}
+
+bool RayCaster::canRender() const
+{
+    if (volume.isEmpty())
+        return false;
+    const int type = volume.type();
+    return type == CV_8UC1 || type == CV_16UC1 || type == CV_16SC1 || type == CV_32FC1;
+}
+
+void RayCaster::setVolume(const Volume &newVolume)
+{
+    const bool sameGrid = volume.sameGeometry(newVolume) && !brickVersions.empty();
+    volume = newVolume;
+
+    if (!canRender()) {
+        brickMin.clear();
+        brickMax.clear();
+        brickVersions.clear();
+        return;
+    }
+
+    const int dims[3] = { volume.width(), volume.height(), volume.depth() };
+    if (!sameGrid) {
+        for (int a = 0; a < 3; ++a)
+            bricks[a] = std::max(1, (dims[a] - 1 + BrickSize - 1) / BrickSize);
+        const size_t count = size_t(bricks[0]) * bricks[1] * bricks[2];
+        brickMin.assign(count, 0);
+        brickMax.assign(count, 0);
+        brickVersions.assign(dims[2], 0);
+    }
+
+    // A brick covers [b * size, (b + 1) * size] inclusive, so a slice on a
+    // brick boundary belongs to two brick layers.
+    std::vector<char> dirty(bricks[2], 0);
+    for (int z = 0; z < dims[2]; ++z) {
+        const quint64 version = volume.sliceVersion(z);
+        if (version == brickVersions[z])
+            continue;
+        brickVersions[z] = version;
+        dirty[std::min(z / BrickSize, bricks[2] - 1)] = 1;
+        if (z % BrickSize == 0 && z > 0)
+            dirty[std::min(z / BrickSize - 1, bricks[2] - 1)] = 1;
+    }
+
+    for (int bz = 0; bz < bricks[2]; ++bz) {
+        if (!dirty[bz])
+            continue;
+        int end = bz;
+        while (end < bricks[2] && dirty[end])
+            ++end;
+        updateBricks(bz, end);
+        bz = end - 1;
+    }
+
+    volumeMin = *std::min_element(brickMin.begin(), brickMin.end());
+    volumeMax = *std::max_element(brickMax.begin(), brickMax.end());
+}
+
+void RayCaster::updateBricks(int zBrickBegin, int zBrickEnd)
+{
+    dispatchVoxelType(volume.type(), [&](auto *tag) {
+        using T = std::remove_pointer_t<decltype(tag)>;
+        if constexpr (std::is_arithmetic<T>::value)
+            updateBricksTyped<T>(zBrickBegin, zBrickEnd);
+    });
+}
+
+template <typename T>
+void RayCaster::updateBricksTyped(int zBrickBegin, int zBrickEnd)
+{
+    const int w = volume.width(), h = volume.height(), d = volume.depth();
+
+    cv::parallel_for_(cv::Range(zBrickBegin, zBrickEnd), [&](const cv::Range &range) {
+        for (int bz = range.start; bz < range.end; ++bz) {
+            const int z0 = bz * BrickSize, z1 = std::min(z0 + BrickSize, d - 1);
+            for (int by = 0; by < bricks[1]; ++by) {
+                const int y0 = by * BrickSize, y1 = std::min(y0 + BrickSize, h - 1);
+                for (int bx = 0; bx < bricks[0]; ++bx) {
+                    const int x0 = bx * BrickSize, x1 = std::min(x0 + BrickSize, w - 1);
+                    float lo = std::numeric_limits<float>::max();
+                    float hi = std::numeric_limits<float>::lowest();
+                    for (int z = z0; z <= z1; ++z) {
+                        for (int y = y0; y <= y1; ++y) {
+                            const T *row = reinterpret_cast<const T *>(volume.slicePtr(z) + y * volume.rowStride());
+                            const auto mm = std::minmax_element(row + x0, row + x1 + 1);
+                            lo = std::min(lo, float(*mm.first));
+                            hi = std::max(hi, float(*mm.second));
+                        }
+                    }
+                    const size_t index = (size_t(bz) * bricks[1] + by) * bricks[0] + bx;
+                    brickMin[index] = lo;
+                    brickMax[index] = hi;
+                }
+            }
+        }
+    });
+}
+
+QImage RayCaster::render(const QSize &size, const Camera &camera, int downsample) const
+{
+    const int ds = std::max(1, downsample);
+    const int width = std::max(1, size.width() / ds);
+    const int height = std::max(1, size.height() / ds);
+
+    QImage image(width, height, QImage::Format_RGB32);
+    image.fill(Background);
+    if (!canRender())
+        return image;
+
+    const int dims[3] = { volume.width(), volume.height(), volume.depth() };
+    const QVector3D spacing = volume.spacing();
+    const float sx = spacing.x() > 0 ? spacing.x() : 1.0f;
+    const float sy = spacing.y() > 0 ? spacing.y() : 1.0f;
+    const float sz = spacing.z() > 0 ? spacing.z() : 1.0f;
+    const Vec3 centre = { (dims[0] - 1) * 0.5f, (dims[1] - 1) * 0.5f, (dims[2] - 1) * 0.5f };
+
+    // World space is centred on the volume with Y up; image rows grow down.
+    auto toVoxel = [&](const Vec3 &w) { return Vec3{ w.x / sx + centre.x, centre.y - w.y / sy, w.z / sz + centre.z }; };
+    auto dirToVoxel = [&](const Vec3 &w) { return Vec3{ w.x / sx, -w.y / sy, w.z / sz }; };
+
+    const float diagonal = std::max(1.0f, std::sqrt(std::pow((dims[0] - 1) * sx, 2.0f)
+                                                    + std::pow((dims[1] - 1) * sy, 2.0f)
+                                                    + std::pow((dims[2] - 1) * sz, 2.0f)));
+    const float yaw = camera.yaw * Pi / 180.0f;
+    const float pitch = camera.pitch * Pi / 180.0f;
+    const Vec3 eye = Vec3{ std::cos(pitch) * std::sin(yaw), std::sin(pitch), std::cos(pitch) * std::cos(yaw) }
+                     * (camera.distance * diagonal);
+    const Vec3 forward = eye * (-1.0f / std::sqrt(dot(eye, eye)));
+    Vec3 right = { -forward.z, 0.0f, forward.x };   // forward x (0, 1, 0)
+    const float rightLength = std::sqrt(dot(right, right));
+    right = rightLength > 1e-6f ? right * (1.0f / rightLength) : Vec3{ 1.0f, 0.0f, 0.0f };
+    const Vec3 up = { right.y * forward.z - right.z * forward.y,
+                      right.z * forward.x - right.x * forward.z,
+                      right.x * forward.y - right.y * forward.x };
+    const float tanHalf = std::tan(camera.fov * 0.5f * Pi / 180.0f);
+    const float aspect = float(width) / float(height);
+
+    const Vec3 origin = toVoxel(eye);
+    const float step = ds > 1 ? 2.0f : 1.0f;
+    const Mode mode = renderMode;
+
+    // Values are compared in raw units; the window maps them to the transfer
+    // function index and to the displayed grey level.
+    const float winLow = float(window.low());
+    const float winScale = float(255.0 / window.width());
+    const float iso = winLow + isoValue / winScale;
+    auto toIndex = [=](float value) {
+        return std::min(255, std::max(0, int((value - winLow) * winScale + 0.5f)));
+    };
+
+    // Step-length corrected, premultiplied transfer function.
+    float tf[256][4];
+    for (int v = 0; v < 256; ++v) {
+        const QRgb c = transferFunction[v];
+        const float a = 1.0f - std::pow(1.0f - qAlpha(c) / 255.0f, step);
+        tf[v][0] = qRed(c) * a;
+        tf[v][1] = qGreen(c) * a;
+        tf[v][2] = qBlue(c) * a;
+        tf[v][3] = a;
+    }
+
+    const int *prefix = alphaPrefix;
+    const float *bMin = brickMin.data();
+    const float *bMax = brickMax.data();
+    const int nb[3] = { bricks[0], bricks[1], bricks[2] };
+    const float globalMin = volumeMin, globalMax = volumeMax;
+
+    uchar *bits = image.bits();
+    const int bytesPerLine = image.bytesPerLine();
+    const int tilesX = (width + TileSize - 1) / TileSize;
+    const int tilesY = (height + TileSize - 1) / TileSize;
+
+    dispatchVoxelType(volume.type(), [&](auto *tag) {
+        using T = std::remove_pointer_t<decltype(tag)>;
+        if constexpr (std::is_arithmetic<T>::value) {
+            const Sampler<T> sample = { volume.data(), volume.sliceStride(), volume.rowStride(), { dims[0], dims[1], dims[2] } };
+
+            TaskScheduler::parallelFor(cv::Range(0, tilesX * tilesY), Task::Interactive, [&](const cv::Range &range) {
+                for (int tile = range.start; tile < range.end; ++tile) {
+                    const int tx = (tile % tilesX) * TileSize, ty = (tile / tilesX) * TileSize;
+                    for (int py = ty; py < std::min(ty + TileSize, height); ++py) {
+                        QRgb *line = reinterpret_cast<QRgb *>(bits + py * bytesPerLine);
+                        const float v = (1.0f - 2.0f * (py + 0.5f) / height) * tanHalf;
+                        for (int px = tx; px < std::min(tx + TileSize, width); ++px) {
+                            const float u = (2.0f * (px + 0.5f) / width - 1.0f) * tanHalf * aspect;
+                            Vec3 dir = dirToVoxel(forward + right * u + up * v);
+                            dir = dir * (1.0f / std::sqrt(dot(dir, dir)));
+
+                            float tNear, tFar;
+                            if (!intersectBox(origin, dir, dims, tNear, tFar))
+                                continue;
+
+                            float best = mode == MinimumIntensity ? std::numeric_limits<float>::max()
+                                                                  : std::numeric_limits<float>::lowest();
+                            float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                            bool hit = false;
+                            Vec3 hitPos = { 0.0f, 0.0f, 0.0f };
+
+                            float t = tNear;
+                            bool havePrevious = false;
+                            while (t <= tFar) {
+                                const Vec3 p = origin + dir * t;
+
+                                // Empty-space skipping on the brick grid.
+                                const int bx = std::min(std::max(int(p.x), 0) / BrickSize, nb[0] - 1);
+                                const int by = std::min(std::max(int(p.y), 0) / BrickSize, nb[1] - 1);
+                                const int bz = std::min(std::max(int(p.z), 0) / BrickSize, nb[2] - 1);
+                                const size_t b = (size_t(bz) * nb[1] + by) * nb[0] + bx;
+                                bool skip = false;
+                                switch (mode) {
+                                case MaximumIntensity: skip = bMax[b] <= best; break;
+                                case MinimumIntensity: skip = bMin[b] >= best; break;
+                                case Composite: skip = prefix[toIndex(bMax[b]) + 1] - prefix[toIndex(bMin[b])] == 0; break;
+                                case Isosurface: skip = bMax[b] < iso; break;
+                                }
+                                if (skip) {
+                                    // Jump to where the ray leaves this brick.
+                                    const float pos[3] = { origin.x, origin.y, origin.z };
+                                    const float d[3] = { dir.x, dir.y, dir.z };
+                                    const int bi[3] = { bx, by, bz };
+                                    float exit = tFar;
+                                    for (int a = 0; a < 3; ++a) {
+                                        if (std::fabs(d[a]) < 1e-8f)
+                                            continue;
+                                        const float bound = float((d[a] > 0 ? bi[a] + 1 : bi[a]) * BrickSize);
+                                        exit = std::min(exit, (bound - pos[a]) / d[a]);
+                                    }
+                                    t = std::max(exit, t) + 0.01f;
+                                    havePrevious = false;
+                                    continue;
+                                }
+
+                                const float value = sample(p);
+                                if (mode == MaximumIntensity) {
+                                    if (value > best) {
+                                        best = value;
+                                        if (best >= globalMax)
+                                            break;   // nothing brighter left on this ray
+                                    }
+                                } else if (mode == MinimumIntensity) {
+                                    if (value < best) {
+                                        best = value;
+                                        if (best <= globalMin)
+                                            break;
+                                    }
+                                } else if (mode == Composite) {
+                                    const float *c = tf[toIndex(value)];
+                                    const float remaining = 1.0f - acc[3];
+                                    acc[0] += remaining * c[0];
+                                    acc[1] += remaining * c[1];
+                                    acc[2] += remaining * c[2];
+                                    acc[3] += remaining * c[3];
+                                    if (acc[3] > OpaqueAlpha)
+                                        break;   // early ray termination
+                                } else if (value >= iso) {
+                                    // First hit: refine between the previous and current sample.
+                                    float lo = havePrevious ? t - step : t, hi = t;
+                                    for (int i = 0; i < 4 && havePrevious; ++i) {
+                                        const float mid = 0.5f * (lo + hi);
+                                        if (sample(origin + dir * mid) >= iso)
+                                            hi = mid;
+                                        else
+                                            lo = mid;
+                                    }
+                                    hitPos = origin + dir * hi;
+                                    hit = true;
+                                    break;
+                                }
+                                havePrevious = true;
+                                t += step;
+                            }
+
+                            if (mode == MaximumIntensity || mode == MinimumIntensity) {
+                                if (best != std::numeric_limits<float>::max() && best != std::numeric_limits<float>::lowest()) {
+                                    const int g = toIndex(best);
+                                    line[px] = qRgb(g, g, g);
+                                }
+                            } else if (mode == Composite) {
+                                const float remaining = 1.0f - acc[3];
+                                line[px] = qRgb(std::min(255, int(acc[0] + remaining * qRed(Background))),
+                                                std::min(255, int(acc[1] + remaining * qGreen(Background))),
+                                                std::min(255, int(acc[2] + remaining * qBlue(Background))));
+                            } else if (hit) {
+                                // Headlight shading from the central-difference gradient.
+                                Vec3 n = { sample(hitPos + Vec3{ 1, 0, 0 }) - sample(hitPos + Vec3{ -1, 0, 0 }),
+                                           sample(hitPos + Vec3{ 0, 1, 0 }) - sample(hitPos + Vec3{ 0, -1, 0 }),
+                                           sample(hitPos + Vec3{ 0, 0, 1 }) - sample(hitPos + Vec3{ 0, 0, -1 }) };
+                                const float length = std::sqrt(dot(n, n));
+                                const float shade = length > 1e-6f ? 0.15f + 0.85f * std::fabs(dot(n, dir)) / length : 1.0f;
+                                line[px] = qRgb(int(235 * shade), int(225 * shade), int(200 * shade));
+                            }
+                        }
+                    }
+                }
+            });
+        }
+    });
+
+    return image;
+}
@@ -0,0 +1,77 @@
+#ifndef RAYCASTER_H
+#define RAYCASTER_H
+
+#include <QImage>
+#include <QSize>
+#include <QVector>
+#include <QVector3D>
+
+#include <vector>
+
+#include "volume.h"
+#include "windowlevel.h"
+
+// CPU volume renderer reading the volume buffer directly.
+//
+// Rays are marched in voxel space with trilinear sampling. A grid of 8^3
+// bricks with min/max values lets every mode skip space that cannot change
+// the result, composite rays stop once they are opaque, and the image is
+// rendered in 16x16 tiles across all cores.
+class RayCaster {
+public:
+    enum Mode { MaximumIntensity, MinimumIntensity, Composite, Isosurface };
+
+    // Orbit camera looking at the volume centre.
+    struct Camera {
+        float yaw = 30.0f;      // degrees around the vertical axis
+        float pitch = 20.0f;    // degrees above the horizontal plane
+        float distance = 2.0f;  // in units of the volume diagonal
+        float fov = 45.0f;      // vertical field of view in degrees
+    };
+
+    RayCaster();
+
+    // Brick min/max are only recomputed for slices whose version changed.
+    void setVolume(const Volume &volume);
+    bool canRender() const;
+
+    void setMode(Mode mode) { renderMode = mode; }
+    Mode mode() const { return renderMode; }
+    // Iso level in display units (0..255 across the window).
+    void setIsoValue(float value) { isoValue = value; }
+    float isoLevel() const { return isoValue; }
+    // Maps raw voxel values to grey levels and transfer-function entries.
+    void setWindow(const WindowLevel &windowLevel) { window = windowLevel; }
+
+    // 256 entries of non-premultiplied colour; alpha is the opacity of one
+    // voxel-length step and is corrected for the actual step length.
+    void setTransferFunction(const QVector<QRgb> &table);
+    static QVector<QRgb> defaultTransferFunction();
+
+    // Renders at size / downsample; interactive passes also use a coarser
+    // step along the ray. The returned image has the reduced size.
+    QImage render(const QSize &size, const Camera &camera, int downsample = 1) const;
+
+    static const int BrickSize = 8;
+
+private:
+    Volume volume;
+    Mode renderMode = MaximumIntensity;
+    float isoValue = 128.0f;
+    WindowLevel window;
+    QVector<QRgb> transferFunction;
+    int alphaPrefix[257];            // count of non-transparent entries below each value
+
+    int bricks[3] = { 0, 0, 0 };     // brick grid size along x, y, z
+    std::vector<float> brickMin;
+    std::vector<float> brickMax;
+    std::vector<quint64> brickVersions;   // slice versions the grid was built from
+    float volumeMin = 0.0f;
+    float volumeMax = 0.0f;
+
+    void updateBricks(int zBrickBegin, int zBrickEnd);
+    template <typename T>
+    void updateBricksTyped(int zBrickBegin, int zBrickEnd);
+};
+
+#endif // RAYCASTER_H
@@ -0,0 +1,205 @@
+#include "reslice.h"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XIP_HAVE_SSE2 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define XIP_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define XIP_TARGET_AVX2
+#endif
+
+namespace {
+
+const int Tile = 16;
+
+// Source layout shared by all kernels: base pointer already offset to the
+// wanted column, plus the slice and row strides in bytes.
+struct ColumnSource {
+    const uchar *base;
+    size_t sliceStride;
+    size_t rowStride;
+};
+
+// Tiled copy, instantiated per voxel type. Also used for partial tiles.
+template <typename T>
+void coronalScalar(const ColumnSource &src, int y0, int y1, int z0, int z1, cv::Mat &dst)
+{
+    for (int yb = y0; yb < y1; yb += Tile) {
+        const int ye = std::min(yb + Tile, y1);
+        for (int z = z0; z < z1; ++z) {
+            const uchar *s = src.base + z * src.sliceStride + yb * src.rowStride;
+            for (int y = yb; y < ye; ++y, s += src.rowStride)
+                dst.ptr<T>(y)[z] = *reinterpret_cast<const T *>(s);
+        }
+    }
+}
+
+#ifdef XIP_HAVE_SSE2
+
+// Gathers 16 voxels of one slice down Y into a register.
+inline __m128i gatherColumn16(const uchar *s, size_t rowStride)
+{
+    alignas(16) uchar tmp[Tile];
+    for (int i = 0; i < Tile; ++i, s += rowStride)
+        tmp[i] = *s;
+    return _mm_load_si128(reinterpret_cast<const __m128i *>(tmp));
+}
+
+// 16x16 byte transpose. Each pass rotates the (row, col) index bits by one,
+// so four identical interleave passes swap rows and columns.
+inline void transpose16x16(__m128i r[Tile])
+{
+    __m128i t[Tile];
+    for (int pass = 0; pass < 4; ++pass) {
+        for (int i = 0; i < 8; ++i) {
+            t[2 * i] = _mm_unpacklo_epi8(r[i], r[i + 8]);
+            t[2 * i + 1] = _mm_unpackhi_epi8(r[i], r[i + 8]);
+        }
+        for (int i = 0; i < Tile; ++i)
+            r[i] = t[i];
+    }
+}
+
+void coronal8uSSE2(const ColumnSource &src, int height, int z0, int z1, cv::Mat &dst)
+{
+    const int yFull = height - height % Tile;
+    const int zFull = z0 + (z1 - z0) / Tile * Tile;
+
+    __m128i rows[Tile];
+    for (int y0 = 0; y0 < yFull; y0 += Tile) {
+        for (int zb = z0; zb < zFull; zb += Tile) {
+            for (int i = 0; i < Tile; ++i)
+                rows[i] = gatherColumn16(src.base + (zb + i) * src.sliceStride + y0 * src.rowStride, src.rowStride);
+            transpose16x16(rows);
+            for (int i = 0; i < Tile; ++i)
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst.ptr(y0 + i) + zb), rows[i]);
+        }
+    }
+
+    if (zFull < z1)
+        coronalScalar<uchar>(src, 0, yFull, zFull, z1, dst);
+    if (yFull < height)
+        coronalScalar<uchar>(src, yFull, height, z0, z1, dst);
+}
+
+// Same as the SSE2 kernel, but each 256-bit register carries two slices
+// 16 apart, so a pass handles a 16 (Y) x 32 (Z) tile and stores 32 bytes.
+XIP_TARGET_AVX2
+void coronal8uAVX2(const ColumnSource &src, int height, int z0, int z1, cv::Mat &dst)
+{
+    const int yFull = height - height % Tile;
+    const int zFull = z0 + (z1 - z0) / (2 * Tile) * (2 * Tile);
+
+    __m256i rows[Tile];
+    __m256i t[Tile];
+    for (int y0 = 0; y0 < yFull; y0 += Tile) {
+        for (int zb = z0; zb < zFull; zb += 2 * Tile) {
+            for (int i = 0; i < Tile; ++i) {
+                const uchar *lo = src.base + (zb + i) * src.sliceStride + y0 * src.rowStride;
+                const uchar *hi = lo + Tile * src.sliceStride;
+                rows[i] = _mm256_set_m128i(gatherColumn16(hi, src.rowStride), gatherColumn16(lo, src.rowStride));
+            }
+            for (int pass = 0; pass < 4; ++pass) {
+                for (int i = 0; i < 8; ++i) {
+                    t[2 * i] = _mm256_unpacklo_epi8(rows[i], rows[i + 8]);
+                    t[2 * i + 1] = _mm256_unpackhi_epi8(rows[i], rows[i + 8]);
+                }
+                for (int i = 0; i < Tile; ++i)
+                    rows[i] = t[i];
+            }
+            for (int i = 0; i < Tile; ++i)
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst.ptr(y0 + i) + zb), rows[i]);
+        }
+    }
+
+    if (yFull < height)
+        coronalScalar<uchar>(src, yFull, height, z0, zFull, dst);
+    if (zFull < z1)
+        coronal8uSSE2(src, height, zFull, z1, dst);
+}
+
+#endif // XIP_HAVE_SSE2
+
+template <typename T>
+void coronalRange(const ColumnSource &src, int height, int z0, int z1, cv::Mat &dst)
+{
+#ifdef XIP_HAVE_SSE2
+    if constexpr (std::is_same<T, uchar>::value) {
+        static const bool hasAVX2 = cv::checkHardwareSupport(CV_CPU_AVX2);
+        if (hasAVX2)
+            coronal8uAVX2(src, height, z0, z1, dst);
+        else
+            coronal8uSSE2(src, height, z0, z1, dst);
+        return;
+    }
+#endif
+    coronalScalar<T>(src, 0, height, z0, z1, dst);
+}
+
+} // namespace
+
+
+// Paged volumes count the slices read here against the memory budget.
+
+void Reslicer::axial(const Volume &volume, int z, cv::Mat &dst)
+{
+    volume.touch(z, z + 1);
+    volume.axial(z).copyTo(dst);
+}
+
+void Reslicer::coronal(const Volume &volume, int x, cv::Mat &dst)
+{
+    const int height = volume.height();
+    const int depth = volume.depth();
+    const size_t elem = volume.elemSize();
+    dst.create(height, depth, volume.type());
+
+    ColumnSource src = { volume.data() + x * elem, volume.sliceStride(), volume.rowStride() };
+
+    dispatchVoxelType(volume.type(), [&](auto *tag) {
+        using T = std::remove_pointer_t<decltype(tag)>;
+        if (depth < ParallelDepth) {
+            volume.touch(0, depth);
+            coronalRange<T>(src, height, 0, depth, dst);
+            return;
+        }
+
+        // Chunks of 64 slices keep neighbouring threads off each other's output cache lines.
+        const int chunk = 64;
+        const int chunks = (depth + chunk - 1) / chunk;
+        cv::parallel_for_(cv::Range(0, chunks), [&](const cv::Range &r) {
+            for (int c = r.start; c < r.end; ++c) {
+                const int z0 = c * chunk;
+                const int z1 = std::min(depth, (c + 1) * chunk);
+                volume.touch(z0, z1);
+                coronalRange<T>(src, height, z0, z1, dst);
+            }
+        });
+    });
+}
+
+void Reslicer::sagittal(const Volume &volume, int y, cv::Mat &dst)
+{
+    const int depth = volume.depth();
+    const size_t rowBytes = volume.width() * volume.elemSize();
+    dst.create(depth, volume.width(), volume.type());
+
+    auto copyRows = [&](const cv::Range &r) {
+        volume.touch(r.start, r.end);
+        for (int z = r.start; z < r.end; ++z)
+            std::memcpy(dst.ptr(z), volume.slicePtr(z) + y * volume.rowStride(), rowBytes);
+    };
+
+    if (depth < ParallelDepth)
+        copyRows(cv::Range(0, depth));
+    else
+        cv::parallel_for_(cv::Range(0, depth), copyRows);
+}
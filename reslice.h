@@ -0,0 +1,29 @@
+#ifndef RESLICE_H
+#define RESLICE_H
+
+#include <opencv2/core.hpp>
+
+#include "volume.h"
+
+// Orthogonal plane extraction for the 2D views.
+//
+// The coronal plane walks down a column of every slice, so it is built in
+// 16x16 tiles: each tile is gathered along Y (consecutive rows of one slice)
+// and transposed in registers before being stored as contiguous output rows.
+// 8-bit volumes use SSE2 or AVX2 kernels picked at runtime; other voxel types
+// get a tiled kernel instantiated per type. Deep volumes are split across
+// threads.
+class Reslicer {
+public:
+    // XY plane at depth z (height x width). Copy of Volume::axial().
+    static void axial(const Volume &volume, int z, cv::Mat &dst);
+    // YZ plane at column x (height x depth).
+    static void coronal(const Volume &volume, int x, cv::Mat &dst);
+    // XZ plane at row y (depth x width).
+    static void sagittal(const Volume &volume, int y, cv::Mat &dst);
+
+    // Depth from which the extraction is run in parallel.
+    static const int ParallelDepth = 64;
+};
+
+#endif // RESLICE_H
@@ -1,7 +1,74 @@
 #include "segmentationwindow.h"
+#include "taskscheduler.h"
+#include "volumehistory.h"
+#include "volumepyramid.h"
+#include "volumestatistics.h"
 
-SegmentationWindow::SegmentationWindow(const QList<cv::Mat> &images, QWidget *parent)
-    : QDialog(parent), imageSlices(images)
+#include <QFormLayout>
+#include <QHeaderView>
+#include <QMessageBox>
+#include <QPixmap>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+namespace {
+
+// 8-bit mask of one slice; src is already 8-bit. A slice reduced by
+// 2^level gets a block size reduced to match.
+void segmentSlice(const SegmentationParams &params, const cv::Mat &src, cv::Mat &img, bool inPlace, int level = 0)
+{
+    if (params.method == "Otsu Threshold" && params.otsu >= 0.0) {
+        cv::threshold(src, img, params.otsu, 255, cv::THRESH_BINARY);
+    } else if (params.method == "Otsu Threshold") {
+        cv::threshold(src, img, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+    } else if (params.method == "Binary Threshold") {
+        cv::threshold(src, img, params.threshold, 255, cv::THRESH_BINARY);
+    } else if (params.method == "Adaptive Threshold") {
+        const int blockSize = std::max(3, (params.blockSize >> level) | 1);
+        cv::adaptiveThreshold(src, img, 255, cv::ADAPTIVE_THRESH_GAUSSIAN_C,
+                              cv::THRESH_BINARY, blockSize, params.offset);
+    } else if (params.method == "Canny Edges") {
+        cv::Mat edges;
+        cv::Canny(src, edges, params.cannyLow, params.cannyHigh);
+        edges.copyTo(img);
+    } else if (!inPlace) {
+        src.copyTo(img);
+    }
+}
+
+// One Otsu threshold for the whole volume, so the masks agree across Z, on
+// the 8-bit scale the slices are segmented at.
+double volumeOtsu(const Volume &volume, const WindowLevel &range, Task::Priority priority)
+{
+    const double threshold = VolumeStatistics::instance().histogram(volume, priority).otsuThreshold();
+    return volume.type() == CV_8UC1 ? threshold : (threshold - range.low()) * 255.0 / range.width();
+}
+
+// Slider with its current value shown next to it.
+QWidget *sliderRow(QSlider *slider, QWidget *parent)
+{
+    QWidget *row = new QWidget(parent);
+    QHBoxLayout *layout = new QHBoxLayout(row);
+    layout->setContentsMargins(0, 0, 0, 0);
+    QLabel *value = new QLabel(QString::number(slider->value()), row);
+    value->setMinimumWidth(32);
+    layout->addWidget(slider, 1);
+    layout->addWidget(value);
+    QObject::connect(slider, &QSlider::valueChanged, value, [value](int v) { value->setText(QString::number(v)); });
+    return row;
+}
+
+struct LabelResult {
+    Volume labels;
+    std::vector<LabelStats> stats;
+};
+
+} // namespace
+
+SegmentationWindow::SegmentationWindow(const Volume &volume, VolumeHistory *history, QWidget *parent)
+    : QDialog(parent), volume(volume), history(history)
 {
     setWindowTitle("Segmentation Tools");
 
@@ -12,11 +79,87 @@ SegmentationWindow::SegmentationWindow(const QList<cv::Mat> &images, QWidget *pa
         "Otsu Threshold",
         "Binary Threshold",
         "Adaptive Threshold",
-        "Canny Edges"
+        "Canny Edges",
+        "Connected Components (3D)",
+        "Region Growing (3D)"
     });
 
     layout->addWidget(segmentationCombo);
 
+    auto makeSlider = [this](int minimum, int maximum, int value, int step = 1) {
+        QSlider *slider = new QSlider(Qt::Horizontal, this);
+        slider->setRange(minimum, maximum);
+        slider->setSingleStep(step);
+        slider->setPageStep(step * 10);
+        slider->setValue(value);
+        return slider;
+    };
+    const SegmentationParams defaults;
+    thresholdSlider = makeSlider(0, 255, defaults.threshold);
+    blockSizeSlider = makeSlider(3, 101, defaults.blockSize, 2);
+    offsetSlider = makeSlider(-30, 30, defaults.offset);
+    cannyLowSlider = makeSlider(0, 500, defaults.cannyLow);
+    cannyHighSlider = makeSlider(0, 500, defaults.cannyHigh);
+    toleranceSlider = makeSlider(0, 255, defaults.tolerance);
+    connectivityCombo = new QComboBox(this);
+    connectivityCombo->addItem("6 (faces)", VolumeLabeler::Faces);
+    connectivityCombo->addItem("18 (edges)", VolumeLabeler::Edges);
+    connectivityCombo->addItem("26 (corners)", VolumeLabeler::Corners);
+    connectivityCombo->setCurrentIndex(connectivityCombo->findData(defaults.connectivity));
+
+    QFormLayout *parameters = new QFormLayout;
+    auto addRow = [&](std::initializer_list<int> methods, const QString &name, QWidget *field) {
+        QLabel *label = new QLabel(name, this);
+        parameters->addRow(label, field);
+        for (int method : methods)
+            parameterRows[method] << label << field;
+    };
+    auto addSlider = [&](int method, const QString &name, QSlider *slider) {
+        addRow({ method }, name, sliderRow(slider, this));
+        connect(slider, &QSlider::valueChanged, this, &SegmentationWindow::schedulePreview);
+        connect(slider, &QSlider::sliderReleased, this, &SegmentationWindow::schedulePreview);
+    };
+    addSlider(1, "Threshold:", thresholdSlider);
+    addSlider(2, "Block size:", blockSizeSlider);
+    addSlider(2, "Offset:", offsetSlider);
+    addSlider(3, "Low threshold:", cannyLowSlider);
+    addSlider(3, "High threshold:", cannyHighSlider);
+    addRow({ 4, 5 }, "Connectivity:", connectivityCombo);
+    addRow({ 5 }, "Tolerance:", sliderRow(toleranceSlider, this));
+    QLabel *seedHint = new QLabel("Click a voxel in any view to grow a region from it.", this);
+    seedHint->setWordWrap(true);
+    parameters->addRow(seedHint);
+    parameterRows[5] << seedHint;
+    layout->addLayout(parameters);
+
+    // 3D methods list the components they found.
+    statsLabel = new QLabel(this);
+    statsTable = new QTableWidget(0, 4, this);
+    statsTable->setHorizontalHeaderLabels({ "Label", "Voxels", "Bounding box", "Centroid" });
+    statsTable->verticalHeader()->hide();
+    statsTable->horizontalHeader()->setStretchLastSection(true);
+    statsTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    statsTable->setSelectionBehavior(QAbstractItemView::SelectRows);
+    layout->addWidget(statsLabel);
+    layout->addWidget(statsTable);
+    for (int method : { 4, 5 })
+        parameterRows[method] << statsLabel << statsTable;
+
+    preview = new QLabel(this);
+    preview->setFixedSize(256, 256);
+    preview->setAlignment(Qt::AlignCenter);
+    preview->setStyleSheet("border: 1px solid gray;");
+    layout->addWidget(preview, 0, Qt::AlignHCenter);
+
+    previewTimer = new QTimer(this);
+    previewTimer->setSingleShot(true);
+    previewTimer->setInterval(0);
+    connect(previewTimer, &QTimer::timeout, this, &SegmentationWindow::updatePreview);
+    connect(segmentationCombo, QOverload<int>::of(&QComboBox::currentIndexChanged), this, [this]() {
+        updateParameterRows();
+        schedulePreview();
+    });
+
     applyButton = new QPushButton("Apply", this);
     undoButton = new QPushButton("Undo", this);
 
@@ -26,49 +169,340 @@ SegmentationWindow::SegmentationWindow(const QList<cv::Mat> &images, QWidget *pa
 
     layout->addLayout(btnLayout);
 
+    QHBoxLayout *progressLayout = new QHBoxLayout;
+    progressBar = new QProgressBar(this);
+    progressBar->setRange(0, 1000);
+    progressBar->setTextVisible(false);
+    cancelButton = new QPushButton("Cancel", this);
+    progressLayout->addWidget(progressBar);
+    progressLayout->addWidget(cancelButton);
+    layout->addLayout(progressLayout);
+    setRunning(false);
+
     connect(applyButton, &QPushButton::clicked, this, &SegmentationWindow::applySegmentation);
     connect(undoButton, &QPushButton::clicked, this, &SegmentationWindow::undo);
+    connect(cancelButton, &QPushButton::clicked, this, [this]() {
+        if (task)
+            task->cancel();
+    });
 
-    resize(400, 200);
+    connect(history, &VolumeHistory::currentChanged, this, [this](const Volume &current) {
+        this->volume = current;
+        updateRange();
+        schedulePreview();
+    });
+    undoButton->setEnabled(history->canUndo());
+    connect(history, &VolumeHistory::changed, this, [this]() {
+        undoButton->setEnabled(!task && this->history->canUndo());
+    });
+
+    updateRange();
+    previewSlice = volume.depth() / 2;
+    seed = cv::Point3i(volume.width() / 2, volume.height() / 2, volume.depth() / 2);
+    updateParameterRows();
+    schedulePreview();
+
+    resize(460, 640);
     show();
 }
 
 QImage SegmentationWindow::matToQImage(const cv::Mat &mat)
 {
-    return QImage(mat.data, mat.cols, mat.rows, mat.step, QImage::Format_Grayscale8).copy();
+    const cv::Mat display = WindowLevel::fullRange(mat).apply(mat);
+    return QImage(display.data, display.cols, display.rows, display.step, QImage::Format_Grayscale8).copy();
+}
+
+SegmentationWindow::~SegmentationWindow()
+{
+    if (task) {
+        task->cancel();
+        task->wait();
+        finishSegmentation(true, QString());
+    }
+}
+
+SegmentationParams SegmentationWindow::params() const
+{
+    SegmentationParams p;
+    p.method = segmentationCombo->currentText();
+    p.threshold = thresholdSlider->value();
+    p.blockSize = blockSizeSlider->value() | 1;
+    p.offset = offsetSlider->value();
+    p.cannyLow = cannyLowSlider->value();
+    p.cannyHigh = cannyHighSlider->value();
+    p.connectivity = connectivityCombo->currentData().toInt();
+    p.tolerance = toleranceSlider->value();
+    return p;
+}
+
+bool SegmentationWindow::isDragging() const
+{
+    for (const QSlider *slider : { thresholdSlider, blockSizeSlider, offsetSlider, cannyLowSlider, cannyHighSlider }) {
+        if (slider->isSliderDown())
+            return true;
+    }
+    return false;
+}
+
+void SegmentationWindow::updateParameterRows()
+{
+    // Some rows serve several methods, so all are hidden before any is shown.
+    for (const QList<QWidget *> &rows : parameterRows) {
+        for (QWidget *widget : rows)
+            widget->hide();
+    }
+    const int method = segmentationCombo->currentIndex();
+    if (method >= 0 && method < 6) {
+        for (QWidget *widget : parameterRows[method])
+            widget->show();
+    }
+}
+
+void SegmentationWindow::setPreviewSlice(int z)
+{
+    previewSlice = z;
+    schedulePreview();
+}
+
+void SegmentationWindow::schedulePreview()
+{
+    previewTimer->start();
+}
+
+// The preview starts on the middle slice's range, with Otsu per slice; the
+// volume's range and Otsu threshold follow from one histogram pass off the
+// GUI thread.
+void SegmentationWindow::updateRange()
+{
+    range = WindowLevel::provisionalRange(volume);
+    previewOtsu = -1.0;
+    const int serial = ++rangeSerial;
+    const Volume source = volume;
+    auto counted = std::make_shared<std::pair<WindowLevel, double>>(range, -1.0);
+    Task *counting = TaskScheduler::instance().run(Task::Interactive, [source, counted](Task &job) {
+        if (source.isEmpty())
+            return;
+        counted->first = WindowLevel::fullRange(source);
+        counted->second = volumeOtsu(source, counted->first, job.priority());
+    });
+    connect(counting, &Task::finished, this, [this, serial, counted](bool cancelled) {
+        if (cancelled || serial != rangeSerial)
+            return;
+        range = counted->first;
+        previewOtsu = counted->second;
+        schedulePreview();
+    });
+}
+
+// Only the shown slice is segmented, reduced while a slider is dragged.
+void SegmentationWindow::updatePreview()
+{
+    if (volume.isEmpty()) {
+        preview->clear();
+        return;
+    }
+    const int z = qBound(0, previewSlice, volume.depth() - 1);
+    int level = 0;
+    if (isDragging()) {
+        while (level < VolumePyramid::MaxLevel && (std::max(volume.width(), volume.height()) >> level) > DraftSize)
+            ++level;
+    }
+    const cv::Mat slice = VolumePyramid::reduce(volume.axial(z), level);
+    const cv::Mat src = volume.type() == CV_8UC1 ? slice : range.apply(slice);
+    SegmentationParams p = params();
+    if (p.method == "Otsu Threshold")
+        p.otsu = previewOtsu;
+    cv::Mat mask;
+    segmentSlice(p, src, mask, false, level);
+    preview->setPixmap(QPixmap::fromImage(matToQImage(mask))
+                           .scaled(preview->size(), Qt::KeepAspectRatio, Qt::SmoothTransformation));
+}
+
+void SegmentationWindow::setRunning(bool running)
+{
+    applyButton->setEnabled(!running);
+    undoButton->setEnabled(!running && history->canUndo());
+    segmentationCombo->setEnabled(!running);
+    for (QSlider *slider : { thresholdSlider, blockSizeSlider, offsetSlider, cannyLowSlider, cannyHighSlider,
+                             toleranceSlider })
+        slider->setEnabled(!running);
+    connectivityCombo->setEnabled(!running);
+    progressBar->setVisible(running);
+    progressBar->setValue(0);
+    cancelButton->setVisible(running);
 }
 
 void SegmentationWindow::applySegmentation()
 {
-    // Deep copy of current imageSlices to save in undoStack
-    QList<cv::Mat> backup;
-    for (const cv::Mat &img : imageSlices) {
-        backup.append(img.clone());  // Deep copy
+    if (task || history->isEditing())
+        return;
+
+    const SegmentationParams segmentation = params();
+    const QString method = segmentation.method;
+    if (method.endsWith("(3D)")) {
+        runLabeling(segmentation);
+        return;
     }
-    undoStack.push(backup);  // Push deep copy to stack
-
-    QString method = segmentationCombo->currentText();
-
-    for (cv::Mat &img : imageSlices) {
-        if (method == "Otsu Threshold") {
-            cv::threshold(img, img, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
-        } else if (method == "Binary Threshold") {
-            cv::threshold(img, img, 128, 255, cv::THRESH_BINARY);
-        } else if (method == "Adaptive Threshold") {
-            cv::adaptiveThreshold(img, img, 255, cv::ADAPTIVE_THRESH_GAUSSIAN_C,
-                                  cv::THRESH_BINARY, 11, 2);
-        } else if (method == "Canny Edges") {
-            cv::Canny(img, img, 100, 200);
+
+    // Masks are 8-bit. Deeper volumes are mapped over their full range into
+    // a new mask volume; 8-bit volumes are still segmented in place, and
+    // then only the changed tiles of each slice go into the history.
+    const bool inPlace = volume.type() == CV_8UC1;
+    pendingMask = inPlace ? volume : Volume::allocate(volume.width(), volume.height(), volume.depth(), CV_8UC1);
+    pendingMask.setSpacing(volume.spacing());
+    if (inPlace)
+        history->beginEdit(method, volume);
+    setRunning(true);
+
+    // Slices are segmented in parallel on the scheduler.
+    const Volume source = volume;
+    const Volume mask = pendingMask;
+    VolumeHistory *edits = history;
+    task = TaskScheduler::instance().run(Task::Compute, [=](Task &job) {
+        // The range and threshold are taken before any slice is written.
+        const WindowLevel range = WindowLevel::fullRange(source);
+        SegmentationParams perSlice = segmentation;
+        if (perSlice.method == "Otsu Threshold")
+            perSlice.otsu = volumeOtsu(source, range, job.priority());
+        job.parallelFor(source.depth(), [&](int z) {
+            source.prefetch(z + 1, z + 2);
+            if (inPlace)
+                edits->saveSlice(z);
+            const cv::Mat src = inPlace ? source.axial(z) : range.apply(source.axial(z));
+            cv::Mat img = mask.axial(z);  // header into the volume, written in place
+            segmentSlice(perSlice, src, img, inPlace);
+            if (inPlace)
+                edits->commitSlice(z);
+            source.release(z, z + 1);   // paged volumes stream through the budget
+            mask.release(z, z + 1);
+        });
+    });
+    connect(task, &Task::progressChanged, progressBar, &QProgressBar::setValue);
+    connect(task, &Task::finished, this, [this, method](bool cancelled) {
+        if (!cancelled && pendingMask.data() != volume.data())
+            history->recordReplace(method, volume);   // the new mask replaces the volume
+        finishSegmentation(cancelled, task ? task->errorString() : QString());
+    });
+}
+
+void SegmentationWindow::finishSegmentation(bool cancelled, const QString &error)
+{
+    task = nullptr;
+    const bool inPlace = pendingMask.data() == volume.data();
+    if (inPlace) {
+        if (cancelled)
+            history->abortEdit();
+        else
+            history->endEdit();
+    } else if (!cancelled) {
+        volume = pendingMask;
+        volume.markModified();
+    }
+    pendingMask = Volume();
+    updateRange();
+    setRunning(false);
+    schedulePreview();
+
+    if (inPlace || !cancelled)
+        emit volumeSegmented(volume);
+    if (!error.isEmpty())
+        QMessageBox::warning(this, "Error", QString("Segmentation failed: %1").arg(error));
+}
+
+void SegmentationWindow::setSeed(int x, int y, int z)
+{
+    seed = cv::Point3i(x, y, z);
+    if (segmentationCombo->currentText() != "Region Growing (3D)")
+        return;
+    // A click while a fill is running replaces that fill.
+    if (task) {
+        if (task->priority() == Task::Interactive) {
+            task->cancel();
+            seedPending = true;
         }
+        return;
     }
+    applySegmentation();
+}
+
+// The 3D methods replace the volume with a new label volume, like the masks
+// of deeper volumes. Region growing runs in the interactive lane, so a click
+// gets its region back ahead of any other queued work.
+void SegmentationWindow::runLabeling(const SegmentationParams &segmentation)
+{
+    const bool growing = segmentation.method == "Region Growing (3D)";
+    const bool regrow = growing && !growResult.isEmpty() && volume.data() == growResult.data();
+    const Volume source = regrow ? growSource : volume;
+    const auto connectivity = static_cast<VolumeLabeler::Connectivity>(segmentation.connectivity);
+    const cv::Point3i at = seed;
+
+    pendingMask = Volume();
+    setRunning(true);
 
-    emit imagesSegmented(imageSlices);
+    auto result = std::make_shared<LabelResult>();
+    task = TaskScheduler::instance().run(growing ? Task::Interactive : Task::Compute, [=](Task &job) {
+        if (growing) {
+            // The tolerance is on the 8-bit scale the other methods use.
+            const WindowLevel sourceRange = WindowLevel::fullRange(source);
+            const double tolerance = segmentation.tolerance * (sourceRange.high() - sourceRange.low()) / 255.0;
+            LabelStats region;
+            result->labels = VolumeLabeler::grow(source, at, tolerance, connectivity, job, &region);
+            if (!result->labels.isEmpty())
+                result->stats.push_back(region);
+        } else {
+            result->labels = VolumeLabeler::components(source, connectivity, job, &result->stats);
+        }
+    });
+    connect(task, &Task::progressChanged, progressBar, &QProgressBar::setValue);
+    connect(task, &Task::finished, this, [=](bool cancelled) {
+        const bool done = !cancelled && !result->labels.isEmpty();
+        if (done) {
+            history->recordReplace(segmentation.method, volume);
+            pendingMask = result->labels;
+            if (growing) {
+                growSource = source;
+                growResult = result->labels;
+            }
+            showStats(result->stats);
+        }
+        finishSegmentation(!done, task ? task->errorString() : QString());
+        if (seedPending) {
+            seedPending = false;
+            applySegmentation();
+        }
+    });
 }
 
-void SegmentationWindow::undo()
+// Largest components first.
+void SegmentationWindow::showStats(std::vector<LabelStats> stats)
 {
-    if (!undoStack.isEmpty()) {
-        imageSlices = undoStack.pop();
-        emit imagesSegmented(imageSlices);
+    std::stable_sort(stats.begin(), stats.end(), [](const LabelStats &a, const LabelStats &b) {
+        return a.voxels > b.voxels;
+    });
+    const int rows = int(std::min<size_t>(stats.size(), MaxStatsRows));
+    statsLabel->setText(stats.size() > size_t(rows)
+                            ? QString("%1 components, the %2 largest listed").arg(stats.size()).arg(rows)
+                            : QString("%1 components").arg(stats.size()));
+    statsTable->setRowCount(rows);
+    for (int i = 0; i < rows; ++i) {
+        const LabelStats &s = stats[i];
+        const QString box = QString("(%1, %2, %3) - (%4, %5, %6)")
+            .arg(s.lower.x).arg(s.lower.y).arg(s.lower.z).arg(s.upper.x).arg(s.upper.y).arg(s.upper.z);
+        const QString centroid = QString("(%1, %2, %3)")
+            .arg(s.centroid.x(), 0, 'f', 1).arg(s.centroid.y(), 0, 'f', 1).arg(s.centroid.z(), 0, 'f', 1);
+        statsTable->setItem(i, 0, new QTableWidgetItem(QString::number(s.label)));
+        statsTable->setItem(i, 1, new QTableWidgetItem(QString::number(s.voxels)));
+        statsTable->setItem(i, 2, new QTableWidgetItem(box));
+        statsTable->setItem(i, 3, new QTableWidgetItem(centroid));
     }
+    statsTable->resizeColumnsToContents();
+}
+
+void SegmentationWindow::undo()
+{
+    if (task)
+        return;
+    // Applied to the history's current volume; this dialog and the main
+    // window follow through VolumeHistory::currentChanged and restored.
+    history->undo();
 }
@@ -6,30 +6,114 @@
 #include <QPushButton>
 #include <QVBoxLayout>
 #include <QLabel>
-#include <QStack>
+#include <QList>
+#include <QPointer>
+#include <QProgressBar>
+#include <QSlider>
+#include <QTableWidget>
+#include <QTimer>
 #include <opencv2/opencv.hpp>
 
+#include <vector>
+
+#include "volume.h"
+#include "volumelabeler.h"
+#include "windowlevel.h"
+
+class Task;
+class VolumeHistory;
+
+// Parameters of the slice segmentation methods; values are on the 8-bit
+// scale the slices are mapped to.
+struct SegmentationParams {
+    QString method = "Otsu Threshold";
+    double otsu = -1.0;       // Otsu Threshold of the whole volume, per slice if negative
+    int threshold = 128;      // Binary Threshold
+    int blockSize = 11;       // Adaptive Threshold, odd
+    int offset = 2;           // Adaptive Threshold, subtracted from the local mean
+    int cannyLow = 100;
+    int cannyHigh = 200;
+    int connectivity = 26;    // 3D methods: 6, 18 or 26 neighbours
+    int tolerance = 20;       // Region Growing, around the seed value
+};
+
 class SegmentationWindow : public QDialog
 {
     Q_OBJECT
 
 public:
-    explicit SegmentationWindow(const QList<cv::Mat> &images, QWidget *parent = nullptr);
+    SegmentationWindow(const Volume &volume, VolumeHistory *history, QWidget *parent = nullptr);
+    ~SegmentationWindow();
+
+    // Width and height the preview is reduced to while a value is dragged.
+    static const int DraftSize = 384;
+
+public slots:
+    // Slice shown in the preview, normally the main window's Z cursor.
+    void setPreviewSlice(int z);
+    // Voxel picked in one of the main window's views. With Region Growing
+    // selected, a region is grown from it straight away.
+    void setSeed(int x, int y, int z);
 
 signals:
-    void imagesSegmented(QList<cv::Mat> segmentedImages);
+    void volumeSegmented(const Volume &volume);
 
 private slots:
     void applySegmentation();
     void undo();
 
 private:
-    QList<cv::Mat> imageSlices;
-    QStack<QList<cv::Mat>> undoStack;
+    Volume volume;
+    VolumeHistory *history;
+    // The preview's mapping of deeper volumes to the 8-bit scale, and its
+    // Otsu threshold (per slice while negative). Applying takes both from
+    // the volume's histogram on the worker.
+    WindowLevel range;
+    double previewOtsu = -1.0;
+    int rangeSerial = 0;   // tells results for earlier volumes apart
+    void updateRange();
 
     QComboBox *segmentationCombo;
+    QLabel *preview;
+    // One slider per parameter, shown for the methods that use it.
+    QSlider *thresholdSlider;
+    QSlider *blockSizeSlider;
+    QSlider *offsetSlider;
+    QSlider *cannyLowSlider;
+    QSlider *cannyHighSlider;
+    QSlider *toleranceSlider;
+    QComboBox *connectivityCombo;
+    QLabel *statsLabel;
+    QTableWidget *statsTable;            // components of the last 3D result
+    QList<QWidget *> parameterRows[6];   // per method, as in the combo box
     QPushButton *applyButton;
     QPushButton *undoButton;
+    QPushButton *cancelButton;
+    QProgressBar *progressBar;
+
+    QPointer<Task> task;   // segmentation running on the scheduler
+    Volume pendingMask;    // result being written, the volume itself when in place
+
+    // Region growing. A new seed on the region grown from the last one
+    // grows again from the volume that region came from.
+    cv::Point3i seed;
+    bool seedPending = false;    // clicked while a fill was running
+    Volume growSource;
+    Volume growResult;
+    static const int MaxStatsRows = 1000;
+    void runLabeling(const SegmentationParams &segmentation);
+    void showStats(std::vector<LabelStats> stats);
+
+    int previewSlice = 0;
+    QTimer *previewTimer;        // coalesces changes into one preview per event loop pass
+    SegmentationParams params() const;
+    bool isDragging() const;
+    void updateParameterRows();
+    void schedulePreview();
+    void updatePreview();
+
+    void setRunning(bool running);
+    void finishSegmentation(bool cancelled, const QString &error);
 
     QImage matToQImage(const cv::Mat &mat);
 };
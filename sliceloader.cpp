@@ -0,0 +1,190 @@
+#include "sliceloader.h"
+
+#include <QRunnable>
+#include <QThread>
+
+#include <functional>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+namespace {
+
+class FunctionTask : public QRunnable {
+public:
+    explicit FunctionTask(std::function<void()> fn) : fn(std::move(fn)) {}
+    void run() override { fn(); }
+
+private:
+    std::function<void()> fn;
+};
+
+} // namespace
+
+
+SliceLoader::SliceLoader(QObject *parent)
+    : QObject(parent), cancelled(false), remaining(0), done(0)
+{
+    pool.setMaxThreadCount(QThread::idealThreadCount());
+}
+
+SliceLoader::~SliceLoader()
+{
+    cancel();
+    pool.waitForDone();
+}
+
+int SliceLoader::voxelType(int imageDepth)
+{
+    switch (imageDepth) {
+    case CV_8U: return CV_8UC1;
+    case CV_16U: return CV_16UC1;
+    case CV_16S: return CV_16SC1;
+    default: return CV_32FC1;
+    }
+}
+
+Volume SliceLoader::volume() const
+{
+    std::lock_guard<std::mutex> lock(targetMutex);
+    return target;
+}
+
+bool SliceLoader::start(const QStringList &fileNames)
+{
+    cancel();
+    pool.waitForDone();
+
+    files = fileNames;
+    if (files.isEmpty())
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(targetMutex);
+        target = Volume();
+    }
+    loaded.assign(files.size(), 0);
+    ++generation;
+    cancelled = false;
+    remaining = files.size();
+    done = 0;
+    running = true;
+
+    pool.start(new FunctionTask([this]() { loadFirst(); }));
+    return true;
+}
+
+void SliceLoader::cancel()
+{
+    cancelled = true;
+}
+
+void SliceLoader::stop()
+{
+    cancel();
+    pool.waitForDone();
+    ++generation;
+    running = false;
+}
+
+// The first file gives the size and bit depth; the others are assumed to
+// match and are converted if they do not.
+void SliceLoader::loadFirst()
+{
+    cv::Mat first;
+    if (!cancelled)
+        first = cv::imread(files.first().toStdString(), cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
+    if (first.empty()) {
+        // Nothing to fill; the remaining files count as done.
+        remaining = 1;
+        done = files.size() - 1;
+        finishSlice();
+        return;
+    }
+
+    Volume volume = Volume::allocate(first.cols, first.rows, files.size(), voxelType(first.depth()));
+    if (!volume.isPaged()) {
+        cv::parallel_for_(cv::Range(0, volume.depth()), [&volume](const cv::Range &r) {
+            for (int z = r.start; z < r.end; ++z)
+                volume.axial(z).setTo(cv::Scalar::all(0));
+        });
+    }
+    {
+        std::lock_guard<std::mutex> lock(targetMutex);
+        target = volume;
+    }
+    store(0, first);
+
+    // Tasks are queued in file order, so the first slices finish first.
+    for (int i = 1; i < files.size(); ++i)
+        pool.start(new FunctionTask([this, i]() { loadSlice(i); }));
+    finishSlice();
+}
+
+void SliceLoader::loadSlice(int index)
+{
+    if (!cancelled) {
+        cv::Mat img = cv::imread(files[index].toStdString(), cv::IMREAD_GRAYSCALE | cv::IMREAD_ANYDEPTH);
+        if (!img.empty())
+            store(index, img);
+    }
+    finishSlice();
+}
+
+void SliceLoader::store(int index, cv::Mat img)
+{
+    if (img.type() != target.type())
+        img.convertTo(img, target.type());
+    cv::Mat slice = target.axial(index);
+    if (img.size() != slice.size())
+        cv::resize(img, slice, slice.size(), 0, 0, cv::INTER_AREA);
+    else
+        img.copyTo(slice);
+    target.markModified(index);
+    target.touch(index, index + 1);
+    loaded[index] = 1;
+    emit sliceLoaded(index);
+}
+
+void SliceLoader::finishSlice()
+{
+    emit progress(++done, files.size());
+    if (--remaining == 0) {
+        // A newer start() may already be running by the time this is delivered.
+        const int run = generation;
+        QMetaObject::invokeMethod(this, [this, run]() {
+            if (run == generation)
+                complete();
+        }, Qt::QueuedConnection);
+    }
+}
+
+// Runs in the GUI thread once every task has finished or been skipped.
+void SliceLoader::complete()
+{
+    running = false;
+
+    int count = 0;
+    for (char ok : loaded)
+        count += ok;
+
+    Volume result;
+    if (count == target.depth()) {
+        result = target;
+    } else if (count > 0) {
+        // Drop unreadable or cancelled files while keeping the order.
+        result = Volume::allocate(target.width(), target.height(), count, target.type());
+        result.setSpacing(target.spacing());
+        int z = 0;
+        for (int i = 0; i < target.depth(); ++i) {
+            if (loaded[i]) {
+                cv::Mat dst = result.axial(z);
+                target.axial(i).copyTo(dst);
+                result.release(z, z + 1);
+                ++z;
+            }
+        }
+    }
+
+    emit finished(result, cancelled);
+}
@@ -0,0 +1,67 @@
+#ifndef SLICELOADER_H
+#define SLICELOADER_H
+
+#include <QObject>
+#include <QStringList>
+#include <QThreadPool>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "volume.h"
+
+// Decodes an image stack on a thread pool straight into the slices of one
+// preallocated volume, keeping the file order. Slices keep the native size
+// and bit depth of the first file (8 or 16 bit, float for anything else).
+// The first file is decoded on the pool as well and becomes slice 0; the
+// volume is allocated from it and the other files are queued after.
+//
+// Signals are emitted from worker threads and arrive queued in the GUI thread.
+class SliceLoader : public QObject {
+    Q_OBJECT
+public:
+    explicit SliceLoader(QObject *parent = nullptr);
+    ~SliceLoader();
+
+    // False for an empty list. An unreadable first file ends the run with
+    // an empty volume.
+    bool start(const QStringList &files);
+    void cancel();
+    // Cancels and waits; finished() is not emitted for the stopped run.
+    void stop();
+    bool isRunning() const { return running; }
+
+    // The volume being filled; slices that are not loaded yet are black.
+    // Empty until the first slice is loaded.
+    Volume volume() const;
+
+    // Volume type used for images decoded with the given depth.
+    static int voxelType(int imageDepth);
+
+signals:
+    void sliceLoaded(int index);
+    void progress(int done, int total);
+    // Loaded slices in file order, without unreadable files.
+    void finished(const Volume &volume, bool cancelled);
+
+private:
+    QThreadPool pool;
+    mutable std::mutex targetMutex;   // target is set on the pool
+    Volume target;
+    QStringList files;
+    bool running = false;
+    int generation = 0;
+    std::vector<char> loaded;
+    std::atomic<bool> cancelled;
+    std::atomic<int> remaining;
+    std::atomic<int> done;
+
+    void loadFirst();
+    void loadSlice(int index);
+    void store(int index, cv::Mat image);
+    void finishSlice();
+    void complete();
+};
+
+#endif // SLICELOADER_H
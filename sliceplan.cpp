@@ -0,0 +1,193 @@
+#include "sliceplan.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/imgproc.hpp>
+
+#include "windowlevel.h"
+
+namespace {
+
+// Thumbnail of a slice, scaled to [0, 1] over the display range.
+cv::Mat signatureOf(const cv::Mat &slice, const WindowLevel &range)
+{
+    cv::Mat gray = slice;
+    if (slice.channels() == 3)
+        cv::cvtColor(slice, gray, cv::COLOR_BGR2GRAY);
+    cv::Mat small;
+    cv::resize(gray, small, cv::Size(SlicePlan::SignatureSize, SlicePlan::SignatureSize), 0, 0, cv::INTER_AREA);
+    cv::Mat signature;
+    const double scale = 1.0 / std::max(range.width(), 1e-6);
+    small.convertTo(signature, CV_32F, scale, -range.low() * scale);
+    return signature;
+}
+
+double difference(const cv::Mat &a, const cv::Mat &b)
+{
+    return cv::norm(a, b, cv::NORM_L1) / double(a.total());
+}
+
+// Keyframes of the runs of non-empty slices at one change threshold.
+std::vector<int> selectKeyframes(const std::vector<cv::Mat> &signatures, const std::vector<cv::Range> &runs,
+                                 double threshold, int maxGap)
+{
+    std::vector<int> keys;
+    for (const cv::Range &run : runs) {
+        int last = run.start;
+        keys.push_back(last);
+        for (int z = run.start + 1; z < run.end; ++z) {
+            if (z == run.end - 1 || z - last >= maxGap || difference(signatures[z], signatures[last]) > threshold) {
+                keys.push_back(z);
+                last = z;
+            }
+        }
+    }
+    return keys;
+}
+
+// Pairs of boxes of the same class on two keyframes, most overlapping first.
+std::vector<std::pair<int, int>> matchBoxes(const std::vector<Detection> &a, const std::vector<Detection> &b)
+{
+    std::vector<std::pair<float, std::pair<int, int>>> candidates;
+    for (int i = 0; i < int(a.size()); ++i) {
+        for (int j = 0; j < int(b.size()); ++j) {
+            if (a[i].classId != b[j].classId)
+                continue;
+            const float overlap = DetectionDecoder::overlap(a[i].box, b[j].box);
+            if (overlap >= SlicePlan::MatchOverlap)
+                candidates.push_back({ overlap, { i, j } });
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const auto &x, const auto &y) { return x.first > y.first; });
+
+    std::vector<bool> usedA(a.size(), false);
+    std::vector<bool> usedB(b.size(), false);
+    std::vector<std::pair<int, int>> matches;
+    for (const auto &candidate : candidates) {
+        const int i = candidate.second.first;
+        const int j = candidate.second.second;
+        if (usedA[i] || usedB[j])
+            continue;
+        usedA[i] = usedB[j] = true;
+        matches.push_back({ i, j });
+    }
+    return matches;
+}
+
+} // namespace
+
+
+SlicePlan SlicePlan::everySlice(int depth)
+{
+    SlicePlan plan;
+    plan.keys.resize(depth);
+    for (int z = 0; z < depth; ++z)
+        plan.keys[z] = z;
+    plan.sliceSources.assign(depth, DetectionResults::Inferred);
+    return plan;
+}
+
+SlicePlan SlicePlan::adaptive(const Volume &volume, double speedup, Task::Priority priority,
+                              const std::atomic<bool> *cancel)
+{
+    const int depth = volume.depth();
+    if (speedup <= 1.0)
+        return everySlice(depth);
+
+    const WindowLevel range = WindowLevel::fullRange(volume);
+    std::vector<cv::Mat> signatures(depth);
+    std::vector<char> empty(depth, 0);
+    TaskScheduler::parallelFor(cv::Range(0, depth), priority, [&](const cv::Range &slices) {
+        for (int z = slices.start; z < slices.end; ++z) {
+            volume.prefetch(z, z + 1);
+            signatures[z] = signatureOf(volume.axial(z), range);
+            volume.release(z, z + 1);
+            cv::Scalar mean, stddev;
+            cv::meanStdDev(signatures[z], mean, stddev);
+            empty[z] = stddev[0] < EmptyContrast;
+        }
+    }, 4, cancel);
+    if (cancel && *cancel)
+        return SlicePlan();
+
+    SlicePlan plan;
+    plan.sliceSources.assign(depth, DetectionResults::Skipped);
+    std::vector<cv::Range> runs;
+    int nonEmpty = 0;
+    for (int z = 0; z < depth; ++z) {
+        if (empty[z])
+            continue;
+        ++nonEmpty;
+        plan.sliceSources[z] = DetectionResults::Propagated;
+        if (runs.empty() || runs.back().end != z)
+            runs.push_back(cv::Range(z, z + 1));
+        else
+            runs.back().end = z + 1;
+    }
+
+    // The lowest threshold that stays within the keyframe budget. When the
+    // run ends and gaps alone already use it up, there is nothing to search.
+    const int budget = int(std::ceil(nonEmpty / speedup));
+    const int maxGap = std::max(2, int(std::ceil(MaxGapFactor * speedup)));
+    double low = 0.0;
+    double high = 1.0;
+    plan.keys = selectKeyframes(signatures, runs, high, maxGap);
+    for (int step = 0; step < 20 && int(plan.keys.size()) < budget; ++step) {
+        const double threshold = 0.5 * (low + high);
+        std::vector<int> keys = selectKeyframes(signatures, runs, threshold, maxGap);
+        if (int(keys.size()) <= budget) {
+            high = threshold;
+            plan.keys.swap(keys);
+        } else {
+            low = threshold;
+        }
+    }
+    for (int z : plan.keys)
+        plan.sliceSources[z] = DetectionResults::Inferred;
+    return plan;
+}
+
+void SlicePlan::propagate(std::vector<std::vector<Detection>> &found) const
+{
+    for (size_t k = 0; k + 1 < keys.size(); ++k) {
+        const int a = keys[k];
+        const int b = keys[k + 1];
+        // Runs end on keyframes, so a gap is either all propagated or all empty.
+        if (b - a < 2 || sliceSources[a + 1] != DetectionResults::Propagated)
+            continue;
+
+        const std::vector<Detection> &first = found[a];
+        const std::vector<Detection> &last = found[b];
+        const std::vector<std::pair<int, int>> matches = matchBoxes(first, last);
+        std::vector<bool> matchedFirst(first.size(), false);
+        std::vector<bool> matchedLast(last.size(), false);
+        for (const auto &match : matches) {
+            matchedFirst[match.first] = true;
+            matchedLast[match.second] = true;
+        }
+
+        for (int z = a + 1; z < b; ++z) {
+            const float t = float(z - a) / float(b - a);
+            std::vector<Detection> &slice = found[z];
+            slice.clear();
+            for (const auto &match : matches) {
+                const Detection &from = first[match.first];
+                const Detection &to = last[match.second];
+                auto lerp = [t](int x, int y) { return cvRound(x + t * (y - x)); };
+                Detection detection;
+                detection.box = cv::Rect(lerp(from.box.x, to.box.x), lerp(from.box.y, to.box.y),
+                                         lerp(from.box.width, to.box.width), lerp(from.box.height, to.box.height));
+                detection.score = from.score + t * (to.score - from.score);
+                detection.classId = from.classId;
+                slice.push_back(detection);
+            }
+            const std::vector<Detection> &nearer = t < 0.5f ? first : last;
+            const std::vector<bool> &matched = t < 0.5f ? matchedFirst : matchedLast;
+            for (size_t i = 0; i < nearer.size(); ++i) {
+                if (!matched[i])
+                    slice.push_back(nearer[i]);
+            }
+        }
+    }
+}
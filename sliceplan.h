@@ -0,0 +1,50 @@
+#ifndef SLICEPLAN_H
+#define SLICEPLAN_H
+
+#include <atomic>
+#include <vector>
+
+#include "detectionresults.h"
+#include "taskscheduler.h"
+#include "volume.h"
+
+// Which slices of a volume a detection run sends through the network.
+//
+// The adaptive plan reduces every slice to a SignatureSize^2 thumbnail,
+// mapped through the volume's full intensity range. Slices whose thumbnail
+// has almost no contrast are empty background and skipped. Within each
+// run of non-empty slices, the first and last slice are keyframes, and so
+// is every slice whose thumbnail differs from the last keyframe's by more
+// than a threshold (mean absolute difference) or that is MaxGapFactor x
+// speedup slices past it. The threshold is searched for so that about one
+// in `speedup` non-empty slices is a keyframe, which puts keyframes where
+// the slices change most.
+//
+// Slices between two keyframes get their detections from both: boxes of
+// the same class matched across the gap (by overlap) are interpolated,
+// unmatched ones are copied from the nearer keyframe.
+class SlicePlan {
+public:
+    static const int SignatureSize = 32;
+    static constexpr double EmptyContrast = 0.01;   // thumbnail stddev, of the full range
+    static const int MaxGapFactor = 2;
+    static constexpr float MatchOverlap = 0.3f;
+
+    // Every slice a keyframe.
+    static SlicePlan everySlice(int depth);
+    // Keyframes for about 1 / speedup of the non-empty slices.
+    static SlicePlan adaptive(const Volume &volume, double speedup, Task::Priority priority = Task::Compute,
+                              const std::atomic<bool> *cancel = nullptr);
+
+    const std::vector<int> &keyframes() const { return keys; }
+    const std::vector<DetectionResults::SliceSource> &sources() const { return sliceSources; }
+
+    // Fills the propagated slices of found from the keyframes' detections.
+    void propagate(std::vector<std::vector<Detection>> &found) const;
+
+private:
+    std::vector<int> keys;
+    std::vector<DetectionResults::SliceSource> sliceSources;
+};
+
+#endif // SLICEPLAN_H
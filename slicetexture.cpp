@@ -0,0 +1,86 @@
+#include "slicetexture.h"
+
+#include <Qt3DRender/QTextureImageData>
+#include <QOpenGLTexture>
+
+#include <opencv2/imgproc.hpp>
+
+SliceTextureGenerator::SliceTextureGenerator(const Volume &volume, int z, const WindowLevel &window)
+    : volume(volume), z(z), version(volume.sliceVersion(z)), window(window)
+{
+}
+
+Qt3DRender::QTextureImageDataPtr SliceTextureGenerator::operator()()
+{
+    const int width = volume.width();
+    const int height = volume.height();
+
+    QByteArray bytes(width * height * 4, Qt::Uninitialized);
+    cv::Mat rgba(height, width, CV_8UC4, bytes.data());
+
+    const cv::Mat slice = volume.axial(z);
+    if (slice.type() == CV_8UC3)
+        cv::cvtColor(slice, rgba, cv::COLOR_BGR2RGBA);
+    else
+        cv::cvtColor(window.apply(slice), rgba, cv::COLOR_GRAY2RGBA);
+
+    // Same orientation as QTextureImage's default mirrored=true.
+    cv::flip(rgba, rgba, 0);
+
+    Qt3DRender::QTextureImageDataPtr data = Qt3DRender::QTextureImageDataPtr::create();
+    data->setTarget(QOpenGLTexture::Target2D);
+    data->setFormat(QOpenGLTexture::RGBA8_UNorm);
+    data->setPixelFormat(QOpenGLTexture::RGBA);
+    data->setPixelType(QOpenGLTexture::UInt8);
+    data->setWidth(width);
+    data->setHeight(height);
+    data->setDepth(1);
+    data->setFaces(1);
+    data->setLayers(1);
+    data->setMipLevels(1);
+    data->setData(bytes, 4);
+    return data;
+}
+
+bool SliceTextureGenerator::operator==(const Qt3DRender::QTextureImageDataGenerator &other) const
+{
+    const SliceTextureGenerator *otherGenerator = Qt3DRender::functor_cast<SliceTextureGenerator>(&other);
+    return otherGenerator && otherGenerator->z == z && otherGenerator->version == version
+        && otherGenerator->window == window;
+}
+
+
+SliceTextureImage::SliceTextureImage(int z, Qt3DCore::QNode *parent)
+    : Qt3DRender::QAbstractTextureImage(parent), z(z)
+{
+}
+
+bool SliceTextureImage::setVolume(const Volume &newVolume)
+{
+    const quint64 newVersion = newVolume.sliceVersion(z);
+    volume = newVolume;
+    if (newVersion == version)
+        return false;
+
+    version = newVersion;
+    notifyDataGeneratorChanged();
+    return true;
+}
+
+bool SliceTextureImage::setWindow(const WindowLevel &newWindow)
+{
+    // Colour slices are uploaded as they are.
+    if (newWindow == window || volume.channels() != 1) {
+        window = newWindow;
+        return false;
+    }
+
+    window = newWindow;
+    notifyDataGeneratorChanged();
+    return true;
+}
+
+Qt3DRender::QTextureImageDataGeneratorPtr SliceTextureImage::dataGenerator() const
+{
+    return Qt3DRender::QTextureImageDataGeneratorPtr(new SliceTextureGenerator(volume, z, window));
+}
@@ -0,0 +1,51 @@
+#ifndef SLICETEXTURE_H
+#define SLICETEXTURE_H
+
+#include <Qt3DRender/QAbstractTextureImage>
+#include <Qt3DRender/QTextureImageDataGenerator>
+
+#include "volume.h"
+#include "windowlevel.h"
+
+// Builds RGBA texture data for one axial slice straight from the volume
+// buffer, mapped through the display window. Runs on the Qt3D aspect thread,
+// so nothing touches the disk and the GUI thread never encodes anything.
+class SliceTextureGenerator : public Qt3DRender::QTextureImageDataGenerator {
+public:
+    SliceTextureGenerator(const Volume &volume, int z, const WindowLevel &window);
+
+    Qt3DRender::QTextureImageDataPtr operator()() override;
+    bool operator==(const Qt3DRender::QTextureImageDataGenerator &other) const override;
+
+    QT3D_FUNCTOR(SliceTextureGenerator)
+
+private:
+    Volume volume;     // shallow copy, keeps the buffer alive
+    int z;
+    quint64 version;   // slice content version, used for change detection
+    WindowLevel window;
+};
+
+// Texture image bound to one slice of the volume. setVolume() and setWindow()
+// only re-upload when the slice content version or the window differs from
+// what is already on the GPU.
+class SliceTextureImage : public Qt3DRender::QAbstractTextureImage {
+    Q_OBJECT
+public:
+    explicit SliceTextureImage(int z, Qt3DCore::QNode *parent = nullptr);
+
+    bool setVolume(const Volume &volume);
+    bool setWindow(const WindowLevel &window);
+    quint64 uploadedVersion() const { return version; }
+
+protected:
+    Qt3DRender::QTextureImageDataGeneratorPtr dataGenerator() const override;
+
+private:
+    Volume volume;
+    int z;
+    quint64 version = 0;
+    WindowLevel window;
+};
+
+#endif // SLICETEXTURE_H
@@ -0,0 +1,153 @@
+#include "taskscheduler.h"
+
+#include <QCoreApplication>
+#include <QThread>
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+
+bool Task::isFinished() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return complete;
+}
+
+void Task::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return complete; });
+}
+
+QString Task::errorString() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return error;
+}
+
+void Task::setProgress(qint64 doneCount, qint64 total)
+{
+    const int permille = total > 0 ? int(doneCount * 1000 / total) : 0;
+    if (reportedPermille.exchange(permille) != permille)
+        emit progressChanged(permille, 1000);
+}
+
+void Task::setError(const QString &message)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error.isEmpty())
+            error = message;
+    }
+    cancel();
+}
+
+bool Task::parallelFor(int n, const std::function<void(int)> &fn)
+{
+    TaskScheduler::parallelFor(cv::Range(0, n), lane, [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end && !isCancelled(); ++i) {
+            try {
+                fn(i);
+            } catch (const std::exception &e) {
+                setError(QString::fromLocal8Bit(e.what()));
+            }
+        }
+    }, 1, &cancelled, [this](int doneCount, int total) { setProgress(doneCount, total); });
+    return !isCancelled();
+}
+
+void Task::finish()
+{
+    const bool wasCancelled = isCancelled();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        complete = true;
+    }
+    done.notify_all();
+
+    // Sent from the task's (GUI) thread, so a connection made right after
+    // run() returned can never miss it.
+    QMetaObject::invokeMethod(this, [this, wasCancelled]() {
+        emit finished(wasCancelled);
+        deleteLater();
+    }, Qt::QueuedConnection);
+}
+
+
+TaskScheduler::TaskScheduler()
+{
+    threads.setMaxThreadCount(std::max(QThread::idealThreadCount(), 2));
+}
+
+TaskScheduler &TaskScheduler::instance()
+{
+    static TaskScheduler scheduler;
+    return scheduler;
+}
+
+Task *TaskScheduler::run(Task::Priority priority, std::function<void(Task &)> job)
+{
+    Task *task = new Task(priority);
+    if (QCoreApplication::instance())
+        task->moveToThread(QCoreApplication::instance()->thread());
+    threads.start([task, job]() {
+        if (!task->isCancelled()) {
+            try {
+                job(*task);
+            } catch (const std::exception &e) {
+                task->setError(QString::fromLocal8Bit(e.what()));
+            }
+        }
+        task->finish();
+    }, priority);
+    return task;
+}
+
+void TaskScheduler::parallelFor(const cv::Range &range, Task::Priority priority,
+                                const std::function<void(const cv::Range &)> &body, int grain,
+                                const std::atomic<bool> *cancel,
+                                const std::function<void(int, int)> &progress)
+{
+    const int count = range.end - range.start;
+    if (count <= 0)
+        return;
+    grain = std::max(grain, 1);
+    const int chunks = (count + grain - 1) / grain;
+
+    // Helpers may start after the loop is over; they then find no chunk left
+    // and never touch the caller's state, which the shared block outlives.
+    struct Loop {
+        std::atomic<int> next { 0 };
+        std::atomic<int> reported { 0 };
+        std::atomic<int> finished { 0 };
+        std::mutex mutex;
+        std::condition_variable allDone;
+    };
+    auto loop = std::make_shared<Loop>();
+    const std::function<void(const cv::Range &)> *bodyPtr = &body;
+    const std::function<void(int, int)> *progressPtr = &progress;
+
+    auto work = [=]() {
+        for (int c = loop->next++; c < chunks; c = loop->next++) {
+            const cv::Range chunk(range.start + c * grain, std::min(range.start + (c + 1) * grain, range.end));
+            if (!cancel || !cancel->load())
+                (*bodyPtr)(chunk);
+            if (*progressPtr)
+                (*progressPtr)(std::min(++loop->reported * grain, count), count);
+            // Last access to the caller's state; the caller may return after this.
+            if (++loop->finished == chunks) {
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                loop->allDone.notify_all();
+            }
+        }
+    };
+
+    TaskScheduler &scheduler = instance();
+    const int helpers = std::min(chunks - 1, scheduler.threadCount() - 1);
+    for (int i = 0; i < helpers; ++i)
+        scheduler.threads.start(work, priority);
+
+    work();
+    std::unique_lock<std::mutex> lock(loop->mutex);
+    loop->allDone.wait(lock, [&]() { return loop->finished.load() == chunks; });
+}
@@ -0,0 +1,96 @@
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <QObject>
+#include <QString>
+#include <QThreadPool>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+#include <opencv2/core.hpp>
+
+// Handle of one job running on the TaskScheduler. Created and owned by the
+// scheduler; it deletes itself (deleteLater) after finished(), so dialogs
+// keep it in a QPointer. progressChanged() is emitted from the worker and
+// arrives queued; finished() is always sent from the GUI thread.
+class Task : public QObject {
+    Q_OBJECT
+public:
+    // Lanes, highest first: runnables of a higher lane are always dequeued
+    // before those of a lower one.
+    enum Priority { Background = 0, Compute = 1, Interactive = 2 };
+
+    Priority priority() const { return lane; }
+
+    // Safe from any thread.
+    void cancel() { cancelled = true; }
+    bool isCancelled() const { return cancelled; }
+    // For code that polls a flag rather than a task.
+    const std::atomic<bool> *cancelFlag() const { return &cancelled; }
+    bool isFinished() const;
+    void wait();
+    QString errorString() const;
+
+    // Called by the job. Progress signals are only sent when the per-mille
+    // value changes.
+    void setProgress(qint64 done, qint64 total);
+    void setError(const QString &message);
+
+    // Runs fn(i) for i in [0, n) on the job's thread plus helpers in the
+    // job's lane, reporting progress. Returns false if cancelled.
+    bool parallelFor(int n, const std::function<void(int)> &fn);
+
+signals:
+    void progressChanged(int done, int total);
+    void finished(bool cancelled);
+
+private:
+    friend class TaskScheduler;
+    explicit Task(Priority priority) : lane(priority), cancelled(false) {}
+
+    Priority lane;
+    std::atomic<bool> cancelled;
+    std::atomic<int> reportedPermille { -1 };
+    mutable std::mutex mutex;
+    std::condition_variable done;
+    bool complete = false;
+    QString error;
+
+    void finish();
+};
+
+// App-wide thread pool with priority lanes.
+//
+// Jobs are queued by lane (interactive rendering, then user-started compute,
+// then prefetch and other background work). parallelFor() splits a loop
+// across the pool: the calling thread and helper runnables queued in the
+// same lane all pull indices from one shared counter, so idle workers take
+// over whatever is left and the caller never waits on a queue that is busy
+// with other jobs.
+class TaskScheduler {
+public:
+    static TaskScheduler &instance();
+
+    // Starts job(task) in the given lane and returns its handle.
+    Task *run(Task::Priority priority, std::function<void(Task &)> job);
+
+    // Runs body on chunks of range with `grain` indices each, on the calling
+    // thread plus pool helpers. Stops early when *cancel becomes true;
+    // progress(done, total) is called after each chunk from the thread that
+    // ran it.
+    static void parallelFor(const cv::Range &range, Task::Priority priority,
+                            const std::function<void(const cv::Range &)> &body, int grain = 1,
+                            const std::atomic<bool> *cancel = nullptr,
+                            const std::function<void(int, int)> &progress = nullptr);
+
+    int threadCount() const { return threads.maxThreadCount(); }
+
+private:
+    TaskScheduler();
+    QThreadPool threads;
+};
+
+#endif // TASKSCHEDULER_H
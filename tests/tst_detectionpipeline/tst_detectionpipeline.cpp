@@ -0,0 +1,92 @@
+#include <QtTest>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <numeric>
+#include <thread>
+
+#include "batchinference.h"
+#include "detectionpipeline.h"
+
+namespace {
+
+const std::chrono::seconds Deadline(10);
+
+std::vector<int> itemRange(int count)
+{
+    std::vector<int> items(count);
+    std::iota(items.begin(), items.end(), 0);
+    return items;
+}
+
+void nothing(DetectionPipeline::Batch &)
+{
+}
+
+} // namespace
+
+class TestDetectionPipeline : public QObject {
+    Q_OBJECT
+private slots:
+    void runsEveryItem();
+    void cancelWhilePostprocessingLags();
+    void queueWakesOnCancel();
+};
+
+void TestDetectionPipeline::runsEveryItem()
+{
+    const std::vector<int> items = itemRange(57);
+    BatchInference batches(4);
+    DetectionPipeline pipeline(3, 2);
+    std::atomic<int> seen(0);
+    const bool ran = pipeline.run(items, batches, nothing, nothing, [&](DetectionPipeline::Batch &batch) {
+        seen += batch.count;
+    });
+    QVERIFY(ran);
+    QCOMPARE(seen.load(), int(items.size()));
+}
+
+// Inference outpaces postprocessing, so the queue between them is full and
+// the inference stage blocked on it when the run is cancelled.
+void TestDetectionPipeline::cancelWhilePostprocessingLags()
+{
+    const std::vector<int> items = itemRange(200);
+    BatchInference batches(1);
+    DetectionPipeline pipeline(2, 1);
+    std::atomic<bool> cancel(false);
+    std::atomic<int> postprocessed(0);
+    auto slow = [&](DetectionPipeline::Batch &) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (++postprocessed == 2)
+            cancel = true;
+    };
+
+    std::future<bool> run = std::async(std::launch::async, [&]() {
+        return pipeline.run(items, batches, nothing, nothing, slow, &cancel);
+    });
+    if (run.wait_for(Deadline) != std::future_status::ready)
+        qFatal("DetectionPipeline::run did not return after it was cancelled");
+    QVERIFY(!run.get());
+    QVERIFY(postprocessed < int(items.size()));
+}
+
+void TestDetectionPipeline::queueWakesOnCancel()
+{
+    std::atomic<bool> cancel(false);
+    BoundedQueue<int> queue(1, &cancel);
+    QVERIFY(queue.push(1));
+
+    std::future<bool> push = std::async(std::launch::async, [&]() { return queue.push(2); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    cancel = true;
+    if (push.wait_for(Deadline) != std::future_status::ready)
+        qFatal("BoundedQueue::push did not wake on cancel");
+    QVERIFY(!push.get());
+
+    int item = 0;
+    QVERIFY(!queue.pop(item));
+}
+
+QTEST_GUILESS_MAIN(TestDetectionPipeline)
+#include "tst_detectionpipeline.moc"
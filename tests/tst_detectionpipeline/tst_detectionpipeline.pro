@@ -0,0 +1,24 @@
+QT += core testlib
+QT -= gui
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+TARGET = tst_detectionpipeline
+
+APP = $$PWD/../..
+INCLUDEPATH += $$APP
+
+SOURCES += \
+    tst_detectionpipeline.cpp \
+    $$APP/batchinference.cpp \
+    $$APP/detectionpipeline.cpp
+
+HEADERS += \
+    $$APP/batchinference.h \
+    $$APP/detectionpipeline.h
+
+win32: LIBS += -L$$PWD/../../../../../../opencv-4.5.4/build/install/x64/mingw/lib/ -llibopencv_world454.dll
+
+INCLUDEPATH += $$PWD/../../../../../../opencv-4.5.4/build/install/include
+DEPENDPATH += $$PWD/../../../../../../opencv-4.5.4/build/install/include
@@ -0,0 +1,108 @@
+#include <QtTest>
+
+#include <cstring>
+
+#include <opencv2/core.hpp>
+
+#include "filtergraph.h"
+#include "taskscheduler.h"
+#include "volume.h"
+#include "volumehistory.h"
+
+namespace {
+
+Volume randomVolume(int width, int height, int depth)
+{
+    Volume volume = Volume::allocate(width, height, depth, CV_8UC1);
+    cv::RNG rng(12345);
+    for (int z = 0; z < depth; ++z) {
+        cv::Mat slice = volume.axial(z);
+        rng.fill(slice, cv::RNG::UNIFORM, 0, 256);
+    }
+    return volume;
+}
+
+bool sameVoxels(const Volume &a, const Volume &b)
+{
+    if (!a.sameGeometry(b) || a.type() != b.type())
+        return false;
+    const size_t rowBytes = size_t(a.width()) * a.elemSize();
+    for (int z = 0; z < a.depth(); ++z) {
+        for (int y = 0; y < a.height(); ++y) {
+            if (std::memcmp(a.axial(z).ptr(y), b.axial(z).ptr(y), rowBytes) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+// A chain that takes three passes: 3D, 2D, 3D.
+FilterGraph mixedChain(const Volume &volume)
+{
+    FilterGraph graph(volume);
+    graph.append(FilterOp(FilterOp::Gaussian3D, 1.5));
+    graph.append(FilterOp(FilterOp::Invert, 0.0));
+    graph.append(FilterOp(FilterOp::GaussianBlur, 1.0));
+    graph.append(FilterOp(FilterOp::Mean3D, 1.0));
+    return graph;
+}
+
+// Runs the chain over volume as one recorded edit; false if it failed.
+bool runRecorded(VolumeHistory &history, const FilterGraph &graph, const Volume &volume)
+{
+    history.beginEdit(graph.name(), volume);
+    VolumeHistory *edits = &history;
+    bool ran = false;
+    Task *task = TaskScheduler::instance().run(Task::Compute, [&](Task &job) {
+        ran = graph.run(volume, job, [edits](int z) { edits->saveSlice(z); },
+                        [edits](int z) { edits->commitSlice(z); });
+    });
+    task->wait();
+    return ran;
+}
+
+} // namespace
+
+class TestVolumeHistory : public QObject {
+    Q_OBJECT
+private slots:
+    void undoRedoMixedChain();
+    void abortMixedChain();
+};
+
+// Every pass of the chain writes every slice; undo and redo must still
+// give back the exact voxels.
+void TestVolumeHistory::undoRedoMixedChain()
+{
+    Volume volume = randomVolume(150, 97, 9);
+    const Volume original = volume.clone();
+    VolumeHistory history;
+    history.setCurrentVolume(volume);
+
+    QVERIFY(runRecorded(history, mixedChain(volume), volume));
+    history.endEdit();
+    const Volume edited = volume.clone();
+    QVERIFY(!sameVoxels(edited, original));
+
+    QVERIFY(history.undo());
+    QVERIFY(sameVoxels(history.currentVolume(), original));
+    QVERIFY(history.redo());
+    QVERIFY(sameVoxels(history.currentVolume(), edited));
+    QVERIFY(history.undo());
+    QVERIFY(sameVoxels(history.currentVolume(), original));
+}
+
+void TestVolumeHistory::abortMixedChain()
+{
+    Volume volume = randomVolume(130, 70, 7);
+    const Volume original = volume.clone();
+    VolumeHistory history;
+
+    QVERIFY(runRecorded(history, mixedChain(volume), volume));
+    history.abortEdit();
+    QVERIFY(sameVoxels(volume, original));
+    QVERIFY(!history.canUndo());
+}
+
+QTEST_GUILESS_MAIN(TestVolumeHistory)
+#include "tst_volumehistory.moc"
@@ -0,0 +1,40 @@
+# Volume and VolumeFilter use QVector3D from QtGui.
+QT += core gui testlib
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+TARGET = tst_volumehistory
+
+APP = $$PWD/../..
+INCLUDEPATH += $$APP
+
+SOURCES += \
+    tst_volumehistory.cpp \
+    $$APP/filtergraph.cpp \
+    $$APP/pagedstorage.cpp \
+    $$APP/taskscheduler.cpp \
+    $$APP/volume.cpp \
+    $$APP/volumefile.cpp \
+    $$APP/volumefilter.cpp \
+    $$APP/volumehistory.cpp \
+    $$APP/volumepyramid.cpp \
+    $$APP/volumestatistics.cpp \
+    $$APP/windowlevel.cpp
+
+HEADERS += \
+    $$APP/filtergraph.h \
+    $$APP/pagedstorage.h \
+    $$APP/taskscheduler.h \
+    $$APP/volume.h \
+    $$APP/volumefile.h \
+    $$APP/volumefilter.h \
+    $$APP/volumehistory.h \
+    $$APP/volumepyramid.h \
+    $$APP/volumestatistics.h \
+    $$APP/windowlevel.h
+
+win32: LIBS += -L$$PWD/../../../../../../opencv-4.5.4/build/install/x64/mingw/lib/ -llibopencv_world454.dll
+
+INCLUDEPATH += $$PWD/../../../../../../opencv-4.5.4/build/install/include
+DEPENDPATH += $$PWD/../../../../../../opencv-4.5.4/build/install/include
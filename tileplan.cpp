@@ -0,0 +1,175 @@
+#include "tileplan.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include <opencv2/imgproc.hpp>
+
+#include "windowlevel.h"
+
+namespace {
+
+// Starts of tiles along one axis, evenly spread so that the first starts
+// at 0, the last ends at length and neighbours overlap by at least overlap.
+std::vector<int> startsAlong(int length, int tile, double overlap)
+{
+    if (length <= tile)
+        return { 0 };
+    const int stride = std::max(1, int(tile * (1.0 - overlap)));
+    const int steps = int(std::ceil(double(length - tile) / stride));
+    std::vector<int> starts(steps + 1);
+    for (int i = 0; i <= steps; ++i)
+        starts[i] = int(std::lround(double(i) * (length - tile) / steps));
+    return starts;
+}
+
+} // namespace
+
+
+TilePlan TilePlan::wholeSlices(const Volume &volume, const std::vector<int> &slices)
+{
+    TilePlan plan;
+    plan.tiles.reserve(slices.size());
+    for (int z : slices)
+        plan.tiles.push_back({ z, cv::Rect(0, 0, volume.width(), volume.height()) });
+    return plan;
+}
+
+TilePlan TilePlan::tiled(const Volume &volume, const std::vector<int> &slices, int tileSize,
+                         Task::Priority priority, const std::atomic<bool> *cancel)
+{
+    const std::vector<cv::Rect> rects = grid(cv::Size(volume.width(), volume.height()), tileSize);
+    const WindowLevel range = WindowLevel::fullRange(volume);
+    const double minDeviation = BackgroundContrast * std::max(range.width(), 1e-6);
+
+    // Which tiles of each slice hold more than background.
+    std::vector<std::vector<char>> kept(slices.size());
+    TaskScheduler::parallelFor(cv::Range(0, int(slices.size())), priority, [&](const cv::Range &part) {
+        for (int k = part.start; k < part.end; ++k) {
+            const int z = slices[k];
+            volume.prefetch(z, z + 1);
+            cv::Mat slice = volume.axial(z);
+            if (slice.channels() == 3)
+                cv::cvtColor(slice, slice, cv::COLOR_BGR2GRAY);
+            kept[k].resize(rects.size());
+            for (size_t t = 0; t < rects.size(); ++t) {
+                cv::Scalar mean, stddev;
+                cv::meanStdDev(slice(rects[t]), mean, stddev);
+                kept[k][t] = stddev[0] >= minDeviation;
+            }
+            volume.release(z, z + 1);
+        }
+    }, 1, cancel);
+    if (cancel && *cancel)
+        return TilePlan();
+
+    TilePlan plan;
+    plan.split = true;
+    for (size_t k = 0; k < slices.size(); ++k) {
+        for (size_t t = 0; t < rects.size(); ++t) {
+            if (kept[k][t])
+                plan.tiles.push_back({ slices[k], rects[t] });
+            else
+                ++plan.skipped;
+        }
+    }
+    return plan;
+}
+
+std::vector<cv::Rect> TilePlan::grid(const cv::Size &size, int tileSize, double overlap)
+{
+    const std::vector<int> xs = startsAlong(size.width, tileSize, overlap);
+    const std::vector<int> ys = startsAlong(size.height, tileSize, overlap);
+    std::vector<cv::Rect> rects;
+    rects.reserve(xs.size() * ys.size());
+    for (int y : ys) {
+        for (int x : xs)
+            rects.push_back(cv::Rect(x, y, std::min(tileSize, size.width), std::min(tileSize, size.height)));
+    }
+    return rects;
+}
+
+std::vector<int> TilePlan::items() const
+{
+    std::vector<int> indices(tiles.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    return indices;
+}
+
+void TilePlan::merge(std::vector<Detection> &detections) const
+{
+    struct Match {
+        float overlap;
+        int a, b;
+    };
+    std::vector<Match> matches;
+    for (int a = 0; a < int(detections.size()); ++a) {
+        const Detection &first = detections[a];
+        for (int b = a + 1; b < int(detections.size()); ++b) {
+            const Detection &second = detections[b];
+            if (first.classId != second.classId || first.tile < 0 || second.tile < 0 || first.tile == second.tile)
+                continue;
+            const cv::Rect common = first.box & second.box;
+            const cv::Rect shared = tiles[first.tile].rect & tiles[second.tile].rect;
+            if (common.empty() || float((common & shared).area()) < SharedFraction * float(common.area()))
+                continue;
+            const float overlap = float(common.area()) / float(std::min(first.box.area(), second.box.area()));
+            if (overlap > MergeOverlap)
+                matches.push_back({ overlap, a, b });
+        }
+    }
+    if (matches.empty())
+        return;
+    std::sort(matches.begin(), matches.end(), [](const Match &x, const Match &y) { return x.overlap > y.overlap; });
+
+    // Groups as a union-find forest; each root knows the tiles of its group.
+    std::vector<int> parent(detections.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    std::vector<std::vector<int>> groupTiles(detections.size());
+    for (size_t i = 0; i < detections.size(); ++i)
+        groupTiles[i].push_back(detections[i].tile);
+    auto root = [&parent](int i) {
+        while (parent[i] != i)
+            i = parent[i] = parent[parent[i]];
+        return i;
+    };
+    for (const Match &match : matches) {
+        const int a = root(match.a);
+        const int b = root(match.b);
+        if (a == b)
+            continue;
+        std::vector<int> &tilesA = groupTiles[a];
+        std::vector<int> &tilesB = groupTiles[b];
+        const bool disjoint = std::none_of(tilesB.begin(), tilesB.end(), [&tilesA](int tile) {
+            return std::find(tilesA.begin(), tilesA.end(), tile) != tilesA.end();
+        });
+        if (!disjoint)
+            continue;
+        parent[b] = a;
+        tilesA.insert(tilesA.end(), tilesB.begin(), tilesB.end());
+    }
+
+    std::vector<Detection> merged;
+    std::vector<int> slot(detections.size(), -1);
+    for (size_t i = 0; i < detections.size(); ++i) {
+        const int r = root(int(i));
+        if (slot[r] < 0) {
+            slot[r] = int(merged.size());
+            merged.push_back(detections[i]);
+            continue;
+        }
+        Detection &group = merged[slot[r]];
+        group.box |= detections[i].box;
+        group.score = std::max(group.score, detections[i].score);
+    }
+    detections.swap(merged);
+}
+
+std::vector<int> TilePlan::tilesPerSlice(int depth) const
+{
+    std::vector<int> counts(depth, 0);
+    for (const Tile &tile : tiles)
+        ++counts[tile.slice];
+    return counts;
+}
@@ -0,0 +1,70 @@
+#ifndef TILEPLAN_H
+#define TILEPLAN_H
+
+#include <atomic>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "detectiondecoder.h"
+#include "taskscheduler.h"
+#include "volume.h"
+
+// The network inputs of a detection run: tiles of slices, in slice pixels.
+//
+// Untiled, each slice is one tile, squashed to the network input. Tiled,
+// each slice is cut into a grid of tileSize squares (the network input
+// size, so tiles go in at native resolution) that overlap their neighbours
+// by at least Overlap; the last row and column end at the slice border.
+// Tiles whose intensity standard deviation is below BackgroundContrast of
+// the volume's full range hold nothing but background and are left out.
+// Detections of one slice's tiles are joined across tile borders with
+// merge().
+class TilePlan {
+public:
+    static constexpr double Overlap = 0.2;               // of the tile size
+    static constexpr double BackgroundContrast = 0.01;   // tile stddev, of the full range
+    static constexpr float MergeOverlap = 0.5f;          // of the smaller box, see merge()
+    static constexpr float SharedFraction = 0.9f;        // see merge()
+
+    struct Tile {
+        int slice = 0;
+        cv::Rect rect;
+    };
+
+    // One tile per slice, covering it.
+    static TilePlan wholeSlices(const Volume &volume, const std::vector<int> &slices);
+    // Overlapping non-background tiles of the slices. Empty if cancelled.
+    static TilePlan tiled(const Volume &volume, const std::vector<int> &slices, int tileSize,
+                          Task::Priority priority = Task::Compute, const std::atomic<bool> *cancel = nullptr);
+
+    // Grid of at most tileSize squares covering a slice of this size.
+    static std::vector<cv::Rect> grid(const cv::Size &size, int tileSize, double overlap = Overlap);
+
+    bool isTiled() const { return split; }
+    int count() const { return int(tiles.size()); }
+    const Tile &tile(int i) const { return tiles[i]; }
+    // Indices of all tiles, slice after slice, for DetectionPipeline::run().
+    std::vector<int> items() const;
+    // Tiles of each slice of a volume this deep.
+    std::vector<int> tilesPerSlice(int depth) const;
+    int skippedCount() const { return skipped; }
+
+    // Joins the detections of one slice that are the same object seen from
+    // two overlapping tiles, tagged with Detection::tile. Two boxes of one
+    // class from different tiles match when their intersection covers more
+    // than MergeOverlap of the smaller box (a box cut off at a tile border
+    // lies mostly inside the whole one) and at least SharedFraction of that
+    // intersection lies where the two tiles overlap. Matches are taken best
+    // first and measured on the boxes as found, and a group never holds two
+    // boxes of one tile, which per-tile suppression already told apart. A
+    // group becomes the box enclosing its members, with their best score.
+    void merge(std::vector<Detection> &detections) const;
+
+private:
+    std::vector<Tile> tiles;
+    bool split = false;
+    int skipped = 0;   // background tiles left out
+};
+
+#endif // TILEPLAN_H
@@ -0,0 +1,215 @@
+#include "volume.h"
+#include "pagedstorage.h"
+
+#include <algorithm>
+#include <cstring>
+
+cv::Mat VolumePlane::toMat() const
+{
+    if (isEmpty())
+        return cv::Mat();
+
+    if (isContiguousRows())
+        return cv::Mat(rows, cols, type, data, rowStep);
+
+    cv::Mat out(rows, cols, type);
+    const size_t elem = CV_ELEM_SIZE(type);
+    for (int r = 0; r < rows; ++r) {
+        const uchar *src = data + r * rowStep;
+        uchar *dst = out.ptr(r);
+        for (int c = 0; c < cols; ++c, src += colStep, dst += elem)
+            std::memcpy(dst, src, elem);
+    }
+    return out;
+}
+
+
+Volume::Volume(int width, int height, int depth, int type)
+{
+    // cv::Mat allocations go through cv::fastMalloc, so the buffer is aligned
+    // for SIMD loads and every slice starts at a fixed stride from the first.
+    const int sizes[3] = { depth, height, width };
+    buffer.create(3, sizes, type);
+    initVersions(depth);
+}
+
+quint64 Volume::nextVersion()
+{
+    static std::atomic<quint64> counter(0);
+    return ++counter;
+}
+
+void Volume::initVersions(int depth)
+{
+    versions = std::make_shared<std::vector<std::atomic<quint64>>>(depth);
+    firstVersion = 0;
+    for (int z = 0; z < depth; ++z)
+        (*versions)[z].store(nextVersion());
+}
+
+quint64 Volume::sliceVersion(int z) const
+{
+    return versions ? (*versions)[firstVersion + z].load() : 0;
+}
+
+void Volume::beginModify(int z)
+{
+    if (versions)
+        (*versions)[firstVersion + z].store(0);
+    if (storage) {
+        const int first = int((data() - storage->data()) / sliceStride());
+        storage->markWritten(first + z, first + z + 1);
+    }
+}
+
+void Volume::markModified(int z)
+{
+    if (versions)
+        (*versions)[firstVersion + z].store(nextVersion());
+    if (storage) {
+        const int first = int((data() - storage->data()) / sliceStride());
+        storage->markWritten(first + z, first + z + 1);
+    }
+}
+
+void Volume::markModified()
+{
+    for (int z = 0; z < depth(); ++z)
+        markModified(z);
+}
+
+Volume Volume::fromSlices(const QVector<cv::Mat> &slices)
+{
+    if (slices.isEmpty() || slices.first().empty())
+        return Volume();
+
+    const cv::Mat &first = slices.first();
+    Volume volume(first.cols, first.rows, slices.size(), first.type());
+    for (int z = 0; z < slices.size(); ++z) {
+        cv::Mat dst = volume.axial(z);
+        if (slices[z].size() == first.size() && slices[z].type() == first.type())
+            slices[z].copyTo(dst);
+        else
+            dst.setTo(cv::Scalar::all(0));
+    }
+    return volume;
+}
+
+Volume Volume::allocate(int width, int height, int depth, int type)
+{
+    const qint64 bytes = qint64(width) * height * depth * CV_ELEM_SIZE(type);
+    if (bytes <= PagedStorage::budget())
+        return Volume(width, height, depth, type);
+
+    const size_t sliceBytes = size_t(width) * height * CV_ELEM_SIZE(type);
+    std::shared_ptr<PagedStorage> scratch = PagedStorage::createScratch(bytes, sliceBytes, depth);
+    if (!scratch)
+        return Volume(width, height, depth, type);   // no scratch space: try the heap
+    return wrap(scratch, width, height, depth, type);
+}
+
+Volume Volume::wrap(std::shared_ptr<PagedStorage> storage, int width, int height, int depth, int type)
+{
+    Volume volume;
+    const int sizes[3] = { depth, height, width };
+    const size_t rowBytes = size_t(width) * CV_ELEM_SIZE(type);
+    const size_t steps[2] = { rowBytes * height, rowBytes };
+    volume.buffer = cv::Mat(3, sizes, type, storage->data(), steps);
+    volume.storage = std::move(storage);
+    volume.initVersions(depth);
+    return volume;
+}
+
+// Views share the storage, so their slice 0 is not necessarily storage slice 0.
+void Volume::touch(int begin, int end) const
+{
+    if (storage) {
+        const int first = int((data() - storage->data()) / sliceStride());
+        storage->touch(first + std::max(begin, 0), first + std::min(end, depth()));
+    }
+}
+
+void Volume::prefetch(int begin, int end) const
+{
+    if (storage) {
+        const int first = int((data() - storage->data()) / sliceStride());
+        storage->prefetch(first + std::max(begin, 0), first + std::min(end, depth()));
+    }
+}
+
+void Volume::release(int begin, int end) const
+{
+    if (storage) {
+        const int first = int((data() - storage->data()) / sliceStride());
+        storage->release(first + std::max(begin, 0), first + std::min(end, depth()));
+    }
+}
+
+cv::Mat Volume::axial(int z) const
+{
+    return cv::Mat(height(), width(), type(), const_cast<uchar *>(slicePtr(z)), rowStride());
+}
+
+VolumePlane Volume::coronal(int x) const
+{
+    VolumePlane plane;
+    plane.data = const_cast<uchar *>(data()) + x * elemSize();
+    plane.rows = height();
+    plane.cols = depth();
+    plane.rowStep = rowStride();
+    plane.colStep = sliceStride();
+    plane.type = type();
+    return plane;
+}
+
+VolumePlane Volume::sagittal(int y) const
+{
+    VolumePlane plane;
+    plane.data = const_cast<uchar *>(data()) + y * rowStride();
+    plane.rows = depth();
+    plane.cols = width();
+    plane.rowStep = sliceStride();
+    plane.colStep = elemSize();
+    plane.type = type();
+    return plane;
+}
+
+Volume Volume::sliceRange(int begin, int end) const
+{
+    Volume view;
+    const cv::Range ranges[3] = { cv::Range(begin, end), cv::Range::all(), cv::Range::all() };
+    view.buffer = buffer(ranges);
+    view.storage = storage;
+    view.voxelSpacing = voxelSpacing;
+    view.versions = versions;
+    view.firstVersion = firstVersion + begin;
+    return view;
+}
+
+Volume Volume::clone() const
+{
+    if (isEmpty())
+        return Volume();
+
+    // Large copies go to scratch storage and are streamed slice by slice.
+    Volume copy = allocate(width(), height(), depth(), type());
+    for (int z = 0; z < depth(); ++z) {
+        cv::Mat dst = copy.axial(z);
+        axial(z).copyTo(dst);
+        release(z, z + 1);
+        copy.release(z, z + 1);
+    }
+    copy.voxelSpacing = voxelSpacing;
+    if (versions) {
+        copy.versions = std::make_shared<std::vector<std::atomic<quint64>>>(depth());
+        for (int z = 0; z < depth(); ++z)
+            (*copy.versions)[z].store(sliceVersion(z));
+    }
+    return copy;
+}
+
+bool Volume::sameGeometry(const Volume &other) const
+{
+    return width() == other.width() && height() == other.height()
+        && depth() == other.depth() && type() == other.type();
+}
@@ -0,0 +1,133 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <QVector3D>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+class PagedStorage;
+
+// Non-owning 2D view into a Volume. Rows and columns can both be strided,
+// which is what lets the coronal plane (fixed X) be described without copying.
+struct VolumePlane {
+    uchar *data = nullptr;
+    int rows = 0;
+    int cols = 0;
+    size_t rowStep = 0;   // bytes between rows
+    size_t colStep = 0;   // bytes between columns
+    int type = CV_8UC1;
+
+    bool isEmpty() const { return data == nullptr || rows == 0 || cols == 0; }
+    bool isContiguousRows() const { return colStep == CV_ELEM_SIZE(type); }
+
+    template <typename T>
+    T &at(int row, int col) const { return *reinterpret_cast<T *>(data + row * rowStep + col * colStep); }
+
+    // Header over the same memory when rows are contiguous, deep copy otherwise.
+    cv::Mat toMat() const;
+};
+
+// Contiguous 3D image volume (depth x height x width) backed by a single
+// OpenCV allocation or by paged, file-backed storage (see pagedstorage.h).
+// Copies are shallow; use clone() for a deep copy.
+class Volume {
+public:
+    Volume() = default;
+    Volume(int width, int height, int depth, int type = CV_8UC1);
+
+    // Heap volume when it fits the paging budget, scratch-file storage
+    // otherwise. Paged volumes start zero-filled; heap volumes are uninitialised.
+    static Volume allocate(int width, int height, int depth, int type = CV_8UC1);
+    static Volume fromSlices(const QVector<cv::Mat> &slices);
+    // Volume over the densely packed voxels of paged storage, which is kept
+    // alive by every shallow copy and view.
+    static Volume wrap(std::shared_ptr<PagedStorage> storage, int width, int height, int depth, int type);
+
+    bool isEmpty() const { return buffer.empty(); }
+    int width() const { return isEmpty() ? 0 : buffer.size[2]; }
+    int height() const { return isEmpty() ? 0 : buffer.size[1]; }
+    int depth() const { return isEmpty() ? 0 : buffer.size[0]; }
+    int type() const { return buffer.type(); }
+    int channels() const { return buffer.channels(); }
+    size_t elemSize() const { return buffer.elemSize(); }
+
+    size_t rowStride() const { return buffer.step[1]; }
+    size_t sliceStride() const { return buffer.step[0]; }
+    size_t totalBytes() const { return sliceStride() * depth(); }
+
+    QVector3D spacing() const { return voxelSpacing; }
+    void setSpacing(const QVector3D &s) { voxelSpacing = s; }
+
+    uchar *data() { return buffer.data; }
+    const uchar *data() const { return buffer.data; }
+    uchar *slicePtr(int z) { return buffer.data + z * sliceStride(); }
+    const uchar *slicePtr(int z) const { return buffer.data + z * sliceStride(); }
+
+    // XY plane at depth z (height x width), shares memory with the volume.
+    cv::Mat axial(int z) const;
+    // YZ plane at column x (height x depth). Columns step through slices.
+    VolumePlane coronal(int x) const;
+    // XZ plane at row y (depth x width). Rows step through slices.
+    VolumePlane sagittal(int y) const;
+
+    // Shallow view of slices [begin, end). It shares the slice versions, so
+    // marking a slice of the view marks it in the volume as well.
+    Volume sliceRange(int begin, int end) const;
+
+    // Residency hints for paged volumes, no-ops for heap volumes. Slice
+    // ranges are [begin, end). touch() marks slices as in use, prefetch()
+    // starts reading them ahead, release() lets them go once a slice-streamed
+    // operation is done with them.
+    bool isPaged() const { return storage != nullptr; }
+    void touch(int begin, int end) const;
+    void prefetch(int begin, int end) const;
+    void release(int begin, int end) const;
+
+    Volume clone() const;
+    bool sameGeometry(const Volume &other) const;
+
+    // Per-slice content versions. They come from one global counter, so equal
+    // versions mean equal slice content, also across clones. Anything that
+    // writes into the buffer in place must call markModified(). Writes that
+    // others may read while they run call beginModify() first, so the slice
+    // reads as version 0, matching no snapshot, until markModified().
+    quint64 sliceVersion(int z) const;
+    void beginModify(int z);
+    void markModified(int z);
+    void markModified();
+
+    const cv::Mat &mat() const { return buffer; }
+
+private:
+    cv::Mat buffer;   // 3D Mat: size[0] = depth, size[1] = height, size[2] = width
+    std::shared_ptr<PagedStorage> storage;   // behind buffer when paged
+    QVector3D voxelSpacing = QVector3D(1.0f, 1.0f, 1.0f);
+    std::shared_ptr<std::vector<std::atomic<quint64>>> versions;
+    int firstVersion = 0;   // index of slice 0 in versions, non-zero for views
+
+    void initVersions(int depth);
+    static quint64 nextVersion();
+};
+
+// Calls fn with a null pointer of the voxel element type, so generic lambdas
+// and templates are compiled once per supported type instead of branching on
+// the depth inside inner loops.
+template <typename Fn>
+void dispatchVoxelType(int type, Fn &&fn)
+{
+    switch (type) {
+    case CV_8UC1: fn(static_cast<uchar *>(nullptr)); break;
+    case CV_16UC1: fn(static_cast<ushort *>(nullptr)); break;
+    case CV_16SC1: fn(static_cast<short *>(nullptr)); break;
+    case CV_32FC1: fn(static_cast<float *>(nullptr)); break;
+    case CV_8UC3: fn(static_cast<cv::Vec3b *>(nullptr)); break;
+    default: CV_Error(cv::Error::StsUnsupportedFormat, "Unsupported voxel type");
+    }
+}
+
+#endif // VOLUME_H
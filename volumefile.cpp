@@ -0,0 +1,277 @@
+#include "volumefile.h"
+#include "pagedstorage.h"
+#include "taskscheduler.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+const char Magic[8] = { 'X', 'I', 'P', 'V', 'O', 'L', '\r', '\n' };
+const quint32 ByteOrderMark = 0x01020304;
+const quint32 FormatVersion = 1;
+const qint64 DataOffset = 4096;   // keeps the voxel block page aligned in the mapping
+
+struct FileHeader {
+    char magic[8];
+    quint32 byteOrder;       // ByteOrderMark in the writer's byte order
+    quint32 formatVersion;
+    qint64 dataOffset;
+    qint32 width;
+    qint32 height;
+    qint32 depth;
+    qint32 type;             // OpenCV type, single channel or CV_8UC3
+    float spacing[3];
+};
+
+static_assert(sizeof(FileHeader) <= DataOffset, "header must fit before the voxel block");
+
+std::atomic<qint64> cacheBytes(qint64(4096) * 1024 * 1024);
+std::mutex cacheMutex;   // serializes evictions
+
+QString cacheDirectory()
+{
+    const QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    return dir.isEmpty() ? QString() : dir + "/volumes";
+}
+
+bool inCache(const QString &path)
+{
+    const QString dir = cacheDirectory();
+    return !dir.isEmpty() && QFileInfo(path).absolutePath() == QFileInfo(dir).absoluteFilePath();
+}
+
+// Removes the least recently used cache files (by modification time, which
+// a cache hit renews) until the rest fit into the limit.
+void evictCache(qint64 limit)
+{
+    const QString dir = cacheDirectory();
+    if (dir.isEmpty())
+        return;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    const QFileInfoList files = QDir(dir).entryInfoList(
+        { QString("*.") + VolumeFile::Extension }, QDir::Files, QDir::Time);   // newest first
+    qint64 kept = 0;
+    for (const QFileInfo &info : files) {
+        kept += info.size();
+        if (kept > limit)
+            QFile::remove(info.absoluteFilePath());
+    }
+}
+
+bool isSupportedType(int type)
+{
+    return type == CV_8UC1 || type == CV_16UC1 || type == CV_16SC1 || type == CV_32FC1 || type == CV_8UC3;
+}
+
+void setError(QString *error, const QString &message)
+{
+    if (error)
+        *error = message;
+}
+
+bool writeVolume(const Volume &volume, QSaveFile &file, QString *error)
+{
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    header.byteOrder = ByteOrderMark;
+    header.formatVersion = FormatVersion;
+    header.dataOffset = DataOffset;
+    header.width = volume.width();
+    header.height = volume.height();
+    header.depth = volume.depth();
+    header.type = volume.type();
+    header.spacing[0] = volume.spacing().x();
+    header.spacing[1] = volume.spacing().y();
+    header.spacing[2] = volume.spacing().z();
+
+    std::vector<char> block(DataOffset, 0);
+    std::memcpy(block.data(), &header, sizeof(header));
+    if (file.write(block.data(), DataOffset) != DataOffset) {
+        setError(error, file.errorString());
+        return false;
+    }
+
+    // Slices are written whole when their rows are packed, row by row otherwise.
+    const qint64 rowBytes = qint64(volume.width()) * qint64(volume.elemSize());
+    const bool packed = volume.rowStride() == size_t(rowBytes);
+    for (int z = 0; z < volume.depth(); ++z) {
+        const char *slice = reinterpret_cast<const char *>(volume.slicePtr(z));
+        if (packed) {
+            if (file.write(slice, rowBytes * volume.height()) != rowBytes * volume.height()) {
+                setError(error, file.errorString());
+                return false;
+            }
+            continue;
+        }
+        for (int y = 0; y < volume.height(); ++y) {
+            if (file.write(slice + y * volume.rowStride(), rowBytes) != rowBytes) {
+                setError(error, file.errorString());
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Writes a snapshot of the volume, dropped if any slice changes meanwhile.
+void writeUnchanged(const Volume &volume, const QString &path)
+{
+    // Version 0 is a slice that an edit is writing right now.
+    std::vector<quint64> versions(volume.depth());
+    for (int z = 0; z < volume.depth(); ++z) {
+        versions[z] = volume.sliceVersion(z);
+        if (versions[z] == 0)
+            return;
+    }
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || !writeVolume(volume, file, nullptr))
+        return;
+
+    // An edit in the meantime may have left a mix of old and new slices.
+    for (int z = 0; z < volume.depth(); ++z) {
+        if (volume.sliceVersion(z) != versions[z]) {
+            file.cancelWriting();
+            return;
+        }
+    }
+    if (file.commit() && inCache(path))
+        evictCache(cacheBytes.load());
+}
+
+} // namespace
+
+
+const char *const VolumeFile::Extension = "xvol";
+
+bool VolumeFile::write(const Volume &volume, const QString &path, QString *error)
+{
+    if (volume.isEmpty() || !isSupportedType(volume.type())) {
+        setError(error, "Unsupported or empty volume.");
+        return false;
+    }
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        setError(error, file.errorString());
+        return false;
+    }
+    if (!writeVolume(volume, file, error)) {
+        file.cancelWriting();
+        return false;
+    }
+    if (!file.commit()) {
+        setError(error, file.errorString());
+        return false;
+    }
+    return true;
+}
+
+void VolumeFile::writeInBackground(const Volume &volume, const QString &path)
+{
+    if (volume.isEmpty() || !isSupportedType(volume.type()) || path.isEmpty())
+        return;
+    const qint64 bytes = qint64(volume.width()) * volume.height() * volume.depth() * qint64(volume.elemSize());
+    if (inCache(path) && DataOffset + bytes > cacheBytes.load())
+        return;   // would evict everything, itself included
+    // The job's copy is shallow and keeps the buffer alive.
+    TaskScheduler::instance().run(Task::Background, [volume, path](Task &) {
+        writeUnchanged(volume, path);
+    });
+}
+
+Volume VolumeFile::map(const QString &path, QString *error)
+{
+    std::unique_ptr<QFile> file(new QFile(path));
+    if (!file->open(QIODevice::ReadOnly)) {
+        setError(error, file->errorString());
+        return Volume();
+    }
+
+    FileHeader header;
+    if (file->read(reinterpret_cast<char *>(&header), sizeof(header)) != qint64(sizeof(header))
+            || std::memcmp(header.magic, Magic, sizeof(Magic)) != 0) {
+        setError(error, "Not a volume file.");
+        return Volume();
+    }
+    if (header.byteOrder != ByteOrderMark || header.formatVersion != FormatVersion) {
+        setError(error, "Volume file was written by an incompatible version or machine.");
+        return Volume();
+    }
+    if (header.width <= 0 || header.height <= 0 || header.depth <= 0 || !isSupportedType(header.type)
+            || header.dataOffset < qint64(sizeof(header))) {
+        setError(error, "Corrupt volume header.");
+        return Volume();
+    }
+
+    const qint64 bytes = qint64(header.width) * header.height * header.depth * CV_ELEM_SIZE(header.type);
+    if (file->size() < header.dataOffset + bytes) {
+        setError(error, "Volume file is truncated.");
+        return Volume();
+    }
+
+    // Private (copy-on-write) mapping: untouched pages stay shared with the
+    // page cache, pages written by edits become private to this process.
+    // It is unmapped when the last view of the volume goes away.
+    const size_t sliceBytes = size_t(header.width) * header.height * CV_ELEM_SIZE(header.type);
+    std::shared_ptr<PagedStorage> storage = PagedStorage::mapFile(std::move(file), header.dataOffset,
+                                                                  sliceBytes, header.depth, error);
+    if (!storage)
+        return Volume();
+
+    Volume volume = Volume::wrap(storage, header.width, header.height, header.depth, header.type);
+    volume.setSpacing(QVector3D(header.spacing[0], header.spacing[1], header.spacing[2]));
+    return volume;
+}
+
+QString VolumeFile::cachePath(const QStringList &sourceFiles)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (const QString &name : sourceFiles) {
+        const QFileInfo info(name);
+        hash.addData(info.absoluteFilePath().toUtf8());
+        hash.addData(QByteArray::number(info.size()));
+        hash.addData(QByteArray::number(info.lastModified().toMSecsSinceEpoch()));
+    }
+
+    const QString dir = cacheDirectory();
+    if (dir.isEmpty() || cacheBytes.load() <= 0)
+        return QString();
+    return dir + "/" + QString::fromLatin1(hash.result().toHex()) + "." + Extension;
+}
+
+Volume VolumeFile::mapCached(const QString &path, QString *error)
+{
+    Volume volume = map(path, error);
+    if (!volume.isEmpty()) {
+        QFile file(path);
+        if (file.open(QIODevice::ReadWrite))
+            file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+    }
+    return volume;
+}
+
+void VolumeFile::setCacheLimit(qint64 bytes)
+{
+    cacheBytes.store(std::max<qint64>(bytes, 0));
+    evictCache(cacheBytes.load());
+}
+
+qint64 VolumeFile::cacheLimit()
+{
+    return cacheBytes.load();
+}
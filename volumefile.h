@@ -0,0 +1,41 @@
+#ifndef VOLUMEFILE_H
+#define VOLUMEFILE_H
+
+#include <QString>
+#include <QStringList>
+
+#include "volume.h"
+
+// Native volume file (.xvol): a 4 KiB header with dimensions, voxel type and
+// spacing, followed by the raw, densely packed voxel block.
+//
+// Files are opened by mapping them into memory, so slices are only paged in
+// when a view touches them and the pages are shared with other processes
+// that have the same file open. The mapping is private: edits made in the
+// application never reach the file.
+class VolumeFile {
+public:
+    static const char *const Extension;   // "xvol"
+
+    static bool write(const Volume &volume, const QString &path, QString *error = nullptr);
+    static Volume map(const QString &path, QString *error = nullptr);
+
+    // Writes on the global thread pool. The file is only committed if no
+    // slice was being written or modified while it was written, and a file
+    // in the cache directory then evicts others down to the cache limit.
+    static void writeInBackground(const Volume &volume, const QString &path);
+
+    // Cache location for a decoded image stack. The key covers the file
+    // names, sizes and modification times, so changed inputs miss the cache.
+    // Empty while the cache is off.
+    static QString cachePath(const QStringList &sourceFiles);
+    // Maps a cache file and marks it as the most recently used.
+    static Volume mapCached(const QString &path, QString *error = nullptr);
+
+    // Disk space for cached stacks; least recently used files are evicted
+    // beyond it. 0 turns the cache off and empties it.
+    static void setCacheLimit(qint64 bytes);
+    static qint64 cacheLimit();
+};
+
+#endif // VOLUMEFILE_H
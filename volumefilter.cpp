@@ -0,0 +1,400 @@
+#include "volumefilter.h"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+namespace {
+
+// What one input slice becomes when it enters the window.
+using Prepared = std::vector<cv::Mat>;
+
+struct Plan {
+    VolumeFilter::Kind kind = VolumeFilter::Gaussian;
+    int rz = 0;                     // window radius along Z
+    // Gaussian
+    cv::Mat kx, ky;
+    std::vector<float> kz;
+    // Mean and median: radius along every axis
+    int r = 0;
+    // Median
+    int bins = 256;
+    double low = 0.0, step = 1.0, centre = 0.0;
+};
+
+double axisRatio(float a, float b)
+{
+    return a > 0.0f && b > 0.0f ? double(a) / b : 1.0;
+}
+
+int gaussianRadius(double sigma)
+{
+    return std::max(1, int(std::ceil(3.0 * sigma)));
+}
+
+Plan makePlan(VolumeFilter::Kind kind, double size, const QVector3D &spacing, int depth, const WindowLevel &range,
+              int type)
+{
+    Plan plan;
+    plan.kind = kind;
+    const int maxZ = std::max(depth - 1, 0);
+
+    switch (kind) {
+    case VolumeFilter::Gaussian: {
+        const double sigmaX = std::max(size, 0.3);
+        const double sigmaY = sigmaX * axisRatio(spacing.x(), spacing.y());
+        const double sigmaZ = sigmaX * axisRatio(spacing.x(), spacing.z());
+        plan.kx = cv::getGaussianKernel(2 * gaussianRadius(sigmaX) + 1, sigmaX, CV_32F);
+        plan.ky = cv::getGaussianKernel(2 * gaussianRadius(sigmaY) + 1, sigmaY, CV_32F);
+        plan.rz = std::min(gaussianRadius(sigmaZ), maxZ);
+        // Weights are taken over the clamped window and renormalised.
+        float sum = 0.0f;
+        for (int k = -plan.rz; k <= plan.rz; ++k) {
+            plan.kz.push_back(float(std::exp(-0.5 * k * k / (sigmaZ * sigmaZ))));
+            sum += plan.kz.back();
+        }
+        for (float &w : plan.kz)
+            w /= sum;
+        break;
+    }
+    case VolumeFilter::Mean:
+        plan.r = std::max(int(size), 1);
+        plan.rz = std::min(plan.r, maxZ);
+        break;
+    case VolumeFilter::Median: {
+        plan.r = std::min(std::max(int(size), 1), int(VolumeFilter::MaxMedianRadius));
+        plan.rz = std::min(plan.r, maxZ);
+        const double low = CV_MAT_DEPTH(type) == CV_8U ? 0.0 : range.low();
+        const double high = CV_MAT_DEPTH(type) == CV_8U ? 255.0 : range.high();
+        const bool integer = CV_MAT_DEPTH(type) != CV_32F && CV_MAT_DEPTH(type) != CV_64F;
+        plan.low = low;
+        if (integer && high - low + 1 <= VolumeFilter::MaxBins) {
+            plan.bins = int(high - low) + 1;
+            plan.step = 1.0;
+            plan.centre = 0.0;
+        } else {
+            plan.bins = VolumeFilter::MaxBins;
+            plan.step = std::max(high - low, 1e-6) / plan.bins;
+            plan.centre = 0.5;
+        }
+        // Coarse bins are groups of 16.
+        plan.bins = (plan.bins + 15) & ~15;
+        break;
+    }
+    case VolumeFilter::GradientMagnitude:
+        plan.rz = std::min(1, maxZ);
+        break;
+    }
+    return plan;
+}
+
+// Runs fn(y0, y1) over bands of rows on the scheduler.
+template <typename Fn>
+void forBands(int rows, Task::Priority priority, Fn fn)
+{
+    TaskScheduler::parallelFor(cv::Range(0, rows), priority, [&](const cv::Range &range) {
+        fn(range.start, range.end);
+    }, VolumeFilter::BandRows);
+}
+
+cv::Mat luminance(const cv::Mat &slice)
+{
+    if (slice.channels() == 1)
+        return slice;
+    cv::Mat gray;
+    cv::cvtColor(slice, gray, cv::COLOR_BGR2GRAY);
+    return gray;
+}
+
+// Filters in X and Y run on bands of the slice; the bands are views into it,
+// so their borders come from the neighbouring rows.
+Prepared prepare(const Plan &plan, const cv::Mat &slice, Task::Priority priority)
+{
+    Prepared prepared;
+    switch (plan.kind) {
+    case VolumeFilter::Gaussian: {
+        cv::Mat out(slice.size(), CV_32FC(slice.channels()));
+        forBands(slice.rows, priority, [&](int y0, int y1) {
+            cv::Mat dst = out.rowRange(y0, y1);
+            cv::sepFilter2D(slice.rowRange(y0, y1), dst, CV_32F, plan.kx, plan.ky);
+        });
+        prepared.push_back(out);
+        break;
+    }
+    case VolumeFilter::Mean: {
+        // Sums; the mean is taken once the Z sum is known.
+        cv::Mat out(slice.size(), CV_32FC(slice.channels()));
+        const int n = 2 * plan.r + 1;
+        forBands(slice.rows, priority, [&](int y0, int y1) {
+            cv::Mat dst = out.rowRange(y0, y1);
+            cv::boxFilter(slice.rowRange(y0, y1), dst, CV_32F, cv::Size(n, n), cv::Point(-1, -1), false);
+        });
+        prepared.push_back(out);
+        break;
+    }
+    case VolumeFilter::Median: {
+        const cv::Mat gray = luminance(slice);
+        cv::Mat bins;
+        // Rounds (v - low) / step - 0.5 to the nearest, i.e. floors it.
+        gray.convertTo(bins, CV_16U, 1.0 / plan.step, -plan.low / plan.step - plan.centre);
+        cv::min(bins, cv::Scalar(plan.bins - 1), bins);
+        prepared.push_back(bins);
+        break;
+    }
+    case VolumeFilter::GradientMagnitude: {
+        const cv::Mat gray = luminance(slice);
+        const cv::Mat derive = (cv::Mat_<float>(3, 1) << -1, 0, 1);
+        const cv::Mat smooth = (cv::Mat_<float>(3, 1) << 1, 2, 1);
+        cv::Mat dx(gray.size(), CV_32F), dy(gray.size(), CV_32F), s(gray.size(), CV_32F);
+        forBands(gray.rows, priority, [&](int y0, int y1) {
+            const cv::Mat band = gray.rowRange(y0, y1);
+            cv::Mat dxBand = dx.rowRange(y0, y1), dyBand = dy.rowRange(y0, y1), sBand = s.rowRange(y0, y1);
+            cv::sepFilter2D(band, dxBand, CV_32F, derive, smooth);
+            cv::sepFilter2D(band, dyBand, CV_32F, smooth, derive);
+            cv::sepFilter2D(band, sBand, CV_32F, smooth, smooth);
+        });
+        prepared = { dx, dy, s };
+        break;
+    }
+    }
+    return prepared;
+}
+
+// Adds or removes a column histogram; plain loops over the bins, which the
+// compiler vectorises.
+inline void addHistogram(quint16 *dst, const quint16 *src, int count)
+{
+    for (int i = 0; i < count; ++i)
+        dst[i] += src[i];
+}
+
+inline void subtractHistogram(quint16 *dst, const quint16 *src, int count)
+{
+    for (int i = 0; i < count; ++i)
+        dst[i] -= src[i];
+}
+
+// Median of rows y0..y1 of one output slice. Every column keeps the
+// histogram of its (2r + 1) x (2r + 1) extent in Y and Z, updated by one row
+// in and one row out per output row; the cube histogram then slides along X
+// one column histogram at a time.
+template <typename T>
+void medianBand(const Plan &plan, const std::vector<const Prepared *> &window, int y0, int y1, cv::Mat &out)
+{
+    const int r = plan.r;
+    const int n = 2 * r + 1;
+    const int bins = plan.bins;
+    const int coarseBins = bins / 16;
+    const int rows = out.rows, cols = out.cols;
+
+    std::vector<const cv::Mat *> slices;
+    for (const Prepared *prepared : window)
+        slices.push_back(&prepared->front());
+    // The window is 2 * rz + 1 slices; a clamped Z radius repeats slices so
+    // the cube keeps n^3 samples.
+    std::vector<const cv::Mat *> cube;
+    const int rz = int(slices.size()) / 2;
+    for (int k = -r; k <= r; ++k)
+        cube.push_back(slices[rz + std::min(std::max(k, -rz), rz)]);
+
+    std::vector<quint16> fine(size_t(cols) * bins, 0), coarse(size_t(cols) * coarseBins, 0);
+    auto updateRow = [&](int y, quint16 delta) {
+        const int yy = cv::borderInterpolate(y, rows, cv::BORDER_REFLECT_101);
+        for (const cv::Mat *slice : cube) {
+            const ushort *b = slice->ptr<ushort>(yy);
+            for (int x = 0; x < cols; ++x) {
+                fine[size_t(x) * bins + b[x]] += delta;
+                coarse[size_t(x) * coarseBins + (b[x] >> 4)] += delta;
+            }
+        }
+    };
+    for (int y = y0 - r; y <= y0 + r; ++y)
+        updateRow(y, 1);
+
+    std::vector<quint16> kernelFine(bins), kernelCoarse(coarseBins);
+    auto addColumn = [&](int x) {
+        x = cv::borderInterpolate(x, cols, cv::BORDER_REFLECT_101);
+        addHistogram(kernelFine.data(), &fine[size_t(x) * bins], bins);
+        addHistogram(kernelCoarse.data(), &coarse[size_t(x) * coarseBins], coarseBins);
+    };
+    auto removeColumn = [&](int x) {
+        x = cv::borderInterpolate(x, cols, cv::BORDER_REFLECT_101);
+        subtractHistogram(kernelFine.data(), &fine[size_t(x) * bins], bins);
+        subtractHistogram(kernelCoarse.data(), &coarse[size_t(x) * coarseBins], coarseBins);
+    };
+
+    const int half = n * n * n / 2;
+    for (int y = y0; y < y1; ++y) {
+        if (y > y0) {
+            updateRow(y - 1 - r, quint16(-1));
+            updateRow(y + r, 1);
+        }
+        std::fill(kernelFine.begin(), kernelFine.end(), 0);
+        std::fill(kernelCoarse.begin(), kernelCoarse.end(), 0);
+        for (int x = -r; x <= r; ++x)
+            addColumn(x);
+
+        T *dst = out.ptr<T>(y);
+        for (int x = 0; x < cols; ++x) {
+            if (x > 0) {
+                addColumn(x + r);
+                removeColumn(x - 1 - r);
+            }
+            int count = 0, c = 0;
+            while (count + kernelCoarse[c] <= half)
+                count += kernelCoarse[c++];
+            int b = c * 16;
+            while (count + kernelFine[b] <= half)
+                count += kernelFine[b++];
+            dst[x] = cv::saturate_cast<T>(plan.low + (b + plan.centre) * plan.step);
+        }
+    }
+}
+
+// Writes a single-channel result into a slice of the volume type.
+void store(const cv::Mat &result, cv::Mat &out, double scale = 1.0)
+{
+    if (out.channels() == result.channels()) {
+        result.convertTo(out, out.depth(), scale);
+        return;
+    }
+    cv::Mat gray;
+    result.convertTo(gray, out.depth(), scale);
+    cv::cvtColor(gray, out, cv::COLOR_GRAY2BGR);
+}
+
+void combine(const Plan &plan, const std::vector<const Prepared *> &window, cv::Mat &out, Task::Priority priority)
+{
+    const int n = int(window.size());
+    switch (plan.kind) {
+    case VolumeFilter::Gaussian:
+    case VolumeFilter::Mean: {
+        const int r = plan.r;
+        const double scale = plan.kind == VolumeFilter::Mean ? 1.0 / (double(2 * r + 1) * (2 * r + 1) * (2 * r + 1)) : 1.0;
+        // A Z radius clamped by a thin volume repeats the end slices.
+        std::vector<float> weights(n, 1.0f);
+        if (plan.kind == VolumeFilter::Gaussian) {
+            weights = plan.kz;
+        } else if (plan.rz < r) {
+            weights[0] = weights[n - 1] = float(r - plan.rz + 1);
+        }
+        forBands(out.rows, priority, [&](int y0, int y1) {
+            cv::Mat sum;
+            window[0]->front().rowRange(y0, y1).convertTo(sum, CV_32F, weights[0]);
+            for (int k = 1; k < n; ++k)
+                cv::scaleAdd(window[k]->front().rowRange(y0, y1), weights[k], sum, sum);
+            cv::Mat dst = out.rowRange(y0, y1);
+            sum.convertTo(dst, out.depth(), scale);
+        });
+        break;
+    }
+    case VolumeFilter::Median: {
+        cv::Mat result = out.channels() == 1 ? out : cv::Mat(out.size(), CV_MAKETYPE(out.depth(), 1));
+        forBands(out.rows, priority, [&](int y0, int y1) {
+            switch (result.depth()) {
+            case CV_8U: medianBand<uchar>(plan, window, y0, y1, result); break;
+            case CV_16U: medianBand<ushort>(plan, window, y0, y1, result); break;
+            case CV_16S: medianBand<short>(plan, window, y0, y1, result); break;
+            default: medianBand<float>(plan, window, y0, y1, result); break;
+            }
+        });
+        if (result.data != out.data)
+            store(result, out);
+        break;
+    }
+    case VolumeFilter::GradientMagnitude: {
+        // Z derivative and smoothing over the previous, current and next slice.
+        const Prepared &prev = *window.front();
+        const Prepared &mid = *window[n / 2];
+        const Prepared &next = *window.back();
+        forBands(out.rows, priority, [&](int y0, int y1) {
+            const cv::Range rows(y0, y1);
+            const cv::Mat gx = prev[0].rowRange(rows) + 2 * mid[0].rowRange(rows) + next[0].rowRange(rows);
+            const cv::Mat gy = prev[1].rowRange(rows) + 2 * mid[1].rowRange(rows) + next[1].rowRange(rows);
+            const cv::Mat gz = next[2].rowRange(rows) - prev[2].rowRange(rows);
+            cv::Mat magnitude = gx.mul(gx) + gy.mul(gy) + gz.mul(gz);
+            cv::sqrt(magnitude, magnitude);
+            cv::Mat dst = out.rowRange(y0, y1);
+            store(magnitude, dst, 1.0 / 16.0);
+        });
+        break;
+    }
+    }
+}
+
+} // namespace
+
+
+int VolumeFilter::radius(Kind kind, double size, const QVector3D &spacing, int depth)
+{
+    return makePlan(kind, size, spacing, depth, WindowLevel(), CV_8UC1).rz;
+}
+
+cv::Mat VolumeFilter::filterSlice(Kind kind, double size, const QVector3D &spacing, const WindowLevel &range,
+                                  const std::vector<cv::Mat> &window, Task::Priority priority)
+{
+    if (window.empty())
+        return cv::Mat();
+    const cv::Mat &centre = window[window.size() / 2];
+    // The window size tells the clamped radius; the plan is built for a
+    // volume just deep enough to give it.
+    const Plan plan = makePlan(kind, size, spacing, int(window.size() / 2) + 1, range, centre.type());
+
+    std::vector<Prepared> prepared;
+    for (int k = int(window.size()) / 2 - plan.rz; k <= int(window.size()) / 2 + plan.rz; ++k)
+        prepared.push_back(prepare(plan, window[k], priority));
+    std::vector<const Prepared *> slices;
+    for (const Prepared &p : prepared)
+        slices.push_back(&p);
+
+    cv::Mat out(centre.size(), centre.type());
+    combine(plan, slices, out, priority);
+    return out;
+}
+
+bool VolumeFilter::apply(Kind kind, double size, const WindowLevel &range, const Volume &src, const Volume &dst,
+                         Task &job, const std::function<void(int)> &beforeWrite,
+                         const std::function<void(int)> &afterWrite)
+{
+    if (src.isEmpty() || !src.sameGeometry(dst) || src.type() != dst.type())
+        return false;
+
+    const int depth = src.depth();
+    const Plan plan = makePlan(kind, size, src.spacing(), depth, range, src.type());
+    const bool inPlace = src.data() == dst.data();
+
+    // Input slices by index. The Z radius is clamped to depth - 1, so the
+    // reflected indices around z always lie in [z - rz, z + rz].
+    std::map<int, Prepared> window;
+    for (int z = 0; z < depth; ++z) {
+        if (job.isCancelled())
+            return false;
+
+        for (int i = std::max(0, z - plan.rz); i <= std::min(depth - 1, z + plan.rz); ++i) {
+            if (window.count(i))
+                continue;
+            src.prefetch(i + 1, i + 2);
+            window.emplace(i, prepare(plan, src.axial(i), job.priority()));
+            if (!inPlace)
+                src.release(i, i + 1);
+        }
+
+        std::vector<const Prepared *> slices;
+        for (int k = -plan.rz; k <= plan.rz; ++k)
+            slices.push_back(&window.at(cv::borderInterpolate(z + k, depth, cv::BORDER_REFLECT_101)));
+
+        if (beforeWrite)
+            beforeWrite(z);
+        cv::Mat out = dst.axial(z);
+        combine(plan, slices, out, job.priority());
+        if (afterWrite)
+            afterWrite(z);
+        dst.release(z, z + 1);
+
+        window.erase(z - plan.rz);
+        job.setProgress(z + 1, depth);
+    }
+    return true;
+}
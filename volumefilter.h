@@ -0,0 +1,59 @@
+#ifndef VOLUMEFILTER_H
+#define VOLUMEFILTER_H
+
+#include <QVector3D>
+
+#include <functional>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "taskscheduler.h"
+#include "volume.h"
+#include "windowlevel.h"
+
+// Volumetric filters streamed through Z.
+//
+// Every input slice is prepared once when it enters a rolling window of
+// 2 * radius + 1 slices (filtered in X and Y, or binned for the median), and
+// each output slice combines the prepared slices around it. Memory therefore
+// stays at one window whatever the depth, and since an input slice is read
+// before the output slice at its depth is written, dst may be src.
+//
+// - Gaussian: separable, sigma given in X voxels and scaled by the spacing
+//   on the other axes, so the blur is isotropic in physical units.
+// - Mean: box of 2 * radius + 1 voxels per axis.
+// - Median: cube of 2 * radius + 1 voxels, from sliding histograms with
+//   per-column counts (Perreault and Hebert, extended to 3D), so the cost per
+//   voxel grows linearly with the radius. Integer data spanning at most
+//   MaxBins values is exact; wider ranges are binned into MaxBins levels.
+// - Gradient magnitude: 3D Sobel, scaled so a step edge gives its height.
+//
+// Median and gradient work on the luminance of colour volumes. Slices are
+// split into bands of BandRows rows across the scheduler.
+class VolumeFilter {
+public:
+    enum Kind { Gaussian, Mean, Median, GradientMagnitude };
+
+    static const int BandRows = 32;
+    static const int MaxBins = 1024;
+    static const int MaxMedianRadius = 15;
+
+    // Slices on each side of z that output slice z reads, for a volume of
+    // the given depth.
+    static int radius(Kind kind, double size, const QVector3D &spacing, int depth);
+
+    // Output slice from the input slices z - radius .. z + radius, already
+    // reflected at the ends of the volume. `range` is the data range used
+    // to bin the median.
+    static cv::Mat filterSlice(Kind kind, double size, const QVector3D &spacing, const WindowLevel &range,
+                               const std::vector<cv::Mat> &window, Task::Priority priority = Task::Interactive);
+
+    // Filters the whole volume. beforeWrite and afterWrite run around every
+    // output slice, e.g. to record it for undo. Returns false if cancelled.
+    static bool apply(Kind kind, double size, const WindowLevel &range, const Volume &src, const Volume &dst,
+                      Task &job, const std::function<void(int)> &beforeWrite = nullptr,
+                      const std::function<void(int)> &afterWrite = nullptr);
+};
+
+#endif // VOLUMEFILTER_H
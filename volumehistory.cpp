@@ -0,0 +1,499 @@
+#include "volumehistory.h"
+#include "volumefile.h"
+#include "taskscheduler.h"
+
+#include <QDir>
+#include <QFile>
+#include <QStandardPaths>
+
+#include <algorithm>
+#include <set>
+
+VolumeHistory::VolumeHistory(QObject *parent)
+    : QObject(parent), cap(qint64(1024) * 1024 * 1024)
+{
+}
+
+VolumeHistory::~VolumeHistory() = default;
+
+qint64 VolumeHistory::Step::bytes() const
+{
+    if (spilled || spilling)
+        return 0;   // a volume being spilled is about to be dropped
+    if (replaces)
+        return other.isPaged() ? 0 : qint64(other.totalBytes());   // paged volumes already live on disk
+    qint64 total = 0;
+    for (const Tile &tile : tiles)
+        total += tile.data.size();
+    return total;
+}
+
+void VolumeHistory::beginEdit(const QString &name, const Volume &volume)
+{
+    if (pending)
+        endEdit();
+
+    std::unique_ptr<Step> step(new Step);
+    step->name = name;
+    step->width = volume.width();
+    step->height = volume.height();
+    step->type = volume.type();
+
+    std::lock_guard<std::mutex> lock(recordMutex);
+    pending = std::move(step);
+    pendingVolume = volume;
+    recordedTiles.clear();
+    ++editId;
+}
+
+// The slice calls copy what they need under the lock and work on the
+// copies, then record only if the same edit is still pending; the GUI
+// thread may end, abort or clear it in between.
+void VolumeHistory::saveSlice(int z)
+{
+    Volume volume;
+    quint64 id;
+    {
+        std::lock_guard<std::mutex> lock(recordMutex);
+        if (!pending)
+            return;
+        volume = pendingVolume;
+        id = editId;
+    }
+    // The slice is written next; commitSlice() marks it modified once done.
+    volume.beginModify(z);
+    const cv::Mat copy = volume.axial(z).clone();
+    std::lock_guard<std::mutex> lock(recordMutex);
+    if (pending && editId == id)
+        savedSlices.emplace(z, copy);
+}
+
+void VolumeHistory::commitSlice(int z)
+{
+    Volume volume;
+    quint64 id;
+    cv::Mat before;
+    // Edits that make several passes (3D stages in a filter chain) write a
+    // slice more than once. The tiles recorded by earlier passes are folded
+    // into the new ones, (v0 ^ v1) ^ (v1 ^ v2) = v0 ^ v2, so every tile is
+    // kept once and undo can XOR all tiles in parallel. A slice is only
+    // committed by one thread at a time, so the earlier tiles stay put.
+    std::vector<QByteArray> earlier;
+    {
+        std::lock_guard<std::mutex> lock(recordMutex);
+        if (!pending)
+            return;
+        const auto saved = savedSlices.find(z);
+        if (saved == savedSlices.end())
+            return;
+        before = saved->second;
+        savedSlices.erase(saved);
+        volume = pendingVolume;
+        id = editId;
+        const auto recorded = recordedTiles.find(z);
+        if (recorded != recordedTiles.end()) {
+            earlier.resize(recorded->second.size());
+            for (size_t t = 0; t < recorded->second.size(); ++t) {
+                if (recorded->second[t] >= 0)
+                    earlier[t] = pending->tiles[recorded->second[t]].data;
+            }
+        }
+    }
+    // Only slices that were saved are marked, so a cancelled or partial
+    // edit leaves the rest of the volume's caches valid.
+    volume.markModified(z);
+
+    const cv::Mat after = volume.axial(z);
+    const size_t elem = after.elemSize();
+    const int tilesX = (after.cols + TileSize - 1) / TileSize;
+    const int tilesY = (after.rows + TileSize - 1) / TileSize;
+
+    // Tiles are XORed and compressed in parallel; unchanged ones stay empty.
+    std::vector<Tile> tiles(size_t(tilesX) * tilesY);
+    std::vector<char> folded(tiles.size(), 0);   // earlier tile replaced, possibly by nothing
+    cv::parallel_for_(cv::Range(0, tilesX * tilesY), [&](const cv::Range &range) {
+        QByteArray delta;
+        for (int t = range.start; t < range.end; ++t) {
+            const int x = (t % tilesX) * TileSize;
+            const int y = (t / tilesX) * TileSize;
+            const int width = std::min(TileSize, after.cols - x);
+            const int height = std::min(TileSize, after.rows - y);
+            const size_t rowBytes = width * elem;
+
+            delta.resize(int(rowBytes * height));
+            uchar *out = reinterpret_cast<uchar *>(delta.data());
+            uchar differs = 0;
+            for (int r = 0; r < height; ++r, out += rowBytes) {
+                const uchar *a = before.ptr(y + r) + x * elem;
+                const uchar *b = after.ptr(y + r) + x * elem;
+                for (size_t i = 0; i < rowBytes; ++i) {
+                    out[i] = a[i] ^ b[i];
+                    differs |= out[i];
+                }
+            }
+            if (t < int(earlier.size()) && !earlier[t].isEmpty()) {
+                const QByteArray previous = qUncompress(earlier[t]);
+                if (previous.size() == delta.size()) {
+                    const uchar *in = reinterpret_cast<const uchar *>(previous.constData());
+                    out = reinterpret_cast<uchar *>(delta.data());
+                    differs = 0;
+                    for (int i = 0; i < delta.size(); ++i) {
+                        out[i] ^= in[i];
+                        differs |= out[i];
+                    }
+                    folded[t] = 1;
+                }
+            }
+            if (!differs)
+                continue;
+
+            Tile &tile = tiles[t];
+            tile.z = z;
+            tile.x = x;
+            tile.y = y;
+            tile.width = width;
+            tile.height = height;
+            tile.data = qCompress(delta, 1);
+        }
+    });
+
+    std::lock_guard<std::mutex> lock(recordMutex);
+    if (!pending || editId != id)
+        return;
+    std::vector<int> &positions = recordedTiles[z];
+    positions.resize(tiles.size(), -1);
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        if (folded[t]) {
+            // Back to the original content leaves an empty tile, dropped by endEdit().
+            pending->tiles[positions[t]].data = tiles[t].data;
+        } else if (!tiles[t].data.isEmpty()) {
+            positions[t] = int(pending->tiles.size());
+            pending->tiles.push_back(std::move(tiles[t]));
+        }
+    }
+}
+
+void VolumeHistory::endEdit()
+{
+    std::unique_ptr<Step> step;
+    {
+        std::lock_guard<std::mutex> lock(recordMutex);
+        step = std::move(pending);
+        savedSlices.clear();
+        recordedTiles.clear();
+        pendingVolume = Volume();
+    }
+    if (!step)
+        return;
+    step->tiles.erase(std::remove_if(step->tiles.begin(), step->tiles.end(),
+                                     [](const Tile &tile) { return tile.data.isEmpty(); }),
+                      step->tiles.end());
+    if (!step->tiles.empty())
+        push(std::move(step));
+}
+
+void VolumeHistory::abortEdit()
+{
+    std::unique_ptr<Step> step;
+    std::map<int, cv::Mat> saved;
+    Volume volume;
+    {
+        std::lock_guard<std::mutex> lock(recordMutex);
+        step = std::move(pending);
+        saved.swap(savedSlices);
+        recordedTiles.clear();
+        volume = pendingVolume;
+        pendingVolume = Volume();
+    }
+    if (!step)
+        return;
+    for (const auto &slice : saved) {
+        volume.beginModify(slice.first);
+        cv::Mat dst = volume.axial(slice.first);
+        slice.second.copyTo(dst);
+        volume.markModified(slice.first);
+    }
+    applyDelta(*step, volume);
+}
+
+void VolumeHistory::recordReplace(const QString &name, const Volume &before)
+{
+    std::unique_ptr<Step> step(new Step);
+    step->name = name;
+    step->replaces = true;
+    step->other = before;
+    push(std::move(step));
+}
+
+void VolumeHistory::push(std::unique_ptr<Step> step)
+{
+    steps.erase(steps.begin() + current, steps.end());
+    steps.push_back(std::move(step));
+    current = int(steps.size());
+    enforceCap();
+    emit changed();
+}
+
+QString VolumeHistory::undoName() const
+{
+    return canUndo() ? steps[current - 1]->name : QString();
+}
+
+QString VolumeHistory::redoName() const
+{
+    return canRedo() ? steps[current]->name : QString();
+}
+
+void VolumeHistory::setCurrentVolume(const Volume &volume)
+{
+    const bool same = volume.data() == live.data() && volume.sameGeometry(live) && volume.type() == live.type();
+    live = volume;
+    if (!same)
+        emit currentChanged(live);
+}
+
+bool VolumeHistory::undo()
+{
+    if (!canUndo())
+        return false;
+
+    Step &step = *steps[current - 1];
+    if (!(step.replaces ? swapOther(step, live) : applyDelta(step, live))) {
+        // The volume no longer matches the history; nothing before it can be undone.
+        clear();
+        return false;
+    }
+    --current;
+    enforceCap();
+    emit restored(live);
+    emit currentChanged(live);
+    emit changed();
+    return true;
+}
+
+bool VolumeHistory::redo()
+{
+    if (!canRedo())
+        return false;
+
+    Step &step = *steps[current];
+    if (!(step.replaces ? swapOther(step, live) : applyDelta(step, live))) {
+        steps.erase(steps.begin() + current, steps.end());
+        emit changed();
+        return false;
+    }
+    ++current;
+    enforceCap();
+    emit restored(live);
+    emit currentChanged(live);
+    emit changed();
+    return true;
+}
+
+void VolumeHistory::clear()
+{
+    {
+        std::lock_guard<std::mutex> lock(recordMutex);
+        pending.reset();
+        pendingVolume = Volume();
+        savedSlices.clear();
+        recordedTiles.clear();
+    }
+    steps.clear();
+    current = 0;
+    spillDir.reset();
+    emit changed();
+}
+
+qint64 VolumeHistory::memoryBytes() const
+{
+    qint64 total = 0;
+    for (const auto &step : steps)
+        total += step->bytes();
+    return total;
+}
+
+void VolumeHistory::setMemoryCap(qint64 bytes)
+{
+    cap = std::max<qint64>(bytes, 0);
+    enforceCap();
+}
+
+// XOR is its own inverse, so undo and redo are the same operation.
+bool VolumeHistory::applyDelta(Step &step, Volume &volume)
+{
+    if (volume.width() != step.width || volume.height() != step.height || volume.type() != step.type)
+        return false;
+
+    std::vector<QByteArray> compressed(step.tiles.size());
+    if (step.spilled) {
+        QFile file(step.spillPath);
+        if (!file.open(QIODevice::ReadOnly))
+            return false;
+        for (size_t i = 0; i < step.tiles.size(); ++i) {
+            if (!file.seek(step.tiles[i].fileOffset))
+                return false;
+            compressed[i] = file.read(step.tiles[i].fileSize);
+        }
+    } else {
+        for (size_t i = 0; i < step.tiles.size(); ++i)
+            compressed[i] = step.tiles[i].data;
+    }
+
+    std::set<int> slices;
+    for (const Tile &tile : step.tiles) {
+        if (tile.z >= volume.depth())
+            return false;
+        slices.insert(tile.z);
+    }
+
+    for (int z : slices)
+        volume.beginModify(z);
+    const size_t elem = volume.elemSize();
+    cv::parallel_for_(cv::Range(0, int(step.tiles.size())), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; ++i) {
+            const Tile &tile = step.tiles[i];
+            const QByteArray delta = qUncompress(compressed[i]);
+            const size_t rowBytes = tile.width * elem;
+            if (size_t(delta.size()) != rowBytes * tile.height)
+                continue;
+            const uchar *in = reinterpret_cast<const uchar *>(delta.constData());
+            uchar *slice = volume.slicePtr(tile.z);
+            for (int r = 0; r < tile.height; ++r, in += rowBytes) {
+                uchar *out = slice + (tile.y + r) * volume.rowStride() + tile.x * elem;
+                for (size_t b = 0; b < rowBytes; ++b)
+                    out[b] ^= in[b];
+            }
+        }
+    });
+
+    for (int z : slices) {
+        volume.markModified(z);
+        volume.release(z, z + 1);
+    }
+    return true;
+}
+
+bool VolumeHistory::swapOther(Step &step, Volume &volume)
+{
+    if (step.spilling) {
+        // Still in memory; the unfinished file is removed when the write ends.
+        step.spilling = nullptr;
+        step.spillPath.clear();
+    } else if (step.spilled) {
+        const Volume restored = VolumeFile::map(step.spillPath);
+        if (restored.isEmpty())
+            return false;
+        // The mapping keeps the data; the name can go (Unix) or goes with the directory.
+        QFile::remove(step.spillPath);
+        step.spillPath.clear();
+        step.spilled = false;
+        step.other = restored;
+    }
+    std::swap(step.other, volume);
+    return true;
+}
+
+void VolumeHistory::enforceCap()
+{
+    while (int(steps.size()) > MaxSteps) {
+        if (current > 0) {
+            steps.erase(steps.begin());
+            --current;
+        } else {
+            steps.pop_back();
+        }
+    }
+
+    // Steps furthest from the current position are the least likely to be needed.
+    while (memoryBytes() > cap) {
+        int furthest = -1;
+        int furthestDistance = -1;
+        for (int i = 0; i < int(steps.size()); ++i) {
+            const int distance = i < current ? current - 1 - i : i - current;
+            if (steps[i]->bytes() > 0 && distance > furthestDistance) {
+                furthest = i;
+                furthestDistance = distance;
+            }
+        }
+        if (furthest < 0)
+            break;
+        if (spill(*steps[furthest]))
+            continue;
+
+        // Without spill space the step and everything beyond it is dropped.
+        if (furthest < current) {
+            steps.erase(steps.begin(), steps.begin() + furthest + 1);
+            current -= furthest + 1;
+        } else {
+            steps.erase(steps.begin() + furthest, steps.end());
+        }
+    }
+}
+
+bool VolumeHistory::spill(Step &step)
+{
+    const QString path = spillFilePath(step.replaces ? QString(VolumeFile::Extension) : QString("delta"));
+    if (path.isEmpty())
+        return false;
+
+    if (step.replaces) {
+        // Writing a whole volume takes too long for the GUI thread. The job's
+        // shallow copy keeps the data alive; the step drops its own once the
+        // file is complete, unless it was swapped back or dropped meanwhile.
+        auto written = std::make_shared<bool>(false);
+        Task *task = TaskScheduler::instance().run(Task::Background, [volume = step.other, path, written](Task &) {
+            *written = VolumeFile::write(volume, path);
+        });
+        connect(task, &Task::finished, this, [this, task, path, written](bool cancelled) {
+            for (const auto &held : steps) {
+                if (held->spilling != task)
+                    continue;
+                held->spilling = nullptr;
+                if (!cancelled && *written) {
+                    held->other = Volume();
+                    held->spilled = true;
+                    return;
+                }
+                // Kept in memory; the next enforceCap() tries again.
+                held->spillPath.clear();
+                break;
+            }
+            QFile::remove(path);
+        });
+        step.spillPath = path;
+        step.spilling = task;
+        return true;
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    for (Tile &tile : step.tiles) {
+        tile.fileOffset = file.pos();
+        tile.fileSize = tile.data.size();
+        if (file.write(tile.data) != tile.data.size()) {
+            file.remove();
+            return false;
+        }
+    }
+    for (Tile &tile : step.tiles)
+        tile.data = QByteArray();
+    step.spillPath = path;
+    step.spilled = true;
+    return true;
+}
+
+QString VolumeHistory::spillFilePath(const QString &suffix)
+{
+    static int counter = 0;
+    if (!spillDir) {
+        QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+        if (dir.isEmpty() || !QDir().mkpath(dir))
+            dir = QDir::tempPath();
+        spillDir.reset(new QTemporaryDir(dir + "/history-XXXXXX"));
+    }
+    if (!spillDir->isValid())
+        return QString();
+    return spillDir->filePath(QString("step-%1.%2").arg(++counter).arg(suffix));
+}
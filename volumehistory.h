@@ -0,0 +1,135 @@
+#ifndef VOLUMEHISTORY_H
+#define VOLUMEHISTORY_H
+
+#include <QByteArray>
+#include <QObject>
+#include <QString>
+#include <QTemporaryDir>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "volume.h"
+
+class Task;
+
+// Undo/redo history shared by every window that edits the volume.
+//
+// In-place edits are recorded per slice: the slice is saved just before it
+// is written and compared with the result right after, and only the
+// TileSize x TileSize tiles that differ are kept, as the compressed XOR of
+// old and new content. Unchanged tiles stay shared with the live volume, and
+// since XOR is its own inverse the same delta serves undo and redo, both
+// touching only the edited tiles.
+//
+// Edits that produce a new volume (another voxel type or geometry) keep the
+// volume that is not current as a shallow copy, so they cost nothing while
+// both are alive elsewhere.
+//
+// When the steps held in memory exceed the cap, the ones furthest from the
+// current position are spilled to temporary files and read back on demand.
+// Replaced volumes are written out on the background lane and only dropped
+// from memory once the file is complete.
+//
+// The history holds the volume that undo and redo apply to. The main window
+// sets it whenever it shows another volume, and dialogs that keep their own
+// copy follow it through currentChanged(), so nothing undoes a stale copy.
+class VolumeHistory : public QObject {
+    Q_OBJECT
+public:
+    explicit VolumeHistory(QObject *parent = nullptr);
+    ~VolumeHistory();
+
+    // In-place edit: saveSlice(z) before slice z is written, commitSlice(z)
+    // after. Slices that are never saved are assumed unchanged. The two
+    // also mark the slice as being written and as modified (see
+    // Volume::beginModify()), so the edit need not mark anything. The slice
+    // calls may come from several threads at once; the others are GUI-only.
+    // A volume must not be cleared or replaced while an edit is running, as
+    // the edit goes on writing into it.
+    void beginEdit(const QString &name, const Volume &volume);
+    void saveSlice(int z);
+    void commitSlice(int z);
+    void endEdit();
+    // Puts back every slice recorded so far and drops the edit.
+    void abortEdit();
+    bool isEditing() const { return pending != nullptr; }
+
+    // Edit whose result is a new volume; `before` is the one it replaces.
+    void recordReplace(const QString &name, const Volume &before);
+
+    bool canUndo() const { return current > 0; }
+    bool canRedo() const { return current < int(steps.size()); }
+    QString undoName() const;
+    QString redoName() const;
+
+    // The volume the steps apply to. GUI-only.
+    void setCurrentVolume(const Volume &volume);
+    const Volume &currentVolume() const { return live; }
+
+    // Apply to the current volume, which may be replaced. Emit restored().
+    bool undo();
+    bool redo();
+    void clear();
+
+    qint64 memoryBytes() const;
+    qint64 memoryCap() const { return cap; }
+    void setMemoryCap(qint64 bytes);
+
+    static const int TileSize = 64;
+    static const int MaxSteps = 100;
+
+signals:
+    void restored(const Volume &volume);
+    // The current volume was replaced, by undo, redo or setCurrentVolume().
+    void currentChanged(const Volume &volume);
+    void changed();
+
+private:
+    struct Tile {
+        int z = 0, x = 0, y = 0, width = 0, height = 0;
+        QByteArray data;          // compressed XOR, empty while spilled
+        qint64 fileOffset = -1;
+        int fileSize = 0;
+    };
+
+    struct Step {
+        QString name;
+        bool replaces = false;
+        // In-place edit
+        int width = 0, height = 0, type = -1;
+        std::vector<Tile> tiles;
+        // Replacement: the volume that is not current
+        Volume other;
+        QString spillPath;
+        bool spilled = false;
+        Task *spilling = nullptr;   // writing `other` to spillPath
+
+        qint64 bytes() const;
+    };
+
+    std::vector<std::unique_ptr<Step>> steps;
+    int current = 0;                       // steps[0, current) can be undone
+    Volume live;                           // the volume steps[current - 1] left
+    std::unique_ptr<Step> pending;         // edit being recorded
+    Volume pendingVolume;
+    quint64 editId = 0;                    // tells the slice calls of different edits apart
+    std::map<int, cv::Mat> savedSlices;
+    std::map<int, std::vector<int>> recordedTiles;   // per slice, position of each tile in pending->tiles or -1
+    std::mutex recordMutex;                // guards the five above
+    qint64 cap;
+    std::unique_ptr<QTemporaryDir> spillDir;
+
+    void push(std::unique_ptr<Step> step);
+    bool applyDelta(Step &step, Volume &volume);
+    bool swapOther(Step &step, Volume &volume);
+    void enforceCap();
+    bool spill(Step &step);
+    QString spillFilePath(const QString &suffix);
+};
+
+#endif // VOLUMEHISTORY_H
@@ -0,0 +1,405 @@
+#include "volumelabeler.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <type_traits>
+#include <utility>
+
+namespace {
+
+struct Offset {
+    int dx, dy, dz;
+};
+
+// Neighbours that come before a voxel in scan order (Z, then Y, then X).
+std::vector<Offset> backwardOffsets(VolumeLabeler::Connectivity connectivity)
+{
+    const int reach = connectivity == VolumeLabeler::Faces ? 1 : connectivity == VolumeLabeler::Edges ? 2 : 3;
+    std::vector<Offset> offsets;
+    for (int dz = -1; dz <= 0; ++dz) {
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                const bool before = dz < 0 || (dz == 0 && (dy < 0 || (dy == 0 && dx < 0)));
+                if (before && std::abs(dx) + std::abs(dy) + std::abs(dz) <= reach)
+                    offsets.push_back({ dx, dy, dz });
+            }
+        }
+    }
+    return offsets;
+}
+
+// Union-find whose roots are always the smallest label of their set, so a
+// set's root is met first when the labels are walked in order.
+struct DisjointSets {
+    std::vector<int> parent;
+
+    int add()
+    {
+        parent.push_back(int(parent.size()));
+        return parent.back();
+    }
+    int find(int a)
+    {
+        while (parent[a] != a) {
+            parent[a] = parent[parent[a]];
+            a = parent[a];
+        }
+        return a;
+    }
+    void unite(int a, int b)
+    {
+        a = find(a);
+        b = find(b);
+        if (a < b)
+            parent[b] = a;
+        else if (b < a)
+            parent[a] = b;
+    }
+};
+
+struct Accumulator {
+    qint64 voxels = 0;
+    double sumX = 0.0, sumY = 0.0, sumZ = 0.0;
+    cv::Point3i lower { INT_MAX, INT_MAX, INT_MAX };
+    cv::Point3i upper { -1, -1, -1 };
+
+    // Voxels x0..x1 of row y in slice z.
+    void addRun(int x0, int x1, int y, int z)
+    {
+        const qint64 n = x1 - x0 + 1;
+        voxels += n;
+        sumX += 0.5 * double(x0 + x1) * n;
+        sumY += double(y) * n;
+        sumZ += double(z) * n;
+        lower = cv::Point3i(std::min(lower.x, x0), std::min(lower.y, y), std::min(lower.z, z));
+        upper = cv::Point3i(std::max(upper.x, x1), std::max(upper.y, y), std::max(upper.z, z));
+    }
+    void merge(const Accumulator &other)
+    {
+        voxels += other.voxels;
+        sumX += other.sumX;
+        sumY += other.sumY;
+        sumZ += other.sumZ;
+        lower = cv::Point3i(std::min(lower.x, other.lower.x), std::min(lower.y, other.lower.y),
+                            std::min(lower.z, other.lower.z));
+        upper = cv::Point3i(std::max(upper.x, other.upper.x), std::max(upper.y, other.upper.y),
+                            std::max(upper.z, other.upper.z));
+    }
+    LabelStats stats(int label) const
+    {
+        LabelStats s;
+        s.label = label;
+        s.voxels = voxels;
+        s.lower = lower;
+        s.upper = upper;
+        if (voxels > 0)
+            s.centroid = QVector3D(float(sumX / voxels), float(sumY / voxels), float(sumZ / voxels));
+        return s;
+    }
+};
+
+template <typename T>
+bool isForeground(T v) { return v != T(0); }
+bool isForeground(const cv::Vec3b &v) { return v[0] | v[1] | v[2]; }
+
+template <typename T>
+double intensity(T v) { return double(v); }
+double intensity(const cv::Vec3b &v) { return 0.114 * v[0] + 0.587 * v[1] + 0.299 * v[2]; }
+
+// 0 or 1 per voxel of one row.
+void foregroundRow(const uchar *row, int type, int width, uchar *mask)
+{
+    dispatchVoxelType(type, [&](auto *tag) {
+        using T = std::remove_pointer_t<decltype(tag)>;
+        const T *v = reinterpret_cast<const T *>(row);
+        for (int x = 0; x < width; ++x)
+            mask[x] = isForeground(v[x]);
+    });
+}
+
+// Labels of one brick, numbered 1..count, with their partial statistics.
+struct Brick {
+    int z0 = 0, z1 = 0;
+    int count = 0;
+    std::vector<Accumulator> parts;   // by local label, 0 unused
+};
+
+} // namespace
+
+
+Volume VolumeLabeler::components(const Volume &src, Connectivity connectivity, Task &job,
+                                 std::vector<LabelStats> *stats)
+{
+    if (src.isEmpty())
+        return Volume();
+    const int width = src.width();
+    const int height = src.height();
+    const int depth = src.depth();
+
+    // Brick-local labels first, in a scratch volume that is paged like any
+    // other once it exceeds the budget.
+    Volume labels = Volume::allocate(width, height, depth, CV_32SC1);
+    const size_t rowInts = labels.rowStride() / sizeof(int);
+    const size_t sliceInts = labels.sliceStride() / sizeof(int);
+    const std::vector<Offset> offsets = backwardOffsets(connectivity);
+    auto labelRow = [&](int y, int z) { return reinterpret_cast<int *>(labels.slicePtr(z)) + y * rowInts; };
+
+    std::vector<Brick> bricks((depth + BrickSlices - 1) / BrickSlices);
+    for (int b = 0; b < int(bricks.size()); ++b) {
+        bricks[b].z0 = b * BrickSlices;
+        bricks[b].z1 = std::min(bricks[b].z0 + BrickSlices, depth);
+    }
+
+    bool ok = job.parallelFor(int(bricks.size()), [&](int b) {
+        Brick &brick = bricks[b];
+        DisjointSets sets;
+        sets.add();   // 0 is the background
+        std::vector<uchar> foreground(width);
+        src.prefetch(brick.z0, brick.z1);
+
+        for (int z = brick.z0; z < brick.z1; ++z) {
+            for (int y = 0; y < height; ++y) {
+                foregroundRow(src.slicePtr(z) + y * src.rowStride(), src.type(), width, foreground.data());
+                int *row = labelRow(y, z);
+                for (int x = 0; x < width; ++x) {
+                    if (!foreground[x]) {
+                        row[x] = 0;
+                        continue;
+                    }
+                    // Only neighbours inside the brick; the rest are merged later.
+                    int label = 0;
+                    for (const Offset &o : offsets) {
+                        if (z + o.dz < brick.z0 || y + o.dy < 0 || y + o.dy >= height
+                                || x + o.dx < 0 || x + o.dx >= width)
+                            continue;
+                        const int n = row[x + o.dz * ptrdiff_t(sliceInts) + o.dy * ptrdiff_t(rowInts) + o.dx];
+                        if (n == 0)
+                            continue;
+                        if (label == 0)
+                            label = n;
+                        else if (n != label)
+                            sets.unite(label, n);
+                    }
+                    row[x] = label != 0 ? label : sets.add();
+                }
+            }
+            src.release(z, z + 1);
+        }
+
+        // Roots come before the rest of their set, so one walk numbers them.
+        std::vector<int> compact(sets.parent.size(), 0);
+        for (int i = 1; i < int(compact.size()); ++i) {
+            const int root = sets.find(i);
+            compact[i] = root == i ? ++brick.count : compact[root];
+        }
+        brick.parts.assign(brick.count + 1, Accumulator());
+        for (int z = brick.z0; z < brick.z1; ++z) {
+            for (int y = 0; y < height; ++y) {
+                int *row = labelRow(y, z);
+                for (int x = 0; x < width; ++x) {
+                    if (row[x] != 0) {
+                        row[x] = compact[row[x]];
+                        brick.parts[row[x]].addRun(x, x, y, z);
+                    }
+                }
+            }
+        }
+    });
+    if (!ok)
+        return Volume();
+
+    // Brick b's local label l is global label first[b] + l.
+    std::vector<int> first(bricks.size() + 1, 0);
+    for (size_t b = 0; b < bricks.size(); ++b)
+        first[b + 1] = first[b] + bricks[b].count;
+    const int total = first.back();
+
+    // Pairs of labels touching across each brick boundary are found in
+    // parallel and merged afterwards.
+    std::vector<std::vector<std::pair<int, int>>> touching(bricks.size());
+    ok = job.parallelFor(int(bricks.size()) - 1, [&](int i) {
+        const int b = i + 1;
+        const int z = bricks[b].z0;
+        std::vector<std::pair<int, int>> &pairs = touching[b];
+        for (int y = 0; y < height; ++y) {
+            const int *row = labelRow(y, z);
+            for (int x = 0; x < width; ++x) {
+                if (row[x] == 0)
+                    continue;
+                for (const Offset &o : offsets) {
+                    if (o.dz == 0 || y + o.dy < 0 || y + o.dy >= height || x + o.dx < 0 || x + o.dx >= width)
+                        continue;
+                    const int n = row[x - ptrdiff_t(sliceInts) + o.dy * ptrdiff_t(rowInts) + o.dx];
+                    if (n == 0)
+                        continue;
+                    const std::pair<int, int> pair(first[b] + row[x], first[b - 1] + n);
+                    if (pairs.empty() || pairs.back() != pair)
+                        pairs.push_back(pair);
+                }
+            }
+        }
+    });
+    if (!ok)
+        return Volume();
+
+    DisjointSets global;
+    global.parent.resize(total + 1);
+    for (int g = 0; g <= total; ++g)
+        global.parent[g] = g;
+    for (const auto &pairs : touching) {
+        for (const auto &pair : pairs)
+            global.unite(pair.first, pair.second);
+    }
+    touching.clear();
+
+    std::vector<int> finalLabel(total + 1, 0);
+    int count = 0;
+    for (int g = 1; g <= total; ++g) {
+        const int root = global.find(g);
+        finalLabel[g] = root == g ? ++count : finalLabel[root];
+    }
+
+    // Float labels are exact up to 2^24 components.
+    Volume out = Volume::allocate(width, height, depth, count <= 65535 ? CV_16UC1 : CV_32FC1);
+    out.setSpacing(src.spacing());
+    ok = job.parallelFor(int(bricks.size()), [&](int b) {
+        const Brick &brick = bricks[b];
+        const int *map = finalLabel.data() + first[b];
+        auto write = [&](auto *tag) {
+            using T = std::remove_pointer_t<decltype(tag)>;
+            for (int z = brick.z0; z < brick.z1; ++z) {
+                for (int y = 0; y < height; ++y) {
+                    const int *row = labelRow(y, z);
+                    T *dst = reinterpret_cast<T *>(out.slicePtr(z) + y * out.rowStride());
+                    for (int x = 0; x < width; ++x)
+                        dst[x] = row[x] != 0 ? T(map[row[x]]) : T(0);
+                }
+                labels.release(z, z + 1);
+                out.release(z, z + 1);
+            }
+        };
+        if (out.type() == CV_16UC1)
+            write(static_cast<ushort *>(nullptr));
+        else
+            write(static_cast<float *>(nullptr));
+    });
+    if (!ok)
+        return Volume();
+
+    if (stats) {
+        std::vector<Accumulator> merged(count + 1);
+        for (size_t b = 0; b < bricks.size(); ++b) {
+            for (int l = 1; l <= bricks[b].count; ++l)
+                merged[finalLabel[first[b] + l]].merge(bricks[b].parts[l]);
+        }
+        stats->clear();
+        stats->reserve(count);
+        for (int label = 1; label <= count; ++label)
+            stats->push_back(merged[label].stats(label));
+    }
+    return out;
+}
+
+
+Volume VolumeLabeler::grow(const Volume &src, const cv::Point3i &seed, double tolerance,
+                           Connectivity connectivity, Task &job, LabelStats *stats)
+{
+    const int width = src.width();
+    const int height = src.height();
+    const int depth = src.depth();
+    if (seed.x < 0 || seed.y < 0 || seed.z < 0 || seed.x >= width || seed.y >= height || seed.z >= depth)
+        return Volume();
+
+    // Neighbour rows of a run and how far past its ends they connect: rows
+    // sharing a face with the run reach one voxel further for 18 and 26
+    // neighbours, diagonal rows only for 26.
+    struct NeighbourRow {
+        int dy, dz, pad;
+    };
+    std::vector<NeighbourRow> neighbours;
+    for (int dz = -1; dz <= 1; ++dz) {
+        for (int dy = -1; dy <= 1; ++dy) {
+            const int steps = std::abs(dy) + std::abs(dz);
+            if (steps == 0 || (steps == 2 && connectivity == Faces))
+                continue;
+            const int pad = connectivity == Corners || (steps == 1 && connectivity == Edges) ? 1 : 0;
+            neighbours.push_back({ dy, dz, pad });
+        }
+    }
+
+    // The mask doubles as the visited set. Paged volumes start zero-filled.
+    Volume mask = Volume::allocate(width, height, depth, CV_8UC1);
+    mask.setSpacing(src.spacing());
+    if (!mask.isPaged()) {
+        TaskScheduler::parallelFor(cv::Range(0, depth), job.priority(), [&](const cv::Range &r) {
+            for (int z = r.start; z < r.end; ++z)
+                std::fill(mask.slicePtr(z), mask.slicePtr(z) + mask.sliceStride(), uchar(0));
+        }, 8, job.cancelFlag());
+    }
+
+    Accumulator region;
+    bool ok = false;
+    dispatchVoxelType(src.type(), [&](auto *tag) {
+        using T = std::remove_pointer_t<decltype(tag)>;
+        auto inRow = [&](int y, int z) { return reinterpret_cast<const T *>(src.slicePtr(z) + y * src.rowStride()); };
+        auto outRow = [&](int y, int z) { return mask.slicePtr(z) + y * mask.rowStride(); };
+        const double low = intensity(inRow(seed.y, seed.z)[seed.x]) - tolerance;
+        const double high = low + 2.0 * tolerance;
+        auto inside = [&](const T &v) {
+            const double value = intensity(v);
+            return value >= low && value <= high;
+        };
+
+        const qint64 voxels = qint64(width) * height * depth;
+        std::vector<cv::Point3i> pending { seed };
+        qint64 runs = 0;
+        while (!pending.empty()) {
+            const cv::Point3i p = pending.back();
+            pending.pop_back();
+            uchar *out = outRow(p.y, p.z);
+            if (out[p.x])
+                continue;
+            const T *in = inRow(p.y, p.z);
+            int x0 = p.x;
+            int x1 = p.x;
+            while (x0 > 0 && !out[x0 - 1] && inside(in[x0 - 1]))
+                --x0;
+            while (x1 < width - 1 && !out[x1 + 1] && inside(in[x1 + 1]))
+                ++x1;
+            std::fill(out + x0, out + x1 + 1, uchar(255));
+            region.addRun(x0, x1, p.y, p.z);
+
+            // One entry per run of open voxels in each neighbour row.
+            for (const NeighbourRow &n : neighbours) {
+                const int y = p.y + n.dy;
+                const int z = p.z + n.dz;
+                if (y < 0 || y >= height || z < 0 || z >= depth)
+                    continue;
+                const T *nin = inRow(y, z);
+                const uchar *nout = outRow(y, z);
+                const int end = std::min(x1 + n.pad, width - 1);
+                bool open = false;
+                for (int x = std::max(x0 - n.pad, 0); x <= end; ++x) {
+                    const bool next = !nout[x] && inside(nin[x]);
+                    if (next && !open)
+                        pending.push_back(cv::Point3i(x, y, z));
+                    open = next;
+                }
+            }
+
+            if (++runs % 4096 == 0) {
+                if (job.isCancelled())
+                    return;
+                job.setProgress(region.voxels, voxels);
+            }
+        }
+        ok = true;
+    });
+    if (!ok || job.isCancelled())
+        return Volume();
+
+    if (stats)
+        *stats = region.stats(255);
+    return mask;
+}
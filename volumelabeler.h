@@ -0,0 +1,55 @@
+#ifndef VOLUMELABELER_H
+#define VOLUMELABELER_H
+
+#include <QVector3D>
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "taskscheduler.h"
+#include "volume.h"
+
+// Size and position of one labelled component.
+struct LabelStats {
+    int label = 0;
+    qint64 voxels = 0;
+    cv::Point3i lower;      // bounding box, inclusive, in voxels
+    cv::Point3i upper;
+    QVector3D centroid;     // in voxels
+};
+
+// 3D connected components and seeded region growing.
+//
+// components() labels the non-zero voxels of a volume (a mask from the
+// segmentation methods, say). The volume is cut into bricks of BrickSlices
+// slices that are labelled in parallel, each with its own union-find over
+// brick-local labels. The local labels are then offset into one global
+// range, the labels that touch across each brick boundary are merged, and a
+// last parallel pass writes the final labels, numbered 1..n in scan order.
+//
+// grow() fills the region of voxels around a seed whose values stay within
+// a tolerance of the seed's, one run of voxels along X at a time, so a fill
+// touches every voxel of the region once and its neighbour rows once per run.
+class VolumeLabeler {
+public:
+    // Neighbours that connect: sharing a face, also an edge, also a corner.
+    enum Connectivity { Faces = 6, Edges = 18, Corners = 26 };
+
+    static const int BrickSlices = 16;
+
+    // Label volume of the non-zero voxels: CV_16UC1 while the labels fit,
+    // CV_32FC1 otherwise. stats, if given, receives one entry per label in
+    // label order. Returns an empty volume if cancelled.
+    static Volume components(const Volume &src, Connectivity connectivity, Task &job,
+                             std::vector<LabelStats> *stats = nullptr);
+
+    // 8-bit mask with 255 on the voxels connected to seed whose value (the
+    // luminance for colour volumes) differs from the seed's by at most
+    // tolerance, 0 elsewhere. The mask is empty if the seed is outside the
+    // volume or the fill is cancelled.
+    static Volume grow(const Volume &src, const cv::Point3i &seed, double tolerance,
+                       Connectivity connectivity, Task &job, LabelStats *stats = nullptr);
+};
+
+#endif // VOLUMELABELER_H
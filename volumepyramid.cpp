@@ -0,0 +1,120 @@
+#include "volumepyramid.h"
+
+#include "taskscheduler.h"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+
+VolumePyramid::VolumePyramid(const Volume &source)
+{
+    if (source.isEmpty())
+        return;
+
+    levels.push_back(source);
+    for (int k = 1; k <= MaxLevel; ++k) {
+        const int width = source.width() >> k;
+        const int height = source.height() >> k;
+        if (width < MinSize || height < MinSize)
+            break;
+        Volume level = Volume::allocate(width, height, source.depth(), source.type());
+        const QVector3D spacing = source.spacing();
+        level.setSpacing(QVector3D(spacing.x() * (1 << k), spacing.y() * (1 << k), spacing.z()));
+        levels.push_back(level);
+    }
+
+    // Version 0 is never handed out, so every slice starts out stale.
+    built = std::make_shared<std::vector<std::atomic<quint64>>>(source.depth());
+    for (auto &version : *built)
+        version.store(0);
+}
+
+bool VolumePyramid::covers(const Volume &volume) const
+{
+    return !isEmpty() && source().data() == volume.data() && source().sameGeometry(volume);
+}
+
+bool VolumePyramid::update(const std::atomic<bool> *cancel)
+{
+    if (levelCount() < 2)
+        return true;
+
+    const Volume &src = source();
+    // Chunks of slices keep paged volumes streaming through the budget.
+    const int chunk = 16;
+    for (int z0 = 0; z0 < src.depth(); z0 += chunk) {
+        if (cancel && cancel->load())
+            return false;
+        const int z1 = std::min(z0 + chunk, src.depth());
+        TaskScheduler::parallelFor(cv::Range(z0, z1), Task::Background, [&](const cv::Range &range) {
+            for (int z = range.start; z < range.end; ++z) {
+                const quint64 version = src.sliceVersion(z);
+                if ((*built)[z].load() == version)
+                    continue;
+                // Each level is reduced from the one above it, 2x2 -> 1 by area.
+                for (int k = 1; k < levelCount(); ++k) {
+                    Volume &level = levels[k];
+                    cv::Mat dst = level.axial(z);
+                    cv::resize(levels[k - 1].axial(z), dst, dst.size(), 0, 0, cv::INTER_AREA);
+                    level.markModified(z);
+                }
+                (*built)[z].store(version);
+                src.release(z, z + 1);
+            }
+        }, 1, cancel);
+    }
+    return true;
+}
+
+bool VolumePyramid::isCurrent() const
+{
+    if (isEmpty())
+        return false;
+    for (int z = 0; z < source().depth(); ++z) {
+        if ((*built)[z].load() != source().sliceVersion(z))
+            return false;
+    }
+    return true;
+}
+
+int VolumePyramid::levelFor(const QSize &planeSize, const QSize &targetSize) const
+{
+    int k = 0;
+    while (k + 1 < levelCount() && (planeSize.width() >> (k + 1)) >= targetSize.width()
+            && (planeSize.height() >> (k + 1)) >= targetSize.height())
+        ++k;
+    return k;
+}
+
+// The coarsest level still shown at one level pixel per screen pixel or more.
+int VolumePyramid::levelForScale(double scale) const
+{
+    int k = 0;
+    while (k + 1 < levelCount() && scale * (1 << (k + 1)) <= 1.0)
+        ++k;
+    return k;
+}
+
+int VolumePyramid::levelWithin(qint64 bytes, int finest) const
+{
+    for (int k = std::max(finest, 0); k < levelCount(); ++k) {
+        if (qint64(levels[k].totalBytes()) <= bytes)
+            return k;
+    }
+    return -1;
+}
+
+int VolumePyramid::toLevel(int coordinate, int level, int levelSize)
+{
+    return std::min(coordinate >> level, levelSize - 1);
+}
+
+cv::Mat VolumePyramid::reduce(const cv::Mat &image, int level)
+{
+    if (level <= 0 || image.empty())
+        return image;
+    cv::Mat reduced;
+    cv::resize(image, reduced, cv::Size(std::max(image.cols >> level, 1), std::max(image.rows >> level, 1)),
+               0, 0, cv::INTER_AREA);
+    return reduced;
+}
@@ -0,0 +1,63 @@
+#ifndef VOLUMEPYRAMID_H
+#define VOLUMEPYRAMID_H
+
+#include <QSize>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "volume.h"
+
+// Downsampled copies of a volume at 1/2, 1/4 and 1/8 of its width and height.
+//
+// Depth is kept, so every level slice corresponds to one source slice and
+// the levels can follow the per-slice content versions: update() only
+// reduces slices whose source version changed since they were last built.
+// Each level carries the source spacing scaled by its factor, so its
+// physical extent matches the source.
+//
+// Copies are shallow and share the levels and their build state, which lets
+// a copy be updated on a worker thread.
+class VolumePyramid {
+public:
+    static const int MaxLevel = 3;   // 8x
+    static const int MinSize = 16;   // no level narrower or shorter than this
+
+    VolumePyramid() = default;
+    // Allocates the levels; nothing is built until update().
+    explicit VolumePyramid(const Volume &source);
+
+    bool isEmpty() const { return levels.empty(); }
+    // Level 0 is the source itself.
+    int levelCount() const { return int(levels.size()); }
+    const Volume &level(int k) const { return levels[std::min(std::max(k, 0), levelCount() - 1)]; }
+    const Volume &source() const { return levels.front(); }
+    // Whether the pyramid was built over this very buffer.
+    bool covers(const Volume &volume) const;
+
+    // Reduces every slice whose source version changed, in parallel. The
+    // version is read before the slice, so a slice edited while this runs is
+    // rebuilt by the next call. Returns false when cancelled.
+    bool update(const std::atomic<bool> *cancel = nullptr);
+    bool isCurrent() const;
+
+    // Coarsest level whose plane of the given level-0 size still covers the
+    // target size, or the coarsest whose volume fits the byte limit.
+    int levelFor(const QSize &planeSize, const QSize &targetSize) const;
+    int levelForScale(double scale) const;
+    int levelWithin(qint64 bytes, int finest = 0) const;
+
+    // Level-0 coordinate along a reduced axis, clamped to the level.
+    static int toLevel(int coordinate, int level, int levelSize);
+    // One image reduced by 2^level, for callers without a pyramid.
+    static cv::Mat reduce(const cv::Mat &image, int level);
+
+private:
+    std::vector<Volume> levels;
+    // Source slice version each level slice was reduced from.
+    std::shared_ptr<std::vector<std::atomic<quint64>>> built;
+};
+
+#endif // VOLUMEPYRAMID_H
@@ -0,0 +1,121 @@
+#include "volumerenderview.h"
+
+#include <QMouseEvent>
+#include <QPainter>
+#include <QWheelEvent>
+
+#include <cmath>
+
+VolumeRenderView::VolumeRenderView(QWidget *parent)
+    : QWidget(parent)
+{
+    setMinimumSize(200, 200);
+    setMouseTracking(false);
+
+    refineTimer.setSingleShot(true);
+    refineTimer.setInterval(150);
+    connect(&refineTimer, &QTimer::timeout, this, &VolumeRenderView::renderFullResolution);
+}
+
+void VolumeRenderView::setVolume(const Volume &volume)
+{
+    caster.setVolume(volume);
+    if (isVisible())
+        renderFullResolution();
+}
+
+void VolumeRenderView::setMode(RayCaster::Mode mode)
+{
+    caster.setMode(mode);
+    if (isVisible())
+        renderFullResolution();
+}
+
+void VolumeRenderView::setIsoValue(float value)
+{
+    caster.setIsoValue(value);
+    if (isVisible())
+        renderInteractive();
+}
+
+void VolumeRenderView::setWindow(const WindowLevel &window)
+{
+    caster.setWindow(window);
+    if (isVisible())
+        renderInteractive();
+}
+
+void VolumeRenderView::renderFrame(int downsample)
+{
+    frame = caster.render(size(), camera, downsample);
+    update();
+}
+
+void VolumeRenderView::renderFullResolution()
+{
+    renderFrame(1);
+}
+
+// Cheap frame now, full resolution once the input has been idle for a bit.
+void VolumeRenderView::renderInteractive()
+{
+    renderFrame(InteractiveDownsample);
+    refineTimer.start();
+}
+
+void VolumeRenderView::paintEvent(QPaintEvent *)
+{
+    QPainter painter(this);
+    painter.fillRect(rect(), QColor(128, 128, 128));
+    if (!frame.isNull()) {
+        painter.setRenderHint(QPainter::SmoothPixmapTransform, true);
+        painter.drawImage(rect(), frame);
+    }
+    if (!caster.canRender()) {
+        painter.setPen(Qt::white);
+        painter.drawText(rect(), Qt::AlignCenter, "Ray casting needs a grayscale volume.");
+    }
+}
+
+void VolumeRenderView::resizeEvent(QResizeEvent *event)
+{
+    QWidget::resizeEvent(event);
+    if (isVisible())
+        renderInteractive();
+}
+
+void VolumeRenderView::showEvent(QShowEvent *event)
+{
+    QWidget::showEvent(event);
+    renderFullResolution();
+}
+
+void VolumeRenderView::mousePressEvent(QMouseEvent *event)
+{
+    lastMousePos = event->pos();
+}
+
+void VolumeRenderView::mouseMoveEvent(QMouseEvent *event)
+{
+    if (!(event->buttons() & Qt::LeftButton))
+        return;
+
+    const QPoint delta = event->pos() - lastMousePos;
+    lastMousePos = event->pos();
+    camera.yaw -= delta.x() * 0.5f;
+    camera.pitch = qBound(-89.0f, camera.pitch + delta.y() * 0.5f, 89.0f);
+    renderInteractive();
+}
+
+void VolumeRenderView::mouseReleaseEvent(QMouseEvent *)
+{
+    refineTimer.stop();
+    renderFullResolution();
+}
+
+void VolumeRenderView::wheelEvent(QWheelEvent *event)
+{
+    const float steps = event->angleDelta().y() / 120.0f;
+    camera.distance = qBound(0.3f, camera.distance * std::pow(0.9f, steps), 10.0f);
+    renderInteractive();
+}
@@ -0,0 +1,49 @@
+#ifndef VOLUMERENDERVIEW_H
+#define VOLUMERENDERVIEW_H
+
+#include <QWidget>
+#include <QImage>
+#include <QPoint>
+#include <QTimer>
+
+#include "raycaster.h"
+
+// 3D viewport backed by the CPU ray caster. Dragging orbits the camera and
+// the wheel zooms; while the camera moves frames are rendered at a quarter
+// of the resolution, and a full-resolution frame follows once it stops.
+class VolumeRenderView : public QWidget {
+    Q_OBJECT
+public:
+    explicit VolumeRenderView(QWidget *parent = nullptr);
+
+    void setVolume(const Volume &volume);
+    void setMode(RayCaster::Mode mode);
+    void setIsoValue(float value);
+    void setWindow(const WindowLevel &window);
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+    void resizeEvent(QResizeEvent *event) override;
+    void showEvent(QShowEvent *event) override;
+    void mousePressEvent(QMouseEvent *event) override;
+    void mouseMoveEvent(QMouseEvent *event) override;
+    void mouseReleaseEvent(QMouseEvent *event) override;
+    void wheelEvent(QWheelEvent *event) override;
+
+private slots:
+    void renderFullResolution();
+
+private:
+    RayCaster caster;
+    RayCaster::Camera camera;
+    QImage frame;
+    QTimer refineTimer;
+    QPoint lastMousePos;
+
+    static const int InteractiveDownsample = 4;
+
+    void renderFrame(int downsample);
+    void renderInteractive();
+};
+
+#endif // VOLUMERENDERVIEW_H
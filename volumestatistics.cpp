@@ -0,0 +1,389 @@
+#include "volumestatistics.h"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+// Bin layout shared by every slice counted into one histogram.
+struct Bins {
+    double low = 0.0;
+    double width = 1.0;
+    int count = 0;
+    bool exact = false;
+};
+
+Bins binsFor(int depth, double minimum, double maximum)
+{
+    Bins bins;
+    bins.low = minimum;
+    if (depth == CV_8U) {
+        bins.low = 0.0;
+        bins.count = 256;
+        bins.exact = true;
+    } else if (depth != CV_32F && depth != CV_64F && maximum - minimum + 1 <= VolumeStatistics::MaxBins) {
+        bins.count = int(maximum - minimum) + 1;
+        bins.exact = true;
+    } else {
+        bins.count = VolumeStatistics::MaxBins;
+        bins.width = std::max(maximum - minimum, 1e-6) / bins.count;
+    }
+    return bins;
+}
+
+bool covers(const Bins &bins, double minimum, double maximum)
+{
+    return bins.count > 0 && minimum >= bins.low && maximum <= bins.low + bins.count * bins.width;
+}
+
+// Colour is counted by luminance.
+cv::Mat scalarImage(const cv::Mat &image)
+{
+    if (image.channels() != 3)
+        return image;
+    cv::Mat gray;
+    cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    return gray;
+}
+
+struct Moments {
+    qint64 count = 0;
+    double minimum = std::numeric_limits<double>::infinity();
+    double maximum = -std::numeric_limits<double>::infinity();
+    double sum = 0.0;
+    double sumSquares = 0.0;
+
+    void add(const cv::Mat &image)
+    {
+        if (image.empty())
+            return;
+        double low = 0.0, high = 0.0;
+        cv::minMaxIdx(image, &low, &high);
+        minimum = std::min(minimum, low);
+        maximum = std::max(maximum, high);
+        sum += cv::sum(image)[0];
+        sumSquares += cv::norm(image, cv::NORM_L2SQR);
+        count += qint64(image.total());
+    }
+    void merge(const Moments &other)
+    {
+        count += other.count;
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+        sum += other.sum;
+        sumSquares += other.sumSquares;
+    }
+};
+
+// Adds the bin counts of a single-channel image to counts.
+template <typename Count>
+void binImage(const cv::Mat &image, const Bins &bins, Count *counts)
+{
+    const size_t n = size_t(bins.count);
+    std::vector<Count> sub(4 * n, 0);
+    Count *h0 = sub.data(), *h1 = h0 + n, *h2 = h1 + n, *h3 = h2 + n;
+    const int cols = image.cols;
+
+    if (image.depth() == CV_8U) {
+        // 8-bit values are their own bin index.
+        for (int y = 0; y < image.rows; ++y) {
+            const uchar *p = image.ptr<uchar>(y);
+            int x = 0;
+            for (; x + 4 <= cols; x += 4) {
+                ++h0[p[x]];
+                ++h1[p[x + 1]];
+                ++h2[p[x + 2]];
+                ++h3[p[x + 3]];
+            }
+            for (; x < cols; ++x)
+                ++h0[p[x]];
+        }
+    } else {
+        // Exact bins are whole numbers apart; otherwise the half-bin shift
+        // turns convertTo's rounding into a floor.
+        const double scale = 1.0 / bins.width;
+        const double shift = -bins.low * scale - (bins.exact ? 0.0 : 0.5);
+        const int last = bins.count - 1;
+        cv::Mat index(1, cols, CV_32S);
+        const int *i = index.ptr<int>();
+        auto bin = [last](int v) { return std::min(std::max(v, 0), last); };
+        for (int y = 0; y < image.rows; ++y) {
+            image.row(y).convertTo(index, CV_32S, scale, shift);
+            int x = 0;
+            for (; x + 4 <= cols; x += 4) {
+                ++h0[bin(i[x])];
+                ++h1[bin(i[x + 1])];
+                ++h2[bin(i[x + 2])];
+                ++h3[bin(i[x + 3])];
+            }
+            for (; x < cols; ++x)
+                ++h0[bin(i[x])];
+        }
+    }
+    for (size_t b = 0; b < n; ++b)
+        counts[b] += h0[b] + h1[b] + h2[b] + h3[b];
+}
+
+Histogram makeHistogram(const Bins &bins, std::vector<qint64> counts, const Moments &moments)
+{
+    Histogram histogram;
+    if (moments.count == 0)
+        return histogram;
+    histogram.low = bins.low;
+    histogram.binWidth = bins.width;
+    histogram.exact = bins.exact;
+    histogram.counts = std::move(counts);
+    histogram.total = moments.count;
+    histogram.minimum = moments.minimum;
+    histogram.maximum = moments.maximum;
+    histogram.sum = moments.sum;
+    histogram.sumSquares = moments.sumSquares;
+    return histogram;
+}
+
+} // namespace
+
+
+double Histogram::mean() const
+{
+    return total > 0 ? sum / total : 0.0;
+}
+
+double Histogram::stddev() const
+{
+    if (total == 0)
+        return 0.0;
+    const double m = mean();
+    return std::sqrt(std::max(sumSquares / total - m * m, 0.0));
+}
+
+double Histogram::percentile(double p) const
+{
+    if (isEmpty())
+        return 0.0;
+    const double target = std::min(std::max(p, 0.0), 100.0) / 100.0 * total;
+    qint64 below = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i] > 0 && below + counts[i] > target) {
+            if (exact)
+                return low + double(i);
+            const double value = low + binWidth * (i + (target - below) / counts[i]);
+            return std::min(std::max(value, minimum), maximum);
+        }
+        below += counts[i];
+    }
+    return maximum;
+}
+
+double Histogram::otsuThreshold() const
+{
+    if (isEmpty())
+        return 0.0;
+    double sumAll = 0.0;
+    for (size_t i = 0; i < counts.size(); ++i)
+        sumAll += double(i) * counts[i];
+
+    qint64 background = 0;
+    double sumBackground = 0.0;
+    double best = -1.0;
+    size_t bestBin = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        background += counts[i];
+        sumBackground += double(i) * counts[i];
+        const qint64 foreground = total - background;
+        if (background == 0)
+            continue;
+        if (foreground == 0)
+            break;
+        const double meanBackground = sumBackground / background;
+        const double meanForeground = (sumAll - sumBackground) / foreground;
+        const double between = double(background) * foreground * (meanBackground - meanForeground)
+                               * (meanBackground - meanForeground);
+        if (between > best) {
+            best = between;
+            bestBin = i;
+        }
+    }
+    return exact ? low + double(bestBin) : low + (bestBin + 1) * binWidth;
+}
+
+
+// Results for one volume, per slice and summed.
+struct VolumeStatistics::Entry {
+    std::mutex mutex;                 // held while the entry is brought up to date
+    const uchar *data = nullptr;
+    int width = 0, height = 0, depth = 0, type = 0;
+    Bins bins;
+    std::vector<quint64> versions;    // slice versions counted below, 0 for none
+    std::vector<Moments> moments;
+    std::vector<std::vector<quint32>> counts;
+    std::vector<qint64> total;        // counts summed over the slices
+
+    bool matches(const Volume &volume) const
+    {
+        return data == volume.data() && width == volume.width() && height == volume.height()
+               && depth == volume.depth() && type == volume.type();
+    }
+};
+
+VolumeStatistics &VolumeStatistics::instance()
+{
+    static VolumeStatistics statistics;
+    return statistics;
+}
+
+Histogram VolumeStatistics::histogram(const Volume &volume, Task::Priority priority)
+{
+    if (volume.isEmpty())
+        return Histogram();
+
+    std::shared_ptr<Entry> cached;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = std::find_if(entries.begin(), entries.end(),
+                               [&](const std::shared_ptr<Entry> &e) { return e->matches(volume); });
+        if (it == entries.end()) {
+            auto created = std::make_shared<Entry>();
+            created->data = volume.data();
+            created->width = volume.width();
+            created->height = volume.height();
+            created->depth = volume.depth();
+            created->type = volume.type();
+            created->versions.assign(created->depth, 0);
+            created->moments.resize(created->depth);
+            created->counts.resize(created->depth);
+            if (CV_MAT_DEPTH(created->type) == CV_8U)
+                created->bins = binsFor(CV_8U, 0.0, 255.0);
+            created->total.assign(created->bins.count, 0);
+            entries.push_front(std::move(created));
+            // An entry dropped here lives on until a pass still updating it is done.
+            if (int(entries.size()) > CachedVolumes)
+                entries.pop_back();
+        } else {
+            entries.splice(entries.begin(), entries, it);
+        }
+        cached = entries.front();
+    }
+
+    // Requests for one volume take turns: a later one finds the slices the
+    // earlier one counted and only bins what changed since.
+    std::lock_guard<std::mutex> lock(cached->mutex);
+    Entry &entry = *cached;
+
+    // Slices changed since they were counted. The version is read before the
+    // slice, so a write that races with the count makes it stale again.
+    std::vector<int> stale;
+    std::vector<quint64> seen(entry.depth);
+    for (int z = 0; z < entry.depth; ++z) {
+        seen[z] = volume.sliceVersion(z);
+        if (seen[z] == 0 || seen[z] != entry.versions[z])
+            stale.push_back(z);
+    }
+
+    // One visit per stale slice: extremes and moments, and the counts too
+    // while the current bins are known.
+    std::vector<std::vector<quint32>> fresh(stale.size());
+    const Bins bins = entry.bins;
+    TaskScheduler::parallelFor(cv::Range(0, int(stale.size())), priority, [&](const cv::Range &r) {
+        for (int i = r.start; i < r.end; ++i) {
+            const int z = stale[i];
+            volume.prefetch(z + 1, z + 2);
+            const cv::Mat slice = scalarImage(volume.axial(z));
+            Moments moments;
+            moments.add(slice);
+            entry.moments[z] = moments;
+            if (bins.count > 0) {
+                fresh[i].assign(bins.count, 0);
+                binImage(slice, bins, fresh[i].data());
+            }
+            volume.release(z, z + 1);
+        }
+    });
+
+    Moments all;
+    for (const Moments &m : entry.moments)
+        all.merge(m);
+
+    if (covers(entry.bins, all.minimum, all.maximum)) {
+        for (size_t i = 0; i < stale.size(); ++i) {
+            std::vector<quint32> &counts = entry.counts[stale[i]];
+            for (size_t b = 0; b < counts.size(); ++b)
+                entry.total[b] -= counts[b];
+            counts = std::move(fresh[i]);
+            for (size_t b = 0; b < counts.size(); ++b)
+                entry.total[b] += counts[b];
+        }
+    } else {
+        // New range: every slice is counted again over the new bins.
+        entry.bins = binsFor(CV_MAT_DEPTH(entry.type), all.minimum, all.maximum);
+        const Bins rebinned = entry.bins;
+        TaskScheduler::parallelFor(cv::Range(0, entry.depth), priority, [&](const cv::Range &r) {
+            for (int z = r.start; z < r.end; ++z) {
+                volume.prefetch(z + 1, z + 2);
+                entry.counts[z].assign(rebinned.count, 0);
+                binImage(scalarImage(volume.axial(z)), rebinned, entry.counts[z].data());
+                volume.release(z, z + 1);
+            }
+        });
+        entry.total.assign(rebinned.count, 0);
+        for (const std::vector<quint32> &counts : entry.counts) {
+            for (size_t b = 0; b < counts.size(); ++b)
+                entry.total[b] += counts[b];
+        }
+    }
+    for (int z : stale)
+        entry.versions[z] = seen[z];
+
+    return makeHistogram(entry.bins, entry.total, all);
+}
+
+Histogram VolumeStatistics::histogram(const Volume &volume, const cv::Range &slices, const cv::Rect &roi,
+                                      Task::Priority priority)
+{
+    const int begin = std::max(slices.start, 0);
+    const int end = std::min(slices.end, volume.depth());
+    const cv::Rect area = roi.empty() ? cv::Rect(0, 0, volume.width(), volume.height())
+                                      : roi & cv::Rect(0, 0, volume.width(), volume.height());
+    if (begin >= end || area.empty())
+        return Histogram();
+
+    auto sliceAt = [&](int z) { return scalarImage(volume.axial(z)(area)); };
+
+    std::vector<Moments> moments(end - begin);
+    TaskScheduler::parallelFor(cv::Range(begin, end), priority, [&](const cv::Range &r) {
+        for (int z = r.start; z < r.end; ++z)
+            moments[z - begin].add(sliceAt(z));
+    });
+    Moments all;
+    for (const Moments &m : moments)
+        all.merge(m);
+
+    const Bins bins = binsFor(CV_MAT_DEPTH(volume.type()), all.minimum, all.maximum);
+    std::vector<qint64> counts(bins.count, 0);
+    std::mutex merge;
+    TaskScheduler::parallelFor(cv::Range(begin, end), priority, [&](const cv::Range &r) {
+        std::vector<qint64> local(bins.count, 0);
+        for (int z = r.start; z < r.end; ++z)
+            binImage(sliceAt(z), bins, local.data());
+        std::lock_guard<std::mutex> lock(merge);
+        for (int b = 0; b < bins.count; ++b)
+            counts[b] += local[b];
+    });
+    return makeHistogram(bins, std::move(counts), all);
+}
+
+Histogram VolumeStatistics::histogram(const cv::Mat &image)
+{
+    if (image.empty())
+        return Histogram();
+    const cv::Mat scalar = scalarImage(image);
+    Moments moments;
+    moments.add(scalar);
+    const Bins bins = binsFor(scalar.depth(), moments.minimum, moments.maximum);
+    std::vector<qint64> counts(bins.count, 0);
+    binImage(scalar, bins, counts.data());
+    return makeHistogram(bins, std::move(counts), moments);
+}
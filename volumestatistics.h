@@ -0,0 +1,80 @@
+#ifndef VOLUMESTATISTICS_H
+#define VOLUMESTATISTICS_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "taskscheduler.h"
+#include "volume.h"
+
+// Intensity histogram together with the extremes and moments of the same
+// voxels. Bin i covers [low + i * binWidth, low + (i + 1) * binWidth);
+// integer data spanning at most VolumeStatistics::MaxBins values gets one
+// bin per value (exact), so its percentiles and Otsu threshold are exact too.
+// Colour data is counted by luminance.
+struct Histogram {
+    double low = 0.0;
+    double binWidth = 1.0;
+    bool exact = false;
+    std::vector<qint64> counts;
+    qint64 total = 0;
+    double minimum = 0.0;
+    double maximum = 0.0;
+    double sum = 0.0;
+    double sumSquares = 0.0;
+
+    bool isEmpty() const { return total == 0; }
+    double mean() const;
+    double stddev() const;
+    // Value below which p percent of the voxels lie, p in [0, 100].
+    // Interpolated within a bin unless the bins are exact.
+    double percentile(double p) const;
+    // Threshold maximising the between-class variance; voxels above it are
+    // the foreground, as with cv::THRESH_BINARY.
+    double otsuThreshold() const;
+};
+
+// Histograms and statistics of volumes, in one pass over the voxels.
+//
+// Every slice is reduced to its extremes, sum and sum of squares (OpenCV's
+// vectorised minMaxIdx, sum and norm) and to bin counts. Values are turned
+// into bin indices by a vectorised convertTo per row and counted into four
+// interleaved sub-histograms, so neighbouring equal values do not stall on
+// the same counter. Slices are spread over the scheduler.
+//
+// Whole-volume results are cached per slice version for the last few
+// volumes: a later call only bins the slices that changed since. If a
+// changed slice falls outside the current bin range, the volume is binned
+// again over its new range. The cache lock is only held to look up an entry;
+// binning runs under the entry's own lock, so no request waits on another
+// volume's pass, and concurrent requests for one volume bin it once.
+class VolumeStatistics {
+public:
+    static VolumeStatistics &instance();
+
+    static const int MaxBins = 4096;
+    static const int CachedVolumes = 4;
+
+    // Whole volume, cached. Safe from any thread.
+    Histogram histogram(const Volume &volume, Task::Priority priority = Task::Compute);
+
+    // Region of interest in slices [slices.start, slices.end), uncached.
+    // An empty roi means whole slices.
+    static Histogram histogram(const Volume &volume, const cv::Range &slices, const cv::Rect &roi,
+                               Task::Priority priority = Task::Compute);
+    // One image on the calling thread, uncached.
+    static Histogram histogram(const cv::Mat &image);
+
+private:
+    VolumeStatistics() = default;
+
+    struct Entry;
+    std::mutex mutex;                            // guards the list, not the entries
+    std::list<std::shared_ptr<Entry>> entries;   // most recently used first
+};
+
+#endif // VOLUMESTATISTICS_H
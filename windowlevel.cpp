@@ -0,0 +1,119 @@
+#include "windowlevel.h"
+#include "taskscheduler.h"
+#include "volume.h"
+#include "volumestatistics.h"
+
+#include <algorithm>
+#include <memory>
+
+namespace {
+
+// Below this many pixels a single thread is faster than splitting.
+const int ParallelPixels = 512 * 512;
+
+} // namespace
+
+
+WindowLevel::WindowLevel(double center, double width)
+    : windowCenter(center), windowWidth(std::max(width, 1e-6))
+{
+}
+
+WindowLevel WindowLevel::fromRange(double low, double high)
+{
+    return WindowLevel((low + high) / 2.0, high - low);
+}
+
+WindowLevel WindowLevel::fullRange(const Volume &volume)
+{
+    if (volume.isEmpty() || volume.type() == CV_8UC1 || volume.channels() != 1)
+        return WindowLevel();
+    const Histogram stats = VolumeStatistics::instance().histogram(volume, Task::Interactive);
+    return fromRange(stats.minimum, stats.maximum > stats.minimum ? stats.maximum : stats.minimum + 1.0);
+}
+
+void WindowLevel::fullRangeLater(const Volume &volume, QObject *context,
+                                 const std::function<void(const WindowLevel &)> &done)
+{
+    if (volume.isEmpty() || volume.type() == CV_8UC1 || volume.channels() != 1) {
+        done(fullRange(volume));
+        return;
+    }
+    auto range = std::make_shared<WindowLevel>();
+    Task *task = TaskScheduler::instance().run(Task::Interactive, [volume, range](Task &) {
+        *range = fullRange(volume);
+    });
+    QObject::connect(task, &Task::finished, context, [range, done](bool cancelled) {
+        if (!cancelled)
+            done(*range);
+    });
+}
+
+WindowLevel WindowLevel::provisionalRange(const Volume &volume)
+{
+    if (volume.isEmpty())
+        return WindowLevel();
+    return fullRange(volume.axial(volume.depth() / 2));
+}
+
+WindowLevel WindowLevel::fullRange(const cv::Mat &image)
+{
+    if (image.empty() || image.depth() == CV_8U || image.channels() != 1)
+        return WindowLevel();
+    double low = 0.0, high = 0.0;
+    cv::minMaxIdx(image, &low, &high);
+    return fromRange(low, high > low ? high : low + 1.0);
+}
+
+void WindowLevel::apply(const cv::Mat &src, cv::Mat &dst) const
+{
+    if (src.empty()) {
+        dst.release();
+        return;
+    }
+    if (src.depth() == CV_8U && src.channels() != 1) {
+        dst = src;
+        return;
+    }
+
+    dst.create(src.size(), CV_8UC1);
+    const double scale = 255.0 / windowWidth;
+    const double offset = -low() * scale;
+
+    cv::Mat lut;
+    if (src.depth() == CV_8U) {
+        lut.create(1, 256, CV_8U);
+        for (int v = 0; v < 256; ++v)
+            lut.at<uchar>(v) = cv::saturate_cast<uchar>(v * scale + offset);
+    }
+
+    auto mapRows = [&](const cv::Range &rows) {
+        const cv::Mat in = src.rowRange(rows);
+        cv::Mat out = dst.rowRange(rows);
+        if (src.depth() == CV_8U)
+            cv::LUT(in, lut, out);
+        else
+            in.convertTo(out, CV_8U, scale, offset);
+    };
+
+    if (src.total() < size_t(ParallelPixels)) {
+        mapRows(cv::Range(0, src.rows));
+    } else {
+        const int stripes = std::min(src.rows, cv::getNumThreads() * 4);
+        cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range &r) {
+            mapRows(cv::Range(r.start * src.rows / stripes, r.end * src.rows / stripes));
+        });
+    }
+}
+
+cv::Mat WindowLevel::apply(const cv::Mat &src) const
+{
+    cv::Mat dst;
+    apply(src, dst);
+    return dst;
+}
+
+bool WindowLevel::operator==(const WindowLevel &other) const
+{
+    return windowCenter == other.windowCenter && windowWidth == other.windowWidth;
+}
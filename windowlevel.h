@@ -0,0 +1,55 @@
+#ifndef WINDOWLEVEL_H
+#define WINDOWLEVEL_H
+
+#include <algorithm>
+#include <functional>
+
+#include <opencv2/core.hpp>
+
+class QObject;
+class Volume;
+
+// Linear intensity window (centre/width) mapped to 0..255 for display.
+// Volumes keep their native depth; this is only applied when an image is
+// about to be shown, so changing the window never touches voxel data.
+class WindowLevel {
+public:
+    WindowLevel() = default;
+    WindowLevel(double center, double width);
+
+    static WindowLevel fromRange(double low, double high);
+    // Data range of the whole volume, from the cached VolumeStatistics;
+    // 8-bit volumes get the identity window. Unless cached, this is a pass
+    // over every voxel, so the GUI thread uses the two below instead.
+    static WindowLevel fullRange(const Volume &volume);
+    static WindowLevel fullRange(const cv::Mat &image);
+    // fullRange() of the volume, computed on the scheduler. done gets it on
+    // the GUI thread, unless context is destroyed first.
+    static void fullRangeLater(const Volume &volume, QObject *context,
+                               const std::function<void(const WindowLevel &)> &done);
+    // Range of the middle slice, a stand-in until fullRangeLater() reports.
+    static WindowLevel provisionalRange(const Volume &volume);
+
+    double center() const { return windowCenter; }
+    double width() const { return windowWidth; }
+    double low() const { return windowCenter - windowWidth / 2.0; }
+    double high() const { return windowCenter + windowWidth / 2.0; }
+    void setCenter(double center) { windowCenter = center; }
+    void setWidth(double width) { windowWidth = std::max(width, 1e-6); }
+
+    // Maps a single-channel image of any depth to CV_8UC1. 8-bit images go
+    // through cv::LUT, other depths through the vectorised convertTo(); large
+    // images are split into row stripes across threads. 8-bit colour images
+    // are passed through unchanged.
+    void apply(const cv::Mat &src, cv::Mat &dst) const;
+    cv::Mat apply(const cv::Mat &src) const;
+
+    bool operator==(const WindowLevel &other) const;
+    bool operator!=(const WindowLevel &other) const { return !(*this == other); }
+
+private:
+    double windowCenter = 127.5;
+    double windowWidth = 255.0;
+};
+
+#endif // WINDOWLEVEL_H
@@ -2,26 +2,78 @@ QT += core gui widgets 3dcore 3drender 3dinput 3dextras
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
-CONFIG += c++11
+CONFIG += c++17
 
 # You can make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    batchinference.cpp \
     customobjectdetectionwindow.cpp \
+    datastream.cpp \
+    detectiondecoder.cpp \
+    detectionpipeline.cpp \
+    detectionresults.cpp \
     editwindow.cpp \
+    filtergraph.cpp \
     main.cpp \
     mainwindow.cpp \
+    modelregistry.cpp \
+    niftifile.cpp \
+    nrrdfile.cpp \
     objectdetectionwindow.cpp \
-    segmentationwindow.cpp
+    pagedstorage.cpp \
+    raycaster.cpp \
+    reslice.cpp \
+    segmentationwindow.cpp \
+    sliceloader.cpp \
+    sliceplan.cpp \
+    slicetexture.cpp \
+    taskscheduler.cpp \
+    tileplan.cpp \
+    volume.cpp \
+    volumefile.cpp \
+    volumefilter.cpp \
+    volumehistory.cpp \
+    volumelabeler.cpp \
+    volumepyramid.cpp \
+    volumestatistics.cpp \
+    volumerenderview.cpp \
+    windowlevel.cpp
 
 HEADERS += \
+    batchinference.h \
     customobjectdetectionwindow.h \
+    datastream.h \
+    detectiondecoder.h \
+    detectionpipeline.h \
+    detectionresults.h \
     editwindow.h \
+    filtergraph.h \
     mainwindow.h \
+    modelregistry.h \
+    niftifile.h \
+    nrrdfile.h \
     objectdetectionwindow.h \
-    segmentationwindow.h
+    pagedstorage.h \
+    raycaster.h \
+    reslice.h \
+    segmentationwindow.h \
+    sliceloader.h \
+    sliceplan.h \
+    slicetexture.h \
+    taskscheduler.h \
+    tileplan.h \
+    volume.h \
+    volumefile.h \
+    volumefilter.h \
+    volumehistory.h \
+    volumelabeler.h \
+    volumepyramid.h \
+    volumestatistics.h \
+    volumerenderview.h \
+    windowlevel.h
 
 FORMS += \
     mainwindow.ui
@@ -35,6 +87,9 @@ else: unix:!android: target.path = /opt/$${TARGET}/bin
 !isEmpty(target.path): INSTALLS += target
 
 
+# zlib for gzip-compressed NRRD and NIfTI files
+LIBS += -lz
+
 win32: LIBS += -L$$PWD/../../../../opencv-4.5.4/build/install/x64/mingw/lib/ -llibopencv_world454.dll
 
 INCLUDEPATH += $$PWD/../../../../opencv-4.5.4/build/install/include